@@ -0,0 +1,86 @@
+/*
+ * File:    dispatchBench.c
+ * author:  patrick conroy
+ *
+ * Command lookup - every name in commandTable[] plus a few that aren't there,
+ * thru DoCommand_Priority(), which is findCommand()'s binary search and a load.
+ * Against it, the lookup doCommand() used to do: a linear scan comparing
+ * strncmp() over the length of each table entry, in the old table order.
+ * The linear scan also "finds" the near misses, since "BTX" starts with "BT".
+ *
+ * Links every module but main.c - see PROGRAM_LIBS in the Makefile.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "logger.h"
+#include "timestamp.h"
+#include "doCommand.h"
+
+
+#define ROUNDS      2000000L
+
+//
+//  What we look up - hits, then misses
+static  const char  *lookups[] = {
+    "BC", "BRV", "BT", "BV", "CDOFF", "CDON", "CGES", "CLV", "EV", "FV", "HVD", "KEYFRAME", "LDOFF",
+    "LDON", "LVR", "OVR", "RSD", "SLON", "TCC", "TOFFT1", "TOFFT2", "TONT1", "TONT2", "WTL1", "WTL2",
+    "BTX", "LDONX", "ZZZ", "bt", ""
+};
+#define NUM_LOOKUPS     ( (int) (sizeof lookups / sizeof lookups[ 0 ]) )
+#define NUM_HITS        25
+
+//
+//  The table as it was before it was sorted
+static  const char  *oldTable[] = {
+    "BT", "TCC", "BC", "HVD", "CLV", "OVR", "EV", "BV", "FV", "BRV", "LVR", "WTL1", "WTL2",
+    "SLON", "TONT1", "TOFFT1", "TONT2", "TOFFT2", "CDON", "CDOFF", "LDON", "LDOFF", "RSD", "CGES"
+};
+#define OLD_TABLE_SIZE  ( (int) (sizeof oldTable / sizeof oldTable[ 0 ]) )
+
+
+// -----------------------------------------------------------------------------
+static  __attribute__(( noinline ))
+int     linearScan (const char *command)
+{
+    int i;
+
+    for (i = 0; i < OLD_TABLE_SIZE; i += 1)
+        if (strncmp( command, oldTable[ i ], strlen( oldTable[ i ] ) ) == 0)
+            return i;
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+int main (int argc, char *argv[])
+{
+    long        round;
+    long long   startUS;
+    long long   elapsedUS;
+    long        sink = 0;
+    int         i;
+
+    startUS = Timestamp_MonotonicUS();
+    for (round = 0; round < ROUNDS; round += 1)
+        for (i = 0; i < NUM_LOOKUPS; i += 1)
+            sink += DoCommand_Priority( lookups[ i ] );
+    elapsedUS = Timestamp_MonotonicUS() - startUS;
+    printf( "  binary search  %8.2f ns/lookup\n", (elapsedUS * 1000.0) / (ROUNDS * NUM_LOOKUPS) );
+
+    startUS = Timestamp_MonotonicUS();
+    for (round = 0; round < ROUNDS; round += 1)
+        for (i = 0; i < NUM_LOOKUPS; i += 1)
+            sink += linearScan( lookups[ i ] );
+    elapsedUS = Timestamp_MonotonicUS() - startUS;
+    printf( "  linear strncmp %8.2f ns/lookup\n", (elapsedUS * 1000.0) / (ROUNDS * NUM_LOOKUPS) );
+
+    int falseMatches = 0;
+    for (i = NUM_HITS; i < NUM_LOOKUPS; i += 1)
+        if (linearScan( lookups[ i ] ) >= 0)
+            falseMatches += 1;
+    printf( "  %d of %d unknown commands matched by the linear scan (%ld)\n", falseMatches, NUM_LOOKUPS - NUM_HITS, sink );
+
+    return 0;
+}
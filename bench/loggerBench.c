@@ -0,0 +1,77 @@
+/*
+ * File:    loggerBench.c
+ * author:  patrick conroy
+ *
+ * What a log call costs when its level is turned off. Three ways:
+ *
+ *      macro       - Logger_LogDebug() at Logger_Level 3: one branch, the
+ *                    arguments are never evaluated
+ *      function    - Logger_Write() called directly, the way every call went
+ *                    before the level check moved into the macros: the
+ *                    arguments are evaluated and the call is made, then it returns
+ *      enabled     - Logger_LogWarning() to /dev/null, for scale
+ *
+ * Built twice by the Makefile - loggerBenchCompiledOut has -DLOG_COMPILE_LEVEL=3,
+ * so its "macro" loop has no Debug call left in it at all.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "logger.h"
+#include "timestamp.h"
+
+
+#define DISABLED_CALLS      50000000L
+#define ENABLED_CALLS       200000L
+
+static  long    evaluated = 0;
+
+
+// -----------------------------------------------------------------------------
+static  __attribute__(( noinline ))
+int     expensiveArgument (const long i)
+{
+    evaluated += 1;
+    return (int) (i * 7);
+}
+
+// -----------------------------------------------------------------------------
+static
+void    report (const char *name, const long calls, const long long startUS)
+{
+    long long   elapsedUS = Timestamp_MonotonicUS() - startUS;
+
+    printf( "  %-10s %10ld calls  %8.3f ns/call  (%ld arguments evaluated)\n",
+            name, calls, (elapsedUS * 1000.0) / calls, evaluated );
+    evaluated = 0;
+}
+
+// -----------------------------------------------------------------------------
+int main (int argc, char *argv[])
+{
+    long        i;
+    long long   startUS;
+
+    Logger_Initialize( "/dev/null", LOG_LEVEL_WARNING );
+    printf( "Disabled log calls, LOG_COMPILE_LEVEL %d, Logger_Level %d\n", LOG_COMPILE_LEVEL, Logger_Level );
+
+    startUS = Timestamp_MonotonicUS();
+    for (i = 0; i < DISABLED_CALLS; i += 1)
+        Logger_LogDebug( "sample %ld took %d us\n", i, expensiveArgument( i ) );
+    report( "macro", DISABLED_CALLS, startUS );
+
+    startUS = Timestamp_MonotonicUS();
+    for (i = 0; i < DISABLED_CALLS; i += 1)
+        Logger_Write( LOG_LEVEL_DEBUG, "sample %ld took %d us\n", i, expensiveArgument( i ) );
+    report( "function", DISABLED_CALLS, startUS );
+
+    startUS = Timestamp_MonotonicUS();
+    for (i = 0; i < ENABLED_CALLS; i += 1)
+        Logger_LogWarning( "sample %ld took %d us\n", i, expensiveArgument( i ) );
+    report( "enabled", ENABLED_CALLS, startUS );
+
+    Logger_Terminate();
+    return 0;
+}
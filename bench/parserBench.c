@@ -0,0 +1,102 @@
+/*
+ * File:    parserBench.c
+ * author:  patrick conroy
+ *
+ * What it costs to turn a COMMAND payload into mqttCommand_t's with
+ * CommandParser_Parse(), for a few typical payloads.
+ *
+ * Built with CJSON=1 ("make -C bench run CJSON=1") it also times what the
+ * MQTT handler used to do with the same payloads - copy to get a NUL, cJSON_Parse()
+ * the whole thing, pull four keys back out of the tree and free it.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timestamp.h"
+#include "commandParser.h"
+#ifdef WITH_CJSON
+# include "cjson/cJSON.h"
+#endif
+
+
+#define ROUNDS      1000000L
+
+static  const char  *payloads[] = {
+    "{ \"command\" : \"HVD\", \"fParam\" : 15.0 }",
+    "{ \"command\" : \"TONT1\", \"cParam\" : \"06:30:00\", \"correlationID\" : \"dashboard-1791500000-17\", \"ttlMS\" : 5000 }",
+    "{ \"source\" : { \"app\" : \"dashboard\", \"version\" : [ 2, 1, 0 ] }, \"command\" : \"BT\", \"iParam\" : 2, \"note\" : \"new bank\" }",
+    "{ \"correlationID\" : \"abc\", \"coalesce\" : true, \"commands\" : [ { \"command\" : \"BV\", \"fParam\" : 14.4 }, "
+        "{ \"command\" : \"FV\", \"fParam\" : 13.8 }, { \"command\" : \"EV\", \"fParam\" : 14.6 }, { \"command\" : \"LVR\", \"fParam\" : 12.6 } ] }"
+};
+#define NUM_PAYLOADS    ( (int) (sizeof payloads / sizeof payloads[ 0 ]) )
+
+#ifdef WITH_CJSON
+
+// -----------------------------------------------------------------------------
+static
+int     parseWithCJSON (const char *payload, const int length, mqttCommand_t *command)
+{
+    char    *text = malloc( length + 1 );
+    memcpy( text, payload, length );
+    text[ length ] = '\0';
+
+    cJSON   *json = cJSON_Parse( text );
+    free( text );
+    if (json == NULL)
+        return -1;
+
+    cJSON   *parameter = cJSON_GetObjectItemCaseSensitive( json, "command" );
+    if (cJSON_IsString( parameter ) && parameter->valuestring != NULL)
+        strncpy( command->command, parameter->valuestring, sizeof command->command - 1 );
+    parameter = cJSON_GetObjectItemCaseSensitive( json, "iParam" );
+    if (cJSON_IsNumber( parameter ))
+        command->iParam = parameter->valueint;
+    parameter = cJSON_GetObjectItemCaseSensitive( json, "fParam" );
+    if (cJSON_IsNumber( parameter ))
+        command->fParam = parameter->valuedouble;
+    parameter = cJSON_GetObjectItemCaseSensitive( json, "cParam" );
+    if (cJSON_IsString( parameter ) && parameter->valuestring != NULL)
+        strncpy( command->cParam, parameter->valuestring, sizeof command->cParam - 1 );
+
+    cJSON_Delete( json );
+    return 1;
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+int main (int argc, char *argv[])
+{
+    mqttCommand_t   commands[ COMMAND_BATCH_MAX ];
+    char            error[ 128 ];
+    long            round;
+    long            sink = 0;
+    int             i;
+
+    for (i = 0; i < NUM_PAYLOADS; i += 1) {
+        int         length = strlen( payloads[ i ] );
+        long long   startUS = Timestamp_MonotonicUS();
+
+        for (round = 0; round < ROUNDS; round += 1)
+            sink += CommandParser_Parse( payloads[ i ], length, commands, COMMAND_BATCH_MAX, error, sizeof error );
+
+        long long   elapsedUS = Timestamp_MonotonicUS() - startUS;
+        printf( "  payload %d (%3d bytes)  commandParser %8.1f ns  %7.1f MB/s\n", i, length,
+                (elapsedUS * 1000.0) / ROUNDS, ((double) length * ROUNDS) / elapsedUS );
+
+#ifdef WITH_CJSON
+        startUS = Timestamp_MonotonicUS();
+        for (round = 0; round < ROUNDS; round += 1)
+            sink += parseWithCJSON( payloads[ i ], length, &commands[ 0 ] );
+        elapsedUS = Timestamp_MonotonicUS() - startUS;
+        printf( "  payload %d (%3d bytes)  cJSON         %8.1f ns  %7.1f MB/s\n", i, length,
+                (elapsedUS * 1000.0) / ROUNDS, ((double) length * ROUNDS) / elapsedUS );
+#endif
+    }
+
+    printf( "  (%ld)\n", sink );
+    return 0;
+}
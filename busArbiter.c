@@ -0,0 +1,104 @@
+/*
+ * File:    busArbiter.c
+ * author:  patrick conroy
+ *
+ * One transaction at a time on an RS-485 bus.
+ *
+ * The poller threads and the command thread both want the serial port. If
+ * their RTU frames interleave on the wire we get CRC errors, retries and
+ * garbage reads. The arbiter owns the port's modbus_t and hands it out one
+ * transaction at a time, pointed at the right slave ID.
+ *
+ * Polls acquire the bus per register span, so a command that shows up in the
+ * middle of a poll only waits for the span on the wire to finish - waiting
+ * commands always go ahead of waiting polls.
+ *
+ * We keep queue depth and wait time statistics per priority.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <modbus/modbus.h>
+
+#include "logger.h"
+#include "busArbiter.h"
+
+
+// -----------------------------------------------------------------------------
+static
+long long   nowUS (void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((long long) ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000L);
+}
+
+// -----------------------------------------------------------------------------
+void    Arbiter_Initialize (busArbiter_t *bus)
+{
+    memset( bus, '\0', sizeof( busArbiter_t ) );
+    pthread_mutex_init( &bus->lock, NULL );
+    pthread_cond_init( &bus->available, NULL );
+}
+
+// -----------------------------------------------------------------------------
+modbus_t    *Arbiter_Acquire (busArbiter_t *bus, const int slaveID, const int priority)
+{
+    long long   start = nowUS();
+
+    pthread_mutex_lock( &bus->lock );
+    bus->waiting[ priority ] += 1;
+    bus->stats.queueDepth += 1;
+    if (bus->stats.queueDepth > bus->stats.maxQueueDepth)
+        bus->stats.maxQueueDepth = bus->stats.queueDepth;
+
+    //
+    //  A poll also has to wait while any command is waiting
+    while (bus->busy || (priority == BUS_PRIORITY_POLL && bus->waiting[ BUS_PRIORITY_COMMAND ] > 0))
+        pthread_cond_wait( &bus->available, &bus->lock );
+
+    bus->busy = TRUE;
+    bus->waiting[ priority ] -= 1;
+    bus->stats.queueDepth -= 1;
+
+    long long   waitUS = nowUS() - start;
+    bus->stats.transactions[ priority ] += 1;
+    bus->stats.totalWaitUS[ priority ] += waitUS;
+    if (waitUS > bus->stats.maxWaitUS[ priority ])
+        bus->stats.maxWaitUS[ priority ] = waitUS;
+    pthread_mutex_unlock( &bus->lock );
+
+    //
+    //  We own the bus now - point it at the right SCC
+    modbus_set_slave( bus->ctx, slaveID );
+    return bus->ctx;
+}
+
+// -----------------------------------------------------------------------------
+void    Arbiter_Release (busArbiter_t *bus)
+{
+    pthread_mutex_lock( &bus->lock );
+    bus->busy = FALSE;
+    pthread_cond_broadcast( &bus->available );
+    pthread_mutex_unlock( &bus->lock );
+}
+
+// -----------------------------------------------------------------------------
+void    Arbiter_GetStats (busArbiter_t *bus, busStats_t *stats, const int reset)
+{
+    pthread_mutex_lock( &bus->lock );
+    *stats = bus->stats;
+
+    if (reset) {
+        int queueDepth = bus->stats.queueDepth;
+        memset( &bus->stats, '\0', sizeof( busStats_t ) );
+        bus->stats.queueDepth = queueDepth;
+        bus->stats.maxQueueDepth = queueDepth;
+    }
+    pthread_mutex_unlock( &bus->lock );
+}
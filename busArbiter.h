@@ -0,0 +1,57 @@
+/*
+ * File:   busArbiter.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef BUSARBITER_H
+#define BUSARBITER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <modbus/modbus.h>
+
+
+//
+//  Who wants the bus. Commands go ahead of polls at the next transaction boundary.
+#define BUS_PRIORITY_POLL       0
+#define BUS_PRIORITY_COMMAND    1
+#define NUM_BUS_PRIORITIES      2
+
+typedef struct  busStats {
+    long            transactions[ NUM_BUS_PRIORITIES ];
+    long long       totalWaitUS[ NUM_BUS_PRIORITIES ];
+    long long       maxWaitUS[ NUM_BUS_PRIORITIES ];
+    int             queueDepth;                         // waiting right now
+    int             maxQueueDepth;
+} busStats_t;
+
+//
+//  The arbiter owns the modbus context for one serial port. Nobody touches
+//  'ctx' without going thru Arbiter_Acquire() first.
+typedef struct  busArbiter {
+    modbus_t        *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t  available;
+    int             busy;
+    int             waiting[ NUM_BUS_PRIORITIES ];
+    busStats_t      stats;
+} busArbiter_t;
+
+
+extern  void        Arbiter_Initialize( busArbiter_t *bus );
+extern  modbus_t    *Arbiter_Acquire( busArbiter_t *bus, const int slaveID, const int priority );
+extern  void        Arbiter_Release( busArbiter_t *bus );
+extern  void        Arbiter_GetStats( busArbiter_t *bus, busStats_t *stats, const int reset );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUSARBITER_H */
+
@@ -0,0 +1,771 @@
+/*
+ * File:    commandParser.c
+ * author:  patrick conroy
+ *
+ * Turns a COMMAND payload into mqttCommand_t's. A payload is one command
+ *
+ *      { "command" : "HVD", "fParam" : 15.0, "correlationID" : "abc", "ttlMS" : 5000 }
+ *
+ * or a batch, run in order as one transaction and answered once - a bare array
+ * of commands, or an object that wraps the array and says how to run it
+ *
+ *      [ { "command" : "BV", "fParam" : 14.4 }, { "command" : "FV", "fParam" : 13.8 } ]
+ *      { "correlationID" : "abc", "coalesce" : true, "commands" : [ ... ] }
+ *
+ * We used to hand the payload to cJSON_Parse(), which wants a NUL terminated
+ * string (mosquitto gives us a pointer and a length), builds a whole tree with
+ * a malloc per node, and then we'd pick four keys back out of it.
+ *
+ * This is one pass over (payload, length) that only knows our schema. Keys we
+ * care about are copied straight into the command - bounded by the size of
+ * each field - and everything else is checked for well-formedness and skipped.
+ * Nothing is allocated and nothing past payload + length is ever read.
+ *
+ * Anything that isn't well formed JSON, has the wrong type for one of our
+ * keys, or won't fit in its field is rejected, with a reason and the offset.
+ * A null value is treated the same as leaving the key out. Inside a batch the
+ * commands' own correlationIDs and ttlMS are replaced by the batch's.
+ *
+ * History queries (the QUERY topic) go thru the same machinery, into a
+ * historyQuery_t - see CommandParser_ParseQuery().
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "logger.h"
+#include "commandParser.h"
+
+
+#define MAX_NUMBER_LENGTH       64          // longer than any number anyone should send us
+#define MAX_KEY_LENGTH          16          // longer than any key we know about
+
+typedef struct  cursor {
+    const char  *start;
+    const char  *next;
+    const char  *end;
+    char        *error;
+    int         errorSize;
+} cursor_t;
+
+
+static  int     skipValue( cursor_t *cursor, const int depth );
+
+
+// -----------------------------------------------------------------------------
+static
+int     fail (cursor_t *cursor, const char *reason)
+{
+    if (cursor->error != NULL && cursor->errorSize > 0)
+        snprintf( cursor->error, cursor->errorSize, "%s at offset %d", reason, (int) (cursor->next - cursor->start) );
+    return FALSE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    skipSpace (cursor_t *cursor)
+{
+    while (cursor->next < cursor->end &&
+           (*cursor->next == ' ' || *cursor->next == '\t' || *cursor->next == '\n' || *cursor->next == '\r'))
+        cursor->next += 1;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     peek (const cursor_t *cursor)
+{
+    //
+    //  -1 at the end of the payload
+    return (cursor->next < cursor->end) ? (unsigned char) *cursor->next : -1;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     expect (cursor_t *cursor, const char ch, const char *reason)
+{
+    skipSpace( cursor );
+    if (peek( cursor ) != (unsigned char) ch)
+        return fail( cursor, reason );
+    cursor->next += 1;
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     hexValue (const int ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     parseHex4 (cursor_t *cursor, unsigned long *codePoint)
+{
+    int     i;
+
+    if (cursor->end - cursor->next < 4)
+        return fail( cursor, "truncated \\u escape" );
+
+    *codePoint = 0;
+    for (i = 0; i < 4; i += 1) {
+        int digit = hexValue( (unsigned char) cursor->next[ i ] );
+        if (digit < 0)
+            return fail( cursor, "bad \\u escape" );
+        *codePoint = (*codePoint << 4) | digit;
+    }
+    cursor->next += 4;
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    putByte (char *out, const int outSize, int *length, const int ch)
+{
+    //
+    //  Keeps counting once out is full so the caller can tell it didn't fit
+    if (out != NULL && *length < outSize - 1)
+        out[ *length ] = (char) ch;
+    *length += 1;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    putUTF8 (char *out, const int outSize, int *length, const unsigned long codePoint)
+{
+    if (codePoint < 0x80) {
+        putByte( out, outSize, length, (int) codePoint );
+    } else if (codePoint < 0x800) {
+        putByte( out, outSize, length, 0xC0 | (int) (codePoint >> 6) );
+        putByte( out, outSize, length, 0x80 | (int) (codePoint & 0x3F) );
+    } else if (codePoint < 0x10000) {
+        putByte( out, outSize, length, 0xE0 | (int) (codePoint >> 12) );
+        putByte( out, outSize, length, 0x80 | (int) ((codePoint >> 6) & 0x3F) );
+        putByte( out, outSize, length, 0x80 | (int) (codePoint & 0x3F) );
+    } else {
+        putByte( out, outSize, length, 0xF0 | (int) (codePoint >> 18) );
+        putByte( out, outSize, length, 0x80 | (int) ((codePoint >> 12) & 0x3F) );
+        putByte( out, outSize, length, 0x80 | (int) ((codePoint >> 6) & 0x3F) );
+        putByte( out, outSize, length, 0x80 | (int) (codePoint & 0x3F) );
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+int     parseString (cursor_t *cursor, char *out, const int outSize, int *length)
+{
+    //
+    //  cursor is on the opening quote. Unescapes into out (which can be NULL to
+    //  just skip the string), always NUL terminated. *length is the full
+    //  unescaped length, so *length >= outSize means it was cut short
+    *length = 0;
+    cursor->next += 1;
+
+    for (;;) {
+        int ch = peek( cursor );
+
+        if (ch < 0)
+            return fail( cursor, "unterminated string" );
+        if (ch < 0x20)
+            return fail( cursor, "control character in string" );
+        cursor->next += 1;
+
+        if (ch == '"')
+            break;
+
+        if (ch != '\\') {
+            putByte( out, outSize, length, ch );
+            continue;
+        }
+
+        unsigned long   codePoint;
+        switch (peek( cursor )) {
+            case '"':   putByte( out, outSize, length, '"' );   break;
+            case '\\':  putByte( out, outSize, length, '\\' );  break;
+            case '/':   putByte( out, outSize, length, '/' );   break;
+            case 'b':   putByte( out, outSize, length, '\b' );  break;
+            case 'f':   putByte( out, outSize, length, '\f' );  break;
+            case 'n':   putByte( out, outSize, length, '\n' );  break;
+            case 'r':   putByte( out, outSize, length, '\r' );  break;
+            case 't':   putByte( out, outSize, length, '\t' );  break;
+            case 'u':
+                cursor->next += 1;
+                if (!parseHex4( cursor, &codePoint ))
+                    return FALSE;
+
+                //
+                //  Characters outside the BMP come as a surrogate pair
+                if (codePoint >= 0xD800 && codePoint <= 0xDBFF) {
+                    unsigned long   low;
+                    if (cursor->end - cursor->next < 2 || cursor->next[ 0 ] != '\\' || cursor->next[ 1 ] != 'u')
+                        return fail( cursor, "unpaired surrogate" );
+                    cursor->next += 2;
+                    if (!parseHex4( cursor, &low ))
+                        return FALSE;
+                    if (low < 0xDC00 || low > 0xDFFF)
+                        return fail( cursor, "unpaired surrogate" );
+                    codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                } else if (codePoint >= 0xDC00 && codePoint <= 0xDFFF) {
+                    return fail( cursor, "unpaired surrogate" );
+                } else if (codePoint == 0) {
+                    return fail( cursor, "NUL in string" );
+                }
+                putUTF8( out, outSize, length, codePoint );
+                continue;                                   // parseHex4 already moved past the digits
+            default:
+                return fail( cursor, "bad escape" );
+        }
+        cursor->next += 1;
+    }
+
+    if (out != NULL && outSize > 0)
+        out[ (*length < outSize) ? *length : outSize - 1 ] = '\0';
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     scanDigits (cursor_t *cursor)
+{
+    //
+    //  Returns how many digits we moved over
+    const char  *first = cursor->next;
+    while (cursor->next < cursor->end && *cursor->next >= '0' && *cursor->next <= '9')
+        cursor->next += 1;
+    return (int) (cursor->next - first);
+}
+
+// -----------------------------------------------------------------------------
+static
+int     parseNumber (cursor_t *cursor, double *value)
+{
+    //
+    //  Checks the JSON number grammar ourselves - strtod() would happily take
+    //  hex, "inf", leading '+' and so on - then converts a NUL terminated copy
+    const char  *first = cursor->next;
+    char        text[ MAX_NUMBER_LENGTH ];
+
+    if (peek( cursor ) == '-')
+        cursor->next += 1;
+
+    if (peek( cursor ) == '0')
+        cursor->next += 1;
+    else if (scanDigits( cursor ) == 0)
+        return fail( cursor, "bad number" );
+
+    if (peek( cursor ) == '.') {
+        cursor->next += 1;
+        if (scanDigits( cursor ) == 0)
+            return fail( cursor, "bad number" );
+    }
+
+    if (peek( cursor ) == 'e' || peek( cursor ) == 'E') {
+        cursor->next += 1;
+        if (peek( cursor ) == '+' || peek( cursor ) == '-')
+            cursor->next += 1;
+        if (scanDigits( cursor ) == 0)
+            return fail( cursor, "bad number" );
+    }
+
+    int length = (int) (cursor->next - first);
+    if (length >= (int) sizeof text)
+        return fail( cursor, "number too long" );
+
+    if (value != NULL) {
+        memcpy( text, first, length );
+        text[ length ] = '\0';
+        *value = strtod( text, NULL );
+    }
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     parseLiteral (cursor_t *cursor, const char *literal)
+{
+    int     length = (int) strlen( literal );
+
+    if (cursor->end - cursor->next < length || memcmp( cursor->next, literal, length ) != 0)
+        return fail( cursor, "unexpected character" );
+    cursor->next += length;
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     skipContainer (cursor_t *cursor, const int depth, const char close)
+{
+    //
+    //  cursor is on the '{' or '['. Objects are "key" : value pairs, arrays just values
+    int     length;
+
+    if (depth >= PARSER_MAX_DEPTH)
+        return fail( cursor, "nested too deeply" );
+    cursor->next += 1;
+
+    skipSpace( cursor );
+    if (peek( cursor ) == (unsigned char) close) {
+        cursor->next += 1;
+        return TRUE;
+    }
+
+    for (;;) {
+        skipSpace( cursor );
+        if (close == '}') {
+            if (peek( cursor ) != '"')
+                return fail( cursor, "expected a key" );
+            if (!parseString( cursor, NULL, 0, &length ) || !expect( cursor, ':', "expected ':'" ))
+                return FALSE;
+        }
+
+        if (!skipValue( cursor, depth + 1 ))
+            return FALSE;
+
+        skipSpace( cursor );
+        int ch = peek( cursor );
+        cursor->next += 1;
+        if (ch == (unsigned char) close)
+            return TRUE;
+        if (ch != ',') {
+            cursor->next -= 1;
+            return fail( cursor, (close == '}') ? "expected ',' or '}'" : "expected ',' or ']'" );
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+int     skipValue (cursor_t *cursor, const int depth)
+{
+    int     length;
+
+    skipSpace( cursor );
+    switch (peek( cursor )) {
+        case '"':   return parseString( cursor, NULL, 0, &length );
+        case '{':   return skipContainer( cursor, depth, '}' );
+        case '[':   return skipContainer( cursor, depth, ']' );
+        case 't':   return parseLiteral( cursor, "true" );
+        case 'f':   return parseLiteral( cursor, "false" );
+        case 'n':   return parseLiteral( cursor, "null" );
+        case -1:    return fail( cursor, "unexpected end of payload" );
+        default:    return parseNumber( cursor, NULL );
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+int     stringField (cursor_t *cursor, const char *key, char *out, const int outSize)
+{
+    char    reason[ 64 ];
+    int     length;
+
+    if (peek( cursor ) != '"') {
+        snprintf( reason, sizeof reason, "'%s' must be a string", key );
+        return fail( cursor, reason );
+    }
+    if (!parseString( cursor, out, outSize, &length ))
+        return FALSE;
+    if (length >= outSize) {
+        snprintf( reason, sizeof reason, "'%s' is longer than %d characters", key, outSize - 1 );
+        return fail( cursor, reason );
+    }
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     numberField (cursor_t *cursor, const char *key, double *value)
+{
+    char    reason[ 64 ];
+    int     ch = peek( cursor );
+
+    if (ch != '-' && (ch < '0' || ch > '9')) {
+        snprintf( reason, sizeof reason, "'%s' must be a number", key );
+        return fail( cursor, reason );
+    }
+    return parseNumber( cursor, value );
+}
+
+// -----------------------------------------------------------------------------
+static
+int     boolField (cursor_t *cursor, const char *key, int *value)
+{
+    char    reason[ 64 ];
+
+    if (peek( cursor ) == 't') {
+        *value = TRUE;
+        return parseLiteral( cursor, "true" );
+    }
+    if (peek( cursor ) == 'f') {
+        *value = FALSE;
+        return parseLiteral( cursor, "false" );
+    }
+    snprintf( reason, sizeof reason, "'%s' must be true or false", key );
+    return fail( cursor, reason );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    clearCommand (mqttCommand_t *command)
+{
+    memset( command, '\0', sizeof( mqttCommand_t ) );
+    command->batchSize = 1;
+}
+
+static  int     parseBatch( cursor_t *cursor, mqttCommand_t *commands, const int maxCommands, int *numCommands );
+
+// -----------------------------------------------------------------------------
+static
+int     parseObject (cursor_t *cursor, mqttCommand_t *command, mqttCommand_t *batch, const int maxBatch, int *batchCount)
+{
+    //
+    //  cursor is on a '{'. Either one command, or - if batch isn't NULL - possibly
+    //  the wrapper around a "commands" array, which is parsed into batch
+    char    key[ MAX_KEY_LENGTH ];
+    int     length;
+    double  value;
+
+    cursor->next += 1;
+    skipSpace( cursor );
+    if (peek( cursor ) == '}') {
+        cursor->next += 1;
+        return TRUE;
+    }
+
+    for (;;) {
+        skipSpace( cursor );
+        if (peek( cursor ) != '"')
+            return fail( cursor, "expected a key" );
+        if (!parseString( cursor, key, sizeof key, &length ) || !expect( cursor, ':', "expected ':'" ))
+            return FALSE;
+        if (length >= (int) sizeof key)
+            key[ 0 ] = '\0';                                // too long to be one of ours
+
+        skipSpace( cursor );
+        if (peek( cursor ) == 'n') {
+            //
+            //  null - same as not sending it
+            if (!parseLiteral( cursor, "null" ))
+                return FALSE;
+        } else if (strcmp( key, "command" ) == 0) {
+            if (!stringField( cursor, key, command->command, sizeof command->command ))
+                return FALSE;
+        } else if (strcmp( key, "iParam" ) == 0) {
+            if (!numberField( cursor, key, &value ))
+                return FALSE;
+            if (value < INT_MIN || value > INT_MAX)
+                return fail( cursor, "'iParam' is out of range" );
+            command->iParam = (int) value;
+        } else if (strcmp( key, "fParam" ) == 0) {
+            if (!numberField( cursor, key, &value ))
+                return FALSE;
+            command->fParam = value;
+        } else if (strcmp( key, "cParam" ) == 0) {
+            if (!stringField( cursor, key, command->cParam, sizeof command->cParam ))
+                return FALSE;
+        } else if (strcmp( key, "correlationID" ) == 0) {
+            if (!stringField( cursor, key, command->correlationID, sizeof command->correlationID ))
+                return FALSE;
+        } else if (strcmp( key, "ttlMS" ) == 0) {
+            if (!numberField( cursor, key, &value ))
+                return FALSE;
+            if (value < 0 || value > INT_MAX)
+                return fail( cursor, "'ttlMS' is out of range" );
+            command->ttlMS = (int) value;
+        } else if (strcmp( key, "coalesce" ) == 0) {
+            if (!boolField( cursor, key, &command->coalesce ))
+                return FALSE;
+        } else if (strcmp( key, "commands" ) == 0) {
+            if (batch == NULL)
+                return fail( cursor, "batches can't be nested" );
+            if (peek( cursor ) != '[')
+                return fail( cursor, "'commands' must be an array" );
+            if (!parseBatch( cursor, batch, maxBatch, batchCount ))
+                return FALSE;
+        } else if (!skipValue( cursor, 1 )) {
+            return FALSE;
+        }
+
+        skipSpace( cursor );
+        int ch = peek( cursor );
+        if (ch == '}') {
+            cursor->next += 1;
+            return TRUE;
+        }
+        if (ch != ',')
+            return fail( cursor, "expected ',' or '}'" );
+        cursor->next += 1;
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+int     parseBatch (cursor_t *cursor, mqttCommand_t *commands, const int maxCommands, int *numCommands)
+{
+    //
+    //  cursor is on the '[' of an array of command objects
+    char    reason[ 64 ];
+
+    *numCommands = 0;
+    cursor->next += 1;
+    skipSpace( cursor );
+    if (peek( cursor ) == ']')
+        return fail( cursor, "empty batch" );
+
+    for (;;) {
+        skipSpace( cursor );
+        if (peek( cursor ) != '{')
+            return fail( cursor, "expected a command object" );
+        if (*numCommands >= maxCommands) {
+            snprintf( reason, sizeof reason, "more than %d commands in a batch", maxCommands );
+            return fail( cursor, reason );
+        }
+
+        mqttCommand_t   *command = &commands[ *numCommands ];
+        clearCommand( command );
+        if (!parseObject( cursor, command, NULL, 0, NULL ))
+            return FALSE;
+        if (command->command[ 0 ] == '\0')
+            return fail( cursor, "no 'command'" );
+        *numCommands += 1;
+
+        skipSpace( cursor );
+        int ch = peek( cursor );
+        if (ch == ']') {
+            cursor->next += 1;
+            return TRUE;
+        }
+        if (ch != ',')
+            return fail( cursor, "expected ',' or ']'" );
+        cursor->next += 1;
+    }
+}
+
+// -----------------------------------------------------------------------------
+int     CommandParser_Parse (const char *payload, const int length, mqttCommand_t *commands, const int maxCommands,
+                             char *error, const int errorSize)
+{
+    //
+    //  Returns how many commands were parsed into commands[], or -1, with a reason
+    //  in error, if the payload isn't something we can use. The caller fills in
+    //  controllerID and receivedUS
+    cursor_t        cursor = { payload, payload, payload + ((length > 0) ? length : 0), error, errorSize };
+    mqttCommand_t   header;
+    int             numCommands = 0;
+    int             i;
+
+    if (payload == NULL || length <= 0 || maxCommands <= 0) {
+        fail( &cursor, "empty payload" );
+        return -1;
+    }
+
+    clearCommand( &header );
+    skipSpace( &cursor );
+    if (peek( &cursor ) == '{') {
+        if (!parseObject( &cursor, &header, commands, maxCommands, &numCommands ))
+            return -1;
+        if (numCommands == 0) {
+            if (header.command[ 0 ] == '\0') {
+                fail( &cursor, "no 'command'" );
+                return -1;
+            }
+            commands[ 0 ] = header;
+            numCommands = 1;
+        } else if (header.command[ 0 ] != '\0') {
+            fail( &cursor, "'command' and 'commands' can't both be given" );
+            return -1;
+        }
+    } else if (peek( &cursor ) == '[') {
+        if (!parseBatch( &cursor, commands, maxCommands, &numCommands ))
+            return -1;
+        strcpy( header.correlationID, commands[ 0 ].correlationID );
+        header.ttlMS = commands[ 0 ].ttlMS;
+    } else {
+        fail( &cursor, "expected '{' or '['" );
+        return -1;
+    }
+
+    //
+    //  Some publishers send the C string's terminator along with it
+    skipSpace( &cursor );
+    while (cursor.next < cursor.end && *cursor.next == '\0')
+        cursor.next += 1;
+    if (cursor.next != cursor.end) {
+        fail( &cursor, "trailing characters" );
+        return -1;
+    }
+
+    //
+    //  A batch is answered once, under the wrapper's correlationID (or the first
+    //  command's), and lives or dies by one ttlMS the same way
+    if (header.command[ 0 ] == '\0') {
+        for (i = 0; i < numCommands; i += 1) {
+            commands[ i ].batchIndex = i;
+            commands[ i ].batchSize = numCommands;
+            commands[ i ].coalesce = header.coalesce;
+            commands[ i ].ttlMS = header.ttlMS;
+            strcpy( commands[ i ].correlationID, header.correlationID );
+        }
+    }
+    return numCommands;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     parseFieldList (cursor_t *cursor, historyQuery_t *query)
+{
+    //
+    //  cursor is on the '[' of an array of field names
+    char    name[ 32 ];
+    char    reason[ 96 ];
+    int     i;
+
+    cursor->next += 1;
+    skipSpace( cursor );
+    if (peek( cursor ) == ']') {
+        cursor->next += 1;
+        return TRUE;                                        // same as leaving it out - all of them
+    }
+
+    for (;;) {
+        skipSpace( cursor );
+        if (!stringField( cursor, "fields", name, sizeof name ))
+            return FALSE;
+
+        int column = History_FindColumn( name );
+        if (column < 0) {
+            snprintf( reason, sizeof reason, "no field '%s' in the history", name );
+            return fail( cursor, reason );
+        }
+        for (i = 0; i < query->numColumns && query->columns[ i ] != column; i += 1)
+            ;
+        if (i == query->numColumns)                         // asking twice gets it once
+            query->columns[ query->numColumns++ ] = column;
+
+        skipSpace( cursor );
+        int ch = peek( cursor );
+        if (ch == ']') {
+            cursor->next += 1;
+            return TRUE;
+        }
+        if (ch != ',')
+            return fail( cursor, "expected ',' or ']'" );
+        cursor->next += 1;
+    }
+}
+
+// -----------------------------------------------------------------------------
+int     CommandParser_ParseQuery (const char *payload, const int length, historyQuery_t *query,
+                                  char *error, const int errorSize)
+{
+    //
+    //  A QUERY payload - one object, every key optional. Returns FALSE, with a
+    //  reason in error, if it isn't something we can answer. The caller fills in
+    //  controllerID and receivedUS
+    cursor_t    cursor = { payload, payload, payload + ((length > 0) ? length : 0), error, errorSize };
+    char        key[ MAX_KEY_LENGTH ];
+    char        mode[ 16 ];
+    int         keyLength;
+    double      value;
+
+    memset( query, '\0', sizeof( historyQuery_t ) );
+    query->mode = QUERY_MODE_SUMMARY;
+    query->maxPoints = HISTORY_QUERY_DEFAULT_POINTS;
+
+    if (payload == NULL || length <= 0)
+        return fail( &cursor, "empty payload" );
+
+    //
+    //  "{}" is a fair question - the summary of the last hour
+    skipSpace( &cursor );
+    if (peek( &cursor ) != '{')
+        return fail( &cursor, "expected '{'" );
+
+    cursor.next += 1;
+    skipSpace( &cursor );
+    if (peek( &cursor ) == '}') {
+        cursor.next += 1;
+    } else {
+        for (;;) {
+            skipSpace( &cursor );
+            if (peek( &cursor ) != '"')
+                return fail( &cursor, "expected a key" );
+            if (!parseString( &cursor, key, sizeof key, &keyLength ) || !expect( &cursor, ':', "expected ':'" ))
+                return FALSE;
+            if (keyLength >= (int) sizeof key)
+                key[ 0 ] = '\0';
+
+            skipSpace( &cursor );
+            if (peek( &cursor ) == 'n') {
+                if (!parseLiteral( &cursor, "null" ))
+                    return FALSE;
+            } else if (strcmp( key, "from" ) == 0 || strcmp( key, "to" ) == 0 || strcmp( key, "last" ) == 0) {
+                if (!numberField( &cursor, key, &value ))
+                    return FALSE;
+                if (value < 0)
+                    return fail( &cursor, "times can't be negative" );
+                if (key[ 0 ] == 'f')
+                    query->from = value;
+                else if (key[ 0 ] == 't')
+                    query->to = value;
+                else
+                    query->last = value;
+            } else if (strcmp( key, "fields" ) == 0) {
+                if (peek( &cursor ) != '[')
+                    return fail( &cursor, "'fields' must be an array" );
+                if (!parseFieldList( &cursor, query ))
+                    return FALSE;
+            } else if (strcmp( key, "mode" ) == 0) {
+                if (!stringField( &cursor, key, mode, sizeof mode ))
+                    return FALSE;
+                if (strcmp( mode, "summary" ) == 0)
+                    query->mode = QUERY_MODE_SUMMARY;
+                else if (strcmp( mode, "raw" ) == 0)
+                    query->mode = QUERY_MODE_RAW;
+                else
+                    return fail( &cursor, "'mode' must be 'summary' or 'raw'" );
+            } else if (strcmp( key, "maxPoints" ) == 0) {
+                if (!numberField( &cursor, key, &value ))
+                    return FALSE;
+                if (value < 1 || value > HISTORY_QUERY_MAX_POINTS)
+                    return fail( &cursor, "'maxPoints' is out of range" );
+                query->maxPoints = (int) value;
+            } else if (strcmp( key, "correlationID" ) == 0) {
+                if (!stringField( &cursor, key, query->correlationID, sizeof query->correlationID ))
+                    return FALSE;
+            } else if (!skipValue( &cursor, 1 )) {
+                return FALSE;
+            }
+
+            skipSpace( &cursor );
+            int ch = peek( &cursor );
+            cursor.next += 1;
+            if (ch == '}')
+                break;
+            if (ch != ',') {
+                cursor.next -= 1;
+                return fail( &cursor, "expected ',' or '}'" );
+            }
+        }
+    }
+
+    skipSpace( &cursor );
+    while (cursor.next < cursor.end && *cursor.next == '\0')
+        cursor.next += 1;
+    if (cursor.next != cursor.end)
+        return fail( &cursor, "trailing characters" );
+
+    if (query->last > 0 && (query->from > 0 || query->to > 0))
+        return fail( &cursor, "'last' can't be used with 'from' or 'to'" );
+    if (query->to > 0 && query->from > query->to)
+        return fail( &cursor, "'from' is after 'to'" );
+    return TRUE;
+}
@@ -0,0 +1,32 @@
+/*
+ * File:   commandParser.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef COMMANDPARSER_H
+#define COMMANDPARSER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "commandQueue.h"
+#include "historyQuery.h"
+
+
+#define PARSER_MAX_DEPTH        16          // deepest nesting we'll skip over in keys we don't use
+
+
+extern  int     CommandParser_Parse( const char *payload, const int length, mqttCommand_t *commands, const int maxCommands,
+                                     char *error, const int errorSize );
+extern  int     CommandParser_ParseQuery( const char *payload, const int length, historyQuery_t *query,
+                                          char *error, const int errorSize );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMMANDPARSER_H */
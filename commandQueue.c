@@ -1,122 +1,451 @@
 /*
  * File:    commandQueue.c
  * author:  patrick conroy
- * 
- * Leverage the wonderful work of Troy Hanson and his Linked List Macros
- * to create a FIFO queue.
- * 
- * NB: No logging in here. One fprintf() to stderr to see if I made a mistake
- * 
+ *
+ * A bounded FIFO of commands from the MQTT thread to the command thread.
+ *
+ * This used to be one of Troy Hanson's utlist doubly linked lists with a
+ * malloc() per element (and another per command) - unbounded, so a flood of
+ * commands could eat all of memory. Now it's a fixed ring of mqttCommand_t
+ * slots, allocated once in createQueue(). Commands are copied in and out.
+ *
+ * The ring is Dmitry Vyukov's bounded queue (same as the async logger): each
+ * slot carries a sequence number, so adding and removing are a CAS on a
+ * position - no lock. The mutex and condition variable are only used to put
+ * the command thread to sleep when the ring is empty, and a producer only
+ * touches them if it sees that someone is actually waiting.
+ *
+ * A batch of commands from one message is claimed as a run of consecutive
+ * slots with a single CAS, so the command thread always finds it in one piece
+ * (unless QUEUE_OVERFLOW_DROP_OLDEST later throws the front of it away).
+ *
+ * There's one ring per priority class. The command thread always empties the
+ * higher class first, so a LDOFF doesn't wait behind a backlog of settings.
+ * Each class is FIFO, and each has the full capacity, so a flood of settings
+ * can't crowd out an on/off command either.
+ *
+ * NB: No logging in here.
+ *
  * date:    September 21, 2018
  */
 #include <stdio.h>
 #include <stdlib.h>
-#include <uthash/utlist.h>              // Troy D. Hanson's work!
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
 
+#include "logger.h"
 #include "commandQueue.h"
 
 
-static  element_t       *head = NULL;       // head of dbl linked list  MUST BE INIIIALIZED TO NULL
+typedef struct  commandSlot {
+    unsigned long   sequence;
+    mqttCommand_t   command;
+} commandSlot_t;
+
+typedef struct  commandRing {
+    commandSlot_t   *slots;
+    unsigned long   enqueuePos;
+    unsigned long   dequeuePos;
+    long            accepted;
+} commandRing_t;
+
+static  commandRing_t   rings[ NUM_COMMAND_PRIORITIES ];
+static  unsigned long   capacity = 0;       // per ring, always a power of two
+static  int             overflowPolicy = QUEUE_OVERFLOW_REJECT;
+static  int             consumerWaiting = FALSE;
+static  int             shuttingDown = FALSE;
+
+static  int             maxDepth = 0;
+static  long            rejected = 0;
+static  long            discarded = 0;
+static  long            expired = 0;
 
 static  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static  pthread_cond_t  condition = PTHREAD_COND_INITIALIZER;
+static  pthread_cond_t  condition;                              // on CLOCK_MONOTONIC - see initializeCondition()
+static  pthread_once_t  conditionOnce = PTHREAD_ONCE_INIT;
 
 
 // -----------------------------------------------------------------------------
-void    *createQueue (const int numElements, const int structureSize)
+static
+void    initializeCondition (void)
 {
     //
-    //  Ok to call destroy() on one that hasn't been created. Will return EINVAL
-    pthread_mutex_destroy( &lock );
-    
-    pthread_mutex_init( &lock, NULL );
-    pthread_mutex_lock( &lock );
-    
-    if (head != NULL)
+    //  Timed waits count down on CLOCK_MONOTONIC. On CLOCK_REALTIME (the default)
+    //  the NTP step at boot stretches or cuts short the batch window and ttlMS waits
+    pthread_condattr_t  attributes;
+
+    pthread_condattr_init( &attributes );
+    pthread_condattr_setclock( &attributes, CLOCK_MONOTONIC );
+    pthread_cond_init( &condition, &attributes );
+    pthread_condattr_destroy( &attributes );
+}
+
+
+// -----------------------------------------------------------------------------
+int     createQueue (const int numElements, const int policy)
+{
+    //
+    //  Returns FALSE if we couldn't allocate the slots
+    unsigned long   i;
+    unsigned long   wanted = (numElements > 0) ? numElements : COMMAND_QUEUE_DEFAULT;
+    int             priority;
+
+    if (wanted > COMMAND_QUEUE_MAX)
+        wanted = COMMAND_QUEUE_MAX;
+
+    pthread_once( &conditionOnce, initializeCondition );
+
+    if (capacity != 0)
         destroyQueue();
-    head = NULL;
-    
-    pthread_mutex_unlock( &lock );
-    return head;
+
+    for (capacity = 1; capacity < wanted; capacity <<= 1)
+        ;
+
+    for (priority = 0; priority < NUM_COMMAND_PRIORITIES; priority += 1) {
+        commandRing_t   *ring = &rings[ priority ];
+
+        ring->slots = calloc( capacity, sizeof( commandSlot_t ) );
+        if (ring->slots == NULL) {
+            destroyQueue();
+            return FALSE;
+        }
+
+        for (i = 0; i < capacity; i += 1)
+            ring->slots[ i ].sequence = i;
+        ring->enqueuePos = ring->dequeuePos = 0;
+        ring->accepted = 0;
+    }
+
+    overflowPolicy = policy;
+    shuttingDown = FALSE;
+    maxDepth = 0;
+    rejected = discarded = expired = 0;
+
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+int     parseQueuePolicy (const char *policy)
+{
+    if (strcmp( policy, "reject" ) == 0)
+        return QUEUE_OVERFLOW_REJECT;
+    if (strcmp( policy, "oldest" ) == 0)
+        return QUEUE_OVERFLOW_DROP_OLDEST;
+    if (strcmp( policy, "block" ) == 0)
+        return QUEUE_OVERFLOW_BLOCK;
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     ringDepth (commandRing_t *ring)
+{
+    //
+    //  SEQ_CST so the command thread's "am I waiting" / "is it empty" pair
+    //  can't be reordered against a producer's "publish" / "is anyone waiting"
+    long    depth = (long) __atomic_load_n( &ring->enqueuePos, __ATOMIC_SEQ_CST ) -
+                    (long) __atomic_load_n( &ring->dequeuePos, __ATOMIC_SEQ_CST );
+    return (depth < 0) ? 0 : (int) depth;
 }
 
 // -----------------------------------------------------------------------------
-element_t *addElement (mqttCommand_t *aStructure)
+static
+int     currentDepth (const int priority)
 {
-    element_t   *newElement = malloc( sizeof( element_t ) );
-    if (newElement != NULL) {
-        newElement->s = aStructure;
-        
-        pthread_mutex_lock( &lock );   
-        DL_APPEND( head, newElement );
+    //
+    //  One class, or all of them if priority is COMMAND_PRIORITY_ANY
+    int     depth = 0;
+    int     i;
+
+    if (priority != COMMAND_PRIORITY_ANY)
+        return ringDepth( &rings[ priority ] );
+
+    for (i = 0; i < NUM_COMMAND_PRIORITIES; i += 1)
+        depth += ringDepth( &rings[ i ] );
+    return depth;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     tryEnqueue (commandRing_t *ring, const mqttCommand_t *commands, const int count)
+{
+    //
+    //  All or nothing - a batch only goes in if there are count free slots in
+    //  a row, and then it's claimed with one CAS so nobody can interleave with it
+    unsigned long   pos = __atomic_load_n( &ring->enqueuePos, __ATOMIC_RELAXED );
+    int             i;
+
+    for (;;) {
+        long    diff = 0;
+
+        for (i = 0; i < count; i += 1) {
+            commandSlot_t   *slot = &ring->slots[ (pos + i) & (capacity - 1) ];
+            unsigned long   sequence = __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE );
+            diff = (long) sequence - (long) (pos + i);
+            if (diff != 0)
+                break;
+        }
+
+        if (i == count) {
+            if (__atomic_compare_exchange_n( &ring->enqueuePos, &pos, pos + count, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED )) {
+                for (i = 0; i < count; i += 1) {
+                    commandSlot_t   *slot = &ring->slots[ (pos + i) & (capacity - 1) ];
+                    slot->command = commands[ i ];
+                    __atomic_store_n( &slot->sequence, pos + i + 1, __ATOMIC_SEQ_CST );
+                }
+                return TRUE;
+            }
+        } else if (diff < 0) {
+            return FALSE;                       // not enough room
+        } else {
+            pos = __atomic_load_n( &ring->enqueuePos, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+int     tryDequeue (commandRing_t *ring, mqttCommand_t *command)
+{
+    //
+    //  command can be NULL - that's how QUEUE_OVERFLOW_DROP_OLDEST throws one away
+    unsigned long   pos = __atomic_load_n( &ring->dequeuePos, __ATOMIC_RELAXED );
+
+    for (;;) {
+        commandSlot_t   *slot = &ring->slots[ pos & (capacity - 1) ];
+        unsigned long   sequence = __atomic_load_n( &slot->sequence, __ATOMIC_SEQ_CST );
+        long            diff = (long) sequence - (long) (pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n( &ring->dequeuePos, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED )) {
+                if (command != NULL)
+                    *command = slot->command;
+                __atomic_store_n( &slot->sequence, pos + capacity, __ATOMIC_RELEASE );
+                return TRUE;
+            }
+        } else if (diff < 0) {
+            return FALSE;                       // empty
+        } else {
+            pos = __atomic_load_n( &ring->dequeuePos, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+int     dequeueByPriority (mqttCommand_t *command, const int priority)
+{
+    //
+    //  The most important command waiting, or the next one from just one class
+    int     i;
+
+    if (priority != COMMAND_PRIORITY_ANY)
+        return tryDequeue( &rings[ priority ], command );
+
+    for (i = NUM_COMMAND_PRIORITIES - 1; i >= 0; i -= 1)
+        if (tryDequeue( &rings[ i ], command ))
+            return TRUE;
+    return FALSE;
+}
+
+// -----------------------------------------------------------------------------
+int     addElement (const mqttCommand_t *command)
+{
+    //
+    //  Returns FALSE if the command was not queued
+    return addElements( command, 1 );
+}
+
+// -----------------------------------------------------------------------------
+int     addElements (const mqttCommand_t *commands, const int numCommands)
+{
+    //
+    //  Queues all of them, in consecutive slots of their class's ring, or none of
+    //  them. A batch goes in the class of its first command. Returns FALSE if they
+    //  were not queued
+    if (capacity == 0 || commands == NULL || numCommands <= 0)
+        return FALSE;
+
+    int             priority = commands[ 0 ].priority;
+    commandRing_t   *ring = &rings[ (priority > 0 && priority < NUM_COMMAND_PRIORITIES) ? priority : COMMAND_PRIORITY_NORMAL ];
+
+    if ((unsigned long) numCommands > capacity) {
+        __atomic_add_fetch( &rejected, numCommands, __ATOMIC_RELAXED );
+        return FALSE;
+    }
+
+    while (!tryEnqueue( ring, commands, numCommands )) {
+        if (overflowPolicy == QUEUE_OVERFLOW_DROP_OLDEST) {
+            if (tryDequeue( ring, NULL ))
+                __atomic_add_fetch( &discarded, 1, __ATOMIC_RELAXED );
+        } else if (overflowPolicy == QUEUE_OVERFLOW_BLOCK && !__atomic_load_n( &shuttingDown, __ATOMIC_RELAXED )) {
+            struct timespec ts = { 0, 1000000L };
+            nanosleep( &ts, NULL );
+        } else {
+            __atomic_add_fetch( &rejected, numCommands, __ATOMIC_RELAXED );
+            return FALSE;
+        }
+    }
+    __atomic_add_fetch( &ring->accepted, numCommands, __ATOMIC_RELAXED );
+
+    int depth = currentDepth( COMMAND_PRIORITY_ANY );
+    if (depth > __atomic_load_n( &maxDepth, __ATOMIC_RELAXED ))
+        __atomic_store_n( &maxDepth, depth, __ATOMIC_RELAXED );
+
+    //
+    //  Only wake the command thread if it's actually asleep
+    if (__atomic_load_n( &consumerWaiting, __ATOMIC_SEQ_CST )) {
+        pthread_mutex_lock( &lock );
         pthread_cond_signal( &condition );
         pthread_mutex_unlock( &lock );
+    }
 
-        return newElement;
-    } 
-    
-    return NULL;
+    return TRUE;
 }
 
 // -----------------------------------------------------------------------------
-void    *removeElement ()
+int     removeElement (mqttCommand_t *command)
 {
-    if (head != NULL) {
-        mqttCommand_t   *aStructure = head->s;
-        element_t       *headElement = head;
-        
+    //
+    //  Non-blocking. Returns FALSE if there was nothing waiting
+    if (capacity == 0)
+        return FALSE;
+    return dequeueByPriority( command, COMMAND_PRIORITY_ANY );
+}
+
+// -----------------------------------------------------------------------------
+static
+int     waitForElement (mqttCommand_t *command, const int priority, const struct timespec *deadline)
+{
+    //
+    //  deadline is CLOCK_MONOTONIC, or NULL to wait forever. Returns FALSE if we
+    //  timed out or the queue is being destroyed
+    if (capacity == 0)
+        return FALSE;
+
+    for (;;) {
+        if (dequeueByPriority( command, priority ))
+            return TRUE;
+
+        int timedOut = FALSE;
         pthread_mutex_lock( &lock );
-        DL_DELETE( head, headElement );
-        free( headElement );
+        __atomic_store_n( &consumerWaiting, TRUE, __ATOMIC_SEQ_CST );
+
+        //
+        //  Look again now that producers can see we're waiting - anything
+        //  added after this point will signal us
+        while (!shuttingDown && !timedOut && currentDepth( priority ) == 0) {
+            if (deadline == NULL)
+                pthread_cond_wait( &condition, &lock );
+            else
+                timedOut = (pthread_cond_timedwait( &condition, &lock, deadline ) != 0);
+        }
+
+        __atomic_store_n( &consumerWaiting, FALSE, __ATOMIC_SEQ_CST );
+        int stopping = shuttingDown;
         pthread_mutex_unlock( &lock );
-    
-        return aStructure;
+
+        if (stopping)
+            return FALSE;
+        if (timedOut)
+            return dequeueByPriority( command, priority );
     }
-    
-    return NULL;
 }
 
 // -----------------------------------------------------------------------------
-void    destroyQueue ()
+static
+void    deadlineIn (struct timespec *deadline, const int timeoutMS)
+{
+    clock_gettime( CLOCK_MONOTONIC, deadline );
+    deadline->tv_sec += timeoutMS / 1000;
+    deadline->tv_nsec += (timeoutMS % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// -----------------------------------------------------------------------------
+int     removeElementAndWait (mqttCommand_t *command)
+{
+    //
+    //  Blocks until there's a command. Returns FALSE if the queue is being destroyed
+    return waitForElement( command, COMMAND_PRIORITY_ANY, NULL );
+}
+
+// -----------------------------------------------------------------------------
+int     removeElementTimed (mqttCommand_t *command, const int timeoutMS)
+{
+    //
+    //  Like removeElementAndWait() but gives up after timeoutMS
+    struct timespec deadline;
+
+    deadlineIn( &deadline, timeoutMS );
+    return waitForElement( command, COMMAND_PRIORITY_ANY, &deadline );
+}
+
+// -----------------------------------------------------------------------------
+int     removeElementOfPriority (mqttCommand_t *command, const int priority, const int timeoutMS)
 {
-    element_t   *e1, *e2;
+    //
+    //  The next command from one class only - how the rest of a batch is collected
+    //  without a more important command cutting into it
+    struct timespec deadline;
+
+    if (priority < 0 || priority >= NUM_COMMAND_PRIORITIES)
+        return FALSE;
+
+    deadlineIn( &deadline, timeoutMS );
+    return waitForElement( command, priority, &deadline );
+}
 
-    pthread_mutex_lock( &lock );    
-    DL_FOREACH_SAFE( head, e1, e2) {
-        if (e1->s != NULL)
-            free( e1->s );
-        
-        DL_DELETE( head, e1 );
-        free( e1 );    
+// -----------------------------------------------------------------------------
+void    countExpired (const int numCommands)
+{
+    //
+    //  The command thread found these too old to run
+    __atomic_add_fetch( &expired, numCommands, __ATOMIC_RELAXED );
+}
+
+// -----------------------------------------------------------------------------
+void    queueStats (queueStats_t *stats, const int resetMax)
+{
+    int     i;
+
+    stats->capacity = (int) capacity;
+    stats->depth = currentDepth( COMMAND_PRIORITY_ANY );
+    stats->maxDepth = __atomic_load_n( &maxDepth, __ATOMIC_RELAXED );
+    stats->accepted = 0;
+    for (i = 0; i < NUM_COMMAND_PRIORITIES; i += 1) {
+        stats->depthByPriority[ i ] = (capacity > 0) ? ringDepth( &rings[ i ] ) : 0;
+        stats->acceptedByPriority[ i ] = __atomic_load_n( &rings[ i ].accepted, __ATOMIC_RELAXED );
+        stats->accepted += stats->acceptedByPriority[ i ];
     }
-    
-    free( head );
-    head = NULL;
-    pthread_mutex_unlock( &lock );
-    pthread_mutex_destroy( &lock );
+    stats->rejected = __atomic_load_n( &rejected, __ATOMIC_RELAXED );
+    stats->discarded = __atomic_load_n( &discarded, __ATOMIC_RELAXED );
+    stats->expired = __atomic_load_n( &expired, __ATOMIC_RELAXED );
+
+    if (resetMax)
+        __atomic_store_n( &maxDepth, stats->depth, __ATOMIC_RELAXED );
 }
 
 // -----------------------------------------------------------------------------
-void    *removeElementAndWait ()
+void    destroyQueue ()
 {
-    mqttCommand_t   *aStructure = NULL;
-    
+    int     i;
+
+    //
+    //  Wake up the command thread so it can see we're going away
+    pthread_once( &conditionOnce, initializeCondition );
     pthread_mutex_lock( &lock );
-    while (head == NULL)
-        pthread_cond_wait( &condition, &lock );
-
-    //
-    //  Head should not be null now...
-    if (head != NULL) {
-        aStructure = head->s;
-        element_t   *headElement = head;
-        
-        DL_DELETE( head, headElement );
-        free( headElement );
-    } else
-        fprintf( stderr, "commandQueue : PROGRAMMER FAUX PAUS - removeElementAndWait - head ptr was NULL!\n" );
-    
+    shuttingDown = TRUE;
+    pthread_cond_broadcast( &condition );
     pthread_mutex_unlock( &lock );
-    return aStructure;
+
+    for (i = 0; i < NUM_COMMAND_PRIORITIES; i += 1) {
+        free( rings[ i ].slots );
+        rings[ i ].slots = NULL;
+    }
+    capacity = 0;
 }
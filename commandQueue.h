@@ -15,7 +15,6 @@ extern "C" {
 /*
  */
 #include <stdio.h>
-#include <uthash/utlist.h>
 
 
     
@@ -30,49 +29,70 @@ extern "C" {
 //      (I'll make the two strings arrays so I can strncpy() and avoid
 //      malloc/free for now.  32 bytes is more than enough)
 typedef struct  mqttCommand {
+    char    controllerID[ 32 ];         // which SCC - taken from the topic it arrived on
     char    command[ 32 ];              // e.g BT, HVD, WTL1
     int     iParam;                     // some commands take Int parameters
     double  fParam;                     // some commands take Floating Point parameters
     char    cParam[ 32 ];               // some commands take other types parameters
+    char    correlationID[ 64 ];        // optional - echoed back on the RESPONSE topic
+    long long   receivedUS;             // when the MQTT message arrived, wall clock microseconds
+    int     batchIndex;                 // position in a batch message, 0 for a single command
+    int     batchSize;                  // how many commands arrived in its message, 1 for a single command
+    int     coalesce;                   // batch only - adjacent register writes may be merged
+    int     priority;                   // COMMAND_PRIORITY_xxx - which ring it waits in
+    int     ttlMS;                      // optional - drop it if it hasn't run this long after it arrived, 0 = never
 } mqttCommand_t;
 
+//
+//  Priority classes - the command thread always takes the highest one waiting
+#define COMMAND_PRIORITY_ANY        -1          // removeElement*() - whatever's most important
+#define COMMAND_PRIORITY_NORMAL     0           // parameter writes, clock settings, statistics
+#define COMMAND_PRIORITY_CONTROL    1           // load and charging on/off
+#define NUM_COMMAND_PRIORITIES      2
 
+//
+//  A batch (a JSON array of commands in one message) is queued as one unit,
+//  in consecutive slots, and run in order as one transaction
+#define COMMAND_BATCH_MAX           16
 
-/*
- * Our Command Queue will Hold "elements" of type "element_t"
- * There are three members in the element_t structure:
- *      1.  a Pointer to the "mqttCommand" structure
- *      2.  a Pointer to the previous element
- *      3.  a Pointer to the next element
- * 
- * From Troy Hanson's documentaion:
- * 
- * You can use any structure with these macros, as long as the structure contains a 
- * next pointer. If you want to make a doubly-linked list, the element also needs to have a prev pointer.
- * 
- *  typedef struct element {
-        char *name;
-        struct element *prev;   //  needed for a doubly-linked list only 
-        struct element *next;   // needed for singly- or doubly-linked lists
-
-     } element;
- * 
- * You can name your structure anything. In the example above it is called element. 
- * Within a particular list, all elements must be of the same type.
- */
-
-typedef struct  element {
-    mqttCommand_t   *s;         // the embedded structure
-    struct element  *prev;      // needed for a doubly-linked list only 
-    struct element  *next;      // needed for singly- or doubly-linked lists
-} element_t;
 
 
+//
+//  The queue is a fixed size ring of mqttCommand_t slots per priority class,
+//  allocated once. Commands are copied in and copied out - nothing is malloc'd per message.
+#define COMMAND_QUEUE_DEFAULT       64
+#define COMMAND_QUEUE_MAX           1024          // capacities are rounded up to a power of two
 
-extern  void    *createQueue (const int numElements, const int structureSize);
-extern  element_t  *addElement (mqttCommand_t *aStructure);
-extern  void    *removeElement( void );
-extern  void    *removeElementAndWait( void );
+//
+//  What addElement() does when the ring is full
+#define QUEUE_OVERFLOW_REJECT       0           // refuse the new command, count it
+#define QUEUE_OVERFLOW_DROP_OLDEST  1           // throw away the oldest waiting command, count it
+#define QUEUE_OVERFLOW_BLOCK        2           // wait for the command thread to make room
+
+typedef struct  queueStats {
+    int     capacity;                           // per priority class
+    int     depth;
+    int     maxDepth;
+    int     depthByPriority[ NUM_COMMAND_PRIORITIES ];
+    long    accepted;
+    long    acceptedByPriority[ NUM_COMMAND_PRIORITIES ];
+    long    rejected;                           // QUEUE_OVERFLOW_REJECT
+    long    discarded;                          // QUEUE_OVERFLOW_DROP_OLDEST
+    long    expired;                            // too old to run by the time they came out
+} queueStats_t;
+
+
+
+extern  int     createQueue( const int numElements, const int overflowPolicy );
+extern  int     parseQueuePolicy( const char *policy );
+extern  int     addElement( const mqttCommand_t *command );
+extern  int     addElements( const mqttCommand_t *commands, const int numCommands );
+extern  int     removeElement( mqttCommand_t *command );
+extern  int     removeElementAndWait( mqttCommand_t *command );
+extern  int     removeElementTimed( mqttCommand_t *command, const int timeoutMS );
+extern  int     removeElementOfPriority( mqttCommand_t *command, const int priority, const int timeoutMS );
+extern  void    countExpired( const int numCommands );
+extern  void    queueStats( queueStats_t *stats, const int resetMax );
 extern  void    destroyQueue( void );
 
 
@@ -0,0 +1,718 @@
+/*
+ * File:    controller.c
+ * author:  patrick conroy
+ *
+ * Most sites have more than one Solar Charge Controller. Rather than run one
+ * process (and one MQTT connection) per SCC, we keep a table of controllers,
+ * each one a (serial port, slave ID, controller ID) tuple.
+ *
+ * Controllers that share a serial port share one RS-485 bus and one modbus_t.
+ * Each port gets its own poller thread that walks the controllers on that bus,
+ * switching slave IDs between them. Every transaction goes thru the port's
+ * bus arbiter so the command thread can't interleave frames.
+ *
+ * Everything publishes thru the single MQTT connection to per-controller topics.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <modbus/modbus.h>
+
+#include "logger.h"
+#include "ls1024b.h"
+#include "mqtt.h"
+#include "jsonMessage.h"
+#include "pollScheduler.h"
+#include "registerMap.h"
+#include "cycleTimer.h"
+#include "busArbiter.h"
+#include "modbusMetrics.h"
+#include "jsonWriter.h"
+#include "commandQueue.h"
+#include "timestamp.h"
+#include "spool.h"
+#include "history.h"
+#include "controller.h"
+
+
+static  controller_t    controllers[ MAX_CONTROLLERS ];
+static  int             numControllers = 0;
+
+static  serialPort_t    ports[ MAX_SERIAL_PORTS ];
+static  int             numPorts = 0;
+
+static  const char      *topTopic = "LS1024B";
+static  int             sleepSeconds = 1;             // the poll loop tick - see Scheduler_DueBlocks()
+static  const char      *blockIntervals = NULL;
+static  int             overrunPolicy = CYCLE_SKIP;
+static  int             metricsSeconds = 60;            // 0 == don't publish METRICS
+static  int             prettyJSON = JSON_PRETTY_DEFAULT;
+static  int             keyframeCycles = 0;             // 0 == every DATA message in full
+
+//
+//  How often each poller logs its cycle lateness statistics
+#define TIMING_REPORT_CYCLES    100
+
+
+// -----------------------------------------------------------------------------
+void    Controller_SetDefaults (const char *top, const int seconds, const char *intervals, const int policy,
+                                const int metricsInterval, const int pretty, const int keyframes)
+{
+    topTopic = top;
+    sleepSeconds = seconds;
+    blockIntervals = intervals;
+    overrunPolicy = policy;
+    metricsSeconds = metricsInterval;
+    prettyJSON = pretty;
+    keyframeCycles = keyframes;
+}
+
+// -----------------------------------------------------------------------------
+static
+serialPort_t    *findOrAddPort (const char *device)
+{
+    int i;
+
+    for (i = 0; i < numPorts; i += 1)
+        if (strcmp( ports[ i ].device, device ) == 0)
+            return &ports[ i ];
+
+    if (numPorts >= MAX_SERIAL_PORTS) {
+        Logger_LogError( "Too many serial ports. Maximum is %d\n", MAX_SERIAL_PORTS );
+        return NULL;
+    }
+
+    serialPort_t    *port = &ports[ numPorts++ ];
+    memset( port, '\0', sizeof( serialPort_t ) );
+    strncpy( port->device, device, sizeof port->device - 1 );
+    Arbiter_Initialize( &port->bus );
+
+    return port;
+}
+
+// -----------------------------------------------------------------------------
+controller_t    *Controller_Add (const char *device, const int slaveID, const char *controllerID)
+{
+    if (numControllers >= MAX_CONTROLLERS) {
+        Logger_LogError( "Too many controllers. Maximum is %d\n", MAX_CONTROLLERS );
+        return NULL;
+    }
+
+    if (Controller_FindByID( controllerID ) != NULL) {
+        Logger_LogError( "Controller ID [%s] is already in use\n", controllerID );
+        return NULL;
+    }
+
+    serialPort_t    *port = findOrAddPort( device );
+    if (port == NULL)
+        return NULL;
+
+    controller_t    *controller = &controllers[ numControllers++ ];
+    memset( controller, '\0', sizeof( controller_t ) );
+
+    strncpy( controller->controllerID, controllerID, sizeof controller->controllerID - 1 );
+    controller->slaveID = slaveID;
+    controller->port = port;
+    port->controllers[ port->numControllers++ ] = controller;
+
+    //
+    //  Concatenate topTopic and controller ID to create our Pub and Sub Topics
+    snprintf( controller->publishTopic, sizeof controller->publishTopic, "%s/%s/%s", topTopic, controllerID, "DATA" );
+    snprintf( controller->subscriptionTopic, sizeof controller->subscriptionTopic, "%s/%s/%s", topTopic, controllerID, "COMMAND" );
+    snprintf( controller->metricsTopic, sizeof controller->metricsTopic, "%s/%s/%s", topTopic, controllerID, "METRICS" );
+    snprintf( controller->responseTopic, sizeof controller->responseTopic, "%s/%s/%s", topTopic, controllerID, "RESPONSE" );
+    snprintf( controller->queryTopic, sizeof controller->queryTopic, "%s/%s/%s", topTopic, controllerID, "QUERY" );
+    snprintf( controller->historyTopic, sizeof controller->historyTopic, "%s/%s/%s", topTopic, controllerID, "HISTORY" );
+    snprintf( controller->stateTopics[ STATE_IDENTITY ], sizeof controller->stateTopics[ 0 ], "%s/%s/%s", topTopic, controllerID, "IDENTITY" );
+    snprintf( controller->stateTopics[ STATE_RATED ], sizeof controller->stateTopics[ 0 ], "%s/%s/%s", topTopic, controllerID, "RATED" );
+    snprintf( controller->stateTopics[ STATE_SETTINGS ], sizeof controller->stateTopics[ 0 ], "%s/%s/%s", topTopic, controllerID, "SETTINGS" );
+
+    Metrics_Initialize( &controller->metrics );
+    JSON_WriterInitialize( &controller->jsonWriter, controller->jsonBuffer, sizeof controller->jsonBuffer, prettyJSON );
+    JSONMessage_InitializeDelta( &controller->delta, keyframeCycles );
+    controller->lastMetricsPublish = time( NULL );
+
+    //
+    //  Who we are can go out right away, the rest once it's been read
+    controller->stateAvailable = controller->stateDirty = STATE_MASK( STATE_IDENTITY );
+    controller->stateReconnects = MQTT_Reconnects();
+
+    //
+    //  Each register block gets read on its own schedule
+    Scheduler_Initialize( &controller->scheduler );
+    pthread_mutex_init( &controller->snapshotLock, NULL );
+    if (blockIntervals != NULL && !Scheduler_ParseIntervals( &controller->scheduler, blockIntervals ))
+        Logger_LogFatal( "Unable to parse the block refresh intervals [%s]\n", blockIntervals );
+
+    Logger_LogInfo( "Controller [%s] is slave ID %d on %s\n", controller->controllerID, slaveID, device );
+    return controller;
+}
+
+// -----------------------------------------------------------------------------
+controller_t    *Controller_AddFromSpec (const char *spec)
+{
+    //
+    //  Spec looks like "/dev/ttyUSB0:1:garage" - port : slave ID : controller ID
+    //  Split from the right, so the device name is everything before the second to last colon
+    char    buffer[ 256 ];
+
+    strncpy( buffer, spec, sizeof buffer - 1 );
+    buffer[ sizeof buffer - 1 ] = '\0';
+
+    char    *idPtr = strrchr( buffer, ':' );
+    if (idPtr == NULL)
+        return NULL;
+    *idPtr++ = '\0';
+
+    char    *slavePtr = strrchr( buffer, ':' );
+    if (slavePtr == NULL)
+        return NULL;
+    *slavePtr++ = '\0';
+
+    int     slaveID = atoi( slavePtr );
+    if (buffer[ 0 ] == '\0' || *idPtr == '\0' || slaveID < 1 || slaveID > 247)
+        return NULL;
+
+    return Controller_Add( buffer, slaveID, idPtr );
+}
+
+// -----------------------------------------------------------------------------
+int Controller_Count (void)
+{
+    return numControllers;
+}
+
+// -----------------------------------------------------------------------------
+controller_t    *Controller_Get (const int index)
+{
+    if (index < 0 || index >= numControllers)
+        return NULL;
+    return &controllers[ index ];
+}
+
+// -----------------------------------------------------------------------------
+controller_t    *Controller_FindByID (const char *controllerID)
+{
+    int i;
+
+    for (i = 0; i < numControllers; i += 1)
+        if (strcmp( controllers[ i ].controllerID, controllerID ) == 0)
+            return &controllers[ i ];
+
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+modbus_t    *Controller_AcquireBus (controller_t *controller, const int priority)
+{
+    //
+    //  Wait our turn on the bus, which comes back pointed at this controller
+    return Arbiter_Acquire( &controller->port->bus, controller->slaveID, priority );
+}
+
+// -----------------------------------------------------------------------------
+void    Controller_ReleaseBus (controller_t *controller)
+{
+    Arbiter_Release( &controller->port->bus );
+}
+
+// -----------------------------------------------------------------------------
+void    Controller_OpenPorts (void)
+{
+    int i;
+
+    for (i = 0; i < numPorts; i += 1) {
+        //
+        // Modbus - open the SCC port. We know it's 115.2K 8N1
+        Logger_LogInfo( "Opening %s, 115200 8N1\n", ports[ i ].device );
+        modbus_t    *ctx = modbus_new_rtu( ports[ i ].device, 115200, 'N', 8, 1 );
+        if (ctx == NULL)
+            Logger_LogFatal( "Unable to create the libmodbus context for %s\n", ports[ i ].device );
+
+        if (modbus_connect( ctx ) == -1) {
+            Logger_LogError( "Connection to %s failed: %s\n", ports[ i ].device, modbus_strerror( errno ) );
+            modbus_free( ctx );
+            Logger_LogFatal( "Unable to open %s\n", ports[ i ].device );
+        }
+
+        ports[ i ].bus.ctx = ctx;
+        Logger_LogInfo( "Port %s to Solar Charge Controller(s) is open.\n", ports[ i ].device );
+    }
+}
+
+// -----------------------------------------------------------------------------
+void    Controller_ClosePorts (void)
+{
+    int i;
+
+    for (i = 0; i < numPorts; i += 1) {
+        if (ports[ i ].bus.ctx != NULL) {
+            modbus_close( ports[ i ].bus.ctx );
+            modbus_free( ports[ i ].bus.ctx );
+            ports[ i ].bus.ctx = NULL;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+int     Controller_OpenHistory (const char *directory, const int megabytes)
+{
+    //
+    //  One file per controller, each with the whole budget. Call before the
+    //  pollers start. Returns how many were opened
+    int     opened = 0;
+    int     i;
+
+    for (i = 0; i < numControllers; i += 1) {
+        controllers[ i ].history = History_Open( directory, controllers[ i ].controllerID, megabytes );
+        if (controllers[ i ].history != NULL)
+            opened += 1;
+        else
+            Logger_LogError( "Unable to open the history for controller [%s] in [%s]\n", controllers[ i ].controllerID, directory );
+    }
+    return opened;
+}
+
+// -----------------------------------------------------------------------------
+void    Controller_CloseHistory (void)
+{
+    //
+    //  After the pollers have stopped - the open blocks are written out
+    int i;
+
+    for (i = 0; i < numControllers; i += 1) {
+        History_Close( controllers[ i ].history );
+        controllers[ i ].history = NULL;
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+void    setControllerClock (controller_t *controller)
+{
+    int seconds, minutes, hour, day, month, year;
+
+    modbus_t    *ctx = Controller_AcquireBus( controller, BUS_PRIORITY_POLL );
+    long long   startUS = Metrics_Start();
+    setRealtimeClockToNow( ctx );
+    Metrics_RecordLibraryCall( &controller->metrics, "setRealtimeClock", startUS );
+    getRealtimeClock( ctx, &seconds, &minutes, &hour, &day, &month, &year );
+    Controller_ReleaseBus( controller );
+
+    Logger_LogInfo( "Controller [%s] clock set to: %02d/%02d/%02d %02d:%02d:%02d\n",
+                    controller->controllerID, month, day, year, hour, minutes, seconds );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    decodeBlocks (controller_t *controller, const int blockMask)
+{
+    //
+    //  Register image -> the structures, for the blocks in 'blockMask'
+    if (blockMask & BLOCK_MASK( BLOCK_REALTIME_DATA ))
+        RegisterMap_DecodeRealTimeData( &controller->registerImage, &controller->realTimeData );
+    if (blockMask & BLOCK_MASK( BLOCK_REALTIME_STATUS ))
+        RegisterMap_DecodeRealTimeStatus( &controller->registerImage, &controller->realTimeStatusData );
+    if (blockMask & BLOCK_MASK( BLOCK_SETTINGS ))
+        RegisterMap_DecodeSettings( &controller->registerImage, &controller->settingsData );
+    if (blockMask & BLOCK_MASK( BLOCK_STATISTICS ))
+        RegisterMap_DecodeStatisticalParameters( &controller->registerImage, &controller->statisticalParametersData );
+    if (blockMask & BLOCK_MASK( BLOCK_CLOCK ))
+        RegisterMap_DecodeClock( &controller->registerImage, &controller->settingsData );
+
+    //
+    //  Fresh settings or rated data - see if the retained copy needs replacing
+    if (blockMask & BLOCK_MASK( BLOCK_RATED_DATA ))
+        controller->stateDirty |= STATE_MASK( STATE_RATED );
+    if (blockMask & BLOCK_MASK( BLOCK_SETTINGS ))
+        controller->stateDirty |= STATE_MASK( STATE_SETTINGS );
+    controller->stateAvailable |= controller->stateDirty;
+}
+
+// -----------------------------------------------------------------------------
+static
+const char  *createStateMessage (controller_t *controller, const int state)
+{
+    const char  *topic = controller->stateTopics[ state ];
+
+    switch (state) {
+        case    STATE_IDENTITY: return JSONMessage_CreateIdentity( &controller->jsonWriter, topic, controller->controllerID,
+                                                                   controller->slaveID, controller->port->device );
+        case    STATE_RATED:    return JSONMessage_CreateRatedData( &controller->jsonWriter, topic, &controller->ratedData );
+        case    STATE_SETTINGS: return JSONMessage_CreateSettings( &controller->jsonWriter, topic, &controller->settingsData );
+    }
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    publishState (controller_t *controller)
+{
+    //
+    //  Settings, rated data and identity are retained, so a new subscriber has them the
+    //  moment it connects - and DATA doesn't have to carry them. They only go out when
+    //  they've changed, or when we get the broker back (it may have restarted without
+    //  them). Anything that couldn't be sent stays dirty for next time. Hold snapshotLock
+    long    reconnects = MQTT_Reconnects();
+    int     state;
+
+    if (reconnects != controller->stateReconnects) {
+        controller->stateReconnects = reconnects;
+        controller->stateSent = 0;
+        controller->stateDirty |= controller->stateAvailable;
+    }
+
+    for (state = 0; state < NUM_STATE_MESSAGES; state += 1) {
+        int     mask = STATE_MASK( state );
+        if (!(controller->stateDirty & mask))
+            continue;
+
+        const char  *jsonMessage = createStateMessage( controller, state );
+        if (jsonMessage == NULL) {
+            Logger_LogError( "Unable to build the message for [%s]\n", controller->stateTopics[ state ] );
+            controller->stateDirty &= ~mask;
+            continue;
+        }
+
+        uint32_t    hash = JSONMessage_Hash( jsonMessage );
+        if ((controller->stateSent & mask) && hash == controller->stateHash[ state ]) {
+            controller->stateDirty &= ~mask;
+            continue;
+        }
+
+        if (MQTT_PublishData( MQTT_CLASS_STATE, controller->stateTopics[ state ], jsonMessage, controller->jsonWriter.length ) == MQTT_PUBLISH_OK) {
+            controller->stateHash[ state ] = hash;
+            controller->stateSent |= mask;
+            controller->stateDirty &= ~mask;
+            controller->statePublished += 1;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+void    pollController (controller_t *controller)
+{
+    //
+    // make the modbus calls for just the blocks that are due
+    int dueBlocks = Scheduler_DueBlocks( &controller->scheduler );
+    Logger_LogDebug( "Poll cycle [%s] - block mask due: 0x%02X\n", controller->controllerID, dueBlocks );
+
+    //
+    //  Rated Data comes from the library, the rest from a few coalesced span reads.
+    //  Each one is a separate trip thru the arbiter so waiting commands can cut in.
+    int         readBlocks = 0;
+    modbus_t    *ctx;
+    long long   startUS;
+
+    if (dueBlocks & BLOCK_MASK( BLOCK_RATED_DATA )) {
+        ctx = Controller_AcquireBus( controller, BUS_PRIORITY_POLL );
+        startUS = Metrics_Start();
+        getRatedData( ctx, &controller->ratedData );
+        Metrics_RecordLibraryCall( &controller->metrics, "rated", startUS );
+        Controller_ReleaseBus( controller );
+        readBlocks |= BLOCK_MASK( BLOCK_RATED_DATA );
+    }
+    readBlocks |= RegisterMap_ReadBlocks( &controller->port->bus, controller->slaveID, &controller->metrics,
+                                        &controller->registerImage, dueBlocks );
+
+    ctx = Controller_AcquireBus( controller, BUS_PRIORITY_POLL );
+    startUS = Metrics_Start();
+    controller->nightTime = isNightTime( ctx );
+    Metrics_RecordLibraryCall( &controller->metrics, "isNightTime", startUS );
+    Controller_ReleaseBus( controller );
+
+    decodeBlocks( controller, readBlocks );
+
+    //
+    //  A fresh real time sample goes into the history, with the latest statistics
+    //  alongside it - they change far more slowly and are read less often
+    if (controller->history != NULL && (readBlocks & BLOCK_MASK( BLOCK_REALTIME_DATA )))
+        History_Append( controller->history, Timestamp_EpochUS() / 1000,
+                        &controller->realTimeData, &controller->statisticalParametersData );
+
+    //
+    //  Anything that failed stays due and gets tried again next cycle
+    Scheduler_MarkRead( &controller->scheduler, readBlocks );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    publishController (controller_t *controller)
+{
+    publishState( controller );
+
+    //
+    //  The broker isn't keeping up - don't pile another sample on top. The next
+    //  cycle's message has everything this one would have had
+    if (MQTT_Backlogged()) {
+        controller->publishesSkipped += 1;
+        Logger_LogDebug( "MQTT backlogged - skipping this sample for controller [%s]\n", controller->controllerID );
+        return;
+    }
+
+    //
+    // craft a JSON message from the data - it lives in the controller's buffer, nothing to free
+    const char  *jsonMessage = createJSONMessage( &controller->jsonWriter,
+                                        controller->nightTime,
+                                        controller->publishTopic,
+                                        DATA_BLOCKS_MASK,
+                                        Spool_NextSequence(),
+                                        &controller->delta,
+                                        &controller->realTimeData,
+                                        &controller->realTimeStatusData,
+                                        &controller->settingsData,
+                                        &controller->statisticalParametersData
+            );
+
+    if (jsonMessage == NULL) {
+        Logger_LogError( "Unable to build the DATA message for controller [%s]\n", controller->controllerID );
+        return;
+    }
+
+    //
+    // Publish it to our MQTT broker - timed too, so a slow cycle can be pinned on the bus or the broker
+    long long   startUS = Metrics_Start();
+    int         result = MQTT_PublishData( MQTT_CLASS_DATA, controller->publishTopic, jsonMessage, controller->jsonWriter.length );
+    Metrics_Record( &controller->metrics, "mqttPublish", startUS, (result == MQTT_PUBLISH_FAILED), 0, 0 );
+    if (result == MQTT_PUBLISH_OK)
+        JSONMessage_CommitDelta( &controller->delta );
+    if (result == MQTT_PUBLISH_BUSY)
+        controller->publishesSkipped += 1;
+    else if (result == MQTT_PUBLISH_OK && controller->samplesSent++ == 0)
+        Logger_LogInfo( "Startup +%0.1f ms: first sample from controller [%s] %s\n", Timestamp_SinceStartupMS(), controller->controllerID,
+                        MQTT_IsConnected() ? "published" : "buffered until the broker connects" );
+
+    //
+    //  Every so often, send out what the call sites have been up to and start over.
+    //  Not while we're backlogged - resetting would lose them
+    time_t  now = time( NULL );
+    if (metricsSeconds > 0 && (now - controller->lastMetricsPublish) >= metricsSeconds && !MQTT_Backlogged()) {
+        char    *metricsMessage = Metrics_CreateJSONMessage( &controller->metrics, controller->metricsTopic, TRUE );
+        if (metricsMessage != NULL) {
+            MQTT_PublishData( MQTT_CLASS_METRICS, controller->metricsTopic, metricsMessage, strlen( metricsMessage ) );
+            free( metricsMessage );
+        } else
+            Logger_LogError( "Unable to build the METRICS message for controller [%s]\n", controller->controllerID );
+        controller->lastMetricsPublish = now;
+    }
+}
+
+// -----------------------------------------------------------------------------
+int Controller_ReadBack (controller_t *controller, const registerSpan_t *span, const int blockMask)
+{
+    //
+    //  Called by the command thread right after a successful write. Re-read just the
+    //  registers the command touched, fold them into the snapshot and publish only the
+    //  section(s) they belong to - no waiting for the next full poll. Settings go to
+    //  their retained topic, the rest in a partial DATA message.
+    //  Returns FALSE if the read failed.
+    registerImage_t scratch;
+    int             sections = blockMask & DATA_BLOCKS_MASK;
+
+    if (RegisterMap_ReadSpan( &controller->port->bus, controller->slaveID, &controller->metrics,
+                              &scratch, span, BUS_PRIORITY_COMMAND ) == -1) {
+        Logger_LogError( "Read-back of 0x%04X (%d registers) for controller [%s] failed: %s\n",
+                         span->start, span->count, controller->controllerID, modbus_strerror( errno ) );
+        return FALSE;
+    }
+
+    pthread_mutex_lock( &controller->snapshotLock );
+    RegisterMap_CopySpan( &controller->registerImage, &scratch, span );
+    decodeBlocks( controller, blockMask );
+    publishState( controller );
+
+    if (sections == 0) {
+        pthread_mutex_unlock( &controller->snapshotLock );
+        return TRUE;
+    }
+
+    const char  *jsonMessage = createJSONMessage( &controller->jsonWriter,
+                                        controller->nightTime,
+                                        controller->publishTopic,
+                                        sections,
+                                        Spool_NextSequence(),
+                                        &controller->delta,
+                                        &controller->realTimeData,
+                                        &controller->realTimeStatusData,
+                                        &controller->settingsData,
+                                        &controller->statisticalParametersData
+            );
+
+    //
+    //  If the broker is backlogged the new values still went into the snapshot -
+    //  they'll go out with the next full publish
+    if (jsonMessage != NULL) {
+        if (MQTT_PublishData( MQTT_CLASS_DATA, controller->publishTopic, jsonMessage, controller->jsonWriter.length ) == MQTT_PUBLISH_OK)
+            JSONMessage_CommitDelta( &controller->delta );
+    } else
+        Logger_LogError( "Unable to build the partial DATA message for controller [%s]\n", controller->controllerID );
+    pthread_mutex_unlock( &controller->snapshotLock );
+
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    reportPortStatistics (serialPort_t *port)
+{
+    cycleTimer_t    *timer = &port->cycleTimer;
+    int             i;
+    
+    if (timer->cycles == 0)
+        return;
+    
+    Logger_LogInfo( "Cycle timing %s: %ld cycles, lateness ms min %0.3f avg %0.3f max %0.3f, %ld overruns, %ld skipped\n",
+                    port->device, timer->cycles,
+                    timer->minLatenessUS / 1000.0,
+                    (timer->sumLatenessUS / (double) timer->cycles) / 1000.0,
+                    timer->maxLatenessUS / 1000.0,
+                    timer->overruns, timer->skipped );
+    CycleTimer_ResetStats( timer );
+    
+    busStats_t      stats;
+    Arbiter_GetStats( &port->bus, &stats, TRUE );
+    Logger_LogInfo( "Bus arbiter %s: polls %ld (wait ms avg %0.3f max %0.3f), commands %ld (wait ms avg %0.3f max %0.3f), max queue depth %d\n",
+                    port->device,
+                    stats.transactions[ BUS_PRIORITY_POLL ],
+                    stats.transactions[ BUS_PRIORITY_POLL ] ? (stats.totalWaitUS[ BUS_PRIORITY_POLL ] / (double) stats.transactions[ BUS_PRIORITY_POLL ]) / 1000.0 : 0.0,
+                    stats.maxWaitUS[ BUS_PRIORITY_POLL ] / 1000.0,
+                    stats.transactions[ BUS_PRIORITY_COMMAND ],
+                    stats.transactions[ BUS_PRIORITY_COMMAND ] ? (stats.totalWaitUS[ BUS_PRIORITY_COMMAND ] / (double) stats.transactions[ BUS_PRIORITY_COMMAND ]) / 1000.0 : 0.0,
+                    stats.maxWaitUS[ BUS_PRIORITY_COMMAND ] / 1000.0,
+                    stats.maxQueueDepth );
+
+    for (i = 0; i < port->numControllers; i += 1) {
+        deltaState_t    *delta = &port->controllers[ i ]->delta;
+        if (delta->messages > 0) {
+            Logger_LogInfo( "Controller [%s]: %ld DATA messages (%ld keyframes), %ld of %ld fields sent\n",
+                            port->controllers[ i ]->controllerID, delta->messages, delta->keyframes,
+                            delta->fieldsSent, delta->fieldsConsidered );
+            delta->messages = delta->keyframes = delta->fieldsSent = delta->fieldsConsidered = 0;
+        }
+        if (port->controllers[ i ]->statePublished > 0)
+            Logger_LogInfo( "Controller [%s]: %ld retained state messages published\n",
+                            port->controllers[ i ]->controllerID, port->controllers[ i ]->statePublished );
+        port->controllers[ i ]->statePublished = 0;
+        if (port->controllers[ i ]->publishesSkipped > 0)
+            Logger_LogWarning( "Controller [%s]: %ld samples not published - MQTT backlogged\n",
+                               port->controllers[ i ]->controllerID, port->controllers[ i ]->publishesSkipped );
+        port->controllers[ i ]->publishesSkipped = 0;
+    }
+
+    for (i = 0; i < port->numControllers; i += 1) {
+        history_t   *history = port->controllers[ i ]->history;
+        if (history != NULL)
+            Logger_LogInfo( "History [%s]: %ld samples, %ld blocks sealed, %ld corrupt blocks skipped\n",
+                            port->controllers[ i ]->controllerID, history->appended, history->sealed, history->corrupt );
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+void    reportSharedStatistics (void)
+{
+    //
+    //  The command queue, the broker connection and the spool are shared by every
+    //  port. Reading them resets them, so only the first port's poller does this
+    int             i;
+
+    queueStats_t    queue;
+    queueStats( &queue, TRUE );
+    Logger_LogInfo( "Command queue: depth %d (control %d, normal %d) of %d per class (max %d), %ld accepted (%ld control), %ld rejected, %ld discarded, %ld expired\n",
+                    queue.depth, queue.depthByPriority[ COMMAND_PRIORITY_CONTROL ], queue.depthByPriority[ COMMAND_PRIORITY_NORMAL ],
+                    queue.capacity, queue.maxDepth, queue.accepted, queue.acceptedByPriority[ COMMAND_PRIORITY_CONTROL ],
+                    queue.rejected, queue.discarded, queue.expired );
+
+    //
+    //  Publish to acknowledgement latency by topic class
+    mqttStats_t     mqtt;
+    MQTT_GetStats( &mqtt, TRUE );
+    Logger_LogInfo( "MQTT %s: %d in flight of %d (max %d), %d buffered (max %d), %ld reconnects\n",
+                    mqtt.connected ? "connected" : "NOT connected", mqtt.inFlight, mqtt.window, mqtt.maxInFlight,
+                    mqtt.backlog, mqtt.maxBacklog, mqtt.reconnects );
+    for (i = 0; i < NUM_MQTT_CLASSES; i += 1) {
+        mqttClassStats_t    *classStats = &mqtt.classes[ i ];
+        if (classStats->published == 0 && classStats->refused == 0 && classStats->failed == 0 && classStats->buffered == 0)
+            continue;
+        Logger_LogInfo( "MQTT %s (QoS %d): %ld published, %ld acked (ms avg %0.3f max %0.3f), %ld refused, %ld failed, %ld lost, %ld buffered, %ld dropped\n",
+                        MQTT_ClassName( i ), MQTT_ClassQoS( i ), classStats->published, classStats->acknowledged,
+                        classStats->acknowledged ? (classStats->totalAckUS / (double) classStats->acknowledged) / 1000.0 : 0.0,
+                        classStats->maxAckUS / 1000.0, classStats->refused, classStats->failed, classStats->lost,
+                        classStats->buffered, classStats->dropped );
+    }
+
+    spoolStats_t    spool;
+    Spool_GetStats( &spool, TRUE );
+    if (spool.open)
+        Logger_LogInfo( "Spool: %ld waiting (%lld of %lld KB), %ld appended, %ld replayed, %ld evicted, %ld corrupt\n",
+                        spool.pending, spool.bytesUsed / 1024, spool.bytesBudget / 1024,
+                        spool.appended, spool.replayed, spool.evicted, spool.corrupt );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    *portPoller (void *argPtr)
+{
+    //
+    //  This function is started by a new thread - one per serial port
+    serialPort_t    *port = (serialPort_t *) argPtr;
+    int             i;
+
+    Logger_LogDebug( "Poller for %s - starting thread, %d controller(s).\n", port->device, port->numControllers );
+
+    for (i = 0; i < port->numControllers; i += 1)
+        setControllerClock( port->controllers[ i ] );
+
+    //
+    //  Loop forever - read SCC data and send it out. Samples are taken on a
+    //  fixed grid, not 'sleepSeconds' after the last one finished
+    CycleTimer_Start( &port->cycleTimer, sleepSeconds * 1000L, overrunPolicy );
+    while (TRUE) {
+        CycleTimer_Wait( &port->cycleTimer );
+
+        for (i = 0; i < port->numControllers; i += 1) {
+            pthread_mutex_lock( &port->controllers[ i ]->snapshotLock );
+            pollController( port->controllers[ i ] );
+            publishController( port->controllers[ i ] );
+            pthread_mutex_unlock( &port->controllers[ i ]->snapshotLock );
+        }
+
+        if (port->cycleTimer.cycles >= TIMING_REPORT_CYCLES) {
+            reportPortStatistics( port );
+            if (port == &ports[ 0 ])
+                reportSharedStatistics();
+        }
+    }
+
+    return (void *) 0;
+}
+
+// -----------------------------------------------------------------------------
+void    Controller_StartPollers (void)
+{
+    int i;
+
+    for (i = 0; i < numPorts; i += 1) {
+        if (pthread_create( &ports[ i ].pollerThread, NULL, portPoller, &ports[ i ] ))
+            Logger_LogFatal( "Unable to start the poller thread for %s!\n", ports[ i ].device );
+    }
+}
+
+// -----------------------------------------------------------------------------
+void    Controller_JoinPollers (void)
+{
+    int i;
+
+    for (i = 0; i < numPorts; i += 1) {
+        if (pthread_join( ports[ i ].pollerThread, NULL ))
+            Logger_LogError( "Shutting down but unable to join the poller thread for %s\n", ports[ i ].device );
+    }
+}
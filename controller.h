@@ -0,0 +1,130 @@
+/*
+ * File:   controller.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <modbus/modbus.h>
+
+#include "ls1024b.h"
+#include "pollScheduler.h"
+#include "registerMap.h"
+#include "cycleTimer.h"
+#include "busArbiter.h"
+#include "modbusMetrics.h"
+#include "jsonWriter.h"
+#include "history.h"
+#include "jsonMessage.h"
+
+
+#define MAX_CONTROLLERS         16
+#define MAX_SERIAL_PORTS        8
+
+//
+//  The retained messages - each on its own topic, published only when it changes
+#define STATE_IDENTITY          0
+#define STATE_RATED             1
+#define STATE_SETTINGS          2
+#define NUM_STATE_MESSAGES      3
+#define STATE_MASK(s)           ( 1 << (s) )
+
+
+struct controller;
+
+//
+//  One RS-485 bus. Several SCCs (different slave IDs) can hang off of it, but
+//  only one transaction can be on the wire at a time - the arbiter owns the modbus_t
+typedef struct  serialPort {
+    char                device[ 128 ];
+    busArbiter_t        bus;
+    pthread_t           pollerThread;
+    cycleTimer_t        cycleTimer;             // absolute deadlines + lateness stats for this port's loop
+    int                 numControllers;
+    struct controller   *controllers[ MAX_CONTROLLERS ];
+} serialPort_t;
+
+//
+//  One Solar Charge Controller and everything we know about it
+typedef struct  controller {
+    char                    controllerID[ 32 ];
+    int                     slaveID;
+    serialPort_t            *port;
+    char                    publishTopic[ 256 ];        // "<topTopic>/<controllerID>/DATA"
+    char                    subscriptionTopic[ 256 ];   // "<topTopic>/<controllerID>/COMMAND"
+    char                    metricsTopic[ 256 ];        // "<topTopic>/<controllerID>/METRICS"
+    char                    responseTopic[ 256 ];       // "<topTopic>/<controllerID>/RESPONSE" - command acknowledgements
+    char                    queryTopic[ 256 ];          // "<topTopic>/<controllerID>/QUERY" - questions about the history
+    char                    historyTopic[ 256 ];        // "<topTopic>/<controllerID>/HISTORY" - and the answers
+    char                    stateTopics[ NUM_STATE_MESSAGES ][ 256 ];   // ".../IDENTITY", ".../RATED", ".../SETTINGS" - retained
+
+    modbusMetrics_t         metrics;                    // latency histograms and errors per call site
+
+    jsonWriter_t            jsonWriter;                 // DATA messages are built here, reused every cycle
+    char                    jsonBuffer[ JSON_BUFFER_SIZE ];
+    time_t                  lastMetricsPublish;
+    long                    publishesSkipped;           // samples not sent because MQTT was backlogged
+    long                    samplesSent;                // handed to MQTT - published, or buffered until we're connected
+    deltaState_t            delta;                      // what DATA subscribers have seen - only changes are sent (-k)
+    history_t               *history;                   // NULL unless we keep one (-H)
+
+    uint32_t                stateHash[ NUM_STATE_MESSAGES ];    // of what's retained on the broker
+    int                     stateSent;                  // STATE_MASK() bits - stateHash is good
+    int                     stateAvailable;             // we've read it at least once
+    int                     stateDirty;                 // build it and compare, next chance we get
+    long                    stateReconnects;            // MQTT_Reconnects() the last time they all went out
+    long                    statePublished;
+
+    pollScheduler_t         scheduler;
+    registerImage_t         registerImage;
+
+    //
+    //  Held by the poller for a whole poll + publish, and by the command thread while
+    //  it folds a read-back into the image and publishes it. Never held while waiting
+    //  on the bus from the command side, so it can't deadlock with the arbiter.
+    pthread_mutex_t         snapshotLock;
+
+    //
+    //  I have 5 Structures because that's the way the SCC Documentation was organized
+    RatedData_t             ratedData;
+    RealTimeData_t          realTimeData;
+    RealTimeStatus_t        realTimeStatusData;
+    Settings_t              settingsData;
+    StatisticalParameters_t statisticalParametersData;
+    int                     nightTime;
+} controller_t;
+
+
+extern  void            Controller_SetDefaults( const char *topTopic, const int sleepSeconds, const char *blockIntervals,
+                                                const int overrunPolicy, const int metricsSeconds, const int prettyJSON,
+                                                const int keyframeCycles );
+extern  controller_t    *Controller_Add( const char *device, const int slaveID, const char *controllerID );
+extern  controller_t    *Controller_AddFromSpec( const char *spec );
+extern  int             Controller_Count( void );
+extern  controller_t    *Controller_Get( const int index );
+extern  controller_t    *Controller_FindByID( const char *controllerID );
+extern  void            Controller_OpenPorts( void );
+extern  void            Controller_StartPollers( void );
+extern  void            Controller_JoinPollers( void );
+extern  void            Controller_ClosePorts( void );
+extern  int             Controller_OpenHistory( const char *directory, const int megabytes );
+extern  void            Controller_CloseHistory( void );
+extern  modbus_t        *Controller_AcquireBus( controller_t *controller, const int priority );
+extern  void            Controller_ReleaseBus( controller_t *controller );
+extern  int             Controller_ReadBack( controller_t *controller, const registerSpan_t *span, const int blockMask );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONTROLLER_H */
+
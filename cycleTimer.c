@@ -0,0 +1,130 @@
+/*
+ * File:    cycleTimer.c
+ * author:  patrick conroy
+ *
+ * Absolute deadline timing for the poll loop.
+ *
+ * The old loop did its work and then slept 'sleepSeconds', so the real period
+ * was sleepSeconds + work time and it drifted every time the serial link was
+ * slow.  Here the deadlines are on a fixed grid on CLOCK_MONOTONIC and we sleep
+ * with clock_nanosleep( TIMER_ABSTIME ), so the work time doesn't matter as
+ * long as it fits in the period.
+ *
+ * If the work overruns the next deadline:
+ *      CYCLE_SKIP      - drop the missed slots and sleep to the next slot on the grid
+ *      CYCLE_CATCHUP   - run right away; if we're more than MAX_CATCHUP_CYCLES behind,
+ *                        give up on the backlog and re-base the grid
+ *
+ * Every wakeup records its lateness vs. the deadline so we can see the jitter.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "logger.h"
+#include "cycleTimer.h"
+
+
+#define NSEC_PER_SEC        1000000000LL
+#define MAX_CATCHUP_CYCLES  3
+
+
+// -----------------------------------------------------------------------------
+static
+long long   toNS (const struct timespec *ts)
+{
+    return ((long long) ts->tv_sec * NSEC_PER_SEC) + ts->tv_nsec;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    fromNS (struct timespec *ts, const long long ns)
+{
+    ts->tv_sec = ns / NSEC_PER_SEC;
+    ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+// -----------------------------------------------------------------------------
+void    CycleTimer_ResetStats (cycleTimer_t *timer)
+{
+    timer->cycles = 0;
+    timer->overruns = 0;
+    timer->skipped = 0;
+    timer->lastLatenessUS = 0;
+    timer->minLatenessUS = 0;
+    timer->maxLatenessUS = 0;
+    timer->sumLatenessUS = 0;
+}
+
+// -----------------------------------------------------------------------------
+void    CycleTimer_Start (cycleTimer_t *timer, const long periodMS, const int overrunPolicy)
+{
+    timer->periodNS = (long long) periodMS * 1000000LL;
+    timer->overrunPolicy = overrunPolicy;
+    CycleTimer_ResetStats( timer );
+
+    //
+    //  First deadline is right now
+    clock_gettime( CLOCK_MONOTONIC, &timer->nextDeadline );
+}
+
+// -----------------------------------------------------------------------------
+int CycleTimer_ParsePolicy (const char *policy)
+{
+    if (strcmp( policy, "catchup" ) == 0)
+        return CYCLE_CATCHUP;
+    if (strcmp( policy, "skip" ) == 0)
+        return CYCLE_SKIP;
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+void    CycleTimer_Wait (cycleTimer_t *timer)
+{
+    struct timespec now;
+    long long       deadlineNS = toNS( &timer->nextDeadline );
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    long long       behindNS = toNS( &now ) - deadlineNS;
+
+    //
+    //  Did the last cycle's work run past this deadline?
+    if (behindNS > 0 && timer->cycles > 0) {
+        timer->overruns += 1;
+
+        if (timer->overrunPolicy == CYCLE_SKIP) {
+            long long   missed = (behindNS / timer->periodNS) + 1;
+            timer->skipped += missed;
+            deadlineNS += missed * timer->periodNS;
+
+        } else if (behindNS > MAX_CATCHUP_CYCLES * timer->periodNS) {
+            long long   missed = behindNS / timer->periodNS;
+            timer->skipped += missed;
+            deadlineNS += missed * timer->periodNS;
+            Logger_LogWarning( "Poll loop is %lld cycles behind - dropping the backlog\n", missed );
+        }
+
+        fromNS( &timer->nextDeadline, deadlineNS );
+    }
+
+    //
+    //  Sleep to the absolute deadline. EINTR just means sleep again
+    while (clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &timer->nextDeadline, NULL ) == EINTR)
+        ;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    long long   latenessUS = (toNS( &now ) - deadlineNS) / 1000LL;
+
+    if (timer->cycles == 0 || latenessUS < timer->minLatenessUS)
+        timer->minLatenessUS = latenessUS;
+    if (timer->cycles == 0 || latenessUS > timer->maxLatenessUS)
+        timer->maxLatenessUS = latenessUS;
+    timer->lastLatenessUS = latenessUS;
+    timer->sumLatenessUS += latenessUS;
+    timer->cycles += 1;
+
+    fromNS( &timer->nextDeadline, deadlineNS + timer->periodNS );
+}
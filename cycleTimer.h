@@ -0,0 +1,51 @@
+/*
+ * File:   cycleTimer.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef CYCLETIMER_H
+#define CYCLETIMER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <time.h>
+
+
+//
+//  What to do when a cycle runs past the next deadline
+#define CYCLE_SKIP          0           // drop the missed slots, stay on the original grid
+#define CYCLE_CATCHUP       1           // run the missed slots back to back (up to a limit)
+
+typedef struct  cycleTimer {
+    struct timespec nextDeadline;       // CLOCK_MONOTONIC, absolute
+    long long       periodNS;
+    int             overrunPolicy;
+
+    //
+    //  Lateness of each wakeup vs. its deadline - reset by CycleTimer_ResetStats()
+    long            cycles;
+    long            overruns;           // work ran past the next deadline
+    long            skipped;            // deadlines dropped under CYCLE_SKIP
+    long long       lastLatenessUS;
+    long long       minLatenessUS;
+    long long       maxLatenessUS;
+    long long       sumLatenessUS;
+} cycleTimer_t;
+
+
+extern  void    CycleTimer_Start( cycleTimer_t *timer, const long periodMS, const int overrunPolicy );
+extern  void    CycleTimer_Wait( cycleTimer_t *timer );
+extern  void    CycleTimer_ResetStats( cycleTimer_t *timer );
+extern  int     CycleTimer_ParsePolicy( const char *policy );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CYCLETIMER_H */
+
@@ -6,11 +6,47 @@
  * and that struct is placed on our FIFO queue.
  * 
  * The 'processInboundCommand' thread will pull it off the queue and pass it to
- * 'doCommand'.  doCommand matches the command in the MQTT packet against the big
- * table 'commandTable[]'.
+ * 'doCommand'.  doCommand looks the command in the MQTT packet up in the big
+ * table 'commandTable[]' - sorted, binary searched, exact matches only.
  * 
- * If a match is found, the corresponding function pointer is called. That fp points
- * to a SCC function found in the "LS10x4B SCC" shared library.
+ * If a match is found, its parameter is range checked and then the typed handler
+ * is called. Each handler wraps a SCC function found in the "LS10x4B SCC" shared
+ * library. Commands that fail the checks are rejected, with a reason, before
+ * we touch the serial bus.
+ * 
+ * Settings commands that each set a single holding register (the battery type,
+ * capacity and the voltage limits) are batched: once one arrives we wait up to
+ * batchWindowMS for more, then write each run of adjacent registers with one
+ * modbus_write_registers(). Retuning a bank - HVD, CLV, OVR, EV, BV, FV, BRV, LVR -
+ * is then one round trip, and the SCC never sees half of the new limits.
+ * 
+ * A batch message (a JSON array of commands) is different: it's queued as one
+ * unit and run as one transaction - all validated before any is sent, then run
+ * in order while we hold the bus, stopping at the first failure. Its settings
+ * writes are only merged if the message asks for "coalesce".
+ * 
+ * Every command - run, batched, rejected or failed - gets a reply on
+ * "<topTopic>/<controllerID>/RESPONSE" with its status, the optional
+ * correlationID it was sent with, and when it was received, dequeued, and
+ * put on / taken off the bus. A batch message gets one reply with the status
+ * of each command in it.
+ * 
+ * After that, the register group a successful command touched is read back and
+ * published - settings to the retained SETTINGS topic, status in an out-of-cycle,
+ * "partial" DATA message with just that section - so a dashboard sees the change
+ * in a few hundred ms instead of a poll later.
+ * 
+ * Load and charging on/off commands are queued in a higher priority class than
+ * everything else, so they don't wait behind a backlog of settings. A command can
+ * carry a "ttlMS" - if it's been waiting longer than that when it comes off the
+ * queue it's dropped (and counted) instead of being sent late.
+ * 
+ * The command's controller ID (from the topic it arrived on) picks the SCC.  The
+ * command gets the bus from that port's arbiter - ahead of any waiting polls -
+ * and holds it for the duration of the call.
+ * 
+ * KEYFRAME never goes near the SCC - it asks for the next DATA message to be
+ * sent in full, for a subscriber using delta publishing that lost its place.
  * 
  * Created on Septmeber 13, 2018, 11:46 AM
  */
@@ -18,77 +54,178 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
 
 #include "ls10x4b.h"
 #include "logger.h"
 #include "commandQueue.h"
+#include "pollScheduler.h"
+#include "controller.h"
+#include "registerMap.h"
+#include "modbusMetrics.h"
+#include "jsonWriter.h"
+#include "timestamp.h"
+#include "mqtt.h"
+#include "doCommand.h"
 
 //
-// Define a function pointer - leave args ambiguous
-typedef void (*fptr) ();
+//  SCC functions have different argument types - see sccls10x4b.h
+#define NOARG       0               // Function takes no parameters
+#define INTARG      1               // Function takes an Int
+#define FLOATARG    2               // Function takes a FP (double)
+#define HHMMARG     3               // Function takes an "HH:MM"
+#define HHMMSSARG   4               // Function takes an "HH:MM:SS"
+
+//
+//  One typed handler per argument type - no more calling thru "void (*)()"
+typedef union   commandHandler {
+    void    (*noArg)( modbus_t *ctx );
+    void    (*intArg)( modbus_t *ctx, const int value );
+    void    (*floatArg)( modbus_t *ctx, const double value );
+    void    (*hhmmArg)( modbus_t *ctx, const int hour, const int minute );
+    void    (*hhmmssArg)( modbus_t *ctx, const int hour, const int minute, const int second );
+} commandHandler_t;
 
 //
 // Define a entry into our Command Dispatch Table
 typedef struct  commandMap {
-    char        *command;           // Command that triggers the function
-    int         fargs;              // Whether function takes Ints, Floats or something else
-    fptr        f;                  // Function pointer to a Solar Charge Controller function
+    char                *command;           // Command that triggers the function
+    int                 fargs;              // Whether function takes Ints, Floats or something else
+    commandHandler_t    f;                  // Wrapper around a Solar Charge Controller function
+    double              minValue;           // INTARG and FLOATARG parameters must be in [minValue, maxValue]
+    double              maxValue;
+    int                 refresh;            // Register blocks to re-read after the command runs
+    int                 holdingRegister;    // Non-zero: the one register this command sets - it can be batched
+    int                 scale;              // FLOATARG: register value = parameter * scale
+    registerSpan_t      readBack;           // re-read and published right after a successful command (count 0 = none)
+    int                 readBackBlock;      // which block those registers feed - and so which message
+    int                 priority;           // COMMAND_PRIORITY_xxx - which class it waits in on the queue
+    int                 keyframe;           // not for the SCC - the next DATA message goes out in full
 } commandMap_t;
 
+//
+//  Thin wrappers so each SCC library function is called with its own prototype
+//  in scope (a float parameter gets a float, not a promoted double)
+#define NOARG_HANDLER(fn)       static void fn##Handler (modbus_t *ctx) { fn( ctx ); }
+#define INTARG_HANDLER(fn)      static void fn##Handler (modbus_t *ctx, const int value) { fn( ctx, value ); }
+#define FLOATARG_HANDLER(fn)    static void fn##Handler (modbus_t *ctx, const double value) { fn( ctx, value ); }
+#define HHMMARG_HANDLER(fn)     static void fn##Handler (modbus_t *ctx, const int hour, const int minute) { fn( ctx, hour, minute ); }
+#define HHMMSSARG_HANDLER(fn)   static void fn##Handler (modbus_t *ctx, const int hour, const int minute, const int second) \
+                                    { fn( ctx, hour, minute, second ); }
 
+INTARG_HANDLER( setBatteryType )
+INTARG_HANDLER( setBatteryCapacity )
+FLOATARG_HANDLER( setTempertureCompensationCoefficient )
+FLOATARG_HANDLER( setHighVoltageDisconnect )
+FLOATARG_HANDLER( setChargingLimitVoltage )
+FLOATARG_HANDLER( setOverVoltageReconnect )
+FLOATARG_HANDLER( setEqualizationVoltage )
+FLOATARG_HANDLER( setBoostVoltage )
+FLOATARG_HANDLER( setFloatVoltage )
+FLOATARG_HANDLER( setBoostReconnectVoltage )
+FLOATARG_HANDLER( setLowVoltageReconnect )
+HHMMARG_HANDLER( setWorkingTimeLength1 )
+HHMMARG_HANDLER( setWorkingTimeLength2 )
+HHMMARG_HANDLER( setLengthOfNight )
+HHMMSSARG_HANDLER( setTurnOnTiming1 )
+HHMMSSARG_HANDLER( setTurnOffTiming1 )
+HHMMSSARG_HANDLER( setTurnOnTiming2 )
+HHMMSSARG_HANDLER( setTurnOffTiming2 )
+NOARG_HANDLER( setChargingDeviceOn )
+NOARG_HANDLER( setChargingDeviceOff )
+NOARG_HANDLER( setLoadDeviceOn )
+NOARG_HANDLER( setLoadDeviceOff )
+NOARG_HANDLER( restoreSystemDefaults )
+NOARG_HANDLER( clearEnergyGeneratingStatistics )
 
 //
-//  SCC functions have different argument types - see sccls10x4b.h
-#define NOARG       0               // Function takes no parameters
-#define INTARG      1               // Function takes an Int
-#define FLOATARG    2               // Function takes a FP (double)
-#define HHMMARG     3               // Function takes an "HH:MM"
-#define HHMMSSARG   4               // Function takes an "HH:MM:SS"
+//  Which blocks a command can change. Settings changes are the common case
+#define SETTINGS_CHANGED    ( BLOCK_MASK( BLOCK_SETTINGS ) | BLOCK_MASK( BLOCK_RATED_DATA ) )
+#define STATUS_CHANGED      ( BLOCK_MASK( BLOCK_REALTIME_STATUS ) | BLOCK_MASK( BLOCK_REALTIME_DATA ) )
+#define STATS_CHANGED       ( BLOCK_MASK( BLOCK_STATISTICS ) )
+
+//
+//  Register groups to read back after a command, so the change shows up right away
+#define VOLTAGE_GROUP       .readBack = { HOLDING_REGISTERS, 0x9000, 15 }, .readBackBlock = BLOCK_SETTINGS
+#define WORKING_TIME_GROUP  .readBack = { HOLDING_REGISTERS, 0x903D, 3 },  .readBackBlock = BLOCK_SETTINGS
+#define TIMING_GROUP        .readBack = { HOLDING_REGISTERS, 0x9042, 12 }, .readBackBlock = BLOCK_SETTINGS
+#define NIGHT_GROUP         .readBack = { HOLDING_REGISTERS, 0x9065, 1 },  .readBackBlock = BLOCK_SETTINGS
+#define STATUS_GROUP        .readBack = { INPUT_REGISTERS,   0x3200, 3 },  .readBackBlock = BLOCK_REALTIME_STATUS
+
+//
+//  Voltage limits are wide enough for a 24V bank (the LS1024B does 12V and 24V)
+#define MIN_VOLTS           9.0
+#define MAX_VOLTS           32.0
 
 
 //
 //  The Command Dispatch Table
-static  commandMap_t    commandTable[] = {
-    { .command = "BT",      .fargs = INTARG,        .f = setBatteryType },
-    { .command = "TCC",     .fargs = FLOATARG,      .f = setTempertureCompensationCoefficient },    
-    { .command = "BC",      .fargs = INTARG,        .f = setBatteryCapacity },
-    { .command = "HVD",     .fargs = FLOATARG,      .f = setHighVoltageDisconnect },
-    { .command = "CLV",     .fargs = FLOATARG,      .f = setChargingLimitVoltage },
-    { .command = "OVR",     .fargs = FLOATARG,      .f = setOverVoltageReconnect },
-    { .command = "EV",      .fargs = FLOATARG,      .f = setEqualizationVoltage },
-    { .command = "BV",      .fargs = FLOATARG,      .f = setBoostVoltage },
-    { .command = "FV",      .fargs = FLOATARG,      .f = setFloatVoltage },
-    { .command = "BRV",     .fargs = FLOATARG,      .f = setBoostReconnectVoltage },
-    { .command = "LVR",     .fargs = FLOATARG,      .f = setLowVoltageReconnect },
-    
-    { .command = "WTL1",    .fargs = HHMMARG,       .f = setWorkingTimeLength1 },
-    { .command = "WTL2",    .fargs = HHMMARG,       .f = setWorkingTimeLength2 },
-    
-    { .command = "SLON",    .fargs = HHMMARG,       .f = setLengthOfNight },
-    
-    { .command = "TONT1",   .fargs = HHMMSSARG,     .f = setTurnOnTiming1 },
-    { .command = "TOFFT1",  .fargs = HHMMSSARG,     .f = setTurnOffTiming1 },
-    { .command = "TONT2",   .fargs = HHMMSSARG,     .f = setTurnOnTiming2 },
-    { .command = "TOFFT2",  .fargs = HHMMSSARG,     .f = setTurnOffTiming2 },
-    
-    { .command = "CDON",    .fargs = NOARG,         .f = setChargingDeviceOn },
-    { .command = "CDOFF",   .fargs = NOARG,         .f = setChargingDeviceOff },
-    { .command = "LDON",    .fargs = NOARG,         .f = setLoadDeviceOn },
-    { .command = "LDOFF",   .fargs = NOARG,         .f = setLoadDeviceOff },
-
-    { .command = "RSD",     .fargs = NOARG,         .f = restoreSystemDefaults },
-    { .command = "CGES",    .fargs = NOARG,         .f = clearEnergyGeneratingStatistics },
-    { .command = "NULL",    .fargs = 0,             .f = NULL }
+//  KEEP IT SORTED BY COMMAND (strcmp order) - it's binary searched.  checkCommandTable() will complain if it isn't.
+static  const commandMap_t  commandTable[] = {
+    { .command = "BC",      .fargs = INTARG,    .f.intArg = setBatteryCapacityHandler,                      .minValue = 1,         .maxValue = 9999,      .refresh = SETTINGS_CHANGED, .holdingRegister = 0x9001, .scale = 1, VOLTAGE_GROUP },
+    { .command = "BRV",     .fargs = FLOATARG,  .f.floatArg = setBoostReconnectVoltageHandler,              .minValue = MIN_VOLTS, .maxValue = MAX_VOLTS, .refresh = SETTINGS_CHANGED, .holdingRegister = 0x9009, .scale = 100, VOLTAGE_GROUP },
+    { .command = "BT",      .fargs = INTARG,    .f.intArg = setBatteryTypeHandler,                          .minValue = 0,         .maxValue = 3,         .refresh = SETTINGS_CHANGED, .holdingRegister = 0x9000, .scale = 1, VOLTAGE_GROUP },
+    { .command = "BV",      .fargs = FLOATARG,  .f.floatArg = setBoostVoltageHandler,                       .minValue = MIN_VOLTS, .maxValue = MAX_VOLTS, .refresh = SETTINGS_CHANGED, .holdingRegister = 0x9007, .scale = 100, VOLTAGE_GROUP },
+    { .command = "CDOFF",   .fargs = NOARG,     .f.noArg = setChargingDeviceOffHandler,                                                                   .refresh = STATUS_CHANGED, .priority = COMMAND_PRIORITY_CONTROL, STATUS_GROUP },
+    { .command = "CDON",    .fargs = NOARG,     .f.noArg = setChargingDeviceOnHandler,                                                                    .refresh = STATUS_CHANGED, .priority = COMMAND_PRIORITY_CONTROL, STATUS_GROUP },
+    { .command = "CGES",    .fargs = NOARG,     .f.noArg = clearEnergyGeneratingStatisticsHandler,                                                        .refresh = STATS_CHANGED },
+    { .command = "CLV",     .fargs = FLOATARG,  .f.floatArg = setChargingLimitVoltageHandler,               .minValue = MIN_VOLTS, .maxValue = MAX_VOLTS, .refresh = SETTINGS_CHANGED, .holdingRegister = 0x9004, .scale = 100, VOLTAGE_GROUP },
+    { .command = "EV",      .fargs = FLOATARG,  .f.floatArg = setEqualizationVoltageHandler,                .minValue = MIN_VOLTS, .maxValue = MAX_VOLTS, .refresh = SETTINGS_CHANGED, .holdingRegister = 0x9006, .scale = 100, VOLTAGE_GROUP },
+    { .command = "FV",      .fargs = FLOATARG,  .f.floatArg = setFloatVoltageHandler,                       .minValue = MIN_VOLTS, .maxValue = MAX_VOLTS, .refresh = SETTINGS_CHANGED, .holdingRegister = 0x9008, .scale = 100, VOLTAGE_GROUP },
+    { .command = "HVD",     .fargs = FLOATARG,  .f.floatArg = setHighVoltageDisconnectHandler,              .minValue = MIN_VOLTS, .maxValue = MAX_VOLTS, .refresh = SETTINGS_CHANGED, .holdingRegister = 0x9003, .scale = 100, VOLTAGE_GROUP },
+    { .command = "KEYFRAME", .fargs = NOARG,    .keyframe = TRUE },
+    { .command = "LDOFF",   .fargs = NOARG,     .f.noArg = setLoadDeviceOffHandler,                                                                       .refresh = STATUS_CHANGED, .priority = COMMAND_PRIORITY_CONTROL, STATUS_GROUP },
+    { .command = "LDON",    .fargs = NOARG,     .f.noArg = setLoadDeviceOnHandler,                                                                        .refresh = STATUS_CHANGED, .priority = COMMAND_PRIORITY_CONTROL, STATUS_GROUP },
+    { .command = "LVR",     .fargs = FLOATARG,  .f.floatArg = setLowVoltageReconnectHandler,                .minValue = MIN_VOLTS, .maxValue = MAX_VOLTS, .refresh = SETTINGS_CHANGED, .holdingRegister = 0x900A, .scale = 100, VOLTAGE_GROUP },
+    { .command = "OVR",     .fargs = FLOATARG,  .f.floatArg = setOverVoltageReconnectHandler,               .minValue = MIN_VOLTS, .maxValue = MAX_VOLTS, .refresh = SETTINGS_CHANGED, .holdingRegister = 0x9005, .scale = 100, VOLTAGE_GROUP },
+    { .command = "RSD",     .fargs = NOARG,     .f.noArg = restoreSystemDefaultsHandler,                                                                  .refresh = ALL_BLOCKS_MASK },
+    { .command = "SLON",    .fargs = HHMMARG,   .f.hhmmArg = setLengthOfNightHandler,                                                                     .refresh = SETTINGS_CHANGED, NIGHT_GROUP },
+    { .command = "TCC",     .fargs = FLOATARG,  .f.floatArg = setTempertureCompensationCoefficientHandler,  .minValue = 0,         .maxValue = 9,         .refresh = SETTINGS_CHANGED, .holdingRegister = 0x9002, .scale = 100, VOLTAGE_GROUP },
+    { .command = "TOFFT1",  .fargs = HHMMSSARG, .f.hhmmssArg = setTurnOffTiming1Handler,                                                                  .refresh = SETTINGS_CHANGED, TIMING_GROUP },
+    { .command = "TOFFT2",  .fargs = HHMMSSARG, .f.hhmmssArg = setTurnOffTiming2Handler,                                                                  .refresh = SETTINGS_CHANGED, TIMING_GROUP },
+    { .command = "TONT1",   .fargs = HHMMSSARG, .f.hhmmssArg = setTurnOnTiming1Handler,                                                                   .refresh = SETTINGS_CHANGED, TIMING_GROUP },
+    { .command = "TONT2",   .fargs = HHMMSSARG, .f.hhmmssArg = setTurnOnTiming2Handler,                                                                   .refresh = SETTINGS_CHANGED, TIMING_GROUP },
+    { .command = "WTL1",    .fargs = HHMMARG,   .f.hhmmArg = setWorkingTimeLength1Handler,                                                                .refresh = SETTINGS_CHANGED, WORKING_TIME_GROUP },
+    { .command = "WTL2",    .fargs = HHMMARG,   .f.hhmmArg = setWorkingTimeLength2Handler,                                                                .refresh = SETTINGS_CHANGED, WORKING_TIME_GROUP },
 };
 
 #define NUM_COMMANDS  ( sizeof( commandTable ) / sizeof( commandMap_t ))
 
+//
+//  Settings commands that arrive within this long of each other are written together
+#define MAX_BATCHED_COMMANDS    COMMAND_BATCH_MAX
+static  int     batchWindowMS = DEFAULT_BATCH_WINDOW_MS;
+
+//
+//  The rest of a batch message is already in the queue behind its first command -
+//  if it doesn't show up in this long, some of it was thrown away
+#define BATCH_ASSEMBLY_MS       1000
+
+//
+//  What happened to one command - published on the controller's RESPONSE topic
+#define COMMAND_OK          0
+#define COMMAND_REJECTED    1               // failed validation, never sent
+#define COMMAND_FAILED      2               // sent, but the Modbus transaction failed
+#define COMMAND_SKIPPED     3               // part of a batch that stopped before it got to this one
+#define COMMAND_EXPIRED     4               // older than its ttlMS by the time we got to it, never sent
+
+typedef struct  commandResult {
+    int         status;
+    char        reason[ 128 ];
+    long long   dequeuedUS;                 // wall clock microseconds, 0 == didn't get that far
+    long long   modbusStartUS;
+    long long   modbusEndUS;
+} commandResult_t;
+
+static  const char      *statusNames[] = { "ok", "rejected", "failed", "skipped", "expired" };
+static  char            responseBuffer[ 4096 ];     // room for a full batch
+static  jsonWriter_t    responseWriter;     // only the command thread builds responses
+
 
 //
 // Forwards
-static  int     hhmmStringToHour( const char * );
-static  int     hhmmStringToMinute( const char * );
-static  int     hhmmssStringToSecond( const char * );
+static  int     parseClockString( const char *clockString, const int withSeconds, int *hour, int *minute, int *second );
 
 
 
@@ -96,99 +233,612 @@ static  int     hhmmssStringToSecond( const char * );
 
 // -----------------------------------------------------------------------------
 static
-int doCommand (modbus_t *ctx, mqttCommand_t *cmd)
+long long   nowMS (void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((long long) ts.tv_sec * 1000LL) + (ts.tv_nsec / 1000000L);
+}
+
+// -----------------------------------------------------------------------------
+static
+void    checkCommandTable (void)
 {
-    Logger_LogInfo( "doCommand. Command [%s], Int parameter [%d], Float parameter [%0.2f]\n", cmd->command, cmd->iParam, cmd->fParam );
-    
-    int i = 0;
-    
     //
-    // Loop thru table. Inefficient, but...
-    while (i < NUM_COMMANDS && commandTable[ i ].f != NULL) {
-        
-        //
-        //  Find a match between inbound Command (cmd->command) and entry in the table
-        if (strncmp( cmd->command, commandTable[ i ].command, strlen( commandTable[ i ].command )) == 0) {
-            
-            //
-            // Figure out if function that executes command takes an Int or Float or...?
-            if (commandTable[ i ].fargs == INTARG) {
-                Logger_LogDebug( "Dispatching INT function for command [%s] parameter [%d]\n", cmd->command, cmd->iParam );
-                commandTable[ i ].f( ctx, cmd->iParam );
-                
-            } else if (commandTable[ i ].fargs == FLOATARG) {
-                Logger_LogDebug( "Dispatching Float function for command [%s] parameter [%0.2f]\n", cmd->command, cmd->fParam );
-                commandTable[ i ].f( ctx, cmd->fParam );
-                
-            } else if (commandTable[ i ].fargs == HHMMARG) {
-                int hour = hhmmStringToHour( cmd->cParam );
-                int min = hhmmStringToMinute( cmd->cParam );
-                Logger_LogDebug( "Dispatching HH:MM function for command [%s] hour [%d] minute [%d]\n", cmd->command, hour, min );
-                commandTable[ i ].f( ctx, hour, min );
-                
-            } else if (commandTable[ i ].fargs == HHMMSSARG) {
-                int hour = hhmmStringToHour( cmd->cParam );
-                int min = hhmmStringToMinute( cmd->cParam );
-                int sec = hhmmssStringToSecond( cmd->cParam );
-                Logger_LogDebug( "Dispatching HH:MM:SS function for command [%s] hour [%d] minute [%d] second [%d]\n", cmd->command, hour, min, sec );
-                commandTable[ i ].f( ctx, hour, min, sec );
-                
-            } else if (commandTable[ i ].fargs == NOARG) {
-                Logger_LogDebug( "Dispatching No Arg function for command [%s]\n", cmd->command );
-                commandTable[ i ].f( ctx );
+    //  A programming error, not a runtime one - catch it before the first command
+    int i;
+
+    for (i = 1; i < NUM_COMMANDS; i += 1)
+        if (strcmp( commandTable[ i - 1 ].command, commandTable[ i ].command ) >= 0)
+            Logger_LogFatal( "commandTable[] is not sorted at [%s] / [%s]\n",
+                             commandTable[ i - 1 ].command, commandTable[ i ].command );
+}
+
+// -----------------------------------------------------------------------------
+static
+const commandMap_t  *findCommand (const char *command)
+{
+    //
+    //  Binary search, exact match only - "BTX" is not "BT"
+    int low = 0;
+    int high = NUM_COMMANDS - 1;
+
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int order = strcmp( command, commandTable[ middle ].command );
+
+        if (order == 0)
+            return &commandTable[ middle ];
+        if (order < 0)
+            high = middle - 1;
+        else
+            low = middle + 1;
+    }
+
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------
+static
+int validateCommand (const commandMap_t *entry, const mqttCommand_t *cmd, int *hour, int *minute, int *second,
+                        char *reason, const int reasonSize)
+{
+    //
+    //  Check the argument before we go anywhere near the serial bus. Returns FALSE,
+    //  with a reason, if the command can't be sent
+    *hour = *minute = *second = 0;
+
+    switch (entry->fargs) {
+        case INTARG:
+            if (cmd->iParam < entry->minValue || cmd->iParam > entry->maxValue) {
+                snprintf( reason, reasonSize, "iParam %d is outside %g..%g", cmd->iParam, entry->minValue, entry->maxValue );
+                return FALSE;
+            }
+            break;
+
+        case FLOATARG:
+            if (!(cmd->fParam >= entry->minValue && cmd->fParam <= entry->maxValue)) {
+                snprintf( reason, reasonSize, "fParam %g is outside %g..%g", cmd->fParam, entry->minValue, entry->maxValue );
+                return FALSE;
             }
-            
             break;
+
+        case HHMMARG:
+        case HHMMSSARG:
+            if (!parseClockString( cmd->cParam, (entry->fargs == HHMMSSARG), hour, minute, second )) {
+                snprintf( reason, reasonSize, "cParam [%s] is not a valid %s", cmd->cParam,
+                          (entry->fargs == HHMMSSARG) ? "HH:MM:SS" : "HH:MM" );
+                return FALSE;
+            }
+            break;
+    }
+
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    addTimings (const long long receivedUS, const long long dequeuedUS, const long long modbusStartUS, const long long modbusEndUS)
+{
+    //
+    //  Wall clock microseconds, so they can be compared with the sender's clock
+    long long   finishedUS = (modbusEndUS != 0) ? modbusEndUS : Timestamp_EpochUS();
+
+    JSON_BeginObject( &responseWriter, "timestamps" );
+    JSON_AddInteger( &responseWriter, "received", receivedUS );
+    JSON_AddInteger( &responseWriter, "dequeued", dequeuedUS );
+    if (modbusStartUS != 0) {
+        JSON_AddInteger( &responseWriter, "modbusStart", modbusStartUS );
+        JSON_AddInteger( &responseWriter, "modbusEnd", modbusEndUS );
+    }
+    JSON_EndObject( &responseWriter );
+
+    JSON_BeginObject( &responseWriter, "latencyMS" );
+    JSON_AddFixed( &responseWriter, "queue", (dequeuedUS - receivedUS) / 1000.0, 3 );
+    if (modbusStartUS != 0) {
+        JSON_AddFixed( &responseWriter, "bus", (modbusStartUS - dequeuedUS) / 1000.0, 3 );
+        JSON_AddFixed( &responseWriter, "modbus", (modbusEndUS - modbusStartUS) / 1000.0, 3 );
+    }
+    JSON_AddFixed( &responseWriter, "total", (finishedUS - receivedUS) / 1000.0, 3 );
+    JSON_EndObject( &responseWriter );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    publishResponse (const controller_t *controller, const char *command)
+{
+    const char  *response = JSON_Finish( &responseWriter );
+    if (response == NULL) {
+        Logger_LogError( "Response for command [%s] did not fit in %d bytes\n", command, (int) sizeof responseBuffer );
+        return;
+    }
+    MQTT_PublishData( MQTT_CLASS_RESPONSE, controller->responseTopic, response, responseWriter.length );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    acknowledgeCommand (const controller_t *controller, const mqttCommand_t *cmd, const commandResult_t *result)
+{
+    //
+    //  Every single command gets exactly one of these, batched or not
+    if (result->status == COMMAND_OK)
+        Logger_LogInfo( "Command [%s] for controller [%s] done\n", cmd->command, controller->controllerID );
+    else
+        Logger_LogWarning( "Command [%s] for controller [%s] %s: %s\n", cmd->command, controller->controllerID,
+                           statusNames[ result->status ], result->reason );
+
+    JSON_Reset( &responseWriter );
+    JSON_BeginObject( &responseWriter, NULL );
+    JSON_AddString( &responseWriter, "topic", controller->responseTopic );
+    JSON_AddString( &responseWriter, "dateTime", Timestamp_Now( TIMESTAMP_ISO8601 ) );
+    if (cmd->correlationID[ 0 ] != '\0')
+        JSON_AddString( &responseWriter, "correlationID", cmd->correlationID );
+    JSON_AddString( &responseWriter, "command", cmd->command );
+    JSON_AddString( &responseWriter, "status", statusNames[ result->status ] );
+    if (result->status != COMMAND_OK)
+        JSON_AddString( &responseWriter, "error", result->reason );
+
+    addTimings( cmd->receivedUS, result->dequeuedUS, result->modbusStartUS, result->modbusEndUS );
+    JSON_EndObject( &responseWriter );
+
+    publishResponse( controller, cmd->command );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    acknowledgeBatch (const controller_t *controller, const mqttCommand_t *commands, const commandResult_t *results,
+                          const int numCommands)
+{
+    //
+    //  A batch message gets one reply for the lot - an overall status (the first
+    //  thing that went wrong, if anything did) and then each command's own
+    int         overall = COMMAND_OK;
+    int         firstProblem = -1;
+    long long   modbusStartUS = 0;
+    long long   modbusEndUS = 0;
+    int         i;
+
+    for (i = 0; i < numCommands; i += 1) {
+        if (results[ i ].status != COMMAND_OK && results[ i ].status != COMMAND_SKIPPED && firstProblem < 0) {
+            firstProblem = i;
+            overall = results[ i ].status;
+        }
+        if (results[ i ].modbusStartUS != 0) {
+            if (modbusStartUS == 0)
+                modbusStartUS = results[ i ].modbusStartUS;
+            modbusEndUS = results[ i ].modbusEndUS;
         }
-        
-        i += 1;
     }
-    
-    return 1;
+
+    if (overall == COMMAND_OK)
+        Logger_LogInfo( "Batch of %d commands for controller [%s] done\n", numCommands, controller->controllerID );
+    else
+        Logger_LogWarning( "Batch of %d commands for controller [%s] %s at [%s]: %s\n", numCommands, controller->controllerID,
+                           statusNames[ overall ], commands[ firstProblem ].command, results[ firstProblem ].reason );
+
+    JSON_Reset( &responseWriter );
+    JSON_BeginObject( &responseWriter, NULL );
+    JSON_AddString( &responseWriter, "topic", controller->responseTopic );
+    JSON_AddString( &responseWriter, "dateTime", Timestamp_Now( TIMESTAMP_ISO8601 ) );
+    if (commands[ 0 ].correlationID[ 0 ] != '\0')
+        JSON_AddString( &responseWriter, "correlationID", commands[ 0 ].correlationID );
+    JSON_AddInteger( &responseWriter, "batch", numCommands );
+    JSON_AddString( &responseWriter, "status", statusNames[ overall ] );
+    if (overall != COMMAND_OK)
+        JSON_AddString( &responseWriter, "error", results[ firstProblem ].reason );
+
+    JSON_BeginArray( &responseWriter, "results" );
+    for (i = 0; i < numCommands; i += 1) {
+        JSON_BeginObject( &responseWriter, NULL );
+        JSON_AddString( &responseWriter, "command", commands[ i ].command );
+        JSON_AddString( &responseWriter, "status", statusNames[ results[ i ].status ] );
+        if (results[ i ].status != COMMAND_OK)
+            JSON_AddString( &responseWriter, "error", results[ i ].reason );
+        JSON_EndObject( &responseWriter );
+    }
+    JSON_EndArray( &responseWriter );
+
+    addTimings( commands[ 0 ].receivedUS, results[ 0 ].dequeuedUS, modbusStartUS, modbusEndUS );
+    JSON_EndObject( &responseWriter );
+
+    publishResponse( controller, commands[ 0 ].command );
 }
 
 // -----------------------------------------------------------------------------
 static
-int hhmmStringToHour (const char *hhmmString)
+int runCommand (controller_t *controller, modbus_t *ctx, const commandMap_t *entry, const mqttCommand_t *cmd,
+                const int hour, const int minute, const int second, commandResult_t *result)
 {
-    char    buffer[ 8 ];
-    
-    buffer[ 0 ] = hhmmString[ 0 ];
-    buffer[ 1 ] = hhmmString[ 1 ];
-    buffer[ 2 ] = '\0';
-    
-    return atoi( buffer );
+    //
+    //  Put one validated command on the wire. The caller holds the bus
+    if (entry->keyframe) {
+        JSONMessage_RequestKeyframe( &controller->delta );
+        return (result->status = COMMAND_OK);
+    }
+
+    result->modbusStartUS = Timestamp_EpochUS();
+    long long   startUS = Metrics_Start();
+
+    switch (entry->fargs) {
+        case INTARG:
+            Logger_LogDebug( "Dispatching INT function for command [%s] parameter [%d]\n", cmd->command, cmd->iParam );
+            entry->f.intArg( ctx, cmd->iParam );
+            break;
+
+        case FLOATARG:
+            Logger_LogDebug( "Dispatching Float function for command [%s] parameter [%0.2f]\n", cmd->command, cmd->fParam );
+            entry->f.floatArg( ctx, cmd->fParam );
+            break;
+
+        case HHMMARG:
+            Logger_LogDebug( "Dispatching HH:MM function for command [%s] hour [%d] minute [%d]\n", cmd->command, hour, minute );
+            entry->f.hhmmArg( ctx, hour, minute );
+            break;
+
+        case HHMMSSARG:
+            Logger_LogDebug( "Dispatching HH:MM:SS function for command [%s] hour [%d] minute [%d] second [%d]\n", cmd->command, hour, minute, second );
+            entry->f.hhmmssArg( ctx, hour, minute, second );
+            break;
+
+        case NOARG:
+            Logger_LogDebug( "Dispatching No Arg function for command [%s]\n", cmd->command );
+            entry->f.noArg( ctx );
+            break;
+    }
+
+    //
+    //  The library setters don't return anything - errno is all we have
+    int errorNumber = errno;
+    result->modbusEndUS = Timestamp_EpochUS();
+    Metrics_RecordLibraryCall( &controller->metrics, entry->command, startUS );
+
+    //
+    //  Whatever the command touched gets re-read on the next poll
+    Scheduler_Invalidate( &controller->scheduler, entry->refresh );
+
+    if (errorNumber != 0) {
+        snprintf( result->reason, sizeof result->reason, "%s", modbus_strerror( errorNumber ) );
+        return (result->status = COMMAND_FAILED);
+    }
+    return (result->status = COMMAND_OK);
 }
 
 // -----------------------------------------------------------------------------
 static
-int hhmmStringToMinute (const char *hhmmString)
+int doCommand (controller_t *controller, mqttCommand_t *cmd, commandResult_t *result)
 {
-    char    buffer[ 8 ];
-    
-    //            "hh:mm"
-    buffer[ 0 ] = hhmmString[ 3 ];
-    buffer[ 1 ] = hhmmString[ 4 ];
-    buffer[ 2 ] = '\0';
+    //
+    //  Returns COMMAND_OK if the SCC took it. If not, result->reason says why
+    int     hour, minute, second;
+
+    Logger_LogInfo( "doCommand. Controller [%s], Command [%s], Int parameter [%d], Float parameter [%0.2f]\n", 
+                    controller->controllerID, cmd->command, cmd->iParam, cmd->fParam );
     
-    return atoi( buffer );
+    const commandMap_t  *entry = findCommand( cmd->command );
+    if (entry == NULL) {
+        snprintf( result->reason, sizeof result->reason, "unknown command" );
+        return (result->status = COMMAND_REJECTED);
+    }
+    if (!validateCommand( entry, cmd, &hour, &minute, &second, result->reason, sizeof result->reason ))
+        return (result->status = COMMAND_REJECTED);
+
+    //
+    //  Nothing to put on the wire - don't wait for the bus
+    if (entry->keyframe)
+        return runCommand( controller, NULL, entry, cmd, hour, minute, second, result );
+
+    modbus_t    *ctx = Controller_AcquireBus( controller, BUS_PRIORITY_COMMAND );
+    runCommand( controller, ctx, entry, cmd, hour, minute, second, result );
+    Controller_ReleaseBus( controller );
+
+    return result->status;
 }
 
 // -----------------------------------------------------------------------------
 static
-int hhmmssStringToSecond (const char *hhmmssString)
+int isBatchable (const mqttCommand_t *cmd)
 {
-    char    buffer[ 8 ];
-    
-    //            "hh:mm:ss"
-    buffer[ 0 ] = hhmmssString[ 6 ];
-    buffer[ 1 ] = hhmmssString[ 7 ];
-    buffer[ 2 ] = '\0';
-    
-    return atoi( buffer );
+    //
+    //  Only single commands are gathered up by the batch window - a batch message
+    //  is already a unit of its own
+    const commandMap_t  *entry = findCommand( cmd->command );
+    return (cmd->batchSize == 1 && entry != NULL && entry->holdingRegister != 0);
+}
+
+// -----------------------------------------------------------------------------
+static
+int writeCoalesced (controller_t *controller, modbus_t *ctx, const mqttCommand_t *commands, commandResult_t *results,
+                    const int *accepted, const int numCommands)
+{
+    //
+    //  Settings commands that each set one holding register. Lay the new values out
+    //  by address, then write each run of adjacent registers with one transaction.
+    //  If two commands set the same register the later one wins. The caller holds
+    //  the bus. Returns FALSE if any of the writes failed
+    uint16_t    values[ HOLDING_REGISTER_COUNT ];
+    int         isSet[ HOLDING_REGISTER_COUNT ];
+    int         runResult[ HOLDING_REGISTER_COUNT ];
+    long long   runStartUS[ HOLDING_REGISTER_COUNT ];
+    long long   runEndUS[ HOLDING_REGISTER_COUNT ];
+    int         allWritten = TRUE;
+    int         i;
+
+    memset( isSet, 0, sizeof isSet );
+
+    for (i = 0; i < numCommands; i += 1) {
+        if (!accepted[ i ])
+            continue;
+
+        const commandMap_t  *entry = findCommand( commands[ i ].command );
+        int                 offset = entry->holdingRegister - HOLDING_REGISTER_BASE;
+        if (entry->fargs == FLOATARG)
+            values[ offset ] = (uint16_t) ((commands[ i ].fParam * entry->scale) + 0.5);
+        else
+            values[ offset ] = (uint16_t) commands[ i ].iParam;
+        isSet[ offset ] = TRUE;
+    }
+
+    int offset = 0;
+    int numWrites = 0;
+    while (offset < HOLDING_REGISTER_COUNT) {
+        if (!isSet[ offset ]) {
+            offset += 1;
+            continue;
+        }
+
+        int count = 1;
+        while (offset + count < HOLDING_REGISTER_COUNT && isSet[ offset + count ])
+            count += 1;
+
+        long long   startUS = Timestamp_EpochUS();
+        int result = RegisterMap_WriteHolding( ctx, &controller->metrics, HOLDING_REGISTER_BASE + offset, count, &values[ offset ] );
+        if (result == -1)
+            Logger_LogError( "Batched write of %d registers at 0x%04X failed: %s\n",
+                             count, HOLDING_REGISTER_BASE + offset, modbus_strerror( errno ) );
+        int savedErrno = errno;
+        long long   endUS = Timestamp_EpochUS();
+        for (i = 0; i < count; i += 1) {
+            runResult[ offset + i ] = (result == -1) ? savedErrno : 0;
+            runStartUS[ offset + i ] = startUS;
+            runEndUS[ offset + i ] = endUS;
+        }
+
+        numWrites += 1;
+        offset += count;
+    }
+
+    Logger_LogDebug( "Coalesced %d commands for controller [%s] into %d write(s)\n", numCommands, controller->controllerID, numWrites );
+
+    for (i = 0; i < numCommands; i += 1) {
+        if (!accepted[ i ])
+            continue;
+
+        const commandMap_t  *entry = findCommand( commands[ i ].command );
+        int                 registerOffset = entry->holdingRegister - HOLDING_REGISTER_BASE;
+
+        results[ i ].modbusStartUS = runStartUS[ registerOffset ];
+        results[ i ].modbusEndUS = runEndUS[ registerOffset ];
+        results[ i ].status = COMMAND_OK;
+        if (runResult[ registerOffset ] != 0) {
+            results[ i ].status = COMMAND_FAILED;
+            snprintf( results[ i ].reason, sizeof results[ i ].reason, "%s", modbus_strerror( runResult[ registerOffset ] ) );
+            allWritten = FALSE;
+        }
+    }
+
+    Scheduler_Invalidate( &controller->scheduler, SETTINGS_CHANGED );
+    return allWritten;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    doBatch (controller_t *controller, mqttCommand_t *commands, commandResult_t *results, const int numCommands)
+{
+    //
+    //  Single settings commands gathered up by the batch window - each is
+    //  validated, and acknowledged, on its own
+    int         accepted[ MAX_BATCHED_COMMANDS ];
+    int         numAccepted = 0;
+    int         hour, minute, second;
+    int         i;
+
+    for (i = 0; i < numCommands; i += 1) {
+        const commandMap_t  *entry = findCommand( commands[ i ].command );
+        if (results[ i ].status == COMMAND_EXPIRED) {
+            accepted[ i ] = FALSE;
+            continue;
+        }
+
+        accepted[ i ] = validateCommand( entry, &commands[ i ], &hour, &minute, &second, results[ i ].reason, sizeof results[ i ].reason );
+        if (!accepted[ i ])
+            results[ i ].status = COMMAND_REJECTED;
+        else
+            numAccepted += 1;
+    }
+
+    if (numAccepted > 0) {
+        modbus_t    *ctx = Controller_AcquireBus( controller, BUS_PRIORITY_COMMAND );
+        writeCoalesced( controller, ctx, commands, results, accepted, numCommands );
+        Controller_ReleaseBus( controller );
+    }
+
+    for (i = 0; i < numCommands; i += 1)
+        acknowledgeCommand( controller, &commands[ i ], &results[ i ] );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    doTransaction (controller_t *controller, mqttCommand_t *commands, commandResult_t *results, const int numCommands)
+{
+    //
+    //  A batch message. Everything is validated first - one bad command and none
+    //  of them are sent. Then they run in order, all under one hold of the bus so no
+    //  poll can slip in between, and the first failure stops the rest (what already
+    //  went out stays written - the SCC has no rollback). With "coalesce", each run
+    //  of consecutive single-register settings goes out as multi-register writes.
+    const commandMap_t  *entries[ MAX_BATCHED_COMMANDS ];
+    int                 hours[ MAX_BATCHED_COMMANDS ];
+    int                 minutes[ MAX_BATCHED_COMMANDS ];
+    int                 seconds[ MAX_BATCHED_COMMANDS ];
+    int                 accepted[ MAX_BATCHED_COMMANDS ];
+    int                 numRejected = 0;
+    int                 failed = FALSE;
+    int                 i, j;
+
+    Logger_LogInfo( "doTransaction. Controller [%s], %d commands%s\n", controller->controllerID, numCommands,
+                    commands[ 0 ].coalesce ? ", coalesced" : "" );
+
+    for (i = 0; i < numCommands; i += 1) {
+        entries[ i ] = findCommand( commands[ i ].command );
+        accepted[ i ] = TRUE;
+        if (entries[ i ] == NULL) {
+            snprintf( results[ i ].reason, sizeof results[ i ].reason, "unknown command" );
+            results[ i ].status = COMMAND_REJECTED;
+            numRejected += 1;
+        } else if (!validateCommand( entries[ i ], &commands[ i ], &hours[ i ], &minutes[ i ], &seconds[ i ],
+                                     results[ i ].reason, sizeof results[ i ].reason )) {
+            results[ i ].status = COMMAND_REJECTED;
+            numRejected += 1;
+        }
+    }
+
+    if (numRejected > 0) {
+        for (i = 0; i < numCommands; i += 1) {
+            if (results[ i ].status != COMMAND_REJECTED) {
+                snprintf( results[ i ].reason, sizeof results[ i ].reason, "not run - the batch was rejected" );
+                results[ i ].status = COMMAND_SKIPPED;
+            }
+        }
+        return;
+    }
+
+    modbus_t    *ctx = Controller_AcquireBus( controller, BUS_PRIORITY_COMMAND );
+
+    for (i = 0; i < numCommands; i = j) {
+        j = i + 1;
+        if (failed) {
+            snprintf( results[ i ].reason, sizeof results[ i ].reason, "not run - an earlier command failed" );
+            results[ i ].status = COMMAND_SKIPPED;
+            continue;
+        }
+
+        if (commands[ i ].coalesce && entries[ i ]->holdingRegister != 0) {
+            while (j < numCommands && entries[ j ]->holdingRegister != 0)
+                j += 1;
+            failed = !writeCoalesced( controller, ctx, &commands[ i ], &results[ i ], &accepted[ i ], j - i );
+        } else {
+            failed = (runCommand( controller, ctx, entries[ i ], &commands[ i ], hours[ i ], minutes[ i ], seconds[ i ],
+                                  &results[ i ] ) != COMMAND_OK);
+        }
+    }
+
+    Controller_ReleaseBus( controller );
 }
 
+// -----------------------------------------------------------------------------
+static
+void    readBackCommands (controller_t *controller, const mqttCommand_t *commands, const commandResult_t *results, const int numCommands)
+{
+    //
+    //  Re-read what the successful commands touched - each register group once,
+    //  however many commands in the batch landed in it - and publish just that section
+    const registerSpan_t    *done[ MAX_BATCHED_COMMANDS ];
+    int                     numDone = 0;
+    int                     i, j;
+
+    for (i = 0; i < numCommands; i += 1) {
+        const commandMap_t  *entry = findCommand( commands[ i ].command );
+        if (results[ i ].status != COMMAND_OK || entry == NULL || entry->readBack.count == 0)
+            continue;
+
+        for (j = 0; j < numDone; j += 1)
+            if (done[ j ]->table == entry->readBack.table && done[ j ]->start == entry->readBack.start)
+                break;
+        if (j < numDone)
+            continue;
+
+        done[ numDone++ ] = &entry->readBack;
+        Controller_ReadBack( controller, &entry->readBack, BLOCK_MASK( entry->readBackBlock ) );
+    }
+}
+
+// -----------------------------------------------------------------------------
+int     DoCommand_Priority (const char *command)
+{
+    //
+    //  Called by the MQTT thread to pick the queue class. Unknown commands wait
+    //  with the rest - they'll be rejected when they come out
+    const commandMap_t  *entry = findCommand( command );
+    return (entry != NULL) ? entry->priority : COMMAND_PRIORITY_NORMAL;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     dropExpired (const mqttCommand_t *commands, commandResult_t *results, const int numCommands)
+{
+    //
+    //  Anything that waited longer than its sender said it was good for never goes
+    //  near the bus. Returns how many were marked COMMAND_EXPIRED
+    long long   nowUS = Timestamp_EpochUS();
+    int         numExpired = 0;
+    int         i;
+
+    for (i = 0; i < numCommands; i += 1) {
+        long long   waitedUS = nowUS - commands[ i ].receivedUS;
+        if (commands[ i ].ttlMS <= 0 || waitedUS <= (commands[ i ].ttlMS * 1000LL))
+            continue;
+
+        snprintf( results[ i ].reason, sizeof results[ i ].reason, "waited %lld ms, ttlMS is %d",
+                  waitedUS / 1000LL, commands[ i ].ttlMS );
+        results[ i ].status = COMMAND_EXPIRED;
+        numExpired += 1;
+    }
+
+    if (numExpired > 0)
+        countExpired( numExpired );
+    return numExpired;
+}
+
+// -----------------------------------------------------------------------------
+void    DoCommand_SetBatchWindow (const int milliSeconds)
+{
+    batchWindowMS = (milliSeconds < 0) ? 0 : milliSeconds;
+}
+
+// -----------------------------------------------------------------------------
+static
+int twoDigits (const char *digits)
+{
+    //
+    //  Returns -1 unless both characters are digits
+    if (digits[ 0 ] < '0' || digits[ 0 ] > '9' || digits[ 1 ] < '0' || digits[ 1 ] > '9')
+        return -1;
+    return ((digits[ 0 ] - '0') * 10) + (digits[ 1 ] - '0');
+}
 
+// -----------------------------------------------------------------------------
+static
+int parseClockString (const char *clockString, const int withSeconds, int *hour, int *minute, int *second)
+{
+    //
+    //  Exactly "hh:mm" or "hh:mm:ss", 24 hour clock. Returns FALSE if it isn't
+    size_t  expected = withSeconds ? 8 : 5;
+
+    if (strlen( clockString ) != expected || clockString[ 2 ] != ':')
+        return FALSE;
+
+    *hour = twoDigits( &clockString[ 0 ] );
+    *minute = twoDigits( &clockString[ 3 ] );
+    *second = 0;
+    if (withSeconds) {
+        if (clockString[ 5 ] != ':')
+            return FALSE;
+        *second = twoDigits( &clockString[ 6 ] );
+    }
+
+    return (*hour >= 0 && *hour <= 23 && *minute >= 0 && *minute <= 59 && *second >= 0 && *second <= 59);
+}
 
 // -----------------------------------------------------------------------------
 void    *processInboundCommand (void *argPtr)
@@ -197,20 +847,112 @@ void    *processInboundCommand (void *argPtr)
     //  This function is started by a new thread
     //
     Logger_LogDebug( "processInBoundCommand - starting thread.\n" );
-    modbus_t    *ctx;
-    
-    ctx = (modbus_t *) argPtr;
+    checkCommandTable();
+
+    mqttCommand_t   commands[ MAX_BATCHED_COMMANDS ];
+    commandResult_t results[ MAX_BATCHED_COMMANDS ];
+    mqttCommand_t   pending;
+    long long       pendingDequeuedUS = 0;
+    int             havePending = FALSE;
+    int             i;
+
+    JSON_WriterInitialize( &responseWriter, responseBuffer, sizeof responseBuffer, FALSE );
 
     //
     //  Loop forever
     while (TRUE) {
         //
-        //  did someone send us a command?
-        mqttCommand_t   *command = removeElementAndWait();
-        if (command != NULL) {
-            doCommand( ctx, command );
-            free( command );
+        //  did someone send us a command? One left over from the last batch goes first
+        memset( results, 0, sizeof results );
+        if (havePending) {
+            commands[ 0 ] = pending;
+            results[ 0 ].dequeuedUS = pendingDequeuedUS;
+            havePending = FALSE;
+        } else if (removeElementAndWait( &commands[ 0 ] )) {
+            results[ 0 ].dequeuedUS = Timestamp_EpochUS();
+        } else {
+            break;
+        }
+
+        controller_t    *controller = Controller_FindByID( commands[ 0 ].controllerID );
+        if (controller == NULL) {
+            Logger_LogError( "Command [%s] for unknown controller [%s] ignored\n", commands[ 0 ].command, commands[ 0 ].controllerID );
+            continue;
+        }
+
+        //
+        //  The front of its batch was thrown away to make room in the queue
+        if (commands[ 0 ].batchIndex != 0) {
+            snprintf( results[ 0 ].reason, sizeof results[ 0 ].reason, "the rest of its batch was discarded from the queue" );
+            results[ 0 ].status = COMMAND_REJECTED;
+            acknowledgeCommand( controller, &commands[ 0 ], &results[ 0 ] );
+            continue;
         }
+
+        //
+        //  A batch message - the rest of it is right behind the first command
+        if (commands[ 0 ].batchSize > 1) {
+            int numCommands = 1;
+            while (numCommands < commands[ 0 ].batchSize &&
+                    removeElementOfPriority( &pending, commands[ 0 ].priority, BATCH_ASSEMBLY_MS )) {
+                if (pending.batchIndex != numCommands || pending.receivedUS != commands[ 0 ].receivedUS) {
+                    pendingDequeuedUS = Timestamp_EpochUS();
+                    havePending = TRUE;
+                    break;
+                }
+                results[ numCommands ].dequeuedUS = Timestamp_EpochUS();
+                commands[ numCommands++ ] = pending;
+            }
+
+            if (numCommands == commands[ 0 ].batchSize) {
+                if (dropExpired( commands, results, numCommands ) == 0)
+                    doTransaction( controller, commands, results, numCommands );
+            } else {
+                for (i = 0; i < numCommands; i += 1) {
+                    snprintf( results[ i ].reason, sizeof results[ i ].reason, "only %d of the batch's %d commands arrived",
+                              numCommands, commands[ 0 ].batchSize );
+                    results[ i ].status = COMMAND_REJECTED;
+                }
+            }
+            acknowledgeBatch( controller, commands, results, numCommands );
+            readBackCommands( controller, commands, results, numCommands );
+            continue;
+        }
+
+        //
+        //  A settings command - wait a little while for more of them for the same controller.
+        //  Anything else that shows up ends the batch and is handled next time around.
+        int numCommands = 1;
+        if (batchWindowMS > 0 && isBatchable( &commands[ 0 ] )) {
+            long long   deadlineMS = nowMS() + batchWindowMS;
+            long long   remainingMS;
+
+            while (numCommands < MAX_BATCHED_COMMANDS && (remainingMS = deadlineMS - nowMS()) > 0) {
+                if (!removeElementTimed( &pending, (int) remainingMS ))
+                    break;
+
+                if (strcmp( pending.controllerID, commands[ 0 ].controllerID ) != 0 || !isBatchable( &pending )) {
+                    pendingDequeuedUS = Timestamp_EpochUS();
+                    havePending = TRUE;
+                    break;
+                }
+                results[ numCommands ].dequeuedUS = Timestamp_EpochUS();
+                commands[ numCommands++ ] = pending;
+            }
+        }
+
+        dropExpired( commands, results, numCommands );
+        if (numCommands > 1) {
+            doBatch( controller, commands, results, numCommands );
+        } else {
+            if (results[ 0 ].status != COMMAND_EXPIRED)
+                doCommand( controller, &commands[ 0 ], &results[ 0 ] );
+            acknowledgeCommand( controller, &commands[ 0 ], &results[ 0 ] );
+        }
+
+        //
+        //  Acknowledge first, then show the new values without waiting for the next poll
+        readBackCommands( controller, commands, results, numCommands );
     }
     
     return (void *) 0;
@@ -16,7 +16,11 @@ extern "C" {
 #endif
 
 
+#define DEFAULT_BATCH_WINDOW_MS     50      // 0 = send every command on its own
+
 extern  void    *processInboundCommand( void * );
+extern  void    DoCommand_SetBatchWindow( const int milliSeconds );
+extern  int     DoCommand_Priority( const char *command );
 
 
 #ifdef __cplusplus
@@ -0,0 +1,916 @@
+/*
+ * File:    history.c
+ * author:  patrick conroy
+ *
+ * A compressed, on-device history of the real time data and statistics, so
+ * "what happened overnight" can be answered from the controller itself, even
+ * when the upstream storage was down.
+ *
+ * One file per controller, divided into HISTORY_BLOCK_BYTES slots used as a
+ * ring - when it's full the oldest block is overwritten. Inside a block the
+ * data is stored by column, the way Facebook's Gorilla does it:
+ *
+ *   timestamps     delta of deltas, so a steady poll interval costs one bit
+ *   values         each float XOR'd with the one before it. Unchanged is one
+ *                  bit, a small change is the few bits in the middle that moved
+ *
+ * which gets a sample of all HISTORY_COLUMNS fields down to tens of bytes, so
+ * a few GB of SD card holds months of 1 second data.
+ *
+ * The block being filled lives in memory and is written over its slot when
+ * it's sealed, and every HISTORY_CHECKPOINT_SECONDS in between. Each block
+ * header carries the time range, a checksum and the min/max/sum of every
+ * column - a summary of a range only has to decode the blocks at either end.
+ * Queries map each block they need with mmap(), never the whole file.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "logger.h"
+#include "history.h"
+
+
+#define HISTORY_MAGIC           0x4C534854u                     // "LSHT"
+#define HISTORY_VERSION         1
+
+#define FROM_REALTIME           0
+#define FROM_STATISTICS         1
+
+//
+//  Worst cases, in bits - a timestamp escape is 4 + 64, a value with a new XOR window 2 + 5 + 5 + 32
+#define MAX_TIME_BITS           68
+#define MAX_VALUE_BITS          44
+#define MAX_POINT_BYTES         ((MAX_TIME_BITS + HISTORY_COLUMNS * MAX_VALUE_BITS) / 8 + HISTORY_COLUMNS + 2)
+
+typedef struct  historyField {
+    const char  *name;
+    int         source;
+    size_t      offset;
+    int         isInteger;
+    int         precision;                                      // decimal places when we send it back out
+} historyField_t;
+
+static  const historyField_t    fields[ HISTORY_COLUMNS ] = {
+    { "pvArrayVoltage",             FROM_REALTIME,   offsetof( RealTimeData_t, pvArrayVoltage ),                    FALSE, 2 },
+    { "pvArrayCurrent",             FROM_REALTIME,   offsetof( RealTimeData_t, pvArrayCurrent ),                    FALSE, 2 },
+    { "loadVoltage",                FROM_REALTIME,   offsetof( RealTimeData_t, loadVoltage ),                       FALSE, 2 },
+    { "loadCurrent",                FROM_REALTIME,   offsetof( RealTimeData_t, loadCurrent ),                       FALSE, 2 },
+    { "batteryTemp",                FROM_REALTIME,   offsetof( RealTimeData_t, batteryTemp ),                       FALSE, 1 },
+    { "caseTemp",                   FROM_REALTIME,   offsetof( RealTimeData_t, caseTemp ),                          FALSE, 1 },
+    { "remoteBatteryTemperature",   FROM_REALTIME,   offsetof( RealTimeData_t, remoteBatteryTemperature ),          FALSE, 1 },
+    { "batterySOC",                 FROM_REALTIME,   offsetof( RealTimeData_t, batterySOC ),                        TRUE,  0 },
+    { "maximumInputVoltageToday",   FROM_STATISTICS, offsetof( StatisticalParameters_t, maximumInputVoltageToday ),   FALSE, 2 },
+    { "minimumInputVoltageToday",   FROM_STATISTICS, offsetof( StatisticalParameters_t, minimumInputVoltageToday ),   FALSE, 2 },
+    { "maximumBatteryVoltageToday", FROM_STATISTICS, offsetof( StatisticalParameters_t, maximumBatteryVoltageToday ), FALSE, 2 },
+    { "minimumBatteryVoltageToday", FROM_STATISTICS, offsetof( StatisticalParameters_t, minimumBatteryVoltageToday ), FALSE, 2 },
+    { "consumedEnergyToday",        FROM_STATISTICS, offsetof( StatisticalParameters_t, consumedEnergyToday ),        FALSE, 2 },
+    { "consumedEnergyMonth",        FROM_STATISTICS, offsetof( StatisticalParameters_t, consumedEnergyMonth ),        FALSE, 2 },
+    { "consumedEnergyYear",         FROM_STATISTICS, offsetof( StatisticalParameters_t, consumedEnergyYear ),         FALSE, 2 },
+    { "totalConsumedEnergy",        FROM_STATISTICS, offsetof( StatisticalParameters_t, totalConsumedEnergy ),        FALSE, 2 },
+    { "generatedEnergyToday",       FROM_STATISTICS, offsetof( StatisticalParameters_t, generatedEnergyToday ),       FALSE, 2 },
+    { "generatedEnergyMonth",       FROM_STATISTICS, offsetof( StatisticalParameters_t, generatedEnergyMonth ),       FALSE, 2 },
+    { "generatedEnergyYear",        FROM_STATISTICS, offsetof( StatisticalParameters_t, generatedEnergyYear ),        FALSE, 2 },
+    { "totalGeneratedEnergy",       FROM_STATISTICS, offsetof( StatisticalParameters_t, totalGeneratedEnergy ),       FALSE, 2 },
+    { "batteryVoltage",             FROM_STATISTICS, offsetof( StatisticalParameters_t, batteryVoltage ),             FALSE, 2 },
+    { "batteryCurrent",             FROM_STATISTICS, offsetof( StatisticalParameters_t, batteryCurrent ),             FALSE, 1 },
+};
+
+typedef struct  blockHeader {
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    generation;                                     // bigger = newer, the slot is (generation - 1) % slots
+    int64_t     firstMS;
+    int64_t     lastMS;
+    uint32_t    points;
+    uint32_t    columns;                                        // HISTORY_COLUMNS when it was written
+    uint32_t    timeBits;
+    uint32_t    valueBits[ HISTORY_COLUMNS ];
+    uint32_t    checksum;                                       // of the streams after the header
+    float       minimum[ HISTORY_COLUMNS ];
+    float       maximum[ HISTORY_COLUMNS ];
+    double      sum[ HISTORY_COLUMNS ];
+} blockHeader_t;
+
+#define PAYLOAD_BYTES           (HISTORY_BLOCK_BYTES - (int) sizeof( blockHeader_t ))
+
+//
+//  No one stream can be longer than all of them together - a block is sealed before that
+#define STREAM_BYTES            (PAYLOAD_BYTES + 8)
+
+typedef struct  bitReader {
+    const unsigned char *bytes;
+    uint32_t    bits;
+    uint32_t    position;
+} bitReader_t;
+
+//
+//  What History_Summarize() and History_Read() do with each block
+typedef int     (*blockVisitor_t)( const blockHeader_t *header, const unsigned char *payload, void *context );
+
+
+// -----------------------------------------------------------------------------
+static
+uint32_t    checksum (const unsigned char *data, const size_t length)
+{
+    //
+    //  FNV-1a - catches a block that was half written when the power went
+    uint32_t    hash = 2166136261u;
+    size_t      i;
+
+    for (i = 0; i < length; i += 1) {
+        hash ^= data[ i ];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// -----------------------------------------------------------------------------
+static
+uint32_t    streamBytes (const uint32_t bits)
+{
+    return (bits + 7) / 8;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    putBits (bitStream_t *stream, const uint64_t value, const int count)
+{
+    //
+    //  Most significant bit first. The buffer was zeroed when the block started
+    int i;
+
+    for (i = count - 1; i >= 0; i -= 1) {
+        if ((value >> i) & 1)
+            stream->bytes[ stream->bits >> 3 ] |= (0x80 >> (stream->bits & 7));
+        stream->bits += 1;
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+int     getBits (bitReader_t *reader, const int count, uint64_t *value)
+{
+    //
+    //  FALSE if the stream runs out first
+    int i;
+
+    if (reader->position + count > reader->bits)
+        return FALSE;
+
+    *value = 0;
+    for (i = 0; i < count; i += 1) {
+        *value = (*value << 1) | ((reader->bytes[ reader->position >> 3 ] >> (7 - (reader->position & 7))) & 1);
+        reader->position += 1;
+    }
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    encodeTime (history_t *history, const long long timeMS)
+{
+    long long   delta = timeMS - history->previousMS;
+    long long   deltaOfDelta = delta - history->previousDelta;
+    bitStream_t *stream = &history->times;
+
+    if (deltaOfDelta == 0) {
+        putBits( stream, 0x0, 1 );
+    } else if (deltaOfDelta >= -63 && deltaOfDelta <= 64) {
+        putBits( stream, 0x2, 2 );
+        putBits( stream, deltaOfDelta + 63, 7 );
+    } else if (deltaOfDelta >= -255 && deltaOfDelta <= 256) {
+        putBits( stream, 0x6, 3 );
+        putBits( stream, deltaOfDelta + 255, 9 );
+    } else if (deltaOfDelta >= -2047 && deltaOfDelta <= 2048) {
+        putBits( stream, 0xE, 4 );
+        putBits( stream, deltaOfDelta + 2047, 12 );
+    } else {
+        putBits( stream, 0xF, 4 );
+        putBits( stream, (uint64_t) deltaOfDelta, 64 );
+    }
+
+    history->previousDelta = delta;
+    history->previousMS = timeMS;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     decodeTimes (const blockHeader_t *header, const unsigned char *payload, long long *times)
+{
+    //
+    //  FALSE if the stream doesn't hold header->points timestamps
+    bitReader_t reader = { payload, header->timeBits, 0 };
+    long long   previous = header->firstMS;
+    long long   delta = 0;
+    uint64_t    bits;
+    uint32_t    i;
+
+    times[ 0 ] = previous;
+    for (i = 1; i < header->points; i += 1) {
+        long long   deltaOfDelta;
+        int         ones = 0;
+
+        while (ones < 4) {
+            if (!getBits( &reader, 1, &bits ))
+                return FALSE;
+            if (bits == 0)
+                break;
+            ones += 1;
+        }
+
+        switch (ones) {
+            case 0:     deltaOfDelta = 0;                                                   break;
+            case 1:     if (!getBits( &reader, 7, &bits )) return FALSE;
+                        deltaOfDelta = (long long) bits - 63;                               break;
+            case 2:     if (!getBits( &reader, 9, &bits )) return FALSE;
+                        deltaOfDelta = (long long) bits - 255;                              break;
+            case 3:     if (!getBits( &reader, 12, &bits )) return FALSE;
+                        deltaOfDelta = (long long) bits - 2047;                             break;
+            default:    if (!getBits( &reader, 64, &bits )) return FALSE;
+                        deltaOfDelta = (long long) bits;                                    break;
+        }
+
+        delta += deltaOfDelta;
+        previous += delta;
+        times[ i ] = previous;
+    }
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    encodeValue (valueEncoder_t *encoder, const float value, const int first)
+{
+    uint32_t    bits;
+
+    memcpy( &bits, &value, sizeof bits );
+    if (first) {
+        putBits( &encoder->stream, bits, 32 );
+        encoder->previous = bits;
+        return;
+    }
+
+    uint32_t    xor = bits ^ encoder->previous;
+    encoder->previous = bits;
+    if (xor == 0) {
+        putBits( &encoder->stream, 0x0, 1 );
+        return;
+    }
+
+    int leading = __builtin_clz( xor );
+    int trailing = __builtin_ctz( xor );
+
+    if (encoder->leading >= 0 && leading >= encoder->leading && trailing >= encoder->trailing) {
+        //
+        //  Fits in the window we used last time - just the bits inside it
+        putBits( &encoder->stream, 0x2, 2 );
+        putBits( &encoder->stream, xor >> encoder->trailing, 32 - encoder->leading - encoder->trailing );
+    } else {
+        int meaningful = 32 - leading - trailing;
+        putBits( &encoder->stream, 0x3, 2 );
+        putBits( &encoder->stream, leading, 5 );
+        putBits( &encoder->stream, meaningful - 1, 5 );
+        putBits( &encoder->stream, xor >> trailing, meaningful );
+        encoder->leading = leading;
+        encoder->trailing = trailing;
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+int     decodeValues (const unsigned char *stream, const uint32_t streamBits, const uint32_t points, float *values)
+{
+    bitReader_t reader = { stream, streamBits, 0 };
+    uint64_t    bits;
+    uint32_t    previous;
+    int         leading = 0;
+    int         trailing = 0;
+    uint32_t    i;
+
+    if (!getBits( &reader, 32, &bits ))
+        return FALSE;
+    previous = (uint32_t) bits;
+    memcpy( &values[ 0 ], &previous, sizeof previous );
+
+    for (i = 1; i < points; i += 1) {
+        if (!getBits( &reader, 1, &bits ))
+            return FALSE;
+
+        if (bits != 0) {
+            if (!getBits( &reader, 1, &bits ))
+                return FALSE;
+            if (bits != 0) {
+                uint64_t    newLeading, meaningful;
+                if (!getBits( &reader, 5, &newLeading ) || !getBits( &reader, 5, &meaningful ))
+                    return FALSE;
+                leading = (int) newLeading;
+                trailing = 32 - leading - ((int) meaningful + 1);
+                if (trailing < 0)
+                    return FALSE;
+            }
+            if (!getBits( &reader, 32 - leading - trailing, &bits ))
+                return FALSE;
+            previous ^= ((uint32_t) bits << trailing);
+        }
+        memcpy( &values[ i ], &previous, sizeof previous );
+    }
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+float   fieldValue (const int column, const RealTimeData_t *rtData, const StatisticalParameters_t *stats)
+{
+    const historyField_t    *field = &fields[ column ];
+    const char              *base = (field->source == FROM_REALTIME) ? (const char *) rtData : (const char *) stats;
+
+    if (field->isInteger)
+        return (float) *(const int *) (base + field->offset);
+    return *(const float *) (base + field->offset);
+}
+
+// -----------------------------------------------------------------------------
+static
+int     payloadUsed (const history_t *history)
+{
+    int used = streamBytes( history->times.bits );
+    int i;
+
+    for (i = 0; i < HISTORY_COLUMNS; i += 1)
+        used += streamBytes( history->values[ i ].stream.bits );
+    return used;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     buildImage (const history_t *history, unsigned char *image)
+{
+    //
+    //  The open block as it would be on disk - header, then the streams back to
+    //  back. Returns how many bytes of it are used. Hold history->lock
+    blockHeader_t   *header = (blockHeader_t *) image;
+    unsigned char   *payload = image + sizeof( blockHeader_t );
+    int             used = 0;
+    int             i;
+
+    memset( header, '\0', sizeof( blockHeader_t ) );
+    header->magic = HISTORY_MAGIC;
+    header->version = HISTORY_VERSION;
+    header->generation = history->generation;
+    header->firstMS = history->firstMS;
+    header->lastMS = history->previousMS;
+    header->points = history->points;
+    header->columns = HISTORY_COLUMNS;
+
+    header->timeBits = history->times.bits;
+    memcpy( payload, history->times.bytes, streamBytes( history->times.bits ) );
+    used += streamBytes( history->times.bits );
+
+    for (i = 0; i < HISTORY_COLUMNS; i += 1) {
+        const valueEncoder_t    *encoder = &history->values[ i ];
+        header->valueBits[ i ] = encoder->stream.bits;
+        header->minimum[ i ] = encoder->minimum;
+        header->maximum[ i ] = encoder->maximum;
+        header->sum[ i ] = encoder->sum;
+        memcpy( payload + used, encoder->stream.bytes, streamBytes( encoder->stream.bits ) );
+        used += streamBytes( encoder->stream.bits );
+    }
+
+    header->checksum = checksum( payload, used );
+    return sizeof( blockHeader_t ) + used;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     slotOf (const history_t *history, const uint64_t generation)
+{
+    return (int) ((generation - 1) % history->numSlots);
+}
+
+// -----------------------------------------------------------------------------
+static
+void    writeBlock (history_t *history)
+{
+    //
+    //  Over the top of the slot, just the bytes in use. Hold history->lock
+    if (history->points == 0)
+        return;
+
+    int     length = buildImage( history, history->image );
+    off_t   offset = (off_t) slotOf( history, history->generation ) * HISTORY_BLOCK_BYTES;
+
+    if (pwrite( history->fd, history->image, length, offset ) != length)
+        Logger_LogError( "History: unable to write a block to %s: %s\n", history->path, strerror( errno ) );
+    history->lastCheckpoint = time( NULL );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    startBlock (history_t *history, const long long timeMS)
+{
+    //
+    //  Hold history->lock
+    int i;
+
+    history->generation += 1;
+    history->points = 0;
+    history->firstMS = timeMS;
+    history->previousMS = timeMS;
+    history->previousDelta = 0;
+
+    memset( history->times.bytes, '\0', history->times.capacity );
+    history->times.bits = 0;
+    for (i = 0; i < HISTORY_COLUMNS; i += 1) {
+        valueEncoder_t  *encoder = &history->values[ i ];
+        memset( encoder->stream.bytes, '\0', encoder->stream.capacity );
+        encoder->stream.bits = 0;
+        encoder->leading = -1;
+        encoder->trailing = 0;
+        encoder->sum = 0.0;
+    }
+
+    //
+    //  The slot's old block is gone as far as queries are concerned
+    blockIndex_t    *index = &history->index[ slotOf( history, history->generation ) ];
+    index->generation = history->generation;
+    index->firstMS = timeMS;
+    index->lastMS = timeMS;
+}
+
+// -----------------------------------------------------------------------------
+history_t   *History_Open (const char *directory, const char *name, const int megabytes)
+{
+    struct stat     info;
+    blockHeader_t   header;
+    uint64_t        newest = 0;
+    int             i;
+
+    if (megabytes < 1 || megabytes > HISTORY_MAX_MEGABYTES) {
+        Logger_LogError( "History: budget of %d MB is out of range (1 - %d)\n", megabytes, HISTORY_MAX_MEGABYTES );
+        return NULL;
+    }
+    if (mkdir( directory, 0755 ) != 0 && errno != EEXIST) {
+        Logger_LogError( "History: unable to create %s: %s\n", directory, strerror( errno ) );
+        return NULL;
+    }
+
+    history_t   *history = calloc( 1, sizeof( history_t ) );
+    if (history == NULL)
+        return NULL;
+
+    snprintf( history->path, sizeof history->path, "%s/%s.history", directory, name );
+    history->numSlots = (int) (((long long) megabytes * 1024 * 1024) / HISTORY_BLOCK_BYTES);
+    history->index = calloc( history->numSlots, sizeof( blockIndex_t ) );
+    history->image = malloc( HISTORY_BLOCK_BYTES );
+    history->times.capacity = STREAM_BYTES;
+    history->times.bytes = malloc( STREAM_BYTES );
+    for (i = 0; i < HISTORY_COLUMNS; i += 1) {
+        history->values[ i ].stream.capacity = STREAM_BYTES;
+        history->values[ i ].stream.bytes = malloc( STREAM_BYTES );
+    }
+    pthread_mutex_init( &history->lock, NULL );
+    history->fd = -1;
+
+    int missing = (history->index == NULL || history->image == NULL || history->times.bytes == NULL);
+    for (i = 0; i < HISTORY_COLUMNS; i += 1)
+        missing |= (history->values[ i ].stream.bytes == NULL);
+    if (missing) {
+        Logger_LogError( "History: out of memory for %s\n", history->path );
+        History_Close( history );
+        return NULL;
+    }
+
+    if ((history->fd = open( history->path, O_RDWR | O_CREAT, 0644 )) < 0) {
+        Logger_LogError( "History: unable to open %s: %s\n", history->path, strerror( errno ) );
+        History_Close( history );
+        return NULL;
+    }
+
+    off_t   size = (off_t) history->numSlots * HISTORY_BLOCK_BYTES;
+    if (fstat( history->fd, &info ) != 0 || (info.st_size != size && ftruncate( history->fd, size ) != 0)) {
+        Logger_LogError( "History: unable to size %s to %d MB: %s\n", history->path, megabytes, strerror( errno ) );
+        History_Close( history );
+        return NULL;
+    }
+    if (info.st_size != 0 && info.st_size != size)
+        Logger_LogWarning( "History: %s resized to %d MB - some old blocks may be lost\n", history->path, megabytes );
+
+    //
+    //  Just the headers - the blocks themselves are checked when a query reads them
+    for (i = 0; i < history->numSlots; i += 1) {
+        if (pread( history->fd, &header, sizeof header, (off_t) i * HISTORY_BLOCK_BYTES ) != sizeof header)
+            continue;
+        if (header.magic != HISTORY_MAGIC || header.version != HISTORY_VERSION || header.columns != HISTORY_COLUMNS ||
+                header.generation == 0 || header.points == 0)
+            continue;
+
+        history->index[ i ].generation = header.generation;
+        history->index[ i ].firstMS = header.firstMS;
+        history->index[ i ].lastMS = header.lastMS;
+        if (header.generation > newest)
+            newest = header.generation;
+    }
+
+    //
+    //  A block that was still open when we stopped stays as it is - we start a new one
+    history->generation = newest;
+    history->lastCheckpoint = time( NULL );
+
+    Logger_LogInfo( "History: %s, %d blocks of %d KB\n", history->path, history->numSlots, HISTORY_BLOCK_BYTES / 1024 );
+    return history;
+}
+
+// -----------------------------------------------------------------------------
+void    History_Close (history_t *history)
+{
+    int i;
+
+    if (history == NULL)
+        return;
+
+    if (history->fd >= 0) {
+        pthread_mutex_lock( &history->lock );
+        writeBlock( history );
+        pthread_mutex_unlock( &history->lock );
+        fsync( history->fd );
+        close( history->fd );
+    }
+
+    free( history->index );
+    free( history->image );
+    free( history->times.bytes );
+    for (i = 0; i < HISTORY_COLUMNS; i += 1)
+        free( history->values[ i ].stream.bytes );
+    pthread_mutex_destroy( &history->lock );
+    free( history );
+}
+
+// -----------------------------------------------------------------------------
+void    History_Append (history_t *history, const long long timeMS,
+                        const RealTimeData_t *rtData, const StatisticalParameters_t *stats)
+{
+    int i;
+
+    pthread_mutex_lock( &history->lock );
+
+    //
+    //  Start a new block if this one is full - or if the clock went backwards
+    //  (NTP setting it after boot), so a block's points are always in order
+    if (history->points > 0 &&
+            (history->points >= HISTORY_BLOCK_POINTS || payloadUsed( history ) + MAX_POINT_BYTES > PAYLOAD_BYTES ||
+             timeMS <= history->previousMS)) {
+        writeBlock( history );
+        history->sealed += 1;
+        history->points = 0;
+    }
+
+    int first = (history->points == 0);
+    if (first)
+        startBlock( history, timeMS );
+    else
+        encodeTime( history, timeMS );
+
+    for (i = 0; i < HISTORY_COLUMNS; i += 1) {
+        valueEncoder_t  *encoder = &history->values[ i ];
+        float           value = fieldValue( i, rtData, stats );
+
+        encodeValue( encoder, value, first );
+        if (first || value < encoder->minimum)
+            encoder->minimum = value;
+        if (first || value > encoder->maximum)
+            encoder->maximum = value;
+        encoder->sum += value;
+    }
+
+    history->points += 1;
+    history->appended += 1;
+    history->index[ slotOf( history, history->generation ) ].lastMS = timeMS;
+
+    if (time( NULL ) - history->lastCheckpoint >= HISTORY_CHECKPOINT_SECONDS)
+        writeBlock( history );
+    pthread_mutex_unlock( &history->lock );
+}
+
+// -----------------------------------------------------------------------------
+void    History_Checkpoint (history_t *history)
+{
+    pthread_mutex_lock( &history->lock );
+    writeBlock( history );
+    pthread_mutex_unlock( &history->lock );
+}
+
+// -----------------------------------------------------------------------------
+static
+int     compareGenerations (const void *a, const void *b)
+{
+    const blockIndex_t  *left = (const blockIndex_t *) a;
+    const blockIndex_t  *right = (const blockIndex_t *) b;
+
+    return (left->generation > right->generation) - (left->generation < right->generation);
+}
+
+// -----------------------------------------------------------------------------
+static
+int     validBlock (const blockHeader_t *header, const uint64_t generation)
+{
+    uint32_t    used = streamBytes( header->timeBits );
+    int         i;
+
+    if (header->magic != HISTORY_MAGIC || header->version != HISTORY_VERSION || header->columns != HISTORY_COLUMNS ||
+            header->generation != generation || header->points == 0 || header->points > HISTORY_BLOCK_POINTS)
+        return FALSE;
+
+    for (i = 0; i < HISTORY_COLUMNS; i += 1)
+        used += streamBytes( header->valueBits[ i ] );
+    if (used > PAYLOAD_BYTES)
+        return FALSE;
+
+    return (checksum( (const unsigned char *) header + sizeof( blockHeader_t ), used ) == header->checksum);
+}
+
+// -----------------------------------------------------------------------------
+static
+int     forEachBlock (history_t *history, const long long fromMS, const long long toMS,
+                      blockVisitor_t visitor, void *context)
+{
+    //
+    //  Oldest first, every block that overlaps [fromMS, toMS]. The open block is
+    //  copied while we hold the lock, the others are mapped one at a time and
+    //  checked before the visitor sees them. Stops early if the visitor returns FALSE
+    blockIndex_t    *blocks = malloc( history->numSlots * sizeof( blockIndex_t ) );
+    unsigned char   *openImage = malloc( HISTORY_BLOCK_BYTES );
+    int             numBlocks = 0;
+    uint64_t        openGeneration;
+    int             i;
+
+    if (blocks == NULL || openImage == NULL) {
+        free( blocks );
+        free( openImage );
+        return FALSE;
+    }
+
+    pthread_mutex_lock( &history->lock );
+    for (i = 0; i < history->numSlots; i += 1) {
+        blockIndex_t    *index = &history->index[ i ];
+        if (index->generation != 0 && index->lastMS >= fromMS && index->firstMS <= toMS)
+            blocks[ numBlocks++ ] = *index;
+    }
+    openGeneration = (history->points > 0) ? history->generation : 0;
+    if (openGeneration != 0)
+        buildImage( history, openImage );
+    pthread_mutex_unlock( &history->lock );
+
+    qsort( blocks, numBlocks, sizeof( blockIndex_t ), compareGenerations );
+
+    for (i = 0; i < numBlocks; i += 1) {
+        int keepGoing;
+
+        if (blocks[ i ].generation == openGeneration) {
+            const blockHeader_t *header = (const blockHeader_t *) openImage;
+            keepGoing = visitor( header, openImage + sizeof( blockHeader_t ), context );
+        } else {
+            off_t           offset = (off_t) slotOf( history, blocks[ i ].generation ) * HISTORY_BLOCK_BYTES;
+            unsigned char   *block = mmap( NULL, HISTORY_BLOCK_BYTES, PROT_READ, MAP_SHARED, history->fd, offset );
+            if (block == MAP_FAILED)
+                continue;
+
+            const blockHeader_t *header = (const blockHeader_t *) block;
+            if (validBlock( header, blocks[ i ].generation )) {
+                keepGoing = visitor( header, block + sizeof( blockHeader_t ), context );
+            } else {
+                __atomic_add_fetch( &history->corrupt, 1, __ATOMIC_RELAXED );
+                keepGoing = TRUE;
+            }
+            munmap( block, HISTORY_BLOCK_BYTES );
+        }
+
+        if (!keepGoing)
+            break;
+    }
+
+    free( blocks );
+    free( openImage );
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     decodeColumn (const blockHeader_t *header, const unsigned char *payload, const int column, float *values)
+{
+    //
+    //  Columnar - skip straight past the streams we don't want
+    uint32_t    offset = streamBytes( header->timeBits );
+    int         i;
+
+    for (i = 0; i < column; i += 1)
+        offset += streamBytes( header->valueBits[ i ] );
+    return decodeValues( payload + offset, header->valueBits[ column ], header->points, values );
+}
+
+// -----------------------------------------------------------------------------
+typedef struct  summaryContext {
+    long long           fromMS;
+    long long           toMS;
+    historySummary_t    *summary;
+    long long           times[ HISTORY_BLOCK_POINTS ];
+    float               values[ HISTORY_BLOCK_POINTS ];
+} summaryContext_t;
+
+// -----------------------------------------------------------------------------
+static
+void    addToSummary (historySummary_t *summary, const int column, const float minimum, const float maximum, const double sum)
+{
+    if (summary->points == 0 || minimum < summary->minimum[ column ])
+        summary->minimum[ column ] = minimum;
+    if (summary->points == 0 || maximum > summary->maximum[ column ])
+        summary->maximum[ column ] = maximum;
+    summary->sum[ column ] += sum;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     summarizeBlock (const blockHeader_t *header, const unsigned char *payload, void *argPtr)
+{
+    summaryContext_t    *context = (summaryContext_t *) argPtr;
+    historySummary_t    *summary = context->summary;
+    uint32_t            i, first, last;
+    int                 column;
+
+    //
+    //  All of it in range - the header already has the answer
+    if (header->firstMS >= context->fromMS && header->lastMS <= context->toMS) {
+        for (column = 0; column < HISTORY_COLUMNS; column += 1)
+            addToSummary( summary, column, header->minimum[ column ], header->maximum[ column ], header->sum[ column ] );
+        if (summary->points == 0)
+            summary->firstMS = header->firstMS;
+        summary->lastMS = header->lastMS;
+        summary->points += header->points;
+        return TRUE;
+    }
+
+    if (!decodeTimes( header, payload, context->times))
+        return TRUE;
+    for (first = 0; first < header->points && context->times[ first ] < context->fromMS; first += 1)
+        ;
+    for (last = first; last < header->points && context->times[ last ] <= context->toMS; last += 1)
+        ;
+    if (first == last)
+        return TRUE;
+
+    for (column = 0; column < HISTORY_COLUMNS; column += 1) {
+        if (!decodeColumn( header, payload, column, context->values ))
+            return TRUE;
+
+        float   minimum = context->values[ first ];
+        float   maximum = context->values[ first ];
+        double  sum = 0.0;
+        for (i = first; i < last; i += 1) {
+            if (context->values[ i ] < minimum)
+                minimum = context->values[ i ];
+            if (context->values[ i ] > maximum)
+                maximum = context->values[ i ];
+            sum += context->values[ i ];
+        }
+        addToSummary( summary, column, minimum, maximum, sum );
+    }
+
+    if (summary->points == 0)
+        summary->firstMS = context->times[ first ];
+    summary->lastMS = context->times[ last - 1 ];
+    summary->points += (last - first);
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+int     History_Summarize (history_t *history, const long long fromMS, const long long toMS, historySummary_t *summary)
+{
+    //
+    //  Min, max and sum of every column over [fromMS, toMS]. FALSE if we couldn't look
+    summaryContext_t    *context = malloc( sizeof( summaryContext_t ) );
+    if (context == NULL)
+        return FALSE;
+
+    memset( summary, '\0', sizeof( historySummary_t ) );
+    context->fromMS = fromMS;
+    context->toMS = toMS;
+    context->summary = summary;
+
+    int result = forEachBlock( history, fromMS, toMS, summarizeBlock, context );
+    free( context );
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+typedef struct  readContext {
+    long long   fromMS;
+    long long   toMS;
+    const int   *columns;
+    int         numColumns;
+    int         maxPoints;
+    int         count;
+    long long   *times;
+    float       *values;                                        // [ column ][ maxPoints ]
+    long long   nextMS;
+    long long   blockTimes[ HISTORY_BLOCK_POINTS ];
+    float       blockValues[ HISTORY_BLOCK_POINTS ];
+} readContext_t;
+
+// -----------------------------------------------------------------------------
+static
+int     readBlock (const blockHeader_t *header, const unsigned char *payload, void *argPtr)
+{
+    readContext_t   *context = (readContext_t *) argPtr;
+    uint32_t        i, first, last;
+    int             c;
+
+    if (!decodeTimes( header, payload, context->blockTimes ))
+        return TRUE;
+    for (first = 0; first < header->points && context->blockTimes[ first ] < context->fromMS; first += 1)
+        ;
+    for (last = first; last < header->points && context->blockTimes[ last ] <= context->toMS; last += 1)
+        ;
+    if (first == last)
+        return TRUE;
+
+    //
+    //  No room for all of it - say where to pick up from
+    int room = context->maxPoints - context->count;
+    if ((int) (last - first) > room) {
+        context->nextMS = context->blockTimes[ first + room ];
+        last = first + room;
+    }
+
+    for (c = 0; c < context->numColumns; c += 1) {
+        float   *out = context->values + ((long) c * context->maxPoints) + context->count;
+        if (!decodeColumn( header, payload, context->columns[ c ], context->blockValues ))
+            memset( context->blockValues, '\0', sizeof context->blockValues );
+        for (i = first; i < last; i += 1)
+            *out++ = context->blockValues[ i ];
+    }
+    for (i = first; i < last; i += 1)
+        context->times[ context->count++ ] = context->blockTimes[ i ];
+
+    return (context->nextMS == 0);
+}
+
+// -----------------------------------------------------------------------------
+int     History_Read (history_t *history, const long long fromMS, const long long toMS,
+                      const int *columns, const int numColumns, const int maxPoints,
+                      long long *times, float *values, long long *nextMS)
+{
+    //
+    //  The raw points in [fromMS, toMS], oldest first - at most maxPoints of them.
+    //  values is column by column, maxPoints apart. *nextMS is 0, or where to
+    //  start the next read if there were more. Returns the count, -1 on error
+    readContext_t   *context = malloc( sizeof( readContext_t ) );
+    if (context == NULL)
+        return -1;
+
+    context->fromMS = fromMS;
+    context->toMS = toMS;
+    context->columns = columns;
+    context->numColumns = numColumns;
+    context->maxPoints = maxPoints;
+    context->count = 0;
+    context->times = times;
+    context->values = values;
+    context->nextMS = 0;
+
+    int result = forEachBlock( history, fromMS, toMS, readBlock, context ) ? context->count : -1;
+    *nextMS = context->nextMS;
+    free( context );
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+int     History_FindColumn (const char *name)
+{
+    int i;
+
+    for (i = 0; i < HISTORY_COLUMNS; i += 1)
+        if (strcmp( fields[ i ].name, name ) == 0)
+            return i;
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+const char  *History_ColumnName (const int column)
+{
+    return fields[ column ].name;
+}
+
+// -----------------------------------------------------------------------------
+int     History_ColumnPrecision (const int column)
+{
+    return fields[ column ].precision;
+}
@@ -0,0 +1,107 @@
+/*
+ * File:   history.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ls1024b.h"
+
+
+#define HISTORY_COLUMNS             22              // see the field table in history.c
+#define HISTORY_BLOCK_BYTES         (64 * 1024)     // one block per slot in the file, the unit we map and scan
+#define HISTORY_BLOCK_POINTS        16384           // most samples in one block - normally it fills by bytes first
+#define HISTORY_DEFAULT_MEGABYTES   256
+#define HISTORY_MAX_MEGABYTES       4096
+#define HISTORY_CHECKPOINT_SECONDS  300             // how much an unsealed block can lose in a power cut
+
+//
+//  Gorilla style bit streams for the block being filled - timestamps as delta of
+//  deltas, values XOR'd with the one before. Kept in memory, written out whole
+typedef struct  bitStream {
+    unsigned char   *bytes;
+    uint32_t        bits;
+    uint32_t        capacity;                       // bytes
+} bitStream_t;
+
+typedef struct  valueEncoder {
+    bitStream_t     stream;
+    uint32_t        previous;                       // the float's bits
+    int             leading;                        // of the last XOR window we wrote, -1 = none yet
+    int             trailing;
+    float           minimum;
+    float           maximum;
+    double          sum;
+} valueEncoder_t;
+
+typedef struct  blockIndex {
+    uint64_t        generation;                     // 0 = empty slot
+    long long       firstMS;
+    long long       lastMS;
+} blockIndex_t;
+
+typedef struct  history {
+    int             fd;
+    char            path[ 512 ];
+    int             numSlots;
+    blockIndex_t    *index;                         // one per slot
+    pthread_mutex_t lock;
+
+    //
+    //  The open block
+    uint64_t        generation;
+    uint32_t        points;
+    long long       firstMS;
+    long long       previousMS;
+    long long       previousDelta;
+    bitStream_t     times;
+    valueEncoder_t  values[ HISTORY_COLUMNS ];
+    time_t          lastCheckpoint;
+    unsigned char   *image;                         // HISTORY_BLOCK_BYTES, for writing it out
+
+    long            appended;
+    long            sealed;
+    long            corrupt;
+} history_t;
+
+typedef struct  historySummary {
+    long            points;
+    long long       firstMS;
+    long long       lastMS;
+    float           minimum[ HISTORY_COLUMNS ];
+    float           maximum[ HISTORY_COLUMNS ];
+    double          sum[ HISTORY_COLUMNS ];
+} historySummary_t;
+
+
+extern  history_t   *History_Open( const char *directory, const char *name, const int megabytes );
+extern  void        History_Close( history_t *history );
+extern  void        History_Append( history_t *history, const long long timeMS,
+                                    const RealTimeData_t *rtData, const StatisticalParameters_t *stats );
+extern  void        History_Checkpoint( history_t *history );
+extern  int         History_Summarize( history_t *history, const long long fromMS, const long long toMS,
+                                       historySummary_t *summary );
+extern  int         History_Read( history_t *history, const long long fromMS, const long long toMS,
+                                  const int *columns, const int numColumns, const int maxPoints,
+                                  long long *times, float *values, long long *nextMS );
+extern  int         History_FindColumn( const char *name );
+extern  const char  *History_ColumnName( const int column );
+extern  int         History_ColumnPrecision( const int column );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HISTORY_H */
@@ -0,0 +1,334 @@
+/*
+ * File:    historyQuery.c
+ * author:  patrick conroy
+ *
+ * Answers questions about the on-device history. A request arrives on
+ * "<topTopic>/<controllerID>/QUERY" and the answer goes back on
+ * "<topTopic>/<controllerID>/HISTORY", e.g.
+ *
+ *      { "last" : 28800, "fields" : [ "batteryVoltage" ] }
+ *
+ *      { "status" : "ok", "mode" : "summary", "points" : 28800, "from" : ..., "to" : ...,
+ *        "fields" : { "batteryVoltage" : { "min" : 12.31, "max" : 14.42, "avg" : 13.05 } } }
+ *
+ * or with "mode" : "raw", the points themselves - a "timeMS" array and one
+ * array per field, at most maxPoints of them. If there were more, "truncated"
+ * is true and "next" is the "from" to ask for the rest with.
+ *
+ * Scanning months of history can take a while on a Pi, so it's done here on
+ * its own thread, never on the MQTT thread or a poller. The queue is small and
+ * fixed - when it's full a query is answered straight away with an error.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "controller.h"
+#include "commandParser.h"
+#include "history.h"
+#include "historyQuery.h"
+#include "jsonWriter.h"
+#include "timestamp.h"
+#include "mqtt.h"
+
+
+static  historyQuery_t  queue[ HISTORY_QUERY_QUEUE ];
+static  int             queueHead = 0;
+static  int             queueCount = 0;
+static  int             running = FALSE;
+static  pthread_t       queryThread;
+static  pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static  pthread_cond_t  queueCondition = PTHREAD_COND_INITIALIZER;
+
+//
+//  Rough worst cases for one number in the output, with its separator
+#define TIME_CHARACTERS     24
+#define VALUE_CHARACTERS    32
+#define RESPONSE_OVERHEAD   2048
+
+
+// -----------------------------------------------------------------------------
+static
+void    beginResponse (jsonWriter_t *writer, const controller_t *controller, const historyQuery_t *query, const char *status)
+{
+    JSON_BeginObject( writer, NULL );
+    JSON_AddString( writer, "topic", controller->historyTopic );
+    JSON_AddString( writer, "dateTime", Timestamp_Now( TIMESTAMP_ISO8601 ) );
+    if (query->correlationID[ 0 ] != '\0')
+        JSON_AddString( writer, "correlationID", query->correlationID );
+    JSON_AddString( writer, "status", status );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    publishResponse (const controller_t *controller, jsonWriter_t *writer)
+{
+    const char  *response = JSON_Finish( writer );
+    if (response == NULL) {
+        Logger_LogError( "History response for [%s] did not fit in %d bytes\n", controller->controllerID, writer->capacity );
+        return;
+    }
+    MQTT_PublishData( MQTT_CLASS_RESPONSE, controller->historyTopic, response, writer->length );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    answerWithError (const controller_t *controller, const historyQuery_t *query, const char *error)
+{
+    char            buffer[ 1024 ];
+    jsonWriter_t    writer;
+
+    Logger_LogWarning( "History query for [%s] not answered - %s\n", controller->controllerID, error );
+
+    JSON_WriterInitialize( &writer, buffer, sizeof buffer, FALSE );
+    beginResponse( &writer, controller, query, "rejected" );
+    JSON_AddString( &writer, "error", error );
+    JSON_EndObject( &writer );
+    publishResponse( controller, &writer );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    answerSummary (const controller_t *controller, const historyQuery_t *query,
+                       const long long fromMS, const long long toMS)
+{
+    historySummary_t    summary;
+    char                buffer[ RESPONSE_OVERHEAD + HISTORY_COLUMNS * 128 ];
+    jsonWriter_t        writer;
+    int                 i;
+
+    if (!History_Summarize( controller->history, fromMS, toMS, &summary )) {
+        answerWithError( controller, query, "out of memory" );
+        return;
+    }
+
+    JSON_WriterInitialize( &writer, buffer, sizeof buffer, FALSE );
+    beginResponse( &writer, controller, query, "ok" );
+    JSON_AddString( &writer, "mode", "summary" );
+    JSON_AddFixed( &writer, "from", fromMS / 1000.0, 3 );
+    JSON_AddFixed( &writer, "to", toMS / 1000.0, 3 );
+    JSON_AddInteger( &writer, "points", summary.points );
+    if (summary.points > 0) {
+        JSON_AddFixed( &writer, "first", summary.firstMS / 1000.0, 3 );
+        JSON_AddFixed( &writer, "last", summary.lastMS / 1000.0, 3 );
+
+        JSON_BeginObject( &writer, "fields" );
+        for (i = 0; i < query->numColumns; i += 1) {
+            int column = query->columns[ i ];
+            int precision = History_ColumnPrecision( column );
+
+            JSON_BeginObject( &writer, History_ColumnName( column ) );
+            JSON_AddFixed( &writer, "min", summary.minimum[ column ], precision );
+            JSON_AddFixed( &writer, "max", summary.maximum[ column ], precision );
+            JSON_AddFixed( &writer, "avg", summary.sum[ column ] / summary.points, precision + 1 );
+            JSON_EndObject( &writer );
+        }
+        JSON_EndObject( &writer );
+    }
+    JSON_EndObject( &writer );
+
+    publishResponse( controller, &writer );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    answerRaw (const controller_t *controller, const historyQuery_t *query,
+                   const long long fromMS, const long long toMS)
+{
+    //
+    //  Columns, not rows - the field names once, not once per point
+    int         maxPoints = query->maxPoints;
+    long long   *times = malloc( maxPoints * sizeof( long long ) );
+    float       *values = malloc( (size_t) maxPoints * query->numColumns * sizeof( float ) );
+    int         capacity = RESPONSE_OVERHEAD + maxPoints * (TIME_CHARACTERS + query->numColumns * VALUE_CHARACTERS);
+    char        *buffer = malloc( capacity );
+    long long   nextMS = 0;
+    int         i, c;
+
+    if (times == NULL || values == NULL || buffer == NULL) {
+        answerWithError( controller, query, "out of memory" );
+        free( times );
+        free( values );
+        free( buffer );
+        return;
+    }
+
+    int points = History_Read( controller->history, fromMS, toMS, query->columns, query->numColumns, maxPoints,
+                               times, values, &nextMS );
+    if (points < 0) {
+        answerWithError( controller, query, "out of memory" );
+    } else {
+        jsonWriter_t    writer;
+
+        JSON_WriterInitialize( &writer, buffer, capacity, FALSE );
+        beginResponse( &writer, controller, query, "ok" );
+        JSON_AddString( &writer, "mode", "raw" );
+        JSON_AddFixed( &writer, "from", fromMS / 1000.0, 3 );
+        JSON_AddFixed( &writer, "to", toMS / 1000.0, 3 );
+        JSON_AddInteger( &writer, "points", points );
+        JSON_AddBool( &writer, "truncated", (nextMS != 0) );
+        if (nextMS != 0)
+            JSON_AddFixed( &writer, "next", nextMS / 1000.0, 3 );
+
+        JSON_BeginArray( &writer, "timeMS" );
+        for (i = 0; i < points; i += 1)
+            JSON_AddInteger( &writer, NULL, times[ i ] );
+        JSON_EndArray( &writer );
+
+        JSON_BeginObject( &writer, "fields" );
+        for (c = 0; c < query->numColumns; c += 1) {
+            const float *column = values + ((long) c * maxPoints);
+            int         precision = History_ColumnPrecision( query->columns[ c ] );
+
+            JSON_BeginArray( &writer, History_ColumnName( query->columns[ c ] ) );
+            for (i = 0; i < points; i += 1)
+                JSON_AddFixed( &writer, NULL, column[ i ], precision );
+            JSON_EndArray( &writer );
+        }
+        JSON_EndObject( &writer );
+        JSON_EndObject( &writer );
+
+        publishResponse( controller, &writer );
+    }
+
+    free( times );
+    free( values );
+    free( buffer );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    answerQuery (historyQuery_t *query)
+{
+    controller_t    *controller = Controller_FindByID( query->controllerID );
+    int             i;
+
+    if (controller == NULL) {
+        Logger_LogWarning( "History query for unknown controller [%s] ignored\n", query->controllerID );
+        return;
+    }
+    if (query->error[ 0 ] != '\0') {
+        answerWithError( controller, query, query->error );
+        return;
+    }
+    if (controller->history == NULL) {
+        answerWithError( controller, query, "no history is kept for this controller" );
+        return;
+    }
+
+    //
+    //  Resolve the range against when it arrived, not when we got to it
+    long long   nowMS = query->receivedUS / 1000;
+    long long   fromMS, toMS;
+    if (query->from > 0 || query->to > 0) {
+        fromMS = (long long) (query->from * 1000.0);
+        toMS = (query->to > 0) ? (long long) (query->to * 1000.0) : nowMS;
+    } else {
+        double  seconds = (query->last > 0) ? query->last : HISTORY_QUERY_DEFAULT_SECONDS;
+        fromMS = nowMS - (long long) (seconds * 1000.0);
+        toMS = nowMS;
+    }
+
+    if (query->numColumns == 0) {
+        for (i = 0; i < HISTORY_COLUMNS; i += 1)
+            query->columns[ i ] = i;
+        query->numColumns = HISTORY_COLUMNS;
+    }
+
+    long long   startUS = Timestamp_MonotonicUS();
+    if (query->mode == QUERY_MODE_RAW)
+        answerRaw( controller, query, fromMS, toMS );
+    else
+        answerSummary( controller, query, fromMS, toMS );
+
+    Logger_LogInfo( "History query for [%s] (%s, %d fields) answered in %0.1f ms\n", controller->controllerID,
+                    (query->mode == QUERY_MODE_RAW) ? "raw" : "summary", query->numColumns,
+                    (Timestamp_MonotonicUS() - startUS) / 1000.0 );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    *queryWorker (void *argPtr)
+{
+    historyQuery_t  query;
+
+    pthread_mutex_lock( &queueLock );
+    while (running) {
+        if (queueCount == 0) {
+            pthread_cond_wait( &queueCondition, &queueLock );
+            continue;
+        }
+
+        query = queue[ queueHead ];
+        queueHead = (queueHead + 1) % HISTORY_QUERY_QUEUE;
+        queueCount -= 1;
+
+        pthread_mutex_unlock( &queueLock );
+        answerQuery( &query );
+        pthread_mutex_lock( &queueLock );
+    }
+    pthread_mutex_unlock( &queueLock );
+
+    return (void *) 0;
+}
+
+// -----------------------------------------------------------------------------
+int     HistoryQuery_Start (void)
+{
+    running = TRUE;
+    if (pthread_create( &queryThread, NULL, queryWorker, NULL ) != 0) {
+        running = FALSE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+void    HistoryQuery_Stop (void)
+{
+    if (!running)
+        return;
+
+    pthread_mutex_lock( &queueLock );
+    running = FALSE;
+    pthread_cond_signal( &queueCondition );
+    pthread_mutex_unlock( &queueLock );
+
+    pthread_join( queryThread, NULL );
+}
+
+// -----------------------------------------------------------------------------
+int     HistoryQuery_Submit (const char *controllerID, const char *payload, const int length, const long long receivedUS)
+{
+    //
+    //  Called on the MQTT thread - parse it and hand it over, nothing more. A
+    //  query that doesn't parse still goes thru, so the answer says why.
+    //  FALSE if the queue is full
+    historyQuery_t  query;
+
+    if (!CommandParser_ParseQuery( payload, length, &query, query.error, sizeof query.error ) && query.error[ 0 ] == '\0')
+        strcpy( query.error, "unreadable query" );
+    strncpy( query.controllerID, controllerID, sizeof query.controllerID - 1 );
+    query.controllerID[ sizeof query.controllerID - 1 ] = '\0';
+    query.receivedUS = receivedUS;
+
+    pthread_mutex_lock( &queueLock );
+    if (!running || queueCount == HISTORY_QUERY_QUEUE) {
+        pthread_mutex_unlock( &queueLock );
+        controller_t    *controller = Controller_FindByID( controllerID );
+        if (controller != NULL)
+            answerWithError( controller, &query, running ? "too many queries waiting - try again" : "history queries are off" );
+        return FALSE;
+    }
+
+    queue[ (queueHead + queueCount) % HISTORY_QUERY_QUEUE ] = query;
+    queueCount += 1;
+    pthread_cond_signal( &queueCondition );
+    pthread_mutex_unlock( &queueLock );
+    return TRUE;
+}
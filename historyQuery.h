@@ -0,0 +1,54 @@
+/*
+ * File:   historyQuery.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef HISTORYQUERY_H
+#define HISTORYQUERY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "history.h"
+
+
+#define HISTORY_QUERY_QUEUE             8               // waiting queries, more than that are turned away
+#define HISTORY_QUERY_DEFAULT_SECONDS   3600            // with no range, the last hour
+#define HISTORY_QUERY_DEFAULT_POINTS    1000            // raw mode
+#define HISTORY_QUERY_MAX_POINTS        10000
+
+#define QUERY_MODE_SUMMARY              0               // min, max and average of each field
+#define QUERY_MODE_RAW                  1               // the points themselves
+
+//
+//  One request from a controller's QUERY topic, e.g.
+//      { "last" : 28800, "fields" : [ "batteryVoltage", "pvArrayCurrent" ], "mode" : "summary" }
+//      { "from" : 1791500000, "to" : 1791503600, "mode" : "raw", "maxPoints" : 500, "correlationID" : "abc" }
+typedef struct  historyQuery {
+    char        controllerID[ 32 ];
+    char        correlationID[ 64 ];
+    double      from;                                   // epoch seconds, 0 = not given
+    double      to;
+    double      last;                                   // seconds back from now, 0 = not given
+    int         mode;
+    int         maxPoints;
+    int         columns[ HISTORY_COLUMNS ];
+    int         numColumns;                             // 0 = all of them
+    long long   receivedUS;
+    char        error[ 128 ];                           // couldn't parse it - we answer with this
+} historyQuery_t;
+
+
+extern  int     HistoryQuery_Start( void );
+extern  void    HistoryQuery_Stop( void );
+extern  int     HistoryQuery_Submit( const char *controllerID, const char *payload, const int length, const long long receivedUS );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HISTORYQUERY_H */
@@ -6,6 +6,7 @@
  * 
  * {
 	"dateTime" : "xx",
+	"sequence" : 1234,
 	"controllerDateTime" : "xx",
 	"isNightTime" : false,
 	"batterySOC" : 100,
@@ -22,253 +23,725 @@
 	"chargingStatus" : {
 	},
 
-	"settings" : {
-		"batteryType" : "Sealed",
- 		"localControllingModes" : 3,
-		"workingTimeLength1" : 4, 
-		"workingTimeLength2" : 5
-	},
-
 	"statistics" : {    
 		"batteryVoltage" : 12.2,
 		"batteryCurrent" : 4.3
 	}
     }
  * 
+ * With delta publishing on (-k N) a message only carries the fields that have
+ * changed since the last one that made it to MQTT - beyond a deadband, for the
+ * numbers - and sections where nothing changed are left out. Every N cycles, or
+ * on a KEYFRAME command, everything goes out. "keyframe" says which it is.
+ * 
+ * Settings, rated data and the controller's identity hardly ever change, so they
+ * aren't in DATA. Each has a retained message of its own - "settings", "ratedData"
+ * and "identity" objects on SETTINGS, RATED and IDENTITY - with no timestamp, so
+ * the same values always make the same message and it only goes out when one changes.
+ * 
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
+#include <pthread.h>
 
-#include "cjson/cJSON.h"
+#include "logger.h"
 #include "ls1024b.h"
+#include "numberFormat.h"
+#include "timestamp.h"
+#include "pollScheduler.h"
+#include "jsonWriter.h"
+#include "jsonMessage.h"
+
+//
+//  "version" in every message. 3.0: settings moved out to SETTINGS, DATA gained
+//  "sequence" and "keyframe" (and "partial") - see the README
+#define MESSAGE_VERSION         "3.0"
+
+//
+//  Every floating point field is written with a fixed number of decimal places.
+//  The defaults are in the ADD_FIXED() calls below; "-f name=digits,..." overrides them.
+#define MAX_PRECISION_FIELDS    64
+
+typedef struct  fieldPrecision {
+    char    name[ 48 ];
+    int     precision;
+} fieldPrecision_t;
+
+static  fieldPrecision_t    fieldPrecisions[ MAX_PRECISION_FIELDS ];
+static  int                 numFieldPrecisions = 0;
+static  fieldPrecision_t    precisionOverrides[ MAX_PRECISION_FIELDS ];
+static  int                 numPrecisionOverrides = 0;
+static  pthread_mutex_t     precisionLock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+//  In delta mode a number only goes out if it has moved more than its deadband
+//  since subscribers last saw it - "-d name=deadband,...". Without one, any change
+//  that shows at the precision it's written with. Everything else, any change.
+typedef struct  fieldDeadband {
+    char    name[ 48 ];
+    double  deadband;
+} fieldDeadband_t;
 
-extern char    *getCurrentDateTime( void );
+static  fieldDeadband_t     deadbandOverrides[ MAX_PRECISION_FIELDS ];
+static  int                 numDeadbandOverrides = 0;
 
 //
-//  Quickie Macros to control Floating Point Precision
-#define FP21P(x) ( (((int)((x) * 10 + .5))/10.0) )                  // Floating Point to 1 point
-#define FP22P(x) ( (((int)((x) * 100 + .5))/100.0) )                // Floating Point to 2 points
-#define FP23P(x) ( (((int)((x) * 1000 + .5))/1000.0) )              // Floating Point to 3 points
-#define FP24P(x) ( (((int)((x) * 10000 + .5))/10000.0) )            // Floating Point to 4 points
+//  Each call site below looks itself up once, the first time thru, and keeps its
+//  slot - names aren't unique ("isNormal" is in two sections), call sites are.
+//  Two pollers can get there at once, so the slot is claimed under precisionLock
+//  and the call site's static only ever goes from -1 to its slot
+typedef struct  callSite {
+    int     precisionSlot;                  // -1 == not a fixed point field
+    double  deadband;
+} callSite_t;
+
+static  callSite_t          callSites[ DELTA_MAX_FIELDS ];
+static  int                 numCallSites = 0;
+
+//
+//  One message being built. Sections are only opened when the first field goes
+//  in, so in delta mode a section where nothing changed isn't sent at all
+typedef struct  messageBuilder {
+    jsonWriter_t    *writer;
+    deltaState_t    *delta;                 // NULL == every field, every time
+    int             everything;             // a keyframe, or not in delta mode
+    const char      *section;
+    int             sectionOpen;
+} messageBuilder_t;
+
+static  int     registerField( const char *name, const int defaultPrecision );
+static  int     registerCallSite( int *site, const char *name, const int defaultPrecision );
+
+#define ADD_FIXED(name,value,digits)    do {                                        \
+            static int site = -1;                                                   \
+            int thisSite = __atomic_load_n( &site, __ATOMIC_ACQUIRE );              \
+            if (thisSite < 0)                                                       \
+                thisSite = registerCallSite( &site, (name), (digits) );             \
+            addFixed( message, thisSite, (name), (value) );                         \
+        } while (0)
+
+#define ADD_INTEGER(name,value)         do {                                        \
+            static int site = -1;                                                   \
+            int thisSite = __atomic_load_n( &site, __ATOMIC_ACQUIRE );              \
+            if (thisSite < 0)                                                       \
+                thisSite = registerCallSite( &site, (name), -1 );                   \
+            addInteger( message, thisSite, (name), (value) );                       \
+        } while (0)
+
+#define ADD_BOOL(name,value)            do {                                        \
+            static int site = -1;                                                   \
+            int thisSite = __atomic_load_n( &site, __ATOMIC_ACQUIRE );              \
+            if (thisSite < 0)                                                       \
+                thisSite = registerCallSite( &site, (name), -1 );                   \
+            addBool( message, thisSite, (name), (value) );                          \
+        } while (0)
+
+#define ADD_STRING(name,value)          do {                                        \
+            static int site = -1;                                                   \
+            int thisSite = __atomic_load_n( &site, __ATOMIC_ACQUIRE );              \
+            if (thisSite < 0)                                                       \
+                thisSite = registerCallSite( &site, (name), -1 );                   \
+            addString( message, thisSite, (name), (value) );                        \
+        } while (0)
+
+
+
 
+// -----------------------------------------------------------------------------
+static
+int registerField (const char *name, const int defaultPrecision)
+{
+    int i;
+    int slot = -1;
+
+    pthread_mutex_lock( &precisionLock );
+    for (i = 0; i < numFieldPrecisions && slot < 0; i += 1)
+        if (strcmp( fieldPrecisions[ i ].name, name ) == 0)
+            slot = i;
 
+    if (slot < 0 && numFieldPrecisions < MAX_PRECISION_FIELDS) {
+        slot = numFieldPrecisions++;
+        strncpy( fieldPrecisions[ slot ].name, name, sizeof fieldPrecisions[ slot ].name - 1 );
+        fieldPrecisions[ slot ].precision = defaultPrecision;
 
+        for (i = 0; i < numPrecisionOverrides; i += 1)
+            if (strcmp( precisionOverrides[ i ].name, name ) == 0)
+                fieldPrecisions[ slot ].precision = precisionOverrides[ i ].precision;
+    }
+    pthread_mutex_unlock( &precisionLock );
+
+    //
+    //  Table is full - share the last slot rather than crash
+    return (slot < 0) ? MAX_PRECISION_FIELDS - 1 : slot;
+}
 
 // -----------------------------------------------------------------------------
-static  char    currentDateTimeBuffer[ 80 ];
-char    *getCurrentDateTime (void)
+int JSONMessage_SetPrecisions (const char *spec)
 {
     //
-    // Something quick and dirty... Fix this later - thread safe
-    time_t  current_time;
-    struct  tm  *tmPtr;
- 
-    memset( currentDateTimeBuffer, '\0', sizeof currentDateTimeBuffer );
-    
-    /* Obtain current time as seconds elapsed since the Epoch. */
-    current_time = time( NULL );
-    if (current_time > 0) {
-        /* Convert to local time format. */
-        tmPtr = localtime( &current_time );
- 
-        if (tmPtr != NULL) {
-            strftime( currentDateTimeBuffer,
-                    sizeof currentDateTimeBuffer,
-                    "%FT%T%z",                           // ISO 8601 Format
-                    tmPtr );
-        }
+    //  Spec looks like "pvArrayVoltage=3,battery=2". Call before the first message is built.
+    //  Returns FALSE on a bad spec.
+    char    buffer[ 512 ];
+    char    *savePtr = NULL;
+
+    strncpy( buffer, spec, sizeof buffer - 1 );
+    buffer[ sizeof buffer - 1 ] = '\0';
+
+    char    *token = strtok_r( buffer, ",", &savePtr );
+    while (token != NULL) {
+        char    *equals = strchr( token, '=' );
+        if (equals == NULL || numPrecisionOverrides >= MAX_PRECISION_FIELDS)
+            return FALSE;
+        *equals = '\0';
+
+        int digits = atoi( equals + 1 );
+        if (digits < 0 || digits > FORMAT_MAX_PRECISION)
+            return FALSE;
+
+        fieldPrecision_t    *override = &precisionOverrides[ numPrecisionOverrides++ ];
+        strncpy( override->name, token, sizeof override->name - 1 );
+        override->precision = digits;
+
+        token = strtok_r( NULL, ",", &savePtr );
     }
-    
-    return &currentDateTimeBuffer[ 0 ];
+
+    return TRUE;
 }
 
 // -----------------------------------------------------------------------------
-char *createJSONMessage (modbus_t *ctx, const char *topic, const RatedData_t *ratedData, 
-                        const RealTimeData_t *rtData, const RealTimeStatus_t *rtStatusData, 
-                        const Settings_t *setData, const StatisticalParameters_t *stats)
+static
+int registerCallSite (int *site, const char *name, const int defaultPrecision)
 {
     //
-    //  Dave Gamble's C library to create JSON
-    cJSON *message = cJSON_CreateObject();
+    //  *site is the call site's static. Whoever gets the lock first claims a slot,
+    //  anyone who was waiting behind them just picks it up
+    int precisionSlot = (defaultPrecision >= 0) ? registerField( name, defaultPrecision ) : -1;
+    int i;
 
-    cJSON_AddStringToObject( message, "topic", topic );
-    cJSON_AddStringToObject( message, "version", "2.0" );
-    
-    
+    pthread_mutex_lock( &precisionLock );
+    int claimed = *site;
+    if (claimed < 0) {
+        //
+        //  Table is full - share the last slot rather than crash. That field is just sent more often
+        claimed = (numCallSites < DELTA_MAX_FIELDS) ? numCallSites++ : DELTA_MAX_FIELDS - 1;
+        callSites[ claimed ].precisionSlot = precisionSlot;
+        callSites[ claimed ].deadband = 0.0;
+        for (i = 0; i < numDeadbandOverrides; i += 1)
+            if (strcmp( deadbandOverrides[ i ].name, name ) == 0)
+                callSites[ claimed ].deadband = deadbandOverrides[ i ].deadband;
+
+        __atomic_store_n( site, claimed, __ATOMIC_RELEASE );
+    }
+    pthread_mutex_unlock( &precisionLock );
+    return claimed;
+}
+
+// -----------------------------------------------------------------------------
+int JSONMessage_SetDeadbands (const char *spec)
+{
+    //
+    //  Spec looks like "pvArrayVoltage=0.1,batterySOC=1". Call before the first message is built.
+    //  Returns FALSE on a bad spec.
+    char    buffer[ 512 ];
+    char    *savePtr = NULL;
+    char    *end;
+
+    strncpy( buffer, spec, sizeof buffer - 1 );
+    buffer[ sizeof buffer - 1 ] = '\0';
+
+    char    *token = strtok_r( buffer, ",", &savePtr );
+    while (token != NULL) {
+        char    *equals = strchr( token, '=' );
+        if (equals == NULL || numDeadbandOverrides >= MAX_PRECISION_FIELDS)
+            return FALSE;
+        *equals = '\0';
+
+        double  deadband = strtod( equals + 1, &end );
+        if (end == equals + 1 || *end != '\0' || deadband < 0.0)
+            return FALSE;
+
+        fieldDeadband_t *override = &deadbandOverrides[ numDeadbandOverrides++ ];
+        strncpy( override->name, token, sizeof override->name - 1 );
+        override->deadband = deadband;
+
+        token = strtok_r( NULL, ",", &savePtr );
+    }
+
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+void    JSONMessage_InitializeDelta (deltaState_t *delta, const int keyframeCycles)
+{
+    memset( delta, '\0', sizeof( deltaState_t ) );
+    delta->keyframeCycles = keyframeCycles;
+    delta->sinceKeyframe = keyframeCycles;              // the first one is always in full
+}
+
+// -----------------------------------------------------------------------------
+void    JSONMessage_RequestKeyframe (deltaState_t *delta)
+{
+    //
+    //  From the command thread - the poller picks it up on its next full message
+    __atomic_store_n( &delta->keyframeRequested, TRUE, __ATOMIC_RELAXED );
+}
+
+// -----------------------------------------------------------------------------
+void    JSONMessage_CommitDelta (deltaState_t *delta)
+{
+    //
+    //  The message createJSONMessage() just built was handed to MQTT - it's now what
+    //  the subscribers have. If this isn't called, the same changes go out in the next one
+    int i;
+
+    if (delta->keyframeCycles <= 0)
+        return;
+
+    for (i = 0; i < DELTA_MAX_FIELDS; i += 1)
+        if (delta->written[ i ])
+            delta->published[ i ] = delta->candidate[ i ];
+
+    if (delta->buildingKeyframe) {
+        delta->sinceKeyframe = 1;
+        __atomic_store_n( &delta->keyframeRequested, FALSE, __ATOMIC_RELAXED );
+        delta->keyframes += 1;
+    } else if (delta->buildingFull) {
+        delta->sinceKeyframe += 1;
+    }
+    delta->messages += 1;
+    delta->fieldsConsidered += delta->buildingConsidered;
+    delta->fieldsSent += delta->buildingSent;
+}
+
+// -----------------------------------------------------------------------------
+uint32_t    JSONMessage_Hash (const char *text)
+{
     //
-    //  cJSON uses a "%1.15g" format for number formatting which means we can get some
-    //  very large FP numbers in the output.  Let's round and truncate before we have cJSON
-    //  format the numbers.
+    //  FNV-1a - what a field (or a whole state message) looked like, so we can tell if it changed
+    uint32_t    hash = 2166136261u;
+
+    while (*text != '\0') {
+        hash ^= (unsigned char) *text++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     shouldWrite (messageBuilder_t *message, const int site, const int isNumber, const double value, const char *text)
+{
+    //
+    //  text is the field as it would be written. Opens the section if it's going in
+    deltaState_t    *delta = message->delta;
+
+    if (delta != NULL) {
+        deltaField_t    *last = &delta->published[ site ];
+        uint32_t        hash = JSONMessage_Hash( text );
+        int             write = (message->everything || !last->valid);
+
+        if (!write && isNumber && callSites[ site ].deadband > 0.0)
+            write = (fabs( value - last->value ) > callSites[ site ].deadband);
+        else if (!write)
+            write = (hash != last->hash);
+
+        delta->buildingConsidered += 1;
+        if (!write)
+            return FALSE;
+
+        delta->candidate[ site ].valid = TRUE;
+        delta->candidate[ site ].value = value;
+        delta->candidate[ site ].hash = hash;
+        delta->written[ site ] = TRUE;
+        delta->buildingSent += 1;
+    }
+
+    if (message->section != NULL && !message->sectionOpen) {
+        JSON_BeginObject( message->writer, message->section );
+        message->sectionOpen = TRUE;
+    }
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    addFixed (messageBuilder_t *message, const int site, const char *name, const double value)
+{
+    int     precision = fieldPrecisions[ callSites[ site ].precisionSlot ].precision;
+    char    text[ FORMAT_MAX_LENGTH ] = "";
+
+    if (message->delta != NULL && Format_Fixed( text, value, precision ) < 0)
+        snprintf( text, sizeof text, "%g", value );
+    if (shouldWrite( message, site, TRUE, value, text ))
+        JSON_AddFixed( message->writer, name, value, precision );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    addInteger (messageBuilder_t *message, const int site, const char *name, const long long value)
+{
+    char    text[ FORMAT_MAX_LENGTH ] = "";
+
+    if (message->delta != NULL)
+        Format_Integer( text, value );
+    if (shouldWrite( message, site, TRUE, (double) value, text ))
+        JSON_AddInteger( message->writer, name, value );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    addBool (messageBuilder_t *message, const int site, const char *name, const int value)
+{
+    if (shouldWrite( message, site, FALSE, value ? 1.0 : 0.0, value ? "true" : "false" ))
+        JSON_AddBool( message->writer, name, value );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    addString (messageBuilder_t *message, const int site, const char *name, const char *value)
+{
+    if (shouldWrite( message, site, FALSE, 0.0, value ))
+        JSON_AddString( message->writer, name, value );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    beginSection (messageBuilder_t *message, const char *name)
+{
+    message->section = name;
+    message->sectionOpen = FALSE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    endSection (messageBuilder_t *message)
+{
+    if (message->sectionOpen)
+        JSON_EndObject( message->writer );
+    message->section = NULL;
+    message->sectionOpen = FALSE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    addRealTimeData (messageBuilder_t *message, const int nightTime, const RealTimeData_t *rtData, const Settings_t *setData)
+{
     //
-    cJSON_AddStringToObject( message, "dateTime", getCurrentDateTime() );
-    cJSON_AddStringToObject( message, "controllerDateTime", setData->realtimeClock );
-    cJSON_AddBoolToObject( message, "isNightTime", isNightTime( ctx ) );
-    cJSON_AddNumberToObject( message, "batterySOC", rtData->batterySOC );
-    cJSON_AddNumberToObject( message, "pvArrayVoltage", FP22P( rtData->pvArrayVoltage ) );
-    cJSON_AddNumberToObject( message, "pvArrayCurrent", FP22P( rtData->pvArrayCurrent ) );
-    cJSON_AddNumberToObject( message, "loadVoltage", FP22P( rtData->loadVoltage ) );
-    cJSON_AddNumberToObject( message, "loadCurrent", FP22P( rtData->loadCurrent ) );
+    //  Top level values - what the SCC is doing right now
+    ADD_STRING( "controllerDateTime", setData->realtimeClock );
+    ADD_BOOL( "isNightTime", nightTime );
+    ADD_INTEGER( "batterySOC", rtData->batterySOC );
+    ADD_FIXED( "pvArrayVoltage", rtData->pvArrayVoltage, 2 );
+    ADD_FIXED( "pvArrayCurrent", rtData->pvArrayCurrent, 2 );
+    ADD_FIXED( "loadVoltage", rtData->loadVoltage, 2 );
+    ADD_FIXED( "loadCurrent", rtData->loadCurrent, 2 );
 
     //
     //  Temperatures - nested object
-    cJSON *temperatures = cJSON_CreateObject();
-    cJSON_AddStringToObject( temperatures, "unit", "Fahrenheit" );
-    cJSON_AddNumberToObject( temperatures, "battery", FP21P( rtData->batteryTemp ) );
-    cJSON_AddNumberToObject( temperatures, "case", FP21P( rtData->caseTemp ) );
-    cJSON_AddNumberToObject( temperatures, "remoteSensor", FP21P( rtData->remoteBatteryTemperature ) ); 
-    cJSON_AddItemToObject( message, "temperatures", temperatures );
-    
+    beginSection( message, "temperatures" );
+    ADD_STRING( "unit", "Fahrenheit" );
+    ADD_FIXED( "battery", rtData->batteryTemp, 1 );
+    ADD_FIXED( "case", rtData->caseTemp, 1 );
+    ADD_FIXED( "remoteSensor", rtData->remoteBatteryTemperature, 1 ); 
+    endSection( message );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    addRealTimeStatus (messageBuilder_t *message, const RealTimeStatus_t *rtStatusData)
+{
+    //
+    //  Battery, charging and discharging status objects
     //
     //  batteryStatus - nested object
-    cJSON *batteryStatus = cJSON_CreateObject();
-    cJSON_AddStringToObject( batteryStatus, "voltage", rtStatusData->batteryStatusVoltage );
-    cJSON_AddStringToObject( batteryStatus, "temperature", rtStatusData->batteryStatusTemperature );
-    cJSON_AddStringToObject( batteryStatus, "innerResistance", rtStatusData->batteryInnerResistance );
-    cJSON_AddStringToObject( batteryStatus, "identification", rtStatusData->batteryCorrectIdentification );
-    cJSON_AddItemToObject( message, "batteryStatus", batteryStatus );
+    beginSection( message, "batteryStatus" );
+    ADD_STRING( "voltage", rtStatusData->batteryStatusVoltage );
+    ADD_STRING( "temperature", rtStatusData->batteryStatusTemperature );
+    ADD_STRING( "innerResistance", rtStatusData->batteryInnerResistance );
+    ADD_STRING( "identification", rtStatusData->batteryCorrectIdentification );
+    endSection( message );
 
     //
     //  chargingStatus - nested object
-    cJSON *chargingStatus = cJSON_CreateObject();
-    cJSON_AddStringToObject( chargingStatus, "status", rtStatusData->chargingStatus );
-    cJSON_AddBoolToObject( chargingStatus, "isNormal", rtStatusData->chargingStatusNormal );
-    cJSON_AddBoolToObject( chargingStatus, "isRunning", rtStatusData->chargingStatusRunning );
-    cJSON_AddStringToObject( chargingStatus, "inputVoltage", rtStatusData->chargingInputVoltageStatus );
-    cJSON_AddBoolToObject( chargingStatus, "MOSFETShort", rtStatusData->chargingMOSFETShort );
-    cJSON_AddBoolToObject( chargingStatus, "someMOSFETShort",rtStatusData->someMOSFETShort );
-    cJSON_AddBoolToObject( chargingStatus, "antiReverseMOSFETShort", rtStatusData->antiReverseMOSFETShort );
-    cJSON_AddBoolToObject( chargingStatus, "inputIsOverCurrent", rtStatusData->inputIsOverCurrent );
-    cJSON_AddBoolToObject( chargingStatus, "inputIsOverPressure", rtStatusData->inputOverpressure );
-    cJSON_AddBoolToObject( chargingStatus, "loadIsOverCurrent", rtStatusData->loadIsOverCurrent );
-    cJSON_AddBoolToObject( chargingStatus, "loadIsShort", rtStatusData->loadIsShort );
-    cJSON_AddBoolToObject( chargingStatus, "loadMOSFETIsShort", rtStatusData->loadMOSFETIsShort );
-    cJSON_AddBoolToObject( chargingStatus, "pvInputIsShort", rtStatusData->pvInputIsShort );
-    cJSON_AddItemToObject( message, "chargingStatus", chargingStatus );
+    beginSection( message, "chargingStatus" );
+    ADD_STRING( "status", rtStatusData->chargingStatus );
+    ADD_BOOL( "isNormal", rtStatusData->chargingStatusNormal );
+    ADD_BOOL( "isRunning", rtStatusData->chargingStatusRunning );
+    ADD_STRING( "inputVoltage", rtStatusData->chargingInputVoltageStatus );
+    ADD_BOOL( "MOSFETShort", rtStatusData->chargingMOSFETShort );
+    ADD_BOOL( "someMOSFETShort",rtStatusData->someMOSFETShort );
+    ADD_BOOL( "antiReverseMOSFETShort", rtStatusData->antiReverseMOSFETShort );
+    ADD_BOOL( "inputIsOverCurrent", rtStatusData->inputIsOverCurrent );
+    ADD_BOOL( "inputIsOverPressure", rtStatusData->inputOverpressure );
+    ADD_BOOL( "loadIsOverCurrent", rtStatusData->loadIsOverCurrent );
+    ADD_BOOL( "loadIsShort", rtStatusData->loadIsShort );
+    ADD_BOOL( "loadMOSFETIsShort", rtStatusData->loadMOSFETIsShort );
+    ADD_BOOL( "pvInputIsShort", rtStatusData->pvInputIsShort );
+    endSection( message );
         
     //
     //  dischargingStatus - nested object
-    cJSON *dischargingStatus = cJSON_CreateObject();
-    cJSON_AddBoolToObject( dischargingStatus, "isNormal", rtStatusData->dischargingStatusNormal );
-    cJSON_AddBoolToObject( dischargingStatus, "isRunning", rtStatusData->dischargingStatusRunning );
-    cJSON_AddStringToObject( dischargingStatus, "inputVoltageStatus", rtStatusData->dischargingInputVoltageStatus );
-    cJSON_AddStringToObject( dischargingStatus, "outputPower", rtStatusData->dischargingOutputPower );
-    cJSON_AddBoolToObject( dischargingStatus, "shortCircuit", rtStatusData->dischargingShortCircuit );
-    cJSON_AddBoolToObject( dischargingStatus, "unableToDischarge", rtStatusData->unableToDischarge );
-    cJSON_AddBoolToObject( dischargingStatus, "unableToStopDischarging", rtStatusData->unableToStopDischarging );
-    cJSON_AddBoolToObject( dischargingStatus, "outputVoltageAbnormal", rtStatusData->outputVoltageAbnormal );
-    cJSON_AddBoolToObject( dischargingStatus, "inputOverpressure", rtStatusData->outputOverpressure );
-    cJSON_AddBoolToObject( dischargingStatus, "highVoltageSideShort", rtStatusData->highVoltageSideShort );
-    cJSON_AddBoolToObject( dischargingStatus, "boostOverpressure", rtStatusData->boostOverpressure );
-    cJSON_AddBoolToObject( dischargingStatus, "outputOverpressure", rtStatusData->outputOverpressure );
-    cJSON_AddItemToObject( message, "dischargingStatus", dischargingStatus );
+    beginSection( message, "dischargingStatus" );
+    ADD_BOOL( "isNormal", rtStatusData->dischargingStatusNormal );
+    ADD_BOOL( "isRunning", rtStatusData->dischargingStatusRunning );
+    ADD_STRING( "inputVoltageStatus", rtStatusData->dischargingInputVoltageStatus );
+    ADD_STRING( "outputPower", rtStatusData->dischargingOutputPower );
+    ADD_BOOL( "shortCircuit", rtStatusData->dischargingShortCircuit );
+    ADD_BOOL( "unableToDischarge", rtStatusData->unableToDischarge );
+    ADD_BOOL( "unableToStopDischarging", rtStatusData->unableToStopDischarging );
+    ADD_BOOL( "outputVoltageAbnormal", rtStatusData->outputVoltageAbnormal );
+    ADD_BOOL( "inputOverpressure", rtStatusData->outputOverpressure );
+    ADD_BOOL( "highVoltageSideShort", rtStatusData->highVoltageSideShort );
+    ADD_BOOL( "boostOverpressure", rtStatusData->boostOverpressure );
+    ADD_BOOL( "outputOverpressure", rtStatusData->outputOverpressure );
+    endSection( message );
+}
 
+// -----------------------------------------------------------------------------
+static
+void    addSettings (messageBuilder_t *message, const Settings_t *setData)
+{
+    //
+    //  Everything from the holding registers
     //
     //  settings - nested object
-    cJSON *settings = cJSON_CreateObject();
-    cJSON_AddStringToObject( settings, "batteryType", setData->batteryType );
-    cJSON_AddNumberToObject( settings, "batteryCapacity", setData->batteryCapacity );
-    cJSON_AddNumberToObject( settings, "tempCompensationCoeff", FP21P( setData->tempCompensationCoeff ) );
+    beginSection( message, "settings" );
+    ADD_STRING( "batteryType", setData->batteryType );
+    ADD_INTEGER( "batteryCapacity", setData->batteryCapacity );
+    ADD_FIXED( "tempCompensationCoeff", setData->tempCompensationCoeff, 1 );
     
-    cJSON_AddNumberToObject( settings, "highVoltageDisconnect", FP21P( setData->highVoltageDisconnect ) );
-    cJSON_AddNumberToObject( settings, "chargingLimitVoltage", FP21P( setData->chargingLimitVoltage ) );
-    cJSON_AddNumberToObject( settings, "overVoltageReconnect", FP21P( setData->overVoltageReconnect ) );
+    ADD_FIXED( "highVoltageDisconnect", setData->highVoltageDisconnect, 1 );
+    ADD_FIXED( "chargingLimitVoltage", setData->chargingLimitVoltage, 1 );
+    ADD_FIXED( "overVoltageReconnect", setData->overVoltageReconnect, 1 );
     
-    cJSON_AddNumberToObject( settings, "equalizationVoltage", FP21P( setData->equalizationVoltage ) );
-    cJSON_AddNumberToObject( settings, "boostVoltage", FP21P( setData->boostVoltage ) );
-    cJSON_AddNumberToObject( settings, "floatVoltage", FP21P( setData->floatVoltage ) );
+    ADD_FIXED( "equalizationVoltage", setData->equalizationVoltage, 1 );
+    ADD_FIXED( "boostVoltage", setData->boostVoltage, 1 );
+    ADD_FIXED( "floatVoltage", setData->floatVoltage, 1 );
     
-    cJSON_AddNumberToObject( settings, "boostReconnectVoltage", FP21P( setData->boostReconnectVoltage ) );
-    cJSON_AddNumberToObject( settings, "lowVoltageReconnect", FP21P( setData->lowVoltageReconnect ) );
-    cJSON_AddNumberToObject( settings, "underVoltageRecover", FP21P( setData->underVoltageRecover ) );
-    cJSON_AddNumberToObject( settings, "underVoltageWarning", FP21P( setData->underVoltageWarning ) );
-    cJSON_AddNumberToObject( settings, "lowVoltageDisconnect", FP21P( setData->lowVoltageDisconnect ) );
+    ADD_FIXED( "boostReconnectVoltage", setData->boostReconnectVoltage, 1 );
+    ADD_FIXED( "lowVoltageReconnect", setData->lowVoltageReconnect, 1 );
+    ADD_FIXED( "underVoltageRecover", setData->underVoltageRecover, 1 );
+    ADD_FIXED( "underVoltageWarning", setData->underVoltageWarning, 1 );
+    ADD_FIXED( "lowVoltageDisconnect", setData->lowVoltageDisconnect, 1 );
     
-    cJSON_AddNumberToObject( settings, "dischargingLimitVoltage", FP21P( setData->dischargingLimitVoltage ) );
-    //cJSON_AddNumberToObject( settings, "equalizationChargingCycle", setData->equalizationChargingCycle );
+    ADD_FIXED( "dischargingLimitVoltage", setData->dischargingLimitVoltage, 1 );
+    //JSON_AddNumber( writer, "equalizationChargingCycle", setData->equalizationChargingCycle );
     
-    cJSON_AddNumberToObject( settings, "batteryTempWarningUpperLimit", FP21P( setData->batteryTempWarningUpperLimit ) );
-    cJSON_AddNumberToObject( settings, "batteryTempWarningLowerLimit", FP21P( setData->batteryTempWarningLowerLimit ) );
+    ADD_FIXED( "batteryTempWarningUpperLimit", setData->batteryTempWarningUpperLimit, 1 );
+    ADD_FIXED( "batteryTempWarningLowerLimit", setData->batteryTempWarningLowerLimit, 1 );
  
-    cJSON_AddNumberToObject( settings, "controllerInnerTempUpperLimit", FP21P( setData->controllerInnerTempUpperLimit ) );
-    cJSON_AddNumberToObject( settings, "controllerInnerTempUpperLimitRecover", FP21P( setData->controllerInnerTempUpperLimitRecover ) );
+    ADD_FIXED( "controllerInnerTempUpperLimit", setData->controllerInnerTempUpperLimit, 1 );
+    ADD_FIXED( "controllerInnerTempUpperLimitRecover", setData->controllerInnerTempUpperLimitRecover, 1 );
     
-    cJSON_AddNumberToObject( settings, "powerComponentTempUpperLimit", FP21P( setData->powerComponentTempUpperLimit ) );
-    cJSON_AddNumberToObject( settings, "powerComponentTempUpperLimitRecover", FP21P( setData->powerComponentTempUpperLimitRecover ) );
-    //cJSON_AddNumberToObject( settings, "lineImpedence", setData->lineImpedence ) );
+    ADD_FIXED( "powerComponentTempUpperLimit", setData->powerComponentTempUpperLimit, 1 );
+    ADD_FIXED( "powerComponentTempUpperLimitRecover", setData->powerComponentTempUpperLimitRecover, 1 );
+    //JSON_AddNumber( writer, "lineImpedence", setData->lineImpedence ) );
     
-    cJSON_AddNumberToObject( settings, "daytimeThresholdVoltage", FP21P( setData->daytimeThresholdVoltage ) );
-    cJSON_AddNumberToObject( settings, "lightSignalStartupTime", setData->lightSignalStartupTime );
-    cJSON_AddNumberToObject( settings, "lighttimeThresholdVoltage", FP21P( setData->lighttimeThresholdVoltage ) );
-    cJSON_AddNumberToObject( settings, "lightSignalCloseDelayTime", setData->lightSignalCloseDelayTime );
-    cJSON_AddNumberToObject( settings, "localControllingModes", setData->localControllingModes );
+    ADD_FIXED( "daytimeThresholdVoltage", setData->daytimeThresholdVoltage, 1 );
+    ADD_INTEGER( "lightSignalStartupTime", setData->lightSignalStartupTime );
+    ADD_FIXED( "lighttimeThresholdVoltage", setData->lighttimeThresholdVoltage, 1 );
+    ADD_INTEGER( "lightSignalCloseDelayTime", setData->lightSignalCloseDelayTime );
+    ADD_INTEGER( "localControllingModes", setData->localControllingModes );
 
 
     char    dtBuffer[ 32 ];
     snprintf( dtBuffer, sizeof dtBuffer, "%02d:%02d", (setData->workingTimeLength1 >> 8), (setData->workingTimeLength1 & 0XFF) );
-    cJSON_AddStringToObject( settings, "workingTimeLength1", dtBuffer );
+    ADD_STRING( "workingTimeLength1", dtBuffer );
 
     snprintf( dtBuffer, sizeof dtBuffer, "%02d:%02d", (setData->workingTimeLength2 >> 8), (setData->workingTimeLength2 & 0XFF) );
-    cJSON_AddStringToObject( settings, "workingTimeLength2", dtBuffer );
+    ADD_STRING( "workingTimeLength2", dtBuffer );
     
     
     snprintf( dtBuffer, sizeof dtBuffer, "%02d:%02d:%02d", setData->turnOnTiming1_hours, setData->turnOnTiming1_minutes, setData->turnOnTiming1_seconds );
-    cJSON_AddStringToObject( settings, "turnOnTiming1", dtBuffer );
+    ADD_STRING( "turnOnTiming1", dtBuffer );
             
     snprintf( dtBuffer, sizeof dtBuffer, "%02d:%02d:%02d", setData->turnOffTiming1_hours, setData->turnOffTiming1_minutes, setData->turnOffTiming1_seconds );
-    cJSON_AddStringToObject( settings, "turnOffTiming1", dtBuffer );
+    ADD_STRING( "turnOffTiming1", dtBuffer );
             
     snprintf( dtBuffer, sizeof dtBuffer, "%02d:%02d:%02d", setData->turnOnTiming2_hours, setData->turnOnTiming2_minutes, setData->turnOnTiming2_seconds );
-    cJSON_AddStringToObject( settings, "turnOnTiming2", dtBuffer );
+    ADD_STRING( "turnOnTiming2", dtBuffer );
             
     snprintf( dtBuffer, sizeof dtBuffer, "%02d:%02d:%02d", setData->turnOffTiming2_hours, setData->turnOffTiming2_minutes, setData->turnOffTiming2_seconds );
-    cJSON_AddStringToObject( settings, "turnOffTiming2", dtBuffer );
+    ADD_STRING( "turnOffTiming2", dtBuffer );
 
     snprintf( dtBuffer, sizeof dtBuffer, "%02d:%02d", ((setData->lengthOfNight & 0xFF00) >> 8), (setData->lengthOfNight & 0x00FF) ); 
-    cJSON_AddStringToObject( settings, "lengthOfNight", dtBuffer );
+    ADD_STRING( "lengthOfNight", dtBuffer );
     
     
 
-    cJSON_AddStringToObject( settings, "batteryRatedVoltageCode", (setData->batteryRatedVoltageCode == 0) ? "Auto" : ( (setData->batteryRatedVoltageCode == 1) ? "12V" : "24V") );
-    cJSON_AddStringToObject( settings, "loadTimingControlSelection", (setData->batteryRatedVoltageCode == 0) ? "1 Timer" : "2 Timers" );
-    cJSON_AddStringToObject( settings, "defaultLoadOnOffManualMode", (setData->batteryRatedVoltageCode == 0) ? "Off" : "On" );
+    ADD_STRING( "batteryRatedVoltageCode", (setData->batteryRatedVoltageCode == 0) ? "Auto" : ( (setData->batteryRatedVoltageCode == 1) ? "12V" : "24V") );
+    ADD_STRING( "loadTimingControlSelection", (setData->batteryRatedVoltageCode == 0) ? "1 Timer" : "2 Timers" );
+    ADD_STRING( "defaultLoadOnOffManualMode", (setData->batteryRatedVoltageCode == 0) ? "Off" : "On" );
     
-    cJSON_AddNumberToObject( settings, "equalizeDuration", setData->equalizeDuration );
-    cJSON_AddNumberToObject( settings, "boostDuration", setData->boostDuration );
-    cJSON_AddNumberToObject( settings, "dischargingPercentage", setData->dischargingPercentage );
-    cJSON_AddNumberToObject( settings, "chargingPercentage", setData->chargingPercentage );
-    cJSON_AddNumberToObject( settings, "batteryManagementMode", setData->batteryManagementMode );
+    ADD_INTEGER( "equalizeDuration", setData->equalizeDuration );
+    ADD_INTEGER( "boostDuration", setData->boostDuration );
+    ADD_INTEGER( "dischargingPercentage", setData->dischargingPercentage );
+    ADD_INTEGER( "chargingPercentage", setData->chargingPercentage );
+    ADD_INTEGER( "batteryManagementMode", setData->batteryManagementMode );
      
-    cJSON_AddItemToObject( message, "settings", settings );
+    endSection( message );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    addRatedData (messageBuilder_t *message, const RatedData_t *ratedData)
+{
+    //
+    //  What the SCC is built for - only changes if it's swapped out
+    //
+    //  ratedData - nested object
+    beginSection( message, "ratedData" );
+    ADD_FIXED( "pvArrayRatedVoltage", ratedData->pvArrayRatedVoltage, 2 );
+    ADD_FIXED( "pvArrayRatedCurrent", ratedData->pvArrayRatedCurrent, 2 );
+    ADD_FIXED( "pvArrayRatedPower", ratedData->pvArrayRatedPower, 2 );
+    ADD_FIXED( "batteryRatedVoltage", ratedData->batteryRatedVoltage, 2 );
+    ADD_FIXED( "batteryRatedCurrent", ratedData->batteryRatedCurrent, 2 );
+    ADD_FIXED( "batteryRatedPower", ratedData->batteryRatedPower, 2 );
+    ADD_STRING( "chargingMode", ratedData->chargingMode );
+    ADD_FIXED( "ratedCurrentOfLoad", ratedData->ratedCurrentOfLoad, 2 );
+    endSection( message );
+}
 
+// -----------------------------------------------------------------------------
+static
+void    addStatistics (messageBuilder_t *message, const StatisticalParameters_t *stats)
+{
+    //
+    //  Daily/monthly/yearly counters
     //
     //  statistics - nested object
-    cJSON *statistics = cJSON_CreateObject();
-    cJSON_AddNumberToObject( statistics, "maximumInputVoltageToday", FP22P( stats->maximumInputVoltageToday ) );
-    cJSON_AddNumberToObject( statistics, "minimumInputVoltageToday", FP22P( stats->minimumInputVoltageToday ) );
-    cJSON_AddNumberToObject( statistics, "maximumBatteryVoltageToday", FP22P( stats->maximumBatteryVoltageToday ) );
-    cJSON_AddNumberToObject( statistics, "minimumBatteryVoltageToday", FP22P( stats->minimumBatteryVoltageToday ) );
-    cJSON_AddNumberToObject( statistics, "consumedEnergyToday", FP22P( stats->consumedEnergyToday ) );
-    cJSON_AddNumberToObject( statistics, "consumedEnergyMonth", FP22P( stats->consumedEnergyMonth ) );
-    cJSON_AddNumberToObject( statistics, "consumedEnergyYear", FP22P( stats->consumedEnergyYear ) );
-    cJSON_AddNumberToObject( statistics, "totalConsumedEnergy", FP22P( stats->totalConsumedEnergy ) );
-    cJSON_AddNumberToObject( statistics, "generatedEnergyToday", FP22P( stats->generatedEnergyToday ) );
-    cJSON_AddNumberToObject( statistics, "generatedEnergyMonth", FP22P( stats->generatedEnergyMonth ) );
-    cJSON_AddNumberToObject( statistics, "generatedEnergyYear", FP22P( stats->generatedEnergyYear ) );
-    cJSON_AddNumberToObject( statistics, "totalGeneratedEnergy", FP22P( stats->totalGeneratedEnergy ) );
-    cJSON_AddNumberToObject( statistics, "batteryVoltage", FP22P( stats->batteryVoltage ) );
-    cJSON_AddNumberToObject( statistics, "batteryCurrent", FP21P( stats->batteryCurrent ) );
-    cJSON_AddItemToObject( message, "statistics", statistics );
+    beginSection( message, "statistics" );
+    ADD_FIXED( "maximumInputVoltageToday", stats->maximumInputVoltageToday, 2 );
+    ADD_FIXED( "minimumInputVoltageToday", stats->minimumInputVoltageToday, 2 );
+    ADD_FIXED( "maximumBatteryVoltageToday", stats->maximumBatteryVoltageToday, 2 );
+    ADD_FIXED( "minimumBatteryVoltageToday", stats->minimumBatteryVoltageToday, 2 );
+    ADD_FIXED( "consumedEnergyToday", stats->consumedEnergyToday, 2 );
+    ADD_FIXED( "consumedEnergyMonth", stats->consumedEnergyMonth, 2 );
+    ADD_FIXED( "consumedEnergyYear", stats->consumedEnergyYear, 2 );
+    ADD_FIXED( "totalConsumedEnergy", stats->totalConsumedEnergy, 2 );
+    ADD_FIXED( "generatedEnergyToday", stats->generatedEnergyToday, 2 );
+    ADD_FIXED( "generatedEnergyMonth", stats->generatedEnergyMonth, 2 );
+    ADD_FIXED( "generatedEnergyYear", stats->generatedEnergyYear, 2 );
+    ADD_FIXED( "totalGeneratedEnergy", stats->totalGeneratedEnergy, 2 );
+    ADD_FIXED( "batteryVoltage", stats->batteryVoltage, 2 );
+    ADD_FIXED( "batteryCurrent", stats->batteryCurrent, 1 );
+    endSection( message );
+}
+
+// -----------------------------------------------------------------------------
+const char *createJSONMessage (jsonWriter_t *writer, const int nightTime, const char *topic, const int sections, const long long sequence,
+                        deltaState_t *delta,
+                        const RealTimeData_t *rtData, const RealTimeStatus_t *rtStatusData, 
+                        const Settings_t *setData, const StatisticalParameters_t *stats)
+{
+    //
+    //  Stream it straight into the caller's buffer - field order matters to some consumers, keep it.
+    //  'sections' is a mask of poll blocks. Anything less than all of DATA_BLOCKS_MASK is an
+    //  out-of-cycle update (e.g. right after a command) and is flagged "partial".
+    //  With delta publishing on, only what changed goes in - see JSONMessage_CommitDelta()
+    messageBuilder_t    message = { writer, NULL, TRUE, NULL, FALSE };
+    int                 full = ((sections & DATA_BLOCKS_MASK) == DATA_BLOCKS_MASK);
+
+    if (delta != NULL && delta->keyframeCycles > 0) {
+        message.delta = delta;
+        message.everything = full && (delta->sinceKeyframe >= delta->keyframeCycles ||
+                                      __atomic_load_n( &delta->keyframeRequested, __ATOMIC_RELAXED ));
+        memset( delta->written, '\0', sizeof delta->written );
+        delta->buildingKeyframe = message.everything;
+        delta->buildingFull = full;
+        delta->buildingConsidered = 0;
+        delta->buildingSent = 0;
+    }
+
+    JSON_Reset( writer );
+    JSON_BeginObject( writer, NULL );
+
+    JSON_AddString( writer, "topic", topic );
+    JSON_AddString( writer, "version", MESSAGE_VERSION );
+    
+    
+    //
+    //  Floating point values go out at a fixed precision per field, rounded
+    //  half away from zero, with trailing zeros dropped.
+    //
+    JSON_AddString( writer, "dateTime", Timestamp_Now( TIMESTAMP_ISO8601 ) );
+
+    //
+    //  Goes up by one per message (with gaps across restarts) - a message replayed
+    //  from the spool can arrive twice, this is how to tell
+    JSON_AddInteger( writer, "sequence", sequence );
+    if (!full)
+        JSON_AddBool( writer, "partial", TRUE );
 
     //
-    //  From the cJSON notes: Important: If you have added an item to an array 
-    //  or an object already, you mustn't delete it with cJSON_Delete. Adding 
-    //  it to an array or object transfers its ownership so that when that 
-    //  array or object is deleted, it gets deleted as well.
-    char *string = cJSON_Print( message );
-    cJSON_Delete( message );
+    //  A subscriber that sees a gap in the sequence should wait for (or ask for) the next keyframe
+    if (message.delta != NULL)
+        JSON_AddBool( writer, "keyframe", message.everything );
+
+    if (sections & BLOCK_MASK( BLOCK_REALTIME_DATA ))
+        addRealTimeData( &message, nightTime, rtData, setData );
+    if (sections & BLOCK_MASK( BLOCK_REALTIME_STATUS ))
+        addRealTimeStatus( &message, rtStatusData );
+    if (sections & BLOCK_MASK( BLOCK_STATISTICS ))
+        addStatistics( &message, stats );
+
+    JSON_EndObject( writer );
     
-    return string;
+    //
+    //  NULL if the message didn't fit
+    return JSON_Finish( writer );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    beginStateMessage (jsonWriter_t *writer, const char *topic)
+{
+    //
+    //  No dateTime or sequence - they'd make every copy different
+    JSON_Reset( writer );
+    JSON_BeginObject( writer, NULL );
+    JSON_AddString( writer, "topic", topic );
+    JSON_AddString( writer, "version", MESSAGE_VERSION );
+}
+
+// -----------------------------------------------------------------------------
+const char  *JSONMessage_CreateSettings (jsonWriter_t *writer, const char *topic, const Settings_t *setData)
+{
+    messageBuilder_t    message = { writer, NULL, TRUE, NULL, FALSE };
+
+    beginStateMessage( writer, topic );
+    addSettings( &message, setData );
+    JSON_EndObject( writer );
+    return JSON_Finish( writer );
+}
+
+// -----------------------------------------------------------------------------
+const char  *JSONMessage_CreateRatedData (jsonWriter_t *writer, const char *topic, const RatedData_t *ratedData)
+{
+    messageBuilder_t    message = { writer, NULL, TRUE, NULL, FALSE };
+
+    beginStateMessage( writer, topic );
+    addRatedData( &message, ratedData );
+    JSON_EndObject( writer );
+    return JSON_Finish( writer );
+}
+
+// -----------------------------------------------------------------------------
+const char  *JSONMessage_CreateIdentity (jsonWriter_t *writer, const char *topic, const char *controllerID,
+                                        const int slaveID, const char *device)
+{
+    //
+    //  Which SCC this is and where it hangs - "controllerID" is the one in the topics
+    beginStateMessage( writer, topic );
+    JSON_BeginObject( writer, "identity" );
+    JSON_AddString( writer, "controllerID", controllerID );
+    JSON_AddInteger( writer, "slaveID", slaveID );
+    JSON_AddString( writer, "serialPort", device );
+    JSON_EndObject( writer );
+    JSON_EndObject( writer );
+    return JSON_Finish( writer );
 }
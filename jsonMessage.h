@@ -15,13 +15,62 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
 #include <modbus/modbus.h>
 #include "ls1024b.h"
+#include "pollScheduler.h"
+#include "jsonWriter.h"
+
+
+#define DELTA_MAX_FIELDS        128             // call sites in jsonMessage.c - there are about 105
+
+//
+//  What goes in DATA. Settings and rated data have retained topics of their own
+#define DATA_BLOCKS_MASK        ( BLOCK_MASK( BLOCK_REALTIME_DATA ) | BLOCK_MASK( BLOCK_REALTIME_STATUS ) | BLOCK_MASK( BLOCK_STATISTICS ) )
+
+typedef struct  deltaField {
+    int         valid;
+    double      value;                          // for the deadband
+    uint32_t    hash;                           // of the field as it was written
+} deltaField_t;
+
+//
+//  Delta publishing - one per controller. What its subscribers have been sent,
+//  field by field, so the next message only needs what changed
+typedef struct  deltaState {
+    int             keyframeCycles;             // everything goes out every N cycles, 0 == always (no deltas)
+    int             sinceKeyframe;
+    int             keyframeRequested;          // the KEYFRAME command
+
+    deltaField_t    published[ DELTA_MAX_FIELDS ];
+    deltaField_t    candidate[ DELTA_MAX_FIELDS ];  // the message just built, until it's committed
+    unsigned char   written[ DELTA_MAX_FIELDS ];
+    int             buildingKeyframe;
+    int             buildingFull;
+    int             buildingConsidered;
+    int             buildingSent;
+
+    long            messages;                   // committed
+    long            keyframes;
+    long            fieldsConsidered;
+    long            fieldsSent;
+} deltaState_t;
    
 
-extern char *createJSONMessage( modbus_t *ctx, const char *topic, const RatedData_t *ratedData, 
+extern int JSONMessage_SetPrecisions( const char *spec );
+extern int JSONMessage_SetDeadbands( const char *spec );
+extern void JSONMessage_InitializeDelta( deltaState_t *delta, const int keyframeCycles );
+extern void JSONMessage_RequestKeyframe( deltaState_t *delta );
+extern void JSONMessage_CommitDelta( deltaState_t *delta );
+extern uint32_t JSONMessage_Hash( const char *text );
+extern const char *createJSONMessage( jsonWriter_t *writer, const int nightTime, const char *topic, const int sections, const long long sequence,
+        deltaState_t *delta,
         const RealTimeData_t *rtData, const RealTimeStatus_t *rtStatusData, 
         const Settings_t *setData, const StatisticalParameters_t *stats );
+extern const char *JSONMessage_CreateSettings( jsonWriter_t *writer, const char *topic, const Settings_t *setData );
+extern const char *JSONMessage_CreateRatedData( jsonWriter_t *writer, const char *topic, const RatedData_t *ratedData );
+extern const char *JSONMessage_CreateIdentity( jsonWriter_t *writer, const char *topic, const char *controllerID,
+        const int slaveID, const char *device );
 
 
 #ifdef __cplusplus
@@ -0,0 +1,267 @@
+/*
+ * File:    jsonWriter.c
+ * author:  patrick conroy
+ *
+ * A small streaming JSON writer.
+ *
+ * cJSON builds a tree (one malloc per node, ~100 per DATA message) and then
+ * mallocs again to print it.  On the little ARM boards that's most of the CPU
+ * and heap churn per cycle.  This writes the same document, in the same field
+ * order, directly into a preallocated buffer that gets reused every cycle.
+ *
+ * If the buffer fills up we set 'overflow' and JSON_Finish() returns NULL
+ * rather than handing back truncated JSON.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "logger.h"
+#include "numberFormat.h"
+#include "jsonWriter.h"
+
+
+// -----------------------------------------------------------------------------
+static
+void    putChar (jsonWriter_t *writer, const char c)
+{
+    //
+    //  Always leave room for the NUL
+    if (writer->length + 1 >= writer->capacity) {
+        writer->overflow = TRUE;
+        return;
+    }
+    writer->buffer[ writer->length++ ] = c;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    putBytes (jsonWriter_t *writer, const char *bytes, const int count)
+{
+    if (writer->length + count >= writer->capacity) {
+        writer->overflow = TRUE;
+        return;
+    }
+    memcpy( &writer->buffer[ writer->length ], bytes, count );
+    writer->length += count;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    putEscaped (jsonWriter_t *writer, const char *string)
+{
+    static  const char  hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *) string;
+
+    putChar( writer, '"' );
+    for (; *p != '\0'; p += 1) {
+        switch (*p) {
+            case '"':   putBytes( writer, "\\\"", 2 );     break;
+            case '\\':  putBytes( writer, "\\\\", 2 );     break;
+            case '\b':  putBytes( writer, "\\b", 2 );      break;
+            case '\f':  putBytes( writer, "\\f", 2 );      break;
+            case '\n':  putBytes( writer, "\\n", 2 );      break;
+            case '\r':  putBytes( writer, "\\r", 2 );      break;
+            case '\t':  putBytes( writer, "\\t", 2 );      break;
+            default:
+                if (*p < 0x20) {
+                    char    escape[ 6 ] = { '\\', 'u', '0', '0', hex[ *p >> 4 ], hex[ *p & 0x0F ] };
+                    putBytes( writer, escape, 6 );
+                } else
+                    putChar( writer, *p );
+                break;
+        }
+    }
+    putChar( writer, '"' );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    newLine (jsonWriter_t *writer)
+{
+    int i;
+
+    if (!writer->pretty)
+        return;
+
+    putChar( writer, '\n' );
+    for (i = 0; i < writer->depth; i += 1)
+        putChar( writer, '\t' );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    beginMember (jsonWriter_t *writer, const char *name)
+{
+    if (writer->depth > 0 && writer->needComma[ writer->depth ])
+        putChar( writer, ',' );
+    writer->needComma[ writer->depth ] = TRUE;
+
+    if (name == NULL)
+        return;
+
+    newLine( writer );
+    putEscaped( writer, name );
+    putChar( writer, ':' );
+    if (writer->pretty)
+        putChar( writer, '\t' );
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_WriterInitialize (jsonWriter_t *writer, char *buffer, const int capacity, const int pretty)
+{
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+    writer->pretty = pretty;
+    JSON_Reset( writer );
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_Reset (jsonWriter_t *writer)
+{
+    writer->length = 0;
+    writer->depth = 0;
+    writer->overflow = FALSE;
+    memset( writer->needComma, '\0', sizeof writer->needComma );
+    if (writer->capacity > 0)
+        writer->buffer[ 0 ] = '\0';
+}
+
+// -----------------------------------------------------------------------------
+static
+void    beginContainer (jsonWriter_t *writer, const char *name, const char open)
+{
+    beginMember( writer, name );
+    putChar( writer, open );
+
+    if (writer->depth + 1 >= JSON_MAX_DEPTH) {
+        writer->overflow = TRUE;
+        return;
+    }
+    writer->depth += 1;
+    writer->needComma[ writer->depth ] = FALSE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    endContainer (jsonWriter_t *writer, const char close)
+{
+    if (writer->depth > 0)
+        writer->depth -= 1;
+    newLine( writer );
+    putChar( writer, close );
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_BeginObject (jsonWriter_t *writer, const char *name)
+{
+    beginContainer( writer, name, '{' );
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_EndObject (jsonWriter_t *writer)
+{
+    endContainer( writer, '}' );
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_BeginArray (jsonWriter_t *writer, const char *name)
+{
+    //
+    //  Elements are added with a NULL name
+    beginContainer( writer, name, '[' );
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_EndArray (jsonWriter_t *writer)
+{
+    endContainer( writer, ']' );
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_AddString (jsonWriter_t *writer, const char *name, const char *value)
+{
+    beginMember( writer, name );
+    putEscaped( writer, (value != NULL) ? value : "" );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    putNumber (jsonWriter_t *writer, const double value)
+{
+    char    number[ 32 ];
+
+    //
+    //  Same rules as cJSON - no NaN or Infinity in JSON
+    if (value != value || (value * 0) != 0) {
+        putBytes( writer, "null", 4 );
+        return;
+    }
+
+    int length = snprintf( number, sizeof number, "%1.15g", value );
+    putBytes( writer, number, length );
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_AddNumber (jsonWriter_t *writer, const char *name, const double value)
+{
+    beginMember( writer, name );
+    putNumber( writer, value );
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_AddFixed (jsonWriter_t *writer, const char *name, const double value, const int precision)
+{
+    //
+    //  Format right into the output buffer - fixed number of decimal places, no snprintf
+    beginMember( writer, name );
+
+    if (writer->length + FORMAT_MAX_LENGTH >= writer->capacity) {
+        writer->overflow = TRUE;
+        return;
+    }
+
+    int length = Format_Fixed( &writer->buffer[ writer->length ], value, precision );
+    if (length < 0) {
+        //
+        //  NaN, Infinity or something enormous - let the general path deal with it
+        putNumber( writer, value );
+        return;
+    }
+    writer->length += length;
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_AddInteger (jsonWriter_t *writer, const char *name, const long long value)
+{
+    beginMember( writer, name );
+
+    if (writer->length + FORMAT_MAX_LENGTH >= writer->capacity) {
+        writer->overflow = TRUE;
+        return;
+    }
+    writer->length += Format_Integer( &writer->buffer[ writer->length ], value );
+}
+
+// -----------------------------------------------------------------------------
+void    JSON_AddBool (jsonWriter_t *writer, const char *name, const int value)
+{
+    beginMember( writer, name );
+    if (value)
+        putBytes( writer, "true", 4 );
+    else
+        putBytes( writer, "false", 5 );
+}
+
+// -----------------------------------------------------------------------------
+const char  *JSON_Finish (jsonWriter_t *writer)
+{
+    if (writer->overflow) {
+        Logger_LogError( "JSON writer ran out of room (%d bytes)\n", writer->capacity );
+        return NULL;
+    }
+
+    writer->buffer[ writer->length ] = '\0';
+    return writer->buffer;
+}
@@ -0,0 +1,59 @@
+/*
+ * File:   jsonWriter.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef JSONWRITER_H
+#define JSONWRITER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+//
+//  Compact output unless told otherwise at compile time (-DJSON_PRETTY_DEFAULT=1)
+//  or at run time (-P on the command line)
+#ifndef JSON_PRETTY_DEFAULT
+# define JSON_PRETTY_DEFAULT    0
+#endif
+
+#define JSON_MAX_DEPTH          8
+#define JSON_BUFFER_SIZE        8192
+
+
+//
+//  Streams JSON straight into a buffer the caller owns - no tree, no mallocs
+typedef struct  jsonWriter {
+    char    *buffer;
+    int     capacity;
+    int     length;
+    int     depth;
+    int     needComma[ JSON_MAX_DEPTH ];
+    int     pretty;                     // TRUE == tabs and newlines, same layout as cJSON_Print
+    int     overflow;                   // ran out of room - the output is no good
+} jsonWriter_t;
+
+
+extern  void        JSON_WriterInitialize( jsonWriter_t *writer, char *buffer, const int capacity, const int pretty );
+extern  void        JSON_Reset( jsonWriter_t *writer );
+extern  void        JSON_BeginObject( jsonWriter_t *writer, const char *name );
+extern  void        JSON_EndObject( jsonWriter_t *writer );
+extern  void        JSON_BeginArray( jsonWriter_t *writer, const char *name );
+extern  void        JSON_EndArray( jsonWriter_t *writer );
+extern  void        JSON_AddString( jsonWriter_t *writer, const char *name, const char *value );
+extern  void        JSON_AddNumber( jsonWriter_t *writer, const char *name, const double value );
+extern  void        JSON_AddFixed( jsonWriter_t *writer, const char *name, const double value, const int precision );
+extern  void        JSON_AddInteger( jsonWriter_t *writer, const char *name, const long long value );
+extern  void        JSON_AddBool( jsonWriter_t *writer, const char *name, const int value );
+extern  const char  *JSON_Finish( jsonWriter_t *writer );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JSONWRITER_H */
+
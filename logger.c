@@ -1,7 +1,23 @@
 /*
- * File:    commandQueue.c
+ * File:    logger.c
  * author:  patrick conroy
- * 
+ *
+ * Two ways to get a line into the log file:
+ *
+ * Synchronous (the default) - format, fprintf and fflush right on the calling
+ * thread.  Simple, but the mosquitto callback thread and the pollers pay for
+ * disk I/O on every line.
+ *
+ * Asynchronous (Logger_StartAsync) - the calling thread formats the line into
+ * a slot in a bounded ring and goes back to work. A writer thread wakes up
+ * every LOG_FLUSH_MS, drains whatever's there into one batch and hands it to
+ * the file with a single write(). The ring is the bounded MPMC queue from
+ * Dmitry Vyukov - each slot carries a sequence number, so producers only CAS
+ * the enqueue position and never take a lock.
+ *
+ * When the ring is full the overflow policy decides: wait for room, drop the
+ * new line (counted, and reported later), or throw away the oldest line.
+ * Fatal messages drain the ring and go out synchronously before we exit().
  */
 
 
@@ -9,27 +25,53 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
 #include <time.h>
-#include <sys/time.h>
+#include <pthread.h>
 
 #include "logger.h"
+#include "timestamp.h"
 
 
+#define LOG_RING_SIZE           512             // must be a power of two
+#define LOG_RECORD_SIZE         512             // longer lines are truncated
+#define LOG_FLUSH_MS            100
+#define LOG_BATCH_SIZE          (64 * 1024)
 
-static  int     Logger_Log (char *format, char *level, ...);
-static  char    *getCurrentDateTime( void );
-static  char    currentDateTimeBuffer[ 80 ];
+typedef struct  logRecord {
+    unsigned long   sequence;
+    int             length;
+    char            text[ LOG_RECORD_SIZE ];
+} logRecord_t;
 
 
+static  void    logV( const char *level, const char *format, va_list args );
+
 
 static  FILE    *fp;
 static  int     logFileOpen = FALSE;
-static  int     debugValue = 3; 
+static  int     debugValue = 3;
+
+int             Logger_Level = 0;                       // debugValue once the file is open, else 0
+
+static  const char  *levelNames[ LOG_LEVEL_INFO + 1 ] = {
+    "", "FATAL", "ERROR", "WARNING", "DEBUG", "INFO"
+};
+
+static  logRecord_t     ring[ LOG_RING_SIZE ];
+static  unsigned long   enqueuePos = 0;
+static  unsigned long   dequeuePos = 0;
+static  int             asyncRunning = FALSE;
+static  int             overflowPolicy = LOG_OVERFLOW_DROP;
+static  long            droppedCount = 0;
+static  long            overwrittenCount = 0;
+static  pthread_t       writerThread;
+static  char            batch[ LOG_BATCH_SIZE ];
 
 // ----------------------------------------------------------------------------
 //
 // How "debugValue" works.  It's an integer
-// 0 = Log nothing         
+// 0 = Log nothing
 // 5 = Log Fatal and Error and Warning and Debug and Info
 // 4 = Log Fatal and Error and Warning and Debug
 // 3 = Log Fatal and Error and Warning
@@ -43,160 +85,264 @@ void    Logger_Initialize (char *fileName, int debugLevel)
     if (fileName != (char *) 0 ) {
         debugValue = debugLevel;
         fp = fopen( fileName, "a" );
-        if (fp != (FILE *) 0)
+        if (fp != (FILE *) 0) {
             logFileOpen = TRUE;
+            Logger_Level = debugValue;
+        }
     }
 }
 
 // ----------------------------------------------------------------------------
-void    Logger_Terminate()
+int Logger_ParseOverflowPolicy (const char *policy)
 {
-    if (logFileOpen)
-        fclose( fp );
+    if (strcmp( policy, "block" ) == 0)
+        return LOG_OVERFLOW_BLOCK;
+    if (strcmp( policy, "drop" ) == 0)
+        return LOG_OVERFLOW_DROP;
+    if (strcmp( policy, "overwrite" ) == 0)
+        return LOG_OVERFLOW_OVERWRITE;
+    return -1;
 }
 
 // ----------------------------------------------------------------------------
-void    Logger_LogDebug (char *format, ... )
+static
+void    sleepMS (const long milliSeconds)
 {
-    if (!logFileOpen || debugValue < 4)
-        return;
-    
-    va_list args;
-    
-    va_start( args, format );                   // the last fixed parameter
-    int numWritten = fprintf( fp, "DEBUG|%s|", getCurrentDateTime() );
-    numWritten += vfprintf( fp, format, args );
-    va_end( args );
-    
-    fflush( fp );
+    struct timespec ts;
 
+    ts.tv_sec = milliSeconds / 1000;
+    ts.tv_nsec = (milliSeconds % 1000) * 1000000L;
+    nanosleep( &ts, NULL );
 }
 
 // ----------------------------------------------------------------------------
-void    Logger_LogWarning (char *format, ... )
+static
+int     claimSlot (logRecord_t **slotPtr)
 {
-    if (!logFileOpen || debugValue < 3)
-        return;
-    
-    va_list args;
-    
-    va_start( args, format );                   // the last fixed parameter
-    int numWritten = fprintf( fp, "WARNING|%s|", getCurrentDateTime() );
-    numWritten += vfprintf( fp, format, args );
-    va_end( args );
-    
-    fflush( fp );
+    //
+    //  Producer side. Returns TRUE with *slotPtr pointing at a slot we now own,
+    //  FALSE if the ring is full
+    unsigned long   pos = __atomic_load_n( &enqueuePos, __ATOMIC_RELAXED );
+
+    for (;;) {
+        logRecord_t     *slot = &ring[ pos & (LOG_RING_SIZE - 1) ];
+        unsigned long   sequence = __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE );
+        long            diff = (long) sequence - (long) pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n( &enqueuePos, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED )) {
+                *slotPtr = slot;
+                return TRUE;
+            }
+            //  lost the race - pos has been reloaded for us
+        } else if (diff < 0) {
+            return FALSE;
+        } else {
+            pos = __atomic_load_n( &enqueuePos, __ATOMIC_RELAXED );
+        }
+    }
 }
 
 // ----------------------------------------------------------------------------
-void    Logger_LogError (char *format, ... )
+static
+void    publishSlot (logRecord_t *slot)
 {
-    if (!logFileOpen || debugValue < 2)
-        return;
-    
-    va_list args;
-    
-    va_start( args, format );                   // the last fixed parameter
-    int numWritten = fprintf( fp, "ERROR|%s|", getCurrentDateTime() );
-    numWritten += vfprintf( fp, format, args );
-    va_end( args );
-    
-    fflush( fp );
+    unsigned long   pos = slot->sequence;
+    __atomic_store_n( &slot->sequence, pos + 1, __ATOMIC_RELEASE );
 }
 
 // ----------------------------------------------------------------------------
-void    Logger_LogFatal (char *format, ... )
+static
+int     takeOldest (char *out, const int outSize)
 {
-    if (!logFileOpen || debugValue < 1)
-        return;
-    
-    va_list args;
-    
-    va_start( args, format );                   // the last fixed parameter
-    int numWritten = fprintf( fp, "FATAL|%s|", getCurrentDateTime() );
-    numWritten += vfprintf( fp, format, args );
-    va_end( args );
-    
-    fflush( fp );
-    exit( 1 );
+    //
+    //  Consumer side - the writer thread, or a producer throwing away the oldest
+    //  line under LOG_OVERFLOW_OVERWRITE. Copies the line into out (if not NULL).
+    //  Returns the length copied, or -1 if the ring is empty.
+    unsigned long   pos = __atomic_load_n( &dequeuePos, __ATOMIC_RELAXED );
+
+    for (;;) {
+        logRecord_t     *slot = &ring[ pos & (LOG_RING_SIZE - 1) ];
+        unsigned long   sequence = __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE );
+        long            diff = (long) sequence - (long) (pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n( &dequeuePos, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED )) {
+                int length = 0;
+                if (out != NULL) {
+                    length = (slot->length < outSize) ? slot->length : outSize;
+                    memcpy( out, slot->text, length );
+                }
+                __atomic_store_n( &slot->sequence, pos + LOG_RING_SIZE, __ATOMIC_RELEASE );
+                return length;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n( &dequeuePos, __ATOMIC_RELAXED );
+        }
+    }
 }
 
 // ----------------------------------------------------------------------------
-void    Logger_LogInfo (char *format, ... )
+static
+void    drainRing (void)
 {
-    if (!logFileOpen || debugValue < 5)
+    //
+    //  Move everything that's in the ring to the file - one write() per batch
+    int     fd = fileno( fp );
+    int     used = 0;
+
+    long    dropped = __atomic_exchange_n( &droppedCount, 0, __ATOMIC_RELAXED );
+    long    overwritten = __atomic_exchange_n( &overwrittenCount, 0, __ATOMIC_RELAXED );
+    if (dropped > 0 || overwritten > 0)
+        used = snprintf( batch, sizeof batch, "WARNING|%s|Logger ring full - %ld lines dropped, %ld overwritten\n",
+                         Timestamp_Now( TIMESTAMP_LOG ), dropped, overwritten );
+
+    for (;;) {
+        if (LOG_BATCH_SIZE - used < LOG_RECORD_SIZE) {
+            if (write( fd, batch, used ) < 0)
+                perror( "Logger write" );
+            used = 0;
+        }
+
+        int length = takeOldest( &batch[ used ], LOG_BATCH_SIZE - used );
+        if (length < 0)
+            break;
+        used += length;
+    }
+
+    if (used > 0 && write( fd, batch, used ) < 0)
+        perror( "Logger write" );
+}
+
+// ----------------------------------------------------------------------------
+static
+void    *logWriter (void *arg)
+{
+    while (__atomic_load_n( &asyncRunning, __ATOMIC_ACQUIRE )) {
+        sleepMS( LOG_FLUSH_MS );
+        drainRing();
+    }
+
+    //
+    //  Whatever came in while we were shutting down
+    drainRing();
+    return NULL;
+}
+
+// ----------------------------------------------------------------------------
+void    Logger_StartAsync (const int policy)
+{
+    unsigned long   i;
+
+    if (!logFileOpen || asyncRunning)
         return;
-    
-    va_list args;
-    
-    va_start( args, format );                   // the last fixed parameter
-    int numWritten = fprintf( fp, "INFO|%s|", getCurrentDateTime() );
-    numWritten += vfprintf( fp, format, args );
-    va_end( args );
-    
+
+    //
+    //  Anything already buffered by stdio has to go out ahead of the ring
     fflush( fp );
+
+    for (i = 0; i < LOG_RING_SIZE; i += 1)
+        ring[ i ].sequence = i;
+    enqueuePos = dequeuePos = 0;
+    overflowPolicy = policy;
+
+    __atomic_store_n( &asyncRunning, TRUE, __ATOMIC_RELEASE );
+    if (pthread_create( &writerThread, NULL, logWriter, NULL )) {
+        asyncRunning = FALSE;
+        Logger_LogError( "Unable to start the log writer thread - staying synchronous\n" );
+    }
 }
 
 // ----------------------------------------------------------------------------
-static  int    Logger_Log (char *level, char *format, ...)
+static
+void    stopAsync (void)
 {
-    if (!logFileOpen)
-        return 0;
-    
-    va_list args;
-    
-    va_start( args, format );                   // the last fixed parameter
-   
-    int numWritten = fprintf( fp, "%s|%s|", level, getCurrentDateTime() );
-    numWritten += vfprintf( fp, format, args );
+    //
+    //  Only one caller gets to join the writer
+    if (__atomic_exchange_n( &asyncRunning, FALSE, __ATOMIC_ACQ_REL ))
+        pthread_join( writerThread, NULL );
+}
 
-    va_end( args );
-    
-    return numWritten;
+// ----------------------------------------------------------------------------
+void    Logger_Terminate()
+{
+    stopAsync();
+    Logger_Level = 0;
+    if (logFileOpen)
+        fclose( fp );
 }
 
 // ----------------------------------------------------------------------------
-static  char    *getCurrentDateTime()
+static
+void    logV (const char *level, const char *format, va_list args)
 {
-    //
-    // Something quick and dirty... Fix this later - thread safe
-    time_t  current_time;
-    struct  tm      *tmPtr;
-    struct  timeval tv;
-    
-    memset( currentDateTimeBuffer, '\0', sizeof currentDateTimeBuffer );
-    
-    int milliSeconds = -1;
-    
-    if (gettimeofday( &tv, NULL ) == 0) {
-        milliSeconds = ((int) tv.tv_usec) / 1000;
+    if (!__atomic_load_n( &asyncRunning, __ATOMIC_ACQUIRE )) {
+        fprintf( fp, "%s|%s|", level, Timestamp_Now( TIMESTAMP_LOG ) );
+        vfprintf( fp, format, args );
+        fflush( fp );
+        return;
     }
-    
-    int len = 0;
-    /* Obtain current time as seconds elapsed since the Epoch. */
-    current_time = time( NULL );
-    
-    if (current_time > 0) {
-        /* Convert to local time format. */
-        tmPtr = localtime( &current_time );
- 
-        if (tmPtr != NULL) {
-            len = strftime( currentDateTimeBuffer,
-                    sizeof currentDateTimeBuffer,
-                    "%F %T",
-                    tmPtr );
-            
+
+    logRecord_t     *slot = NULL;
+    while (!claimSlot( &slot )) {
+        if (overflowPolicy == LOG_OVERFLOW_DROP) {
+            __atomic_add_fetch( &droppedCount, 1, __ATOMIC_RELAXED );
+            return;
+        } else if (overflowPolicy == LOG_OVERFLOW_OVERWRITE) {
+            if (takeOldest( NULL, 0 ) >= 0)
+                __atomic_add_fetch( &overwrittenCount, 1, __ATOMIC_RELAXED );
+        } else {
+            sleepMS( 1 );
         }
     }
-    
+
     //
-    //  strftime returns number of bytes put into the string
-    if (len > 0 && milliSeconds >= 0) {
-        currentDateTimeBuffer[ len ] = '.';
-        currentDateTimeBuffer[ len + 1 ] = (milliSeconds % 1000) / 100 + '0';
-        currentDateTimeBuffer[ len + 2 ] = ((milliSeconds % 100) / 10) + '0';
-        currentDateTimeBuffer[ len + 3 ] = (milliSeconds % 10) + '0';
-        currentDateTimeBuffer[ len + 4 ] = '\0';       
+    //  Format right into the slot - snprintf tells us how long it wanted to be
+    int length = snprintf( slot->text, LOG_RECORD_SIZE, "%s|%s|", level, Timestamp_Now( TIMESTAMP_LOG ) );
+    length += vsnprintf( &slot->text[ length ], LOG_RECORD_SIZE - length, format, args );
+    if (length >= LOG_RECORD_SIZE) {
+        length = LOG_RECORD_SIZE - 1;
+        slot->text[ length - 1 ] = '\n';
     }
-    return &currentDateTimeBuffer[ 0 ];    
+    slot->length = length;
+
+    publishSlot( slot );
+}
+
+// ----------------------------------------------------------------------------
+void    Logger_Write (const int level, char *format, ... )
+{
+    //
+    //  Normally reached thru the Logger_LogError/Warning/Debug/Info macros,
+    //  which have already checked the level
+    if (level < LOG_LEVEL_FATAL || level > LOG_LEVEL_INFO || Logger_Level < level)
+        return;
+
+    va_list args;
+
+    va_start( args, format );                   // the last fixed parameter
+    logV( levelNames[ level ], format, args );
+    va_end( args );
+}
+
+// ----------------------------------------------------------------------------
+void    Logger_LogFatal (char *format, ... )
+{
+    if (Logger_Level < LOG_LEVEL_FATAL)
+        return;
+
+    //
+    //  Get everything that's queued up out first, then write this one ourselves
+    stopAsync();
+
+    va_list args;
+
+    va_start( args, format );                   // the last fixed parameter
+    logV( "FATAL", format, args );
+    va_end( args );
+
+    fflush( fp );
+    exit( 1 );
 }
@@ -17,15 +17,51 @@ extern "C" {
 # define TRUE  (!FALSE)
 #endif
     
+//
+//  What an async log call does when the ring is full
+#define LOG_OVERFLOW_BLOCK      0           // wait for the writer thread to make room
+#define LOG_OVERFLOW_DROP       1           // lose the new line, count it
+#define LOG_OVERFLOW_OVERWRITE  2           // lose the oldest line, count it
     
 extern  void    Logger_Initialize( char *fileName, int debugValue );
+extern  void    Logger_StartAsync( const int overflowPolicy );
+extern  int     Logger_ParseOverflowPolicy( const char *policy );
 extern  void    Logger_Terminate();
-extern  void    Logger_LogInfo( char *format, ... );
-extern  void    Logger_LogDebug( char *format, ... );
-extern  void    Logger_LogWarning( char *format, ... );
-extern  void    Logger_LogError( char *format, ... );
+extern  void    Logger_Write( const int level, char *format, ... );
 extern  void    Logger_LogFatal( char *format, ... );
 
+//
+//  Log levels - see "debugValue" in logger.c
+#define LOG_LEVEL_FATAL         1
+#define LOG_LEVEL_ERROR         2
+#define LOG_LEVEL_WARNING       3
+#define LOG_LEVEL_DEBUG         4
+#define LOG_LEVEL_INFO          5
+
+//
+//  Levels above LOG_COMPILE_LEVEL are compiled out completely, e.g.
+//  -DLOG_COMPILE_LEVEL=LOG_LEVEL_WARNING drops every Debug and Info call
+#ifndef LOG_COMPILE_LEVEL
+# define LOG_COMPILE_LEVEL      LOG_LEVEL_INFO
+#endif
+
+//
+//  Set by Logger_Initialize() - 0 until the log file is open
+extern  int     Logger_Level;
+
+//
+//  Check the level before anything else, so a disabled call costs one
+//  predictable branch and its arguments are never evaluated
+#define Logger_LogAt(level, ...)    do {                                                \
+            if ((level) <= LOG_COMPILE_LEVEL && __builtin_expect( Logger_Level >= (level), 0 )) \
+                Logger_Write( (level), __VA_ARGS__ );                                   \
+        } while (0)
+
+#define Logger_LogError(...)        Logger_LogAt( LOG_LEVEL_ERROR, __VA_ARGS__ )
+#define Logger_LogWarning(...)      Logger_LogAt( LOG_LEVEL_WARNING, __VA_ARGS__ )
+#define Logger_LogDebug(...)        Logger_LogAt( LOG_LEVEL_DEBUG, __VA_ARGS__ )
+#define Logger_LogInfo(...)         Logger_LogAt( LOG_LEVEL_INFO, __VA_ARGS__ )
+
 
 #define Logger_FunctionStart(x)     Logger_LogDebug( "%s[%d] :: %s() - enter\n", __FILE__, __LINE__, __func__)
 #define Logger_FunctionEnd(x)       Logger_LogDebug( "%s[%d] :: %s() - exit\n", __FILE__, __LINE__, __func__ )
@@ -28,6 +28,13 @@
 #include "doCommand.h"
 #include "commandQueue.h"
 #include "jsonMessage.h"
+#include "registerMap.h"
+#include "controller.h"
+#include "jsonWriter.h"
+#include "timestamp.h"
+#include "spool.h"
+#include "history.h"
+#include "historyQuery.h"
 
 
 //  
@@ -38,15 +45,38 @@ static  void    parseCommandLine( int, char ** );
 static  char    *version = "LS1024B_MQTT SCC Controller - version 2.0.3 (controlling FP precision)";
 
 
-static  int     sleepSeconds = 15;                  // How often to send out SCC data packets
+static  int     sleepSeconds = 1;                   // Poll loop tick - each block is read on its own interval (-b) on this grid
 static  char    *brokerHost = "10.0.0.11";          // default address of our MQTT broker
 static  char    *controllerID = "1";                // Assigned an arbitrary ID to our SCC in case we have more than one
 static  char    *devicePort = "/dev/ttyUSB0";       // Port where our SCC is connected
 static  int     loggingLevel = 3;
+static  char    *blockIntervals = NULL;             // per-block refresh intervals, e.g. "realtime=1,statistics=60"
+static  int     maxRegisterGap = 8;                 // unused registers we'll read to merge two spans
+static  int     overrunPolicy = CYCLE_SKIP;         // what to do when a poll cycle runs long
+static  int     metricsSeconds = 60;                // how often to publish Modbus call metrics, 0 = never
+static  int     prettyJSON = JSON_PRETTY_DEFAULT;   // compact DATA messages unless -P
+static  char    *fieldPrecisions = NULL;
+static  int     keyframeCycles = 0;                 // delta publishing - a full DATA message every N cycles, 0 = always full
+static  char    *fieldDeadbands = NULL;
+static  int     logOverflowPolicy = -1;
+static  int     commandQueueSize = COMMAND_QUEUE_DEFAULT;
+static  int     commandQueuePolicy = QUEUE_OVERFLOW_REJECT;
+static  int     batchWindowMS = DEFAULT_BATCH_WINDOW_MS;
+static  char    *publishOptions = NULL;             // QoS per topic class and the in-flight window, e.g. "response=1,window=32"
+static  char    *spoolDirectory = NULL;             // keep DATA on disk while the broker is unreachable
+static  int     spoolMegabytes = SPOOL_DEFAULT_MEGABYTES;
+static  char    *historyDirectory = NULL;           // keep a compressed history of every sample, queryable over MQTT
+static  int     historyMegabytes = HISTORY_DEFAULT_MEGABYTES;
 
 static  char    *topTopic = "LS1024B";              // MQTT top level topic
-static  char    publishTopic[ 1024 ];               // published data will be on "<topTopic>/<controlleID>/DATA"
-static  char    subscriptionTopic[ 1024 ];          // subscribe to <"<topTopic>/<controlleID>/COMMAND"
+
+//
+//  Each -c option adds a controller: "<port>:<slaveID>:<controllerID>"
+//  published data will be on "<topTopic>/<controllerID>/DATA"
+//  settings, rated data and identity retained on ".../SETTINGS", ".../RATED" and ".../IDENTITY"
+//  subscribe to commands on "<topTopic>/<controllerID>/COMMAND"
+static  char    *controllerSpecs[ MAX_CONTROLLERS ];
+static  int     numControllerSpecs = 0;
 
 
 
@@ -55,124 +85,114 @@ static  char    subscriptionTopic[ 1024 ];          // subscribe to <"<topTopic>
 // -----------------------------------------------------------------------------
 int main (int argc, char* argv[]) 
 {
-    modbus_t    *ctx;
+    int     i;
     
+    Timestamp_MarkStartup();
     printf( "%s\n", version );
     
     parseCommandLine( argc, argv );
     Logger_Initialize( "ls1024b.log", loggingLevel );           
+    if (logOverflowPolicy >= 0)
+        Logger_StartAsync( logOverflowPolicy );
     Logger_LogWarning( "%s\n", version );
+    Logger_LogInfo( "Startup +%0.1f ms: logging started\n", Timestamp_SinceStartupMS() );
     
     //
-    // Create a FIFO queue for our incoming Commands over MQTT
-    createQueue( 0, 0 );
-
-    //
-    // Connect to our MQTT Broker
-    MQTT_Initialize( controllerID, brokerHost );
-    
+    //  Build the controller table. With no -c options we have the single SCC from -p and -i
+    Controller_SetDefaults( topTopic, sleepSeconds, blockIntervals, overrunPolicy, metricsSeconds, prettyJSON, keyframeCycles );
+    RegisterMap_SetMaxGap( maxRegisterGap );
+    if (fieldPrecisions != NULL && !JSONMessage_SetPrecisions( fieldPrecisions ))
+        Logger_LogFatal( "Unable to parse the field precisions [%s]\n", fieldPrecisions );
+    if (fieldDeadbands != NULL && !JSONMessage_SetDeadbands( fieldDeadbands ))
+        Logger_LogFatal( "Unable to parse the field deadbands [%s]\n", fieldDeadbands );
     
-    //
-    // Modbus - open the SCC port. We know it's 115.2K 8N1
-    Logger_LogInfo( "Opening %s, 115200 8N1\n", devicePort );
-    ctx = modbus_new_rtu( devicePort, 115200, 'N', 8, 1 );
-    if (ctx == NULL) {
-        Logger_LogFatal( "Unable to create the libmodbus context\n" );
-        return -1;
+    if (numControllerSpecs == 0) {
+        if (Controller_Add( devicePort, LANDSTAR_1024B_ID, controllerID ) == NULL)
+            Logger_LogFatal( "Unable to add controller [%s] on %s\n", controllerID, devicePort );
+    }
+    for (i = 0; i < numControllerSpecs; i += 1) {
+        if (Controller_AddFromSpec( controllerSpecs[ i ] ) == NULL)
+            Logger_LogFatal( "Unable to add controller [%s]. Expected <port>:<slaveID>:<controllerID>\n", controllerSpecs[ i ] );
     }
-    
     
     //
-    // I don't know if we need to set the SCC Slave ID or not
-    Logger_LogInfo( "Setting slave ID to %X\n", LANDSTAR_1024B_ID );
-    modbus_set_slave( ctx, LANDSTAR_1024B_ID );
+    // Create a FIFO queue for our incoming Commands over MQTT
+    DoCommand_SetBatchWindow( batchWindowMS );
+    if (!createQueue( commandQueueSize, commandQueuePolicy ))
+        Logger_LogFatal( "Unable to allocate a command queue of %d entries\n", commandQueueSize );
 
-    if (modbus_connect( ctx ) == -1) {
-        Logger_LogFatal( "Connection failed: %s\n", modbus_strerror( errno ) );
-        modbus_free( ctx );
-        return -1;
+    if (publishOptions != NULL && !MQTT_SetPublishOptions( publishOptions ))
+        Logger_LogFatal( "Unable to parse the MQTT publish options [%s]\n", publishOptions );
+    Logger_LogInfo( "Startup +%0.1f ms: %d controller(s) configured\n", Timestamp_SinceStartupMS(), Controller_Count() );
+
+    //
+    //  Without the spool we still sample - DATA just waits in memory instead
+    if (spoolDirectory != NULL) {
+        if (Spool_Open( spoolDirectory, spoolMegabytes ))
+            Logger_LogInfo( "Startup +%0.1f ms: spool open\n", Timestamp_SinceStartupMS() );
+        else
+            Logger_LogError( "Unable to open the spool in [%s] - DATA will only be buffered in memory\n", spoolDirectory );
     }
     
-    Logger_LogInfo( "Port to Solar Charge Controller is open.\n", devicePort );
+    //
+    // Modbus - open each SCC port. Before the broker - after a power cut we come up
+    //  long before the network does, and the samples are buffered until it's there
+    Controller_OpenPorts();
+    Logger_LogInfo( "Startup +%0.1f ms: serial ports open\n", Timestamp_SinceStartupMS() );
 
+    //
+    //  Like the spool, a history we can't open is logged and we carry on without it
+    int historyOpen = FALSE;
+    if (historyDirectory != NULL) {
+        historyOpen = (Controller_OpenHistory( historyDirectory, historyMegabytes ) > 0);
+        if (historyOpen && !HistoryQuery_Start())
+            Logger_LogFatal( "Unable to start the history query thread!\n" );
+        Logger_LogInfo( "Startup +%0.1f ms: history open\n", Timestamp_SinceStartupMS() );
+    }
     
     //
     //  Start up a new thread to watch the Command Queue
     pthread_t   commandProcessingThread;
-    if(pthread_create( &commandProcessingThread, NULL, processInboundCommand, ctx ) ) {
+    if(pthread_create( &commandProcessingThread, NULL, processInboundCommand, NULL ) ) {
         Logger_LogFatal( "Unable to start the command processing thread!\n" );
         perror( "Error:" );
         return -1;
     }
 
-
     //
-    //  Concatenate topTopic and controller ID to create our Pub and Sub Topics
-    snprintf( publishTopic, sizeof publishTopic, "%s/%s/%s", topTopic, controllerID, "DATA" );
-    Logger_LogInfo( "Publishing messages to MQTT Topic [%s]\n", publishTopic );
-    
-    snprintf( subscriptionTopic, sizeof subscriptionTopic, "%s/%s/%s", topTopic, controllerID, "COMMAND" );
-    Logger_LogInfo( "Subscribing to commands on MQTT Topic [%s]", subscriptionTopic );
-    MQTT_Subscribe ( subscriptionTopic, 0 );
+    //  One poller thread per serial port - they loop forever reading SCC data and sending it out
+    Controller_StartPollers();
+    Logger_LogInfo( "Startup +%0.1f ms: pollers started\n", Timestamp_SinceStartupMS() );
 
-    
     //
-    //  I have 5 Structures because that's the way the SCC Documentation was organized
-    //  There's no reason to break it up into 5.  It could have been one, or several
-    RatedData_t             ratedData;
-    RealTimeData_t          realTimeData;
-    RealTimeStatus_t        realTimeStatusData;
-    Settings_t              settingsData;
-    StatisticalParameters_t statisticalParametersData;
-
-    setRealtimeClockToNow( ctx );
-    int seconds, minutes, hour, day, month, year;
-    getRealtimeClock( ctx, &seconds, &minutes, &hour, &day, &month, &year );
-    Logger_LogInfo( "System Clock set to: %02d/%02d/%02d %02d:%02d:%02d\n", month, day, year, hour, minutes, seconds );
+    // Connect to our MQTT Broker - one connection for all of the controllers. This
+    //  doesn't wait for the broker, the connection comes up (and comes back) on its own
+    MQTT_Initialize( controllerID, brokerHost );
 
     //
-    //  Loop forever - read SCC data and send it out
-    while (TRUE) {      
-        //
-        //  every time thru the loop - zero out the structs!
-        memset( &ratedData, '\0', sizeof( RatedData_t ) );
-        memset( &realTimeData, '\0', sizeof( RealTimeData_t ) );
-        memset( &realTimeStatusData, '\0', sizeof( RealTimeStatus_t ) );
-        memset( &settingsData, '\0', sizeof( Settings_t ) );
-        memset( &statisticalParametersData, '\0', sizeof( StatisticalParameters_t ) );
-       
-        //
-        // make the modbus calls to pull the data 
-        getRatedData( ctx, &ratedData );
-        getRealTimeData( ctx, &realTimeData );
-        getRealTimeStatus( ctx, &realTimeStatusData);
-        getSettings( ctx, &settingsData );
-        getStatisticalParameters( ctx, &statisticalParametersData );
-        
-        //
-        // craft a JSON message from the data 
-        char    *jsonMessage = createJSONMessage( ctx, 
-                                            publishTopic,
-                                            &ratedData, 
-                                            &realTimeData, 
-                                            &realTimeStatusData,
-                                            &settingsData,
-                                            &statisticalParametersData
-                );
-       
-        //
-        // Publish it to our MQTT broker 
-        MQTT_PublishData( publishTopic, jsonMessage, strlen( jsonMessage ) );
-        
-        free( jsonMessage );
-        sleep( sleepSeconds );
+    //  Each controller has its own Pub and Sub Topics
+    for (i = 0; i < Controller_Count(); i += 1) {
+        controller_t    *controller = Controller_Get( i );
+        Logger_LogInfo( "Publishing messages to MQTT Topic [%s]\n", controller->publishTopic );
+        Logger_LogInfo( "Subscribing to commands on MQTT Topic [%s]\n", controller->subscriptionTopic );
+        MQTT_Subscribe ( controller->subscriptionTopic, MQTT_ClassQoS( MQTT_CLASS_COMMAND ) );
+        if (historyOpen) {
+            Logger_LogInfo( "Answering history queries on MQTT Topic [%s]\n", controller->queryTopic );
+            MQTT_Subscribe( controller->queryTopic, MQTT_ClassQoS( MQTT_CLASS_COMMAND ) );
+        }
     }
+    Logger_LogInfo( "Startup +%0.1f ms: MQTT connecting in the background\n", Timestamp_SinceStartupMS() );
 
+    Controller_JoinPollers();
     
     //
     // we never get here!
-    MQTT_Unsubscribe( subscriptionTopic );
-    MQTT_Teardown( NULL );
+    for (i = 0; i < Controller_Count(); i += 1)
+        MQTT_Unsubscribe( Controller_Get( i )->subscriptionTopic );
+    HistoryQuery_Stop();
+    MQTT_Teardown( NULL );                      // joins the spool replayer first
+    Spool_Close();
+    Controller_CloseHistory();
 
     if (pthread_join( commandProcessingThread, NULL )) {
         Logger_LogError( "Shutting down but unable to join the commandProcessingThread\n" );
@@ -180,8 +200,7 @@ int main (int argc, char* argv[])
     
     destroyQueue();
     
-    modbus_close( ctx );
-    modbus_free( ctx );
+    Controller_ClosePorts();
     Logger_LogInfo( "Done" );
     Logger_Terminate();
     
@@ -195,10 +214,32 @@ void    showHelp()
     puts( "Options" );
     puts( "  -h  <string>   MQTT host to connect to" );
     puts( "  -t  <string>   MQTT top level topic" );
-    puts( "  -s  N          sleep between sends <seconds>" );
+    puts( "  -s  N          poll loop tick <seconds>, DATA goes out once per tick (defaults to 1)" );
+    puts( "                 a block is read on the first tick after its -b interval is up" );
     puts( "  -i  <string>   give this controller an identifier (defaults to '1')" );
     puts( "  -p  <string>   open this /dev/port to talk to contoller (defaults to /dev/ttyUSB0)" );
+    printf( "  -c  <string>   add a controller <port>:<slaveID>:<controllerID>, repeat for up to %d (overrides -p and -i)\n", MAX_CONTROLLERS );
     puts( "  -v  N          logging level 1..5" );
+    puts( "  -a  <string>   log from a background writer thread; when its buffer is full 'block', 'drop' or 'overwrite'" );
+    puts( "  -q  N          command queue size, per priority class (defaults to 64, max 1024)" );
+    puts( "  -Q  <string>   when the command queue is full 'reject' the new command, drop the 'oldest' or 'block'" );
+    puts( "  -w  N          batch settings commands arriving within N ms into one write (defaults to 50, 0 = off)" );
+    puts( "  -b  <string>   block refresh intervals <seconds>, 0 = startup and after a command only" );
+    puts( "                 (defaults to realtime=1,status=2,statistics=60,settings=0,rated=0,clock=1)" );
+    puts( "  -g  N          max unused registers read to merge two spans (defaults to 8, 0 = never)" );
+    puts( "  -o  <string>   when a cycle overruns: 'skip' missed samples or 'catchup' (defaults to skip)" );
+    puts( "  -f  <string>   decimal places per JSON field, e.g. pvArrayVoltage=3,battery=2" );
+    puts( "  -P             pretty print the JSON DATA messages (defaults to compact)" );
+    puts( "  -k  N          delta publishing: DATA carries only changed fields, in full every N cycles (defaults to 0 = always in full)" );
+    puts( "  -d  <string>   how far a field must move to be sent in a delta, e.g. pvArrayVoltage=0.1,batterySOC=1" );
+    puts( "  -m  N          publish Modbus call metrics every N seconds on <topTopic>/<id>/METRICS (defaults to 60, 0 = off)" );
+    puts( "  -y  <string>   MQTT QoS per topic class and max publishes in flight, e.g. data=0,metrics=0,response=1,command=1,state=1,window=32" );
+    puts( "                 buffer=N holds up to N messages while the broker is unreachable (defaults to 256, 0 = off)" );
+    puts( "                 replay=N sends at most N spooled messages a second once it's back (defaults to 20)" );
+    puts( "  -S  <string>   spool DATA to this directory while the broker is unreachable, replay it when it's back" );
+    puts( "  -Z  N          spool size budget <megabytes> (defaults to 64), the oldest is dropped when it's full" );
+    puts( "  -H  <string>   keep a compressed history of every sample in this directory, queried on <topTopic>/<id>/QUERY" );
+    puts( "  -L  N          history size per controller <megabytes> (defaults to 256), the oldest is overwritten when it's full" );
     exit( 1 ); 
 }
 
@@ -210,19 +251,70 @@ void    parseCommandLine (int argc, char *argv[])
     //  Options
     //  -h  <string>    MQTT host to connect to
     //  -t  <string>    MQTT top level topic
-    //  -s  N           sleep between sends <seconds>
+    //  -s  N           poll loop tick <seconds>
     //  -i  <string>    give this controller an identifier (defaults to LS1024B_1)
     //  -p  <string>    open this /dev/port to talk to contoller (defaults to /dev/ttyUSB0
+    //  -c  <string>    add a controller "<port>:<slaveID>:<controllerID>" - may be repeated
+    //  -b  <string>    per-block refresh intervals "realtime=1,status=2,statistics=60,settings=0,rated=0,clock=1"
+    //  -g  N           max unused registers read to merge two register spans
+    //  -o  <string>    overrun policy "skip" or "catchup"
+    //  -m  N           metrics publishing interval <seconds>
+    //  -P              pretty print JSON
+    //  -f  <string>    per-field precision "name=digits,..."
+    //  -k  N           keyframe interval <cycles>, 0 = no delta publishing
+    //  -d  <string>    per-field deadband "name=deadband,..."
+    //  -q  N           command queue capacity, per priority class
+    //  -Q  <string>    command queue overflow policy "reject", "oldest" or "block"
+    //  -w  N           settings command batching window <milliseconds>
+    //  -a  <string>    asynchronous logging, overflow policy "block", "drop" or "overwrite"
+    //  -y  <string>    MQTT publish options "data=Q,metrics=Q,response=Q,command=Q,state=Q,window=N,buffer=N,replay=N"
+    //  -S  <string>    spool directory
+    //  -Z  N           spool budget <megabytes>
+    //  -H  <string>    history directory
+    //  -L  N           history size per controller <megabytes>
     char    c;
     
-    while (((c = getopt( argc, argv, "h:t:s:i:p:v:" )) != -1) && (c != 255)) {
+    while (((c = getopt( argc, argv, "h:t:s:i:p:c:v:b:g:o:m:Pf:a:q:Q:w:y:S:Z:H:L:k:d:" )) != -1) && (c != 255)) {
         switch (c) {
             case 'h':   brokerHost = optarg;            break;
-            case 's':   sleepSeconds = atoi( optarg );  break;
+            case 's':   sleepSeconds = atoi( optarg );
+                        if (sleepSeconds < 1)
+                            showHelp();
+                        break;
             case 't':   topTopic = optarg;              break;
             case 'i':   controllerID = optarg;          break;
             case 'p':   devicePort = optarg;            break;
+            case 'c':   if (numControllerSpecs >= MAX_CONTROLLERS)
+                            showHelp();
+                        controllerSpecs[ numControllerSpecs++ ] = optarg;
+                        break;
             case 'V':   loggingLevel = atoi( optarg );  break;
+            case 'b':   blockIntervals = optarg;        break;
+            case 'g':   maxRegisterGap = atoi( optarg );    break;
+            case 'm':   metricsSeconds = atoi( optarg );    break;
+            case 'P':   prettyJSON = TRUE;              break;
+            case 'f':   fieldPrecisions = optarg;       break;
+            case 'k':   keyframeCycles = atoi( optarg );    break;
+            case 'd':   fieldDeadbands = optarg;        break;
+            case 'a':   logOverflowPolicy = Logger_ParseOverflowPolicy( optarg );
+                        if (logOverflowPolicy < 0)
+                            showHelp();
+                        break;
+            case 'w':   batchWindowMS = atoi( optarg ); break;
+            case 'y':   publishOptions = optarg;        break;
+            case 'S':   spoolDirectory = optarg;        break;
+            case 'Z':   spoolMegabytes = atoi( optarg );    break;
+            case 'H':   historyDirectory = optarg;      break;
+            case 'L':   historyMegabytes = atoi( optarg );  break;
+            case 'q':   commandQueueSize = atoi( optarg );  break;
+            case 'Q':   commandQueuePolicy = parseQueuePolicy( optarg );
+                        if (commandQueuePolicy < 0)
+                            showHelp();
+                        break;
+            case 'o':   overrunPolicy = CycleTimer_ParsePolicy( optarg );
+                        if (overrunPolicy < 0)
+                            showHelp();
+                        break;
             
             default:    showHelp();     break;
         }
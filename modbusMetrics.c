@@ -0,0 +1,206 @@
+/*
+ * File:    modbusMetrics.c
+ * author:  patrick conroy
+ *
+ * Where does the cycle time go?  Every Modbus call site (span reads, the
+ * library's getRatedData/isNightTime/setRealtimeClockToNow, and each command
+ * setter) records its latency into an HDR style log-linear histogram, along
+ * with error counters and bytes on the wire.  The poller publishes the lot on
+ * "<topTopic>/<controllerID>/METRICS" every so often.
+ *
+ * The LS10x4B library functions return void, so for those we zero errno before
+ * the call and treat a non-zero errno afterwards as a failure. libmodbus always
+ * sets errno when a transaction fails.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <modbus/modbus.h>
+#include "cjson/cJSON.h"
+
+#include "logger.h"
+#include "modbusMetrics.h"
+#include "timestamp.h"
+
+
+// -----------------------------------------------------------------------------
+static
+long long   nowUS (void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((long long) ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000L);
+}
+
+// -----------------------------------------------------------------------------
+static
+int bucketIndex (const long long valueUS)
+{
+    if (valueUS < HISTOGRAM_SUB_BUCKETS)
+        return (valueUS < 0) ? 0 : (int) valueUS;
+
+    //
+    //  Top HISTOGRAM_SUB_BITS + 1 bits pick the bucket
+    int msb = 63 - __builtin_clzll( (unsigned long long) valueUS );
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    int index = ((shift + 1) * HISTOGRAM_SUB_BUCKETS) + (int) ((valueUS >> shift) - HISTOGRAM_SUB_BUCKETS);
+
+    return (index < HISTOGRAM_BUCKETS) ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// -----------------------------------------------------------------------------
+static
+long long   bucketHighestValue (const int index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+
+    int shift = (index / HISTOGRAM_SUB_BUCKETS) - 1;
+    int sub = index % HISTOGRAM_SUB_BUCKETS;
+    return (((long long) (HISTOGRAM_SUB_BUCKETS + sub + 1)) << shift) - 1;
+}
+
+// -----------------------------------------------------------------------------
+void    Metrics_Initialize (modbusMetrics_t *metrics)
+{
+    memset( metrics, '\0', sizeof( modbusMetrics_t ) );
+    pthread_mutex_init( &metrics->lock, NULL );
+}
+
+// -----------------------------------------------------------------------------
+static
+callSiteMetrics_t   *findSite (modbusMetrics_t *metrics, const char *name)
+{
+    //
+    //  Caller holds the lock. A few dozen sites at most, so a linear search is fine
+    int i;
+
+    for (i = 0; i < metrics->numSites; i += 1)
+        if (strcmp( metrics->sites[ i ].name, name ) == 0)
+            return &metrics->sites[ i ];
+
+    if (metrics->numSites >= MAX_CALL_SITES)
+        return NULL;
+
+    callSiteMetrics_t   *site = &metrics->sites[ metrics->numSites++ ];
+    strncpy( site->name, name, sizeof site->name - 1 );
+    return site;
+}
+
+// -----------------------------------------------------------------------------
+long long   Metrics_Start (void)
+{
+    errno = 0;
+    return nowUS();
+}
+
+// -----------------------------------------------------------------------------
+void    Metrics_Record (modbusMetrics_t *metrics, const char *name, const long long startUS,
+                        const int failed, const int errorNumber, const int bytes)
+{
+    long long   elapsedUS = nowUS() - startUS;
+
+    pthread_mutex_lock( &metrics->lock );
+    callSiteMetrics_t   *site = findSite( metrics, name );
+    if (site != NULL) {
+        site->calls += 1;
+        site->totalUS += elapsedUS;
+        if (elapsedUS > site->maxUS)
+            site->maxUS = elapsedUS;
+        site->histogram[ bucketIndex( elapsedUS ) ] += 1;
+        site->bytesOnWire += bytes;
+
+        if (failed) {
+            site->errors += 1;
+            if (errorNumber == ETIMEDOUT)
+                site->timeouts += 1;
+            else if (errorNumber == EMBBADCRC)
+                site->crcErrors += 1;
+            else if (errorNumber > MODBUS_ENOBASE && errorNumber <= EMBXGTAR)
+                site->exceptions += 1;
+        }
+    }
+    pthread_mutex_unlock( &metrics->lock );
+}
+
+// -----------------------------------------------------------------------------
+void    Metrics_RecordLibraryCall (modbusMetrics_t *metrics, const char *name, const long long startUS)
+{
+    int errorNumber = errno;
+    Metrics_Record( metrics, name, startUS, (errorNumber != 0), errorNumber, 0 );
+}
+
+// -----------------------------------------------------------------------------
+long long   Metrics_Percentile (const callSiteMetrics_t *site, const double percentile)
+{
+    long long   target = (long long) ((percentile / 100.0) * site->calls + 0.5);
+    long long   seen = 0;
+    int         i;
+
+    if (target < 1)
+        target = 1;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i += 1) {
+        seen += site->histogram[ i ];
+        if (seen >= target)
+            return (bucketHighestValue( i ) < site->maxUS) ? bucketHighestValue( i ) : site->maxUS;
+    }
+
+    return site->maxUS;
+}
+
+// -----------------------------------------------------------------------------
+char    *Metrics_CreateJSONMessage (modbusMetrics_t *metrics, const char *topic, const int reset)
+{
+    cJSON   *message = cJSON_CreateObject();
+    int     i;
+
+    cJSON_AddStringToObject( message, "topic", topic );
+    cJSON_AddStringToObject( message, "version", "2.0" );
+    cJSON_AddStringToObject( message, "dateTime", Timestamp_Now( TIMESTAMP_ISO8601 ) );
+
+    cJSON   *sites = cJSON_CreateObject();
+
+    pthread_mutex_lock( &metrics->lock );
+    for (i = 0; i < metrics->numSites; i += 1) {
+        callSiteMetrics_t   *site = &metrics->sites[ i ];
+        if (site->calls == 0)
+            continue;
+
+        cJSON   *entry = cJSON_CreateObject();
+        cJSON_AddNumberToObject( entry, "calls", site->calls );
+        cJSON_AddNumberToObject( entry, "errors", site->errors );
+        cJSON_AddNumberToObject( entry, "timeouts", site->timeouts );
+        cJSON_AddNumberToObject( entry, "crcErrors", site->crcErrors );
+        cJSON_AddNumberToObject( entry, "exceptions", site->exceptions );
+        cJSON_AddNumberToObject( entry, "bytesOnWire", site->bytesOnWire );
+        cJSON_AddNumberToObject( entry, "avgMs", (site->totalUS / site->calls) / 1000.0 );
+        cJSON_AddNumberToObject( entry, "p50Ms", Metrics_Percentile( site, 50.0 ) / 1000.0 );
+        cJSON_AddNumberToObject( entry, "p90Ms", Metrics_Percentile( site, 90.0 ) / 1000.0 );
+        cJSON_AddNumberToObject( entry, "p99Ms", Metrics_Percentile( site, 99.0 ) / 1000.0 );
+        cJSON_AddNumberToObject( entry, "maxMs", site->maxUS / 1000.0 );
+        cJSON_AddItemToObject( sites, site->name, entry );
+
+        if (reset) {
+            char    name[ sizeof site->name ];
+            memcpy( name, site->name, sizeof name );
+            memset( site, '\0', sizeof( callSiteMetrics_t ) );
+            memcpy( site->name, name, sizeof name );
+        }
+    }
+    pthread_mutex_unlock( &metrics->lock );
+
+    cJSON_AddItemToObject( message, "callSites", sites );
+
+    char    *string = cJSON_Print( message );
+    cJSON_Delete( message );
+
+    return string;
+}
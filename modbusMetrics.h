@@ -0,0 +1,66 @@
+/*
+ * File:   modbusMetrics.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef MODBUSMETRICS_H
+#define MODBUSMETRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <pthread.h>
+
+
+//
+//  Log-linear (HDR style) latency buckets: each power of two microseconds is
+//  split into HISTOGRAM_SUB_BUCKETS linear steps, so every bucket is within
+//  ~12% of its value from 1us up to ~67 seconds
+#define HISTOGRAM_SUB_BITS          3
+#define HISTOGRAM_SUB_BUCKETS       ( 1 << HISTOGRAM_SUB_BITS )
+#define HISTOGRAM_MAGNITUDES        27
+#define HISTOGRAM_BUCKETS           ( HISTOGRAM_MAGNITUDES * HISTOGRAM_SUB_BUCKETS )
+
+#define MAX_CALL_SITES              40
+
+//
+//  Everything we know about one place in the code that talks to the SCC
+typedef struct  callSiteMetrics {
+    char        name[ 24 ];
+    long        calls;
+    long        errors;
+    long        timeouts;
+    long        crcErrors;
+    long        exceptions;                     // the SCC answered with a Modbus exception
+    long long   bytesOnWire;                    // request + response, for transactions we frame ourselves
+    long long   totalUS;
+    long long   maxUS;
+    uint32_t    histogram[ HISTOGRAM_BUCKETS ];
+} callSiteMetrics_t;
+
+typedef struct  modbusMetrics {
+    pthread_mutex_t     lock;
+    int                 numSites;
+    callSiteMetrics_t   sites[ MAX_CALL_SITES ];
+} modbusMetrics_t;
+
+
+extern  void        Metrics_Initialize( modbusMetrics_t *metrics );
+extern  long long   Metrics_Start( void );
+extern  void        Metrics_Record( modbusMetrics_t *metrics, const char *site, const long long startUS,
+                                    const int failed, const int errorNumber, const int bytes );
+extern  void        Metrics_RecordLibraryCall( modbusMetrics_t *metrics, const char *site, const long long startUS );
+extern  long long   Metrics_Percentile( const callSiteMetrics_t *site, const double percentile );
+extern  char        *Metrics_CreateJSONMessage( modbusMetrics_t *metrics, const char *topic, const int reset );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MODBUSMETRICS_H */
+
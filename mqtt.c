@@ -15,25 +15,107 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
-
-#include <cjson/cJSON.h>
+#include <pthread.h>
 
 #include "mqtt.h"
 #include "logger.h"
 #include "ls1024b.h"
 #include "commandQueue.h"
+#include "commandParser.h"
+#include "doCommand.h"
+#include "timestamp.h"
+#include "spool.h"
+#include "historyQuery.h"
 
 
 
 static  int              MQTT_Connected = FALSE;
-static  int              MQTT_defaultsSet = FALSE;
 
 
 static  struct mosquitto *myMQTTInstance = NULL;
-static  int             QoS = 0;                                // Quality of Service used by MQTT (0, 1 or 2)
+static  int             classQoS[ NUM_MQTT_CLASSES ];           // Quality of Service used by MQTT (0, 1 or 2), per topic class
+static  const char      *classNames[ NUM_MQTT_CLASSES ] = { "data", "metrics", "response", "command", "state" };
+static  const int       classRetained[ NUM_MQTT_CLASSES ] = { FALSE, FALSE, FALSE, FALSE, TRUE };
 
 static  char            *userData = NULL;
 
+//
+//  Publishes we've handed to libmosquitto and haven't heard back about, keyed by
+//  message ID. Message IDs go up by one, so "mid & (slots - 1)" is nearly always
+//  the right slot - if it's taken we look further along. The acknowledgement can
+//  beat mosquitto_publish() back to us, in which case it waits in the table for
+//  the publisher to claim it.
+#define INFLIGHT_SLOTS          512                             // power of two, comfortably > MQTT_MAX_WINDOW
+#define ACK_TIMEOUT_US          (30 * 1000000LL)                // past this we stop counting it against the window
+
+#define SLOT_FREE               0
+#define SLOT_SENT               1
+#define SLOT_ACKED_EARLY        2
+
+typedef struct  inFlight {
+    int         messageID;
+    int         state;
+    int         topicClass;
+    long long   timeUS;                                         // when it was published (or acked, if early)
+} inFlight_t;
+
+static  inFlight_t      inFlight[ INFLIGHT_SLOTS ];
+static  int             window = MQTT_DEFAULT_WINDOW;
+static  int             numInFlight = 0;
+static  mqttStats_t     stats;
+static  pthread_mutex_t publishLock = PTHREAD_MUTEX_INITIALIZER;       // the in-flight table, the backlog and MQTT_Connected
+
+//
+//  Published while we weren't connected. A ring, oldest at backlogHead, allocated
+//  the first time it's needed - the pollers can start publishing before MQTT_Initialize()
+typedef struct  backlogEntry {
+    int         topicClass;
+    char        *topic;
+    char        *payload;
+    int         length;
+} backlogEntry_t;
+
+static  backlogEntry_t  *backlog = NULL;
+static  int             backlogSize = MQTT_DEFAULT_BACKLOG;
+static  int             backlogHead = 0;
+static  int             backlogCount = 0;
+static  int             draining = FALSE;
+
+//
+//  With a spool (-S), DATA waits on disk instead, and a thread of its own feeds
+//  it back out at no more than replayRate messages a second
+#define DEFAULT_REPLAY_RATE     20
+#define MAX_REPLAY_RATE         1000
+
+static  int             replayRate = DEFAULT_REPLAY_RATE;
+static  pthread_cond_t  replayCondition;                        // on CLOCK_MONOTONIC - see setup()
+static  pthread_t       replayThread;
+static  int             replayStarted = FALSE;
+static  int             replayStopping = FALSE;                 // set by MQTT_Teardown(), under publishLock
+
+//
+//  libmosquitto does the reconnecting, waiting twice as long after each failure
+#define RECONNECT_MIN_SECONDS   2
+#define RECONNECT_MAX_SECONDS   120
+
+static  long long       disconnectedUS = 0;                     // when we lost the broker, monotonic
+static  int             everConnected = FALSE;
+static  long            reconnects = 0;                         // since startup - stats.reconnects gets reset
+
+//
+//  With a clean session the broker forgets our subscriptions every time we
+//  disconnect - remember them and subscribe again on each connect
+#define MAX_SUBSCRIPTIONS       32
+
+typedef struct  subscription {
+    char        topic[ 256 ];
+    int         QoS;
+} subscription_t;
+
+static  subscription_t  subscriptions[ MAX_SUBSCRIPTIONS ];
+static  int             numSubscriptions = 0;
+static  pthread_mutex_t subscriptionLock = PTHREAD_MUTEX_INITIALIZER;
+
 
 //
 // Forward declarations
@@ -43,16 +125,103 @@ static  void    defaultOnDisconnectedCallback( struct mosquitto *mosq, void *use
 static  void    defaultOnMessageReceivedCallback( struct mosquitto *mosq, void *userdata, const struct mosquitto_message *message );
 static  void    defaultOnSubscribedCallback( struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos );
 static  void    defaultOnUnsubscribedCallback( struct mosquitto *mosq, void *userdata, int result );
-static  void    defaultOnPublishedCallback( struct mosquitto *mosq, void *userdata, int result );
+static  void    defaultOnPublishedCallback( struct mosquitto *mosq, void *userdata, int messageID );
+static  void    *spoolReplayer( void *argPtr );
+
+
 
 
+static  pthread_once_t  setupOnce = PTHREAD_ONCE_INIT;
 
 
+// ---------------------------------------------------------------------------
+static
+void    setup (void)
+{
+    //
+    //  Everything at QoS 0 unless MQTT_SetPublishOptions() says otherwise - except the
+    //  retained state, which only goes out when it changes. Lose one and subscribers
+    //  have the wrong settings until the next change
+    memset( classQoS, '\0', sizeof classQoS );
+    classQoS[ MQTT_CLASS_STATE ] = 1;
+
+    //
+    //  The replayer's one second wake-up shouldn't jump when NTP sets the clock
+    pthread_condattr_t  conditionAttributes;
+    pthread_condattr_init( &conditionAttributes );
+    pthread_condattr_setclock( &conditionAttributes, CLOCK_MONOTONIC );
+    pthread_cond_init( &replayCondition, &conditionAttributes );
+    pthread_condattr_destroy( &conditionAttributes );
+}
+
 // ---------------------------------------------------------------------------
 void    MQTT_SetDefaults (const char *controllerID)
 {    
-    QoS = 0;    
-    MQTT_defaultsSet = TRUE;
+    //
+    //  The pollers start publishing before MQTT_Initialize() - DATA headed for the
+    //  spool signals replayCondition - so whoever gets here first does the setup
+    pthread_once( &setupOnce, setup );
+}
+
+// ---------------------------------------------------------------------------
+int     MQTT_SetPublishOptions (const char *spec)
+{
+    //
+    //  Spec looks like "data=0,metrics=0,response=1,command=1,window=32,buffer=256,replay=20".
+    //  Call before MQTT_Initialize(). Returns FALSE on a bad spec.
+    char    buffer[ 256 ];
+    char    *savePtr = NULL;
+    int     i;
+
+    MQTT_SetDefaults( NULL );
+    strncpy( buffer, spec, sizeof buffer - 1 );
+    buffer[ sizeof buffer - 1 ] = '\0';
+
+    char    *token = strtok_r( buffer, ",", &savePtr );
+    while (token != NULL) {
+        char    *equals = strchr( token, '=' );
+        if (equals == NULL)
+            return FALSE;
+        *equals = '\0';
+        int value = atoi( equals + 1 );
+
+        if (strcmp( token, "window" ) == 0) {
+            if (value < 1 || value > MQTT_MAX_WINDOW)
+                return FALSE;
+            window = value;
+        } else if (strcmp( token, "buffer" ) == 0) {
+            if (value < 0 || value > MQTT_MAX_BACKLOG)
+                return FALSE;
+            backlogSize = value;
+        } else if (strcmp( token, "replay" ) == 0) {
+            if (value < 1 || value > MAX_REPLAY_RATE)
+                return FALSE;
+            replayRate = value;
+        } else {
+            for (i = 0; i < NUM_MQTT_CLASSES; i += 1)
+                if (strcmp( token, classNames[ i ] ) == 0)
+                    break;
+            if (i == NUM_MQTT_CLASSES || value < 0 || value > 2)
+                return FALSE;
+            classQoS[ i ] = value;
+        }
+
+        token = strtok_r( NULL, ",", &savePtr );
+    }
+
+    return TRUE;
+}
+
+// ---------------------------------------------------------------------------
+int     MQTT_ClassQoS (const int topicClass)
+{
+    return classQoS[ topicClass ];
+}
+
+// ---------------------------------------------------------------------------
+const char  *MQTT_ClassName (const int topicClass)
+{
+    return classNames[ topicClass ];
 }
 
 
@@ -60,10 +229,8 @@ void    MQTT_SetDefaults (const char *controllerID)
 void    MQTT_Initialize (const char *controllerID, const char *brokerHost)
 {
     //
-    //  If we forgot to call 'setDefaults' do so
-    if (!MQTT_defaultsSet)
-        MQTT_SetDefaults( controllerID );
-    
+    //  If we forgot to call 'setDefaults' do so - it only ever runs once
+    MQTT_SetDefaults( controllerID );
     
     //
     // Here we get into Broker Specifics, for Mosquitto (www.mosquitto.org)
@@ -115,120 +282,509 @@ void    MQTT_Initialize (const char *controllerID, const char *brokerHost)
     mosquitto_subscribe_callback_set( myMQTTInstance, defaultOnSubscribedCallback );
     mosquitto_unsubscribe_callback_set( myMQTTInstance, defaultOnUnsubscribedCallback );
     
-    Logger_LogInfo( "Attempting to connect to MQTT broker on host [%s], port [%d]...\n", brokerHost, 1883 );
-    Logger_LogInfo( "If this call hangs, check to make sure the broker is running and reachable.\n" );
-    
-    int returnCode = 0;
-    if ( (returnCode = mosquitto_connect( myMQTTInstance, brokerHost, 1883, 60 )) != MOSQ_ERR_SUCCESS ) {
-        Logger_LogError( "Unable to connect MQTT to broker!\n" );
-        if (returnCode == MOSQ_ERR_INVAL)
-            Logger_LogError( "Check input parameters. One or more are invalid.\n" );
-        else {
-            returnCode = errno;
-            Logger_LogError( "Connect call returned an error (errno) of [%s].\n", strerror( returnCode ) );
-        }
-        Logger_LogFatal( "Cannot connect to the MQTT broker\n" );
+    //
+    //  Don't wait for the broker - at boot the network is often still coming up. The
+    //  mosquitto thread keeps trying, backing off, and defaultOnConnectedCallback()
+    //  takes it from there. Until then, what we publish goes into the backlog
+    mosquitto_reconnect_delay_set( myMQTTInstance, RECONNECT_MIN_SECONDS, RECONNECT_MAX_SECONDS, TRUE );
+
+    Logger_LogInfo( "Connecting to MQTT broker on host [%s], port [%d] in the background\n", brokerHost, 1883 );
+    int returnCode = mosquitto_connect_async( myMQTTInstance, brokerHost, 1883, 60 );
+    if (returnCode == MOSQ_ERR_INVAL)
+        Logger_LogFatal( "Unable to connect to the MQTT broker - check the host [%s]\n", brokerHost );
+    else if (returnCode != MOSQ_ERR_SUCCESS)
+        Logger_LogWarning( "MQTT broker [%s] not reachable yet (%s) - will keep trying\n",
+                           brokerHost, (returnCode == MOSQ_ERR_ERRNO) ? strerror( errno ) : mosquitto_strerror( returnCode ) );
+
+    //
+    //  Runs the network side, including the reconnects
+    if ((returnCode = mosquitto_loop_start( myMQTTInstance )) != MOSQ_ERR_SUCCESS)
+        Logger_LogFatal( "Unable to start the MQTT network thread: %s\n", mosquitto_strerror( returnCode ) );
+
+    if (Spool_IsOpen()) {
+        if (pthread_create( &replayThread, NULL, spoolReplayer, NULL ) != 0)
+            Logger_LogFatal( "Unable to start the spool replay thread!\n" );
+        replayStarted = TRUE;
     }
+}
+
+
+// -----------------------------------------------------------------------------
+static
+void    controllerIDFromTopic (const char *topic, char *controllerID, const int size)
+{
+    //
+    //  Topic is "<topTopic>/<controllerID>/COMMAND" - the ID is the second to last level
+    const char  *end = strrchr( topic, '/' );
+    const char  *start = end;
     
-    Logger_LogInfo( "Successfully connected to the broker\n" );
+    controllerID[ 0 ] = '\0';
+    if (end == NULL)
+        return;
     
-    //  even if we don't expect to receive any messages - things get published faster if we call "loop"
-    mosquitto_loop_start( myMQTTInstance );
-    MQTT_Connected = TRUE;
+    while (start > topic && *(start - 1) != '/')
+        start -= 1;
+    
+    int length = (int) (end - start);
+    if (length >= size)
+        length = size - 1;
+    memcpy( controllerID, start, length );
+    controllerID[ length ] = '\0';
 }
 
-
 // -----------------------------------------------------------------------------
 //static  
 void    MQTT_MessageReceivedHandler (struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg)
 {
     //
     //  Examples we expect
-    //  { "topic" : "LS1024B/x/COMMAND", "dateTime" : "x", "command" : "cmd", "iParam": N, "fParam" : X.X, "cParam" : "hh:mm:ss" }   
+    //  { "topic" : "LS1024B/x/COMMAND", "dateTime" : "x", "command" : "cmd", "iParam": N, "fParam" : X.X, "cParam" : "hh:mm:ss", "correlationID" : "abc" }
+    //  [ { "command" : "cmd", ... }, { "command" : "cmd", ... } ]
+    //  { "correlationID" : "abc", "coalesce" : true, "commands" : [ { "command" : "cmd", ... }, ... ] }
+    //  and on the QUERY topic
+    //  { "last" : 3600, "fields" : [ "batteryVoltage" ], "mode" : "summary" }
+
+    long long   receivedUS = Timestamp_EpochUS();
+
+    if (msg->payload == NULL || msg->payloadlen <= 0) {
+        Logger_LogError( "Received a null or zero length message\n" );
+        return;
+    }
 
-    char    *jsonPayload = msg->payload;
-    int     jsonLength = msg->payloadlen;
-    
     //
-    // Use Dave Gamble's cJSON code to parse
-    if (jsonPayload != NULL && jsonLength > 0) {
-        cJSON *json = cJSON_Parse( jsonPayload );
-        
-        if (json != NULL) {
-            //
-            //  Assume the best, malloc a command
-            mqttCommand_t   *cmd = malloc( sizeof( mqttCommand_t ));
-            cmd->command[ 0 ] = '\0';
-            cmd->cParam[ 0 ] = '\0';
-            cmd->iParam = 0;
-            cmd->fParam = 0.0;
+    //  Build the commands on the stack - the queue keeps its own copy. The
+    //  payload isn't NUL terminated, the parser works from its length
+    mqttCommand_t   commands[ COMMAND_BATCH_MAX ];
+    char            controllerID[ sizeof commands[ 0 ].controllerID ];
+    char            error[ 128 ];
+    int             i;
 
-            //
-            // Pick off the command
-            cJSON   *parameter = cJSON_GetObjectItemCaseSensitive( json, "command" );
-            if (cJSON_IsString( parameter ) && (parameter->valuestring != NULL)) 
-                strncpy( cmd->command, parameter->valuestring, sizeof cmd->command );
-       
-            //
-            // Now the Integer Parameter    
-            //  Nota Bene: ALL PARAMETERS ARE OPTIONAL
-            //
-            parameter = cJSON_GetObjectItemCaseSensitive( json, "iParam" );
-            if (cJSON_IsNumber( parameter )) 
-                cmd->iParam = parameter->valueint;
+    controllerIDFromTopic( msg->topic, controllerID, sizeof controllerID );
 
-            //
-            // Now the Floating Point Parameter
-            parameter = cJSON_GetObjectItemCaseSensitive( json, "fParam" );
-            if (cJSON_IsNumber( parameter )) 
-                cmd->fParam = parameter->valuedouble;
-            else
-                Logger_LogWarning( "No attributed named 'fParam' in the JSON message!\n" );
+    //
+    //  Questions about the history are answered on their own thread
+    const char  *lastLevel = strrchr( msg->topic, '/' );
+    if (lastLevel != NULL && strcmp( lastLevel, "/QUERY" ) == 0) {
+        if (!HistoryQuery_Submit( controllerID, msg->payload, msg->payloadlen, receivedUS ))
+            Logger_LogWarning( "History query for [%s] turned away\n", controllerID );
+        return;
+    }
 
-            //
-            // Pick off the String Parameter
-            parameter = cJSON_GetObjectItemCaseSensitive( json, "cParam" );
-            if (cJSON_IsString( parameter ) && (parameter->valuestring != NULL)) 
-                strncpy( cmd->cParam, parameter->valuestring, sizeof cmd->cParam );
+    //
+    //  Nota Bene: only 'command' is required, all parameters are optional
+    int numCommands = CommandParser_Parse( msg->payload, msg->payloadlen, commands, COMMAND_BATCH_MAX, error, sizeof error );
+    if (numCommands < 0) {
+        Logger_LogWarning( "Rejected command for [%s] on [%s] - %s\n", controllerID, msg->topic, error );
+        return;
+    }
 
-            //
-            // Add it to our Command Queue
-            Logger_LogDebug( "JSON COMMAND RECEIVED. Command [%s], iParam [%d], fParam [%0.2f], cParam [%s]\n",
-                            cmd->command, cmd->iParam, cmd->fParam, cmd->cParam );
+    //
+    //  A batch waits in the class of its most important command
+    int priority = COMMAND_PRIORITY_NORMAL;
+    for (i = 0; i < numCommands; i += 1) {
+        int commandPriority = DoCommand_Priority( commands[ i ].command );
+        if (commandPriority > priority)
+            priority = commandPriority;
+    }
 
-            //
-            //  Push it onto the FIFO queue
-            if (addElement( cmd ) == NULL)
-                Logger_LogError( "Command was NOT added to queue!\n" );
-        
-            cJSON_Delete( json );
+    for (i = 0; i < numCommands; i += 1) {
+        mqttCommand_t   *cmd = &commands[ i ];
+        strcpy( cmd->controllerID, controllerID );
+        cmd->receivedUS = receivedUS;
+        cmd->priority = priority;
+
+        Logger_LogDebug( "JSON COMMAND RECEIVED. Controller [%s], Command [%s], iParam [%d], fParam [%0.2f], cParam [%s] (%d of %d)\n",
+                        cmd->controllerID, cmd->command, cmd->iParam, cmd->fParam, cmd->cParam, i + 1, numCommands );
+    }
+
+    //
+    //  Push it onto the FIFO queue - a batch goes on as one unit, or not at all
+    if (!addElements( commands, numCommands ))
+        Logger_LogError( "Command queue full - %d command(s) starting with [%s] for [%s] were NOT added!\n",
+                         numCommands, commands[ 0 ].command, controllerID );
+}
+
+// ----------------------------------------------------------------------------
+static
+inFlight_t  *findSlot (const int messageID, const int state)
+{
+    //
+    //  With state == SLOT_FREE, finds somewhere to put messageID. Otherwise finds
+    //  messageID in that state. NULL if there isn't one. Hold publishLock
+    int     home = messageID & (INFLIGHT_SLOTS - 1);
+    int     i;
+
+    for (i = 0; i < INFLIGHT_SLOTS; i += 1) {
+        inFlight_t  *slot = &inFlight[ (home + i) & (INFLIGHT_SLOTS - 1) ];
+        if (slot->state == state && (state == SLOT_FREE || slot->messageID == messageID))
+            return slot;
+    }
+    return NULL;
+}
+
+// ----------------------------------------------------------------------------
+static
+void    recordAcknowledgement (const int topicClass, const long long latencyUS)
+{
+    //
+    //  Hold publishLock
+    mqttClassStats_t    *classStats = &stats.classes[ topicClass ];
+
+    classStats->acknowledged += 1;
+    classStats->totalAckUS += latencyUS;
+    if (latencyUS > classStats->maxAckUS)
+        classStats->maxAckUS = latencyUS;
+}
+
+// ----------------------------------------------------------------------------
+static
+void    reapStaleSlots (const long long nowUS)
+{
+    //
+    //  Publishes that were never acknowledged (the connection dropped, say) and early
+    //  acks nobody claimed would otherwise hold the window shut forever. Hold publishLock
+    int     i;
+
+    for (i = 0; i < INFLIGHT_SLOTS; i += 1) {
+        inFlight_t  *slot = &inFlight[ i ];
+        if (slot->state == SLOT_FREE || (nowUS - slot->timeUS) < ACK_TIMEOUT_US)
+            continue;
+
+        if (slot->state == SLOT_SENT) {
+            stats.classes[ slot->topicClass ].lost += 1;
+            numInFlight -= 1;
         }
-    } else {
-        Logger_LogError( "Received a null or zero length message\n" );
+        slot->state = SLOT_FREE;
     }
 }
 
 // ----------------------------------------------------------------------------
-void    MQTT_PublishData (const char *topic, const char *jsonMessage, const int length)
+static
+int     windowOpen (void)
 {
-    int     messageID;
-   
+    //
+    //  TRUE if there's room for another publish. Hold publishLock
+    if (numInFlight >= window)
+        reapStaleSlots( Timestamp_MonotonicUS() );
+    return (numInFlight < window);
+}
+
+// ----------------------------------------------------------------------------
+static
+void    freeEntry (backlogEntry_t *entry)
+{
+    free( entry->topic );
+    free( entry->payload );
+}
+
+// ----------------------------------------------------------------------------
+static
+int     pushBacklog (const int topicClass, const char *topic, const char *payload, const int length)
+{
+    //
+    //  Keep a copy to send once we're connected. A full backlog loses its oldest
+    //  message. FALSE if buffering is off or we're out of memory. Hold publishLock
+    if (backlogSize == 0)
+        return FALSE;
+    if (backlog == NULL && (backlog = calloc( backlogSize, sizeof( backlogEntry_t ) )) == NULL)
+        return FALSE;
+
+    char    *topicCopy = strdup( topic );
+    char    *payloadCopy = malloc( length > 0 ? length : 1 );
+    if (topicCopy == NULL || payloadCopy == NULL) {
+        free( topicCopy );
+        free( payloadCopy );
+        return FALSE;
+    }
+    memcpy( payloadCopy, payload, length );
+
+    if (backlogCount == backlogSize) {
+        stats.classes[ backlog[ backlogHead ].topicClass ].dropped += 1;
+        freeEntry( &backlog[ backlogHead ] );
+        backlogHead = (backlogHead + 1) % backlogSize;
+        backlogCount -= 1;
+    }
+
+    backlogEntry_t  *entry = &backlog[ (backlogHead + backlogCount) % backlogSize ];
+    entry->topicClass = topicClass;
+    entry->topic = topicCopy;
+    entry->payload = payloadCopy;
+    entry->length = length;
+
+    backlogCount += 1;
+    if (backlogCount > stats.maxBacklog)
+        stats.maxBacklog = backlogCount;
+    stats.classes[ topicClass ].buffered += 1;
+    return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+static
+void    unpopBacklog (backlogEntry_t *entry)
+{
+    //
+    //  Put back an entry we couldn't send - it's still the oldest. Hold publishLock
+    if (backlogCount == backlogSize) {
+        stats.classes[ entry->topicClass ].dropped += 1;
+        freeEntry( entry );
+        return;
+    }
+
+    backlogHead = (backlogHead + backlogSize - 1) % backlogSize;
+    backlog[ backlogHead ] = *entry;
+    backlogCount += 1;
+}
+
+// ----------------------------------------------------------------------------
+static
+int     sendMessage (const int topicClass, const char *topic, const char *payload, const int length)
+{
+    //
+    //  Hand it to libmosquitto and track it until it's acknowledged. Returns the
+    //  mosquitto error code - MOSQ_ERR_NO_CONN is left for the caller to buffer
+    int         messageID;
+    long long   startUS = Timestamp_MonotonicUS();
+
     int result = mosquitto_publish( myMQTTInstance,
                         &messageID, 
                         topic,
                         length,
-                        jsonMessage,
-                        QoS, 
-                        0 );
+                        payload,
+                        classQoS[ topicClass ], 
+                        classRetained[ topicClass ] );
     
+    if (result == MOSQ_ERR_NO_CONN)
+        return result;
+
     if (result != MOSQ_ERR_SUCCESS) {
-        Logger_LogError( "Unable to publish the message. Mosquitto error code: %d\n", result );
-    //  MOSQ_ERR_INVAL	if the input parameters were invalid.
-    //  MOSQ_ERR_NOMEM	if an out of memory condition occurred.
-    //  MOSQ_ERR_NO_CONN	if the client isn’t connected to a broker.
-    //  MOSQ_ERR_PROTOCOL	if there is a protocol error communicating with the broker.
-    //  MOSQ_ERR_PAYLOAD_SIZE	if payloadlen is too large.)
+        Logger_LogError( "Unable to publish the message to [%s]. Mosquitto error: %s\n", topic, mosquitto_strerror( result ) );
+        pthread_mutex_lock( &publishLock );
+        stats.classes[ topicClass ].failed += 1;
+        pthread_mutex_unlock( &publishLock );
+        return result;
     }        
+
+    //
+    //  Not holding the lock across mosquitto_publish() - the network thread may
+    //  already have been thru defaultOnPublishedCallback() with this messageID
+    pthread_mutex_lock( &publishLock );
+    stats.classes[ topicClass ].published += 1;
+
+    inFlight_t  *slot = findSlot( messageID, SLOT_ACKED_EARLY );
+    if (slot != NULL) {
+        recordAcknowledgement( topicClass, slot->timeUS - startUS );
+        slot->state = SLOT_FREE;
+    } else if ((slot = findSlot( messageID, SLOT_FREE )) != NULL) {
+        slot->messageID = messageID;
+        slot->topicClass = topicClass;
+        slot->timeUS = startUS;
+        slot->state = SLOT_SENT;
+        numInFlight += 1;
+        if (numInFlight > stats.maxInFlight)
+            stats.maxInFlight = numInFlight;
+    }
+    pthread_mutex_unlock( &publishLock );
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+// ----------------------------------------------------------------------------
+static
+void    drainBacklog (void)
+{
+    //
+    //  Send what piled up while we weren't connected, as fast as the window lets us.
+    //  Called by publishers and by the network thread as acknowledgements come in.
+    //  Only one of them drains at a time - the others just return, and the one
+    //  draining checks again after every message, so nothing gets stranded
+    backlogEntry_t  entry;
+
+    pthread_mutex_lock( &publishLock );
+    if (draining) {
+        pthread_mutex_unlock( &publishLock );
+        return;
+    }
+
+    draining = TRUE;
+    while (MQTT_Connected && backlogCount > 0 && windowOpen()) {
+        entry = backlog[ backlogHead ];
+        backlogHead = (backlogHead + 1) % backlogSize;
+        backlogCount -= 1;
+        pthread_mutex_unlock( &publishLock );
+
+        int result = sendMessage( entry.topicClass, entry.topic, entry.payload, entry.length );
+
+        pthread_mutex_lock( &publishLock );
+        if (result == MOSQ_ERR_NO_CONN) {
+            //
+            //  Lost it again - the disconnect callback will be along shortly
+            unpopBacklog( &entry );
+            break;
+        }
+        freeEntry( &entry );
+    }
+    draining = FALSE;
+    pthread_mutex_unlock( &publishLock );
+}
+
+// ----------------------------------------------------------------------------
+static
+int     holdForLater (const int topicClass, const char *topic, const char *payload, const int length)
+{
+    //
+    //  DATA goes to the spool if there is one, everything else (or DATA the spool
+    //  won't take) to the memory backlog. FALSE if it's lost. Hold publishLock
+    if (topicClass == MQTT_CLASS_DATA && Spool_Append( topicClass, topic, payload, length )) {
+        stats.classes[ topicClass ].buffered += 1;
+        pthread_cond_signal( &replayCondition );
+        return TRUE;
+    }
+
+    if (pushBacklog( topicClass, topic, payload, length ))
+        return TRUE;
+
+    stats.classes[ topicClass ].failed += 1;
+    return FALSE;
+}
+
+// ----------------------------------------------------------------------------
+static
+void    *spoolReplayer (void *argPtr)
+{
+    //
+    //  Started by MQTT_Initialize() when there's a spool. Sends it, oldest first,
+    //  while we're connected and there's room in the window - and no faster than
+    //  replayRate, so hours of backlog don't swamp the link the moment it's back.
+    //  New DATA keeps going into the spool behind it until it's empty. Runs until
+    //  MQTT_Teardown() sets replayStopping
+    spoolEntry_t    *entry = malloc( sizeof( spoolEntry_t ) );
+    long            pauseNS = 1000000000L / replayRate;
+    struct timespec pause = { pauseNS / 1000000000L, pauseNS % 1000000000L };
+    struct timespec deadline;
+
+    if (entry == NULL) {
+        Logger_LogError( "Out of memory - unable to replay the spool\n" );
+        return (void *) 0;
+    }
+
+    while (TRUE) {
+        pthread_mutex_lock( &publishLock );
+        while (!replayStopping && !(MQTT_Connected && Spool_Pending() > 0 && windowOpen())) {
+            //
+            //  Wake up now and again regardless - windowOpen() reaps stale entries
+            clock_gettime( CLOCK_MONOTONIC, &deadline );
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait( &replayCondition, &publishLock, &deadline );
+        }
+        int stopping = replayStopping;
+        pthread_mutex_unlock( &publishLock );
+
+        if (stopping)
+            break;
+
+        if (Spool_Peek( entry )) {
+            //
+            //  Anything but "not connected" moves us on - a message the broker won't
+            //  take would otherwise hold up everything behind it forever
+            if (sendMessage( entry->topicClass, entry->topic, entry->payload, entry->length ) != MOSQ_ERR_NO_CONN)
+                Spool_Commit( entry );
+        }
+        nanosleep( &pause, NULL );
+    }
+
+    free( entry );
+    return (void *) 0;
+}
+
+// ----------------------------------------------------------------------------
+int     MQTT_Backlogged (void)
+{
+    //
+    //  TRUE if the broker (or the network) isn't keeping up - the poller skips a
+    //  sample instead of piling another one up inside libmosquitto. Not while
+    //  we're disconnected - then samples go into the backlog
+    int     backlogged;
+
+    if (__atomic_load_n( &numInFlight, __ATOMIC_RELAXED ) < window)
+        return FALSE;
+
+    pthread_mutex_lock( &publishLock );
+    backlogged = (MQTT_Connected && !windowOpen());
+    pthread_mutex_unlock( &publishLock );
+    return backlogged;
+}
+
+// ----------------------------------------------------------------------------
+int     MQTT_IsConnected (void)
+{
+    return __atomic_load_n( &MQTT_Connected, __ATOMIC_RELAXED );
+}
+
+// ----------------------------------------------------------------------------
+long    MQTT_Reconnects (void)
+{
+    //
+    //  Goes up by one each time we get the broker back. Retained state is published
+    //  again when it does - a broker that restarted without persistence has lost it
+    return __atomic_load_n( &reconnects, __ATOMIC_RELAXED );
+}
+
+// ----------------------------------------------------------------------------
+int     MQTT_PublishData (const int topicClass, const char *topic, const char *jsonMessage, const int length)
+{
+    //
+    //  Returns MQTT_PUBLISH_OK (sent, or buffered until we're connected),
+    //  MQTT_PUBLISH_BUSY if the in-flight window is full (responses to commands
+    //  are always sent), or MQTT_PUBLISH_FAILED
+    int     buffered;
+
+    MQTT_SetDefaults( NULL );
+    pthread_mutex_lock( &publishLock );
+    if (!MQTT_Connected || backlogCount > 0 || (topicClass == MQTT_CLASS_DATA && Spool_Pending() > 0)) {
+        //
+        //  Not connected, or still catching up - get in line behind the others
+        buffered = holdForLater( topicClass, topic, jsonMessage, length );
+        pthread_mutex_unlock( &publishLock );
+
+        drainBacklog();
+        return (buffered ? MQTT_PUBLISH_OK : MQTT_PUBLISH_FAILED);
+    }
+
+    if (!windowOpen() && topicClass != MQTT_CLASS_RESPONSE) {
+        stats.classes[ topicClass ].refused += 1;
+        pthread_mutex_unlock( &publishLock );
+        return MQTT_PUBLISH_BUSY;
+    }
+    pthread_mutex_unlock( &publishLock );
+
+    int result = sendMessage( topicClass, topic, jsonMessage, length );
+    if (result == MOSQ_ERR_NO_CONN) {
+        //
+        //  The connection went before the callback told us
+        pthread_mutex_lock( &publishLock );
+        buffered = holdForLater( topicClass, topic, jsonMessage, length );
+        pthread_mutex_unlock( &publishLock );
+        return (buffered ? MQTT_PUBLISH_OK : MQTT_PUBLISH_FAILED);
+    }
+
+    return ((result == MOSQ_ERR_SUCCESS) ? MQTT_PUBLISH_OK : MQTT_PUBLISH_FAILED);
+}
+
+// ----------------------------------------------------------------------------
+void    MQTT_GetStats (mqttStats_t *statsOut, const int reset)
+{
+    pthread_mutex_lock( &publishLock );
+    *statsOut = stats;
+    statsOut->window = window;
+    statsOut->inFlight = numInFlight;
+    statsOut->connected = MQTT_Connected;
+    statsOut->backlog = backlogCount;
+    if (reset) {
+        memset( &stats, '\0', sizeof stats );
+        stats.maxInFlight = numInFlight;
+        stats.maxBacklog = backlogCount;
+    }
+    pthread_mutex_unlock( &publishLock );
 }
 
 // ----------------------------------------------------------------------------
@@ -236,6 +792,22 @@ void    MQTT_Teardown ()
 {
     Logger_LogInfo( "MQTT_Teardown() - we're shutting down the MQTT pipe.\n" );
 
+    //
+    //  The replayer publishes thru myMQTTInstance and reads the spool - it has to
+    //  be gone before either of them is
+    if (replayStarted) {
+        pthread_mutex_lock( &publishLock );
+        replayStopping = TRUE;
+        pthread_cond_signal( &replayCondition );
+        pthread_mutex_unlock( &publishLock );
+
+        if (pthread_join( replayThread, NULL ))
+            Logger_LogError( "Shutting down but unable to join the spool replay thread\n" );
+        replayStarted = FALSE;
+    }
+
+    mosquitto_disconnect( myMQTTInstance );
+    mosquitto_loop_stop( myMQTTInstance, FALSE );
     mosquitto_destroy( myMQTTInstance );
     mosquitto_lib_cleanup();
     MQTT_Connected = FALSE;
@@ -243,12 +815,9 @@ void    MQTT_Teardown ()
 
 
 // ----------------------------------------------------------------------------
-void    MQTT_Subscribe  (const char *topic, const int QoS)
-{   
-    //
-    //  Point to our subscription handler!
-    mosquitto_message_callback_set( myMQTTInstance, MQTT_MessageReceivedHandler );
-    
+static
+void    sendSubscription (const char *topic, const int QoS)
+{
     int returnCode = mosquitto_subscribe( myMQTTInstance,
                         NULL,                   // message ID, not needed
                         topic,                  // remember this is concatenated parent + subscribe
@@ -256,12 +825,46 @@ void    MQTT_Subscribe  (const char *topic, const int QoS)
   
     if (returnCode != MOSQ_ERR_SUCCESS)
         Logger_LogError( "Unable to subscribe to topic [%s], reason: %d\n", topic, returnCode );  
+}
+
+// ----------------------------------------------------------------------------
+void    MQTT_Subscribe  (const char *topic, const int QoS)
+{   
+    //
+    //  Point to our subscription handler!
+    mosquitto_message_callback_set( myMQTTInstance, MQTT_MessageReceivedHandler );
     
+    //
+    //  If we aren't connected yet it happens when we are - and again after every reconnect
+    pthread_mutex_lock( &subscriptionLock );
+    if (numSubscriptions == MAX_SUBSCRIPTIONS) {
+        pthread_mutex_unlock( &subscriptionLock );
+        Logger_LogError( "Unable to subscribe to topic [%s], already subscribed to %d topics\n", topic, MAX_SUBSCRIPTIONS );
+        return;
+    }
+    strncpy( subscriptions[ numSubscriptions ].topic, topic, sizeof subscriptions[ 0 ].topic - 1 );
+    subscriptions[ numSubscriptions ].QoS = QoS;
+    numSubscriptions += 1;
+
+    if (MQTT_IsConnected())
+        sendSubscription( topic, QoS );
+    pthread_mutex_unlock( &subscriptionLock );
 }
 
 // ----------------------------------------------------------------------------
 void    MQTT_Unsubscribe (const char *subscriptionTopic)
 {
+    int i;
+
+    pthread_mutex_lock( &subscriptionLock );
+    for (i = 0; i < numSubscriptions; i += 1) {
+        if (strcmp( subscriptions[ i ].topic, subscriptionTopic ) == 0) {
+            numSubscriptions -= 1;
+            subscriptions[ i ] = subscriptions[ numSubscriptions ];
+            break;
+        }
+    }
+    pthread_mutex_unlock( &subscriptionLock );
     
     int returnCode = mosquitto_unsubscribe( myMQTTInstance,
                         NULL,                       // message ID, not needed
@@ -292,8 +895,35 @@ void defaultOnConnectedCallback (struct mosquitto *mosq, void *userdata, int res
     //      4-255 - reserved for future use
     //
     if (result == 0) {
+        long long   nowUS = Timestamp_MonotonicUS();
+        int         i;
+
+        pthread_mutex_lock( &publishLock );
         MQTT_Connected = TRUE;
-        Logger_LogDebug( "MQTT Connection Callback. Connection to the broker was successful.\n" );
+        int pending = backlogCount;
+        if (everConnected)
+            stats.reconnects += 1;
+        pthread_mutex_unlock( &publishLock );
+        if (everConnected)
+            __atomic_add_fetch( &reconnects, 1, __ATOMIC_RELAXED );
+
+        if (!everConnected)
+            Logger_LogInfo( "Startup +%0.1f ms: connected to the MQTT broker, %d message(s) waiting to go out\n",
+                            Timestamp_SinceStartupMS(), pending );
+        else
+            Logger_LogWarning( "Reconnected to the MQTT broker after %0.1f seconds, %d message(s) waiting to go out\n",
+                               (nowUS - disconnectedUS) / 1000000.0, pending );
+        everConnected = TRUE;
+
+        //
+        //  Clean session - the broker doesn't remember what we'd subscribed to
+        pthread_mutex_lock( &subscriptionLock );
+        for (i = 0; i < numSubscriptions; i += 1)
+            sendSubscription( subscriptions[ i ].topic, subscriptions[ i ].QoS );
+        pthread_mutex_unlock( &subscriptionLock );
+
+        drainBacklog();
+        pthread_cond_signal( &replayCondition );
         
     } else {
         Logger_LogError( "MQTT Connection refused by broker --  " );
@@ -324,7 +954,29 @@ void defaultOnConnectedCallback (struct mosquitto *mosq, void *userdata, int res
 static
 void defaultOnDisconnectedCallback (struct mosquitto *mosq, void *userdata, int result)
 {
-    Logger_LogInfo( "MQTT *DIS*Connection Acknowledge Callback - Consider the **DIS**connection successful.\n" );
+    int     i;
+
+    //
+    //  QoS 0 messages still in flight are gone - libmosquitto only resends QoS 1 and 2
+    pthread_mutex_lock( &publishLock );
+    MQTT_Connected = FALSE;
+    for (i = 0; i < INFLIGHT_SLOTS; i += 1) {
+        inFlight_t  *slot = &inFlight[ i ];
+        if (slot->state == SLOT_SENT && classQoS[ slot->topicClass ] == 0) {
+            stats.classes[ slot->topicClass ].lost += 1;
+            slot->state = SLOT_FREE;
+            numInFlight -= 1;
+        }
+    }
+    pthread_mutex_unlock( &publishLock );
+    disconnectedUS = Timestamp_MonotonicUS();
+
+    if (result == 0)
+        Logger_LogInfo( "MQTT *DIS*Connection Acknowledge Callback - Consider the **DIS**connection successful.\n" );
+    else if (everConnected)
+        Logger_LogWarning( "Lost the connection to the MQTT broker - buffering until it's back\n" );
+    else
+        Logger_LogDebug( "Still no connection to the MQTT broker - buffering until there is\n" );
 }
 
 
@@ -354,10 +1006,36 @@ void defaultOnUnsubscribedCallback (struct mosquitto *mosq, void *userdata, int
 }
 
 // ------------------------------------------------------------------------------
+//
+//  Called when the broker has acknowledged a QoS 1 or 2 message, or once a QoS 0
+//  message has been written to the socket
+//
 static
-void defaultOnPublishedCallback (struct mosquitto *mosq, void *userdata, int result)
+void defaultOnPublishedCallback (struct mosquitto *mosq, void *userdata, int messageID)
 {
-    Logger_LogInfo( "MQTT Published to Topic Callback - The broker has received your message.\n" );    
+    long long   nowUS = Timestamp_MonotonicUS();
+
+    pthread_mutex_lock( &publishLock );
+    inFlight_t  *slot = findSlot( messageID, SLOT_SENT );
+    if (slot != NULL) {
+        recordAcknowledgement( slot->topicClass, nowUS - slot->timeUS );
+        slot->state = SLOT_FREE;
+        numInFlight -= 1;
+    } else if ((slot = findSlot( messageID, SLOT_FREE )) != NULL) {
+        //
+        //  Beat mosquitto_publish() back to the publisher - it'll pick this up
+        slot->messageID = messageID;
+        slot->timeUS = nowUS;
+        slot->state = SLOT_ACKED_EARLY;
+    }
+    int pending = backlogCount;
+    pthread_cond_signal( &replayCondition );
+    pthread_mutex_unlock( &publishLock );
+
+    //
+    //  Room in the window - keep the backlog moving
+    if (pending > 0)
+        drainBacklog();
 }
 
 #if 0
@@ -16,6 +16,54 @@ extern "C" {
 #include "ls1024b.h"
     
 #define MQTT_NOT_CONNECTED      (-1)
+
+//
+//  What we publish (and subscribe to) falls into a few classes - each gets its own QoS
+#define MQTT_CLASS_DATA         0           // <topTopic>/<id>/DATA
+#define MQTT_CLASS_METRICS      1           // <topTopic>/<id>/METRICS
+#define MQTT_CLASS_RESPONSE     2           // <topTopic>/<id>/RESPONSE - never held back
+#define MQTT_CLASS_COMMAND      3           // <topTopic>/<id>/COMMAND - the subscription
+#define MQTT_CLASS_STATE        4           // <topTopic>/<id>/SETTINGS, RATED, IDENTITY - retained
+#define NUM_MQTT_CLASSES        5
+
+//
+//  At most this many publishes handed to libmosquitto and not yet acknowledged
+//  (QoS 1/2) or written to the socket (QoS 0). Past that, everything but RESPONSE is refused
+#define MQTT_DEFAULT_WINDOW     32
+#define MQTT_MAX_WINDOW         256
+
+//
+//  Messages published while we aren't connected to the broker - at boot, or while it's
+//  away - are kept, oldest first, and sent ahead of anything new once we are
+#define MQTT_DEFAULT_BACKLOG    256
+#define MQTT_MAX_BACKLOG        8192
+
+#define MQTT_PUBLISH_OK         0
+#define MQTT_PUBLISH_BUSY       1           // window full - try again with the next sample
+#define MQTT_PUBLISH_FAILED     2           // (buffered messages count as MQTT_PUBLISH_OK)
+
+typedef struct  mqttClassStats {
+    long        published;
+    long        acknowledged;
+    long        refused;                    // MQTT_PUBLISH_BUSY
+    long        failed;
+    long        lost;                       // never acknowledged, given up on
+    long        buffered;                   // held for later - not connected
+    long        dropped;                    // pushed out of a full backlog, never sent
+    long long   totalAckUS;                 // publish to acknowledgement
+    long long   maxAckUS;
+} mqttClassStats_t;
+
+typedef struct  mqttStats {
+    int                 window;
+    int                 inFlight;
+    int                 maxInFlight;
+    int                 connected;
+    int                 backlog;
+    int                 maxBacklog;
+    long                reconnects;
+    mqttClassStats_t    classes[ NUM_MQTT_CLASSES ];
+} mqttStats_t;
     
     
 extern  void    MQTT_SetDefaults( const char *controllerID );
@@ -26,7 +74,14 @@ extern  void    MQTT_Subscribe( const char *topic, const int QoS );
 extern  void    MQTT_Unsubscribe( const char *topic );
 //extern  int     MQTT_SendReceive( void *aSystem );
 //extern  int     MQTT_HandleError( void *aSystem, int errorCode );
-extern  void    MQTT_PublishData( const char *topic, const char *data, const int length );
+extern  int     MQTT_PublishData( const int topicClass, const char *topic, const char *data, const int length );
+extern  int     MQTT_SetPublishOptions( const char *spec );
+extern  int     MQTT_ClassQoS( const int topicClass );
+extern  const char  *MQTT_ClassName( const int topicClass );
+extern  int     MQTT_Backlogged( void );
+extern  int     MQTT_IsConnected( void );
+extern  long    MQTT_Reconnects( void );
+extern  void    MQTT_GetStats( mqttStats_t *stats, const int reset );
 
 extern  void    MQTT_SetLastWillAndTestament( void *aSystem );
 
@@ -0,0 +1,115 @@
+/*
+ * File:    numberFormat.c
+ * author:  patrick conroy
+ *
+ * Decimal formatting for telemetry values, without snprintf.
+ *
+ * The old FP2xP macros rounded by casting to int, which rounds negative
+ * temperatures the wrong way (-3.25 became -3.2) and overflows for big energy
+ * totals.  Then "%1.15g" would still print tails like 12.300000000000001.
+ *
+ * Format_Fixed() scales the value once, rounds half away from zero into a
+ * 64 bit integer, and writes the digits itself. Trailing zeros after the
+ * decimal point are dropped (12.30 -> "12.3", 4.00 -> "4") to keep the
+ * payload small and match what we used to send.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "numberFormat.h"
+
+
+static  const long long powersOfTen[ FORMAT_MAX_PRECISION + 1 ] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL, 100000000LL, 1000000000LL
+};
+
+//
+//  Beyond this the scaled value won't fit in a long long
+#define MAX_SCALED      9.0e18
+
+
+// -----------------------------------------------------------------------------
+static
+int writeDigits (char *out, unsigned long long value)
+{
+    //
+    //  Digits come out backwards - build them at the end of a scratch buffer
+    char    scratch[ 24 ];
+    int     position = sizeof scratch;
+
+    do {
+        scratch[ --position ] = '0' + (char) (value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    int length = sizeof scratch - position;
+    memcpy( out, &scratch[ position ], length );
+    return length;
+}
+
+// -----------------------------------------------------------------------------
+int Format_Integer (char *out, const long long value)
+{
+    int length = 0;
+    unsigned long long  magnitude = (unsigned long long) value;
+
+    if (value < 0) {
+        out[ length++ ] = '-';
+        magnitude = 0ULL - magnitude;
+    }
+
+    length += writeDigits( &out[ length ], magnitude );
+    out[ length ] = '\0';
+    return length;
+}
+
+// -----------------------------------------------------------------------------
+int Format_Fixed (char *out, const double value, const int precision)
+{
+    //
+    //  Returns the length written, or -1 if the value can't be written this way
+    //  (NaN, Infinity, or too big) and the caller should fall back to something else
+    int     digits = (precision < 0) ? 0 : ((precision > FORMAT_MAX_PRECISION) ? FORMAT_MAX_PRECISION : precision);
+    int     negative = (value < 0.0);
+    double  scaled = (negative ? -value : value) * (double) powersOfTen[ digits ];
+
+    if (value != value || scaled >= MAX_SCALED)
+        return -1;
+
+    //
+    //  Round half away from zero - the same for -3.25 as for 3.25
+    unsigned long long  rounded = (unsigned long long) (scaled + 0.5);
+    unsigned long long  whole = rounded / (unsigned long long) powersOfTen[ digits ];
+    unsigned long long  fraction = rounded % (unsigned long long) powersOfTen[ digits ];
+
+    //
+    //  Drop trailing zeros from the fraction
+    while (digits > 0 && fraction % 10 == 0 && fraction != 0) {
+        fraction /= 10;
+        digits -= 1;
+    }
+    if (fraction == 0)
+        digits = 0;
+
+    int length = 0;
+    if (negative && (whole != 0 || fraction != 0))
+        out[ length++ ] = '-';
+
+    length += writeDigits( &out[ length ], whole );
+
+    if (digits > 0) {
+        out[ length++ ] = '.';
+
+        //
+        //  Leading zeros in the fraction, e.g. 0.05 at 2 digits
+        int i;
+        for (i = digits - 1; i > 0 && fraction < (unsigned long long) powersOfTen[ i ]; i -= 1)
+            out[ length++ ] = '0';
+        length += writeDigits( &out[ length ], fraction );
+    }
+
+    out[ length ] = '\0';
+    return length;
+}
@@ -0,0 +1,29 @@
+/*
+ * File:   numberFormat.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef NUMBERFORMAT_H
+#define NUMBERFORMAT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define FORMAT_MAX_LENGTH       32          // room for any number we'll write, plus the NUL
+#define FORMAT_MAX_PRECISION    9
+
+
+extern  int     Format_Integer( char *out, const long long value );
+extern  int     Format_Fixed( char *out, const double value, const int precision );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NUMBERFORMAT_H */
+
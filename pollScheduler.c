@@ -0,0 +1,173 @@
+/*
+ * File:    pollScheduler.c
+ * author:  patrick conroy
+ *
+ * Decide which of the SCC register blocks need to be read this cycle.
+ *
+ * Rated Data never changes and the Settings only change when we send a
+ * command, so there's no reason to pay for those serial round trips every
+ * time thru the loop. Each block gets its own refresh interval (in seconds).
+ * An interval of zero (REFRESH_ON_DEMAND) means the block is read once at
+ * startup and then only after someone calls Scheduler_Invalidate() - e.g.
+ * the command thread after a successful write.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "pollScheduler.h"
+
+
+static  const char  *blockNames[ NUM_POLL_BLOCKS ] = {
+    "rated", "realtime", "status", "settings", "statistics", "clock"
+};
+
+//
+//  Defaults - real-time values and the clock every second, status every other
+//  second, the daily/monthly counters once a minute, the constants only when needed
+static  const int   defaultIntervals[ NUM_POLL_BLOCKS ] = {
+    REFRESH_ON_DEMAND,                  // BLOCK_RATED_DATA
+    1,                                  // BLOCK_REALTIME_DATA
+    2,                                  // BLOCK_REALTIME_STATUS
+    REFRESH_ON_DEMAND,                  // BLOCK_SETTINGS
+    60,                                 // BLOCK_STATISTICS
+    1                                   // BLOCK_CLOCK
+};
+
+
+// -----------------------------------------------------------------------------
+static
+long long   nowMS (void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((long long) ts.tv_sec * 1000LL) + (ts.tv_nsec / 1000000L);
+}
+
+// -----------------------------------------------------------------------------
+void    Scheduler_Initialize (pollScheduler_t *scheduler)
+{
+    int i;
+
+    for (i = 0; i < NUM_POLL_BLOCKS; i += 1) {
+        scheduler->intervalSeconds[ i ] = defaultIntervals[ i ];
+        scheduler->lastReadMS[ i ] = -1;
+    }
+
+    //
+    //  Nothing has been read yet - everything is due on the first pass
+    scheduler->invalidMask = ALL_BLOCKS_MASK;
+    scheduler->claimedMask = 0;
+    pthread_mutex_init( &scheduler->lock, NULL );
+}
+
+// -----------------------------------------------------------------------------
+const char  *Scheduler_BlockName (const pollBlock_t block)
+{
+    if (block < 0 || block >= NUM_POLL_BLOCKS)
+        return "unknown";
+    return blockNames[ block ];
+}
+
+// -----------------------------------------------------------------------------
+int Scheduler_ParseIntervals (pollScheduler_t *scheduler, const char *spec)
+{
+    //
+    //  Spec looks like "realtime=1,status=2,statistics=60,settings=0,rated=0,clock=1"
+    //  Blocks not mentioned keep their current interval. Returns FALSE on a bad spec.
+    char    buffer[ 256 ];
+    char    *savePtr = NULL;
+
+    strncpy( buffer, spec, sizeof buffer - 1 );
+    buffer[ sizeof buffer - 1 ] = '\0';
+
+    char    *token = strtok_r( buffer, ",", &savePtr );
+    while (token != NULL) {
+        char    *equals = strchr( token, '=' );
+        if (equals == NULL)
+            return FALSE;
+        *equals = '\0';
+
+        int block;
+        for (block = 0; block < NUM_POLL_BLOCKS; block += 1)
+            if (strcmp( token, blockNames[ block ] ) == 0)
+                break;
+
+        int seconds = atoi( equals + 1 );
+        if (block >= NUM_POLL_BLOCKS || seconds < 0)
+            return FALSE;
+
+        scheduler->intervalSeconds[ block ] = seconds;
+        token = strtok_r( NULL, ",", &savePtr );
+    }
+
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+int Scheduler_DueBlocks (pollScheduler_t *scheduler)
+{
+    //
+    //  Return a mask of the blocks that should be read right now
+    long long   now = nowMS();
+    int         dueMask = 0;
+    int         i;
+
+    //
+    //  The invalidations are claimed by this poll. One that arrives while it's
+    //  in flight (a command just wrote the registers) stays in invalidMask for the next
+    pthread_mutex_lock( &scheduler->lock );
+    dueMask = scheduler->invalidMask;
+    scheduler->claimedMask |= scheduler->invalidMask;
+    scheduler->invalidMask = 0;
+
+    for (i = 0; i < NUM_POLL_BLOCKS; i += 1) {
+        if (scheduler->intervalSeconds[ i ] == REFRESH_ON_DEMAND)
+            continue;
+
+        //
+        //  Allow a little slop so a block on a 2s interval polled by a 1s loop
+        //  doesn't slip a whole cycle because the last read finished a few ms late
+        long long   intervalMS = (long long) scheduler->intervalSeconds[ i ] * 1000LL;
+        if (scheduler->lastReadMS[ i ] < 0 || (now - scheduler->lastReadMS[ i ]) >= (intervalMS - 50))
+            dueMask |= BLOCK_MASK( i );
+    }
+    pthread_mutex_unlock( &scheduler->lock );
+
+    return dueMask;
+}
+
+// -----------------------------------------------------------------------------
+void    Scheduler_MarkRead (pollScheduler_t *scheduler, const int blockMask)
+{
+    long long   now = nowMS();
+    int         i;
+
+    pthread_mutex_lock( &scheduler->lock );
+    for (i = 0; i < NUM_POLL_BLOCKS; i += 1) {
+        if (blockMask & BLOCK_MASK( i ))
+            scheduler->lastReadMS[ i ] = now;
+    }
+
+    //
+    //  Claimed blocks that weren't read are still invalid
+    scheduler->invalidMask |= (scheduler->claimedMask & ~blockMask);
+    scheduler->claimedMask = 0;
+    pthread_mutex_unlock( &scheduler->lock );
+}
+
+// -----------------------------------------------------------------------------
+void    Scheduler_Invalidate (pollScheduler_t *scheduler, const int blockMask)
+{
+    //
+    //  Called from the command thread - force these blocks to be read next cycle
+    pthread_mutex_lock( &scheduler->lock );
+    scheduler->invalidMask |= blockMask;
+    pthread_mutex_unlock( &scheduler->lock );
+}
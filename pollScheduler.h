@@ -0,0 +1,62 @@
+/*
+ * File:   pollScheduler.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef POLLSCHEDULER_H
+#define POLLSCHEDULER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+
+
+//
+//  The SCC documentation splits the registers into five blocks. Each one
+//  changes at a very different rate, so each one gets its own refresh interval.
+//  The real time clock sits in the middle of the settings registers but ticks
+//  every second, so it's a block of its own.
+typedef enum {
+    BLOCK_RATED_DATA = 0,
+    BLOCK_REALTIME_DATA,
+    BLOCK_REALTIME_STATUS,
+    BLOCK_SETTINGS,
+    BLOCK_STATISTICS,
+    BLOCK_CLOCK,
+    NUM_POLL_BLOCKS
+} pollBlock_t;
+
+#define BLOCK_MASK(b)       ( 1 << (b) )
+#define ALL_BLOCKS_MASK     ( (1 << NUM_POLL_BLOCKS) - 1 )
+
+//
+//  An interval of zero means "read once at startup and again only when invalidated"
+#define REFRESH_ON_DEMAND   0
+
+typedef struct  pollScheduler {
+    int             intervalSeconds[ NUM_POLL_BLOCKS ];
+    long long       lastReadMS[ NUM_POLL_BLOCKS ];      // monotonic, -1 == never read
+    int             invalidMask;                        // blocks someone asked us to re-read
+    int             claimedMask;                        // ... handed out by Scheduler_DueBlocks(), not yet marked read
+    pthread_mutex_t lock;
+} pollScheduler_t;
+
+
+extern  void    Scheduler_Initialize( pollScheduler_t *scheduler );
+extern  int     Scheduler_ParseIntervals( pollScheduler_t *scheduler, const char *spec );
+extern  int     Scheduler_DueBlocks( pollScheduler_t *scheduler );
+extern  void    Scheduler_MarkRead( pollScheduler_t *scheduler, const int blockMask );
+extern  void    Scheduler_Invalidate( pollScheduler_t *scheduler, const int blockMask );
+extern  const char  *Scheduler_BlockName( const pollBlock_t block );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POLLSCHEDULER_H */
+
@@ -0,0 +1,575 @@
+/*
+ * File:    registerMap.c
+ * author:  patrick conroy
+ *
+ * The LS10x4B library reads the SCC one or two registers at a time. At
+ * 115200 baud each of those request/response pairs pays the RTU framing plus
+ * the 3.5 character silent interval, and a full poll is ~70 of them.
+ *
+ * Here we keep a map of which registers each block needs, and a little
+ * planner that sorts those ranges and merges adjacent (or nearly adjacent)
+ * ones into the fewest spans, up to MODBUS_MAX_READ_REGISTERS each.  The
+ * spans are read into a local register image and then decoded into the same
+ * structures the library fills in.  A full poll becomes ~6 round trips.
+ *
+ * Some firmware answers ILLEGAL DATA ADDRESS if a span crosses an undefined
+ * register. If that happens we fall back to reading that span's ranges one
+ * at a time and stop bridging gaps from then on.
+ *
+ * Each span is its own bus transaction, so a command waiting on the arbiter
+ * gets in between spans rather than waiting for the whole poll.
+ *
+ * Rated Data is only read on demand (startup and after a command) so it is
+ * still fetched with the library's getRatedData().
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <modbus/modbus.h>
+
+#include "logger.h"
+#include "ls1024b.h"
+#include "pollScheduler.h"
+#include "busArbiter.h"
+#include "modbusMetrics.h"
+#include "registerMap.h"
+
+
+#define IREG(img,addr)      ( (img)->input[ (addr) - INPUT_REGISTER_BASE ] )
+#define HREG(img,addr)      ( (img)->holding[ (addr) - HOLDING_REGISTER_BASE ] )
+
+#define END_OF_RANGES       { INPUT_REGISTERS, 0, 0 }
+#define MAX_NEEDED_RANGES   64
+
+//
+//  The register ranges each block needs - straight from the EPSolar LS-B protocol document
+static  const registerSpan_t   realTimeDataRanges[] = {
+    { INPUT_REGISTERS,   0x3100, 4 },           // PV array voltage, current, power L/H
+    { INPUT_REGISTERS,   0x310C, 2 },           // load voltage, current
+    { INPUT_REGISTERS,   0x3110, 2 },           // battery temp, case temp
+    { INPUT_REGISTERS,   0x311A, 2 },           // battery SOC, remote battery temp
+    END_OF_RANGES
+};
+
+static  const registerSpan_t   realTimeStatusRanges[] = {
+    { INPUT_REGISTERS,   0x3200, 3 },           // battery, charging and discharging status
+    END_OF_RANGES
+};
+
+static  const registerSpan_t   settingsRanges[] = {
+    { HOLDING_REGISTERS, 0x9000, 15 },          // battery type thru discharging limit voltage
+    { HOLDING_REGISTERS, 0x9017, 6 },           // temperature limits
+    { HOLDING_REGISTERS, 0x901E, 4 },           // night/day threshold voltages and delays
+    { HOLDING_REGISTERS, 0x903D, 3 },           // load controlling mode, working time lengths
+    { HOLDING_REGISTERS, 0x9042, 12 },          // turn on/off timings
+    { HOLDING_REGISTERS, 0x9065, 1 },           // length of night
+    { HOLDING_REGISTERS, 0x9067, 1 },           // battery rated voltage code
+    { HOLDING_REGISTERS, 0x9069, 6 },           // load timing selection thru charging percentage
+    { HOLDING_REGISTERS, 0x9070, 1 },           // battery management mode
+    END_OF_RANGES
+};
+
+static  const registerSpan_t   statisticsRanges[] = {
+    { INPUT_REGISTERS,   0x3300, 20 },          // min/max voltages, energy counters
+    { INPUT_REGISTERS,   0x331A, 3 },           // battery voltage, battery current L/H
+    END_OF_RANGES
+};
+
+static  const registerSpan_t   clockRanges[] = {
+    { HOLDING_REGISTERS, 0x9013, 3 },           // real time clock
+    END_OF_RANGES
+};
+
+static  const registerSpan_t   emptyRanges[] = {
+    END_OF_RANGES
+};
+
+static  const registerSpan_t   *blockRanges[ NUM_POLL_BLOCKS ] = {
+    emptyRanges,                                // BLOCK_RATED_DATA - library call
+    realTimeDataRanges,                         // BLOCK_REALTIME_DATA
+    realTimeStatusRanges,                       // BLOCK_REALTIME_STATUS
+    settingsRanges,                             // BLOCK_SETTINGS
+    statisticsRanges,                           // BLOCK_STATISTICS
+    clockRanges                                 // BLOCK_CLOCK
+};
+
+
+//
+//  How many unused registers we're willing to read to save a round trip.
+//  Reading a few extra registers is much cheaper than another frame.
+static  int             maxGap = 8;
+
+//
+//  Plans only depend on the block mask, so cache them
+static  registerSpan_t  planCache[ ALL_BLOCKS_MASK + 1 ][ MAX_PLANNED_SPANS ];
+static  int             planCount[ ALL_BLOCKS_MASK + 1 ];
+static  int             planCacheValid = FALSE;
+static  pthread_mutex_t planLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// -----------------------------------------------------------------------------
+static
+int compareSpans (const void *a, const void *b)
+{
+    const registerSpan_t    *spanA = a;
+    const registerSpan_t    *spanB = b;
+
+    if (spanA->table != spanB->table)
+        return (spanA->table - spanB->table);
+    return (spanA->start - spanB->start);
+}
+
+// -----------------------------------------------------------------------------
+static
+int collectRanges (const int blockMask, registerSpan_t *ranges, const int maxRanges)
+{
+    int numRanges = 0;
+    int block;
+
+    for (block = 0; block < NUM_POLL_BLOCKS; block += 1) {
+        if (!(blockMask & BLOCK_MASK( block )))
+            continue;
+
+        const registerSpan_t    *range = blockRanges[ block ];
+        while (range->count > 0 && numRanges < maxRanges)
+            ranges[ numRanges++ ] = *range++;
+    }
+
+    return numRanges;
+}
+
+// -----------------------------------------------------------------------------
+static
+int planSpans (const int blockMask, registerSpan_t *spans, const int maxSpans)
+{
+    registerSpan_t  ranges[ MAX_NEEDED_RANGES ];
+    int             numRanges = collectRanges( blockMask, ranges, MAX_NEEDED_RANGES );
+    int             numSpans = 0;
+    int             i;
+
+    if (numRanges == 0)
+        return 0;
+
+    qsort( ranges, numRanges, sizeof( registerSpan_t ), compareSpans );
+
+    registerSpan_t  current = ranges[ 0 ];
+    for (i = 1; i < numRanges; i += 1) {
+        int currentEnd = current.start + current.count;
+        int rangeEnd = ranges[ i ].start + ranges[ i ].count;
+        int newEnd = (rangeEnd > currentEnd) ? rangeEnd : currentEnd;
+
+        if (ranges[ i ].table == current.table &&
+                ranges[ i ].start <= currentEnd + maxGap &&
+                (newEnd - current.start) <= MODBUS_MAX_READ_REGISTERS) {
+            current.count = newEnd - current.start;
+        } else {
+            if (numSpans < maxSpans)
+                spans[ numSpans++ ] = current;
+            current = ranges[ i ];
+        }
+    }
+
+    if (numSpans < maxSpans)
+        spans[ numSpans++ ] = current;
+
+    return numSpans;
+}
+
+// -----------------------------------------------------------------------------
+void    RegisterMap_SetMaxGap (const int registers)
+{
+    pthread_mutex_lock( &planLock );
+    maxGap = (registers < 0) ? 0 : registers;
+    planCacheValid = FALSE;
+    pthread_mutex_unlock( &planLock );
+}
+
+// -----------------------------------------------------------------------------
+int RegisterMap_Plan (const int blockMask, registerSpan_t *spans, const int maxSpans)
+{
+    int mask = blockMask & ALL_BLOCKS_MASK;
+    int i;
+
+    pthread_mutex_lock( &planLock );
+    if (!planCacheValid) {
+        for (i = 0; i <= ALL_BLOCKS_MASK; i += 1)
+            planCount[ i ] = -1;
+        planCacheValid = TRUE;
+    }
+
+    if (planCount[ mask ] < 0) {
+        planCount[ mask ] = planSpans( mask, planCache[ mask ], MAX_PLANNED_SPANS );
+        Logger_LogDebug( "Register plan for block mask 0x%02X: %d spans\n", mask, planCount[ mask ] );
+    }
+
+    int numSpans = (planCount[ mask ] < maxSpans) ? planCount[ mask ] : maxSpans;
+    memcpy( spans, planCache[ mask ], numSpans * sizeof( registerSpan_t ) );
+    pthread_mutex_unlock( &planLock );
+
+    return numSpans;
+}
+
+// -----------------------------------------------------------------------------
+static
+const char  *spanSiteName (const registerSpan_t *span)
+{
+    //
+    //  Metrics call site for a span - the blocks live in separate address ranges
+    if (span->table == HOLDING_REGISTERS)
+        return "settings";
+    if (span->start >= 0x3300)
+        return "statistics";
+    if (span->start >= 0x3200)
+        return "status";
+    if (span->start >= 0x3100)
+        return "realtime";
+    return "rated";
+}
+
+// -----------------------------------------------------------------------------
+int RegisterMap_ReadSpan (busArbiter_t *bus, const int slaveID, modbusMetrics_t *metrics, registerImage_t *image,
+                          const registerSpan_t *span, const int priority)
+{
+    //
+    //  One span == one transaction on the bus. Returns -1 on error (see errno)
+    modbus_t    *ctx = Arbiter_Acquire( bus, slaveID, priority );
+    long long   startUS = Metrics_Start();
+    int         result;
+    
+    if (span->table == INPUT_REGISTERS)
+        result = modbus_read_input_registers( ctx, span->start, span->count,
+                                            &IREG( image, span->start ) );
+    else
+        result = modbus_read_registers( ctx, span->start, span->count,
+                                            &HREG( image, span->start ) );
+    
+    int savedErrno = errno;
+    Arbiter_Release( bus );
+
+    //
+    //  RTU read request is 8 bytes. Response is addr + fc + count + data + crc, or 5 bytes for an exception
+    int bytes = 8 + ((result == -1) ? 5 : (5 + (2 * span->count)));
+    Metrics_Record( metrics, spanSiteName( span ), startUS, (result == -1), savedErrno, bytes );
+    errno = savedErrno;
+    
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+void    RegisterMap_CopySpan (registerImage_t *destination, const registerImage_t *source, const registerSpan_t *span)
+{
+    if (span->table == INPUT_REGISTERS)
+        memcpy( &IREG( destination, span->start ), &IREG( source, span->start ), span->count * sizeof( uint16_t ) );
+    else
+        memcpy( &HREG( destination, span->start ), &HREG( source, span->start ), span->count * sizeof( uint16_t ) );
+}
+
+// -----------------------------------------------------------------------------
+int RegisterMap_WriteHolding (modbus_t *ctx, modbusMetrics_t *metrics, const int start, const int count, const uint16_t *values)
+{
+    //
+    //  Several adjacent holding registers in one Write Multiple Registers (0x10)
+    //  transaction. The caller already holds the bus (so a batch of commands can
+    //  keep it between writes). Returns -1 on error (see errno)
+    long long   startUS = Metrics_Start();
+    int         result = modbus_write_registers( ctx, start, count, values );
+    int         savedErrno = errno;
+
+    //
+    //  RTU request is addr + fc + start + count + byte count + data + crc. Response is 8 bytes, 5 for an exception
+    int bytes = (9 + (2 * count)) + ((result == -1) ? 5 : 8);
+    Metrics_Record( metrics, "writeRegisters", startUS, (result == -1), savedErrno, bytes );
+    errno = savedErrno;
+
+    return result;
+}
+
+// -----------------------------------------------------------------------------
+static
+int readSpanPiecewise (busArbiter_t *bus, const int slaveID, modbusMetrics_t *metrics, registerImage_t *image,
+                        const registerSpan_t *span, const int blockMask)
+{
+    //
+    //  The coalesced read was refused - read the original ranges inside this span one at a time
+    registerSpan_t  ranges[ MAX_NEEDED_RANGES ];
+    int             numRanges = collectRanges( blockMask, ranges, MAX_NEEDED_RANGES );
+    int             i;
+
+    for (i = 0; i < numRanges; i += 1) {
+        if (ranges[ i ].table != span->table ||
+                ranges[ i ].start < span->start ||
+                ranges[ i ].start >= span->start + span->count)
+            continue;
+
+        if (RegisterMap_ReadSpan( bus, slaveID, metrics, image, &ranges[ i ], BUS_PRIORITY_POLL ) == -1) {
+            Logger_LogError( "Register read failed at 0x%04X (%d registers): %s\n",
+                            ranges[ i ].start, ranges[ i ].count, modbus_strerror( errno ) );
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+int RegisterMap_ReadBlocks (busArbiter_t *bus, const int slaveID, modbusMetrics_t *metrics,
+                            registerImage_t *image, const int blockMask)
+{
+    //
+    //  Read everything the blocks in 'blockMask' need. Returns the mask of blocks
+    //  whose registers were all read successfully.
+    registerSpan_t  spans[ MAX_PLANNED_SPANS ];
+    int             spanOK[ MAX_PLANNED_SPANS ];
+    int             numSpans = RegisterMap_Plan( blockMask, spans, MAX_PLANNED_SPANS );
+    int             i;
+
+    for (i = 0; i < numSpans; i += 1) {
+        spanOK[ i ] = (RegisterMap_ReadSpan( bus, slaveID, metrics, image, &spans[ i ], BUS_PRIORITY_POLL ) != -1);
+
+        if (!spanOK[ i ] && errno == EMBXILADD) {
+            Logger_LogWarning( "SCC refused span 0x%04X-0x%04X. No longer bridging register gaps.\n",
+                            spans[ i ].start, spans[ i ].start + spans[ i ].count - 1 );
+            RegisterMap_SetMaxGap( 0 );
+            spanOK[ i ] = readSpanPiecewise( bus, slaveID, metrics, image, &spans[ i ], blockMask );
+
+        } else if (!spanOK[ i ]) {
+            Logger_LogError( "Register read failed at 0x%04X (%d registers): %s\n",
+                            spans[ i ].start, spans[ i ].count, modbus_strerror( errno ) );
+        }
+    }
+
+    //
+    //  A block is good only if every span covering one of its ranges was read
+    int readMask = 0;
+    int block;
+    for (block = 0; block < NUM_POLL_BLOCKS; block += 1) {
+        if (!(blockMask & BLOCK_MASK( block )))
+            continue;
+
+        int blockOK = TRUE;
+        const registerSpan_t    *range = blockRanges[ block ];
+        for (; range->count > 0 && blockOK; range += 1) {
+            for (i = 0; i < numSpans; i += 1)
+                if (range->table == spans[ i ].table &&
+                        range->start >= spans[ i ].start &&
+                        range->start < spans[ i ].start + spans[ i ].count)
+                    break;
+            blockOK = (i < numSpans && spanOK[ i ]);
+        }
+
+        if (blockOK)
+            readMask |= BLOCK_MASK( block );
+    }
+
+    return readMask;
+}
+
+
+// -----------------------------------------------------------------------------
+//  Decoders - scaling and bit layouts follow the LS-B protocol document
+// -----------------------------------------------------------------------------
+static
+float   unsigned100 (const uint16_t reg)
+{
+    return ((float) reg) / 100.0;
+}
+
+// -----------------------------------------------------------------------------
+static
+float   signed100 (const uint16_t reg)
+{
+    return ((float) ((int16_t) reg)) / 100.0;
+}
+
+// -----------------------------------------------------------------------------
+static
+float   unsigned100x2 (const uint16_t low, const uint16_t high)
+{
+    return ((float) (((uint32_t) high << 16) | low)) / 100.0;
+}
+
+// -----------------------------------------------------------------------------
+static
+float   signed100x2 (const uint16_t low, const uint16_t high)
+{
+    return ((float) ((int32_t) (((uint32_t) high << 16) | low))) / 100.0;
+}
+
+// -----------------------------------------------------------------------------
+static
+float   C2F (const float celsius)
+{
+    return (celsius * 9.0 / 5.0) + 32.0;
+}
+
+// -----------------------------------------------------------------------------
+void    RegisterMap_DecodeRealTimeData (const registerImage_t *image, RealTimeData_t *rtData)
+{
+    rtData->pvArrayVoltage = unsigned100( IREG( image, 0x3100 ) );
+    rtData->pvArrayCurrent = unsigned100( IREG( image, 0x3101 ) );
+    rtData->loadVoltage = unsigned100( IREG( image, 0x310C ) );
+    rtData->loadCurrent = unsigned100( IREG( image, 0x310D ) );
+    rtData->batteryTemp = C2F( signed100( IREG( image, 0x3110 ) ) );
+    rtData->caseTemp = C2F( signed100( IREG( image, 0x3111 ) ) );
+    rtData->batterySOC = IREG( image, 0x311A );
+    rtData->remoteBatteryTemperature = C2F( signed100( IREG( image, 0x311B ) ) );
+}
+
+// -----------------------------------------------------------------------------
+void    RegisterMap_DecodeRealTimeStatus (const registerImage_t *image, RealTimeStatus_t *rtStatusData)
+{
+    static  const char  *batteryVoltage[] = { "Normal", "Overvolt", "Under Volt", "Low Volt Disconnect", "Fault" };
+    static  const char  *batteryTemperature[] = { "Normal", "Over Temp", "Low Temp" };
+    static  const char  *chargingStatus[] = { "Not charging", "Float", "Boost", "Equalization" };
+    static  const char  *chargingInput[] = { "Normal", "No power connected", "Higher volt input", "Input volt error" };
+    static  const char  *dischargingInput[] = { "Normal", "Low", "High", "No access input volt error" };
+    static  const char  *outputPower[] = { "Light load", "Moderate", "Rated", "Overload" };
+
+    uint16_t    battery = IREG( image, 0x3200 );
+    uint16_t    charging = IREG( image, 0x3201 );
+    uint16_t    discharging = IREG( image, 0x3202 );
+
+    int         voltageCode = battery & 0x000F;
+    int         temperatureCode = (battery & 0x00F0) >> 4;
+
+    snprintf( rtStatusData->batteryStatusVoltage, sizeof rtStatusData->batteryStatusVoltage, "%s",
+                (voltageCode <= 4) ? batteryVoltage[ voltageCode ] : "Unknown" );
+    snprintf( rtStatusData->batteryStatusTemperature, sizeof rtStatusData->batteryStatusTemperature, "%s",
+                (temperatureCode <= 2) ? batteryTemperature[ temperatureCode ] : "Unknown" );
+    snprintf( rtStatusData->batteryInnerResistance, sizeof rtStatusData->batteryInnerResistance, "%s",
+                (battery & 0x0100) ? "Abnormal" : "Normal" );
+    snprintf( rtStatusData->batteryCorrectIdentification, sizeof rtStatusData->batteryCorrectIdentification, "%s",
+                (battery & 0x8000) ? "Wrong identification for rated voltage" : "Correct" );
+
+    snprintf( rtStatusData->chargingStatus, sizeof rtStatusData->chargingStatus, "%s",
+                chargingStatus[ (charging & 0x000C) >> 2 ] );
+    snprintf( rtStatusData->chargingInputVoltageStatus, sizeof rtStatusData->chargingInputVoltageStatus, "%s",
+                chargingInput[ (charging & 0xC000) >> 14 ] );
+    rtStatusData->chargingStatusRunning = ((charging & 0x0001) != 0);
+    rtStatusData->chargingStatusNormal = ((charging & 0x0002) == 0);
+    rtStatusData->inputOverpressure = (((charging & 0xC000) >> 14) == 2);
+    rtStatusData->chargingMOSFETShort = ((charging & 0x2000) != 0);
+    rtStatusData->someMOSFETShort = ((charging & 0x1000) != 0);
+    rtStatusData->antiReverseMOSFETShort = ((charging & 0x0800) != 0);
+    rtStatusData->inputIsOverCurrent = ((charging & 0x0400) != 0);
+    rtStatusData->loadIsOverCurrent = ((charging & 0x0200) != 0);
+    rtStatusData->loadIsShort = ((charging & 0x0100) != 0);
+    rtStatusData->loadMOSFETIsShort = ((charging & 0x0080) != 0);
+    rtStatusData->pvInputIsShort = ((charging & 0x0010) != 0);
+
+    snprintf( rtStatusData->dischargingInputVoltageStatus, sizeof rtStatusData->dischargingInputVoltageStatus, "%s",
+                dischargingInput[ (discharging & 0xC000) >> 14 ] );
+    snprintf( rtStatusData->dischargingOutputPower, sizeof rtStatusData->dischargingOutputPower, "%s",
+                outputPower[ (discharging & 0x3000) >> 12 ] );
+    rtStatusData->dischargingStatusRunning = ((discharging & 0x0001) != 0);
+    rtStatusData->dischargingStatusNormal = ((discharging & 0x0002) == 0);
+    rtStatusData->dischargingShortCircuit = ((discharging & 0x0800) != 0);
+    rtStatusData->unableToDischarge = ((discharging & 0x0400) != 0);
+    rtStatusData->unableToStopDischarging = ((discharging & 0x0200) != 0);
+    rtStatusData->outputVoltageAbnormal = ((discharging & 0x0100) != 0);
+    rtStatusData->highVoltageSideShort = ((discharging & 0x0040) != 0);
+    rtStatusData->boostOverpressure = ((discharging & 0x0020) != 0);
+    rtStatusData->outputOverpressure = ((discharging & 0x0010) != 0);
+}
+
+// -----------------------------------------------------------------------------
+void    RegisterMap_DecodeSettings (const registerImage_t *image, Settings_t *setData)
+{
+    static  const char  *batteryTypes[] = { "User Defined", "Sealed", "GEL", "Flooded" };
+    uint16_t    batteryType = HREG( image, 0x9000 );
+
+    snprintf( setData->batteryType, sizeof setData->batteryType, "%s",
+                (batteryType <= 3) ? batteryTypes[ batteryType ] : "Unknown" );
+    setData->batteryCapacity = HREG( image, 0x9001 );
+    setData->tempCompensationCoeff = unsigned100( HREG( image, 0x9002 ) );
+    setData->highVoltageDisconnect = unsigned100( HREG( image, 0x9003 ) );
+    setData->chargingLimitVoltage = unsigned100( HREG( image, 0x9004 ) );
+    setData->overVoltageReconnect = unsigned100( HREG( image, 0x9005 ) );
+    setData->equalizationVoltage = unsigned100( HREG( image, 0x9006 ) );
+    setData->boostVoltage = unsigned100( HREG( image, 0x9007 ) );
+    setData->floatVoltage = unsigned100( HREG( image, 0x9008 ) );
+    setData->boostReconnectVoltage = unsigned100( HREG( image, 0x9009 ) );
+    setData->lowVoltageReconnect = unsigned100( HREG( image, 0x900A ) );
+    setData->underVoltageRecover = unsigned100( HREG( image, 0x900B ) );
+    setData->underVoltageWarning = unsigned100( HREG( image, 0x900C ) );
+    setData->lowVoltageDisconnect = unsigned100( HREG( image, 0x900D ) );
+    setData->dischargingLimitVoltage = unsigned100( HREG( image, 0x900E ) );
+
+    //
+    //  Temperatures in the same units as the "temperatures" object
+    setData->batteryTempWarningUpperLimit = C2F( signed100( HREG( image, 0x9017 ) ) );
+    setData->batteryTempWarningLowerLimit = C2F( signed100( HREG( image, 0x9018 ) ) );
+    setData->controllerInnerTempUpperLimit = C2F( signed100( HREG( image, 0x9019 ) ) );
+    setData->controllerInnerTempUpperLimitRecover = C2F( signed100( HREG( image, 0x901A ) ) );
+    setData->powerComponentTempUpperLimit = C2F( signed100( HREG( image, 0x901B ) ) );
+    setData->powerComponentTempUpperLimitRecover = C2F( signed100( HREG( image, 0x901C ) ) );
+
+    setData->lighttimeThresholdVoltage = unsigned100( HREG( image, 0x901E ) );
+    setData->lightSignalStartupTime = HREG( image, 0x901F );
+    setData->daytimeThresholdVoltage = unsigned100( HREG( image, 0x9020 ) );
+    setData->lightSignalCloseDelayTime = HREG( image, 0x9021 );
+
+    setData->localControllingModes = HREG( image, 0x903D );
+    setData->workingTimeLength1 = HREG( image, 0x903E );
+    setData->workingTimeLength2 = HREG( image, 0x903F );
+
+    setData->turnOnTiming1_seconds = HREG( image, 0x9042 );
+    setData->turnOnTiming1_minutes = HREG( image, 0x9043 );
+    setData->turnOnTiming1_hours = HREG( image, 0x9044 );
+    setData->turnOffTiming1_seconds = HREG( image, 0x9045 );
+    setData->turnOffTiming1_minutes = HREG( image, 0x9046 );
+    setData->turnOffTiming1_hours = HREG( image, 0x9047 );
+    setData->turnOnTiming2_seconds = HREG( image, 0x9048 );
+    setData->turnOnTiming2_minutes = HREG( image, 0x9049 );
+    setData->turnOnTiming2_hours = HREG( image, 0x904A );
+    setData->turnOffTiming2_seconds = HREG( image, 0x904B );
+    setData->turnOffTiming2_minutes = HREG( image, 0x904C );
+    setData->turnOffTiming2_hours = HREG( image, 0x904D );
+
+    setData->lengthOfNight = HREG( image, 0x9065 );
+    setData->batteryRatedVoltageCode = HREG( image, 0x9067 );
+    setData->loadTimingControlSelection = HREG( image, 0x9069 );
+    setData->defaultLoadOnOffManualMode = HREG( image, 0x906A );
+    setData->equalizeDuration = HREG( image, 0x906B );
+    setData->boostDuration = HREG( image, 0x906C );
+    setData->dischargingPercentage = HREG( image, 0x906D );
+    setData->chargingPercentage = HREG( image, 0x906E );
+    setData->batteryManagementMode = HREG( image, 0x9070 );
+}
+
+// -----------------------------------------------------------------------------
+void    RegisterMap_DecodeClock (const registerImage_t *image, Settings_t *setData)
+{
+    //
+    //  Clock is packed two bytes per register: sec/min, hour/day, month/year
+    uint16_t    secMin = HREG( image, 0x9013 );
+    uint16_t    hourDay = HREG( image, 0x9014 );
+    uint16_t    monthYear = HREG( image, 0x9015 );
+    snprintf( setData->realtimeClock, sizeof setData->realtimeClock, "%02d/%02d/%02d %02d:%02d:%02d",
+                (monthYear & 0xFF), (hourDay >> 8), (monthYear >> 8),
+                (hourDay & 0xFF), (secMin >> 8), (secMin & 0xFF) );
+}
+
+// -----------------------------------------------------------------------------
+void    RegisterMap_DecodeStatisticalParameters (const registerImage_t *image, StatisticalParameters_t *stats)
+{
+    stats->maximumInputVoltageToday = unsigned100( IREG( image, 0x3300 ) );
+    stats->minimumInputVoltageToday = unsigned100( IREG( image, 0x3301 ) );
+    stats->maximumBatteryVoltageToday = unsigned100( IREG( image, 0x3302 ) );
+    stats->minimumBatteryVoltageToday = unsigned100( IREG( image, 0x3303 ) );
+    stats->consumedEnergyToday = unsigned100x2( IREG( image, 0x3304 ), IREG( image, 0x3305 ) );
+    stats->consumedEnergyMonth = unsigned100x2( IREG( image, 0x3306 ), IREG( image, 0x3307 ) );
+    stats->consumedEnergyYear = unsigned100x2( IREG( image, 0x3308 ), IREG( image, 0x3309 ) );
+    stats->totalConsumedEnergy = unsigned100x2( IREG( image, 0x330A ), IREG( image, 0x330B ) );
+    stats->generatedEnergyToday = unsigned100x2( IREG( image, 0x330C ), IREG( image, 0x330D ) );
+    stats->generatedEnergyMonth = unsigned100x2( IREG( image, 0x330E ), IREG( image, 0x330F ) );
+    stats->generatedEnergyYear = unsigned100x2( IREG( image, 0x3310 ), IREG( image, 0x3311 ) );
+    stats->totalGeneratedEnergy = unsigned100x2( IREG( image, 0x3312 ), IREG( image, 0x3313 ) );
+    stats->batteryVoltage = unsigned100( IREG( image, 0x331A ) );
+    stats->batteryCurrent = signed100x2( IREG( image, 0x331B ), IREG( image, 0x331C ) );
+}
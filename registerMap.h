@@ -0,0 +1,78 @@
+/*
+ * File:   registerMap.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef REGISTERMAP_H
+#define REGISTERMAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <modbus/modbus.h>
+#include "ls1024b.h"
+#include "busArbiter.h"
+#include "modbusMetrics.h"
+
+
+//
+//  The SCC keeps its read-only values in Input Registers (0x3000 - 0x33FF)
+//  and its parameters in Holding Registers (0x9000 - 0x90FF)
+#define INPUT_REGISTER_BASE         0x3000
+#define INPUT_REGISTER_COUNT        0x0400
+#define HOLDING_REGISTER_BASE       0x9000
+#define HOLDING_REGISTER_COUNT      0x0100
+
+typedef enum {
+    INPUT_REGISTERS = 0,
+    HOLDING_REGISTERS
+} registerTable_t;
+
+//
+//  One contiguous range of registers - either something a block needs,
+//  or a coalesced span we'll actually put on the wire
+typedef struct  registerSpan {
+    registerTable_t table;
+    int             start;
+    int             count;
+} registerSpan_t;
+
+//
+//  A local copy of the registers, filled in by the span reads and then
+//  decoded into the structures
+typedef struct  registerImage {
+    uint16_t    input[ INPUT_REGISTER_COUNT ];
+    uint16_t    holding[ HOLDING_REGISTER_COUNT ];
+} registerImage_t;
+
+
+#define MAX_PLANNED_SPANS           16
+
+
+extern  void    RegisterMap_SetMaxGap( const int registers );
+extern  int     RegisterMap_Plan( const int blockMask, registerSpan_t *spans, const int maxSpans );
+extern  int     RegisterMap_ReadBlocks( busArbiter_t *bus, const int slaveID, modbusMetrics_t *metrics,
+                                        registerImage_t *image, const int blockMask );
+extern  int     RegisterMap_ReadSpan( busArbiter_t *bus, const int slaveID, modbusMetrics_t *metrics, registerImage_t *image,
+                                      const registerSpan_t *span, const int priority );
+extern  void    RegisterMap_CopySpan( registerImage_t *destination, const registerImage_t *source, const registerSpan_t *span );
+extern  int     RegisterMap_WriteHolding( modbus_t *ctx, modbusMetrics_t *metrics,
+                                          const int start, const int count, const uint16_t *values );
+
+extern  void    RegisterMap_DecodeRealTimeData( const registerImage_t *image, RealTimeData_t *rtData );
+extern  void    RegisterMap_DecodeRealTimeStatus( const registerImage_t *image, RealTimeStatus_t *rtStatusData );
+extern  void    RegisterMap_DecodeSettings( const registerImage_t *image, Settings_t *setData );
+extern  void    RegisterMap_DecodeClock( const registerImage_t *image, Settings_t *setData );
+extern  void    RegisterMap_DecodeStatisticalParameters( const registerImage_t *image, StatisticalParameters_t *stats );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REGISTERMAP_H */
+
@@ -0,0 +1,588 @@
+/*
+ * File:    spool.c
+ * author:  patrick conroy
+ *
+ * Store-and-forward for DATA messages while the broker can't be reached.
+ *
+ * The memory backlog in mqtt.c covers a blip. Our remote sites lose their
+ * backhaul for hours, and a restart in the middle of that lost everything, so
+ * with -S the DATA messages go to disk instead: an append-only log split over
+ * SPOOL_SEGMENTS fixed size files in the spool directory, each one mmap()'d.
+ * Appending is a memcpy() into the current segment. When it fills we move to
+ * the next one in the ring - and if that one still has records that haven't
+ * been replayed, they're the oldest we have and they go. So the spool never
+ * grows past its budget, and what it keeps is always the most recent.
+ *
+ * Each segment starts with a header saying where the records end, how far
+ * replay has got and a generation number (bigger = newer) that puts the
+ * segments back in order when we start up. Each record carries a checksum -
+ * after a power cut the pages can reach the disk in any order, so a record
+ * that doesn't check out is thrown away with everything after it in its segment.
+ * Nothing here calls msync() per record, the kernel writes the pages back on
+ * its own schedule; a full segment is pushed out as we leave it.
+ *
+ * Replay is the caller's job: Spool_Peek() copies out the oldest record and
+ * Spool_Commit() marks it done once it's been handed to the broker. A crash
+ * in between sends it twice - which is why DATA messages carry a sequence
+ * number. Spool_NextSequence() hands those out, and reserves them on disk a
+ * block at a time, so they keep going up across restarts (with a gap).
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "logger.h"
+#include "timestamp.h"
+#include "spool.h"
+
+
+#define SPOOL_MAGIC             0x4C535350u                     // "LSSP"
+#define SEQUENCE_MAGIC          0x4C535351u
+#define SPOOL_VERSION           1
+#define RECORD_ALIGN            8
+#define MIN_SEGMENT_BYTES       (64 * 1024)
+
+typedef struct  segmentHeader {
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    segmentBytes;
+    uint64_t    generation;                                     // 0 = never used
+    uint64_t    writeOffset;                                    // end of the last whole record
+    uint64_t    readOffset;                                     // everything before this has been replayed
+    uint32_t    records;
+    uint32_t    replayed;
+    uint8_t     reserved[ 16 ];
+} segmentHeader_t;
+
+typedef struct  recordHeader {
+    uint32_t    length;                                         // header + topic + payload, before padding
+    uint32_t    checksum;                                       // of everything after this field
+    int64_t     spooledUS;
+    uint16_t    topicClass;
+    uint16_t    topicLength;
+    uint32_t    payloadLength;
+} recordHeader_t;
+
+typedef struct  segment {
+    int             fd;
+    unsigned char   *base;
+    segmentHeader_t *header;
+} segment_t;
+
+typedef struct  sequenceFile {
+    uint32_t    magic;
+    uint32_t    unused;
+    int64_t     next;                                           // the next run starts here
+} sequenceFile_t;
+
+static  segment_t       segments[ SPOOL_SEGMENTS ];
+static  long long       segmentBytes = 0;
+static  int             isOpen = FALSE;
+static  int             writer = 0;                             // segment being appended to
+static  int             reader = 0;                             // oldest segment that may have records to replay
+static  uint64_t        nextGeneration = 1;
+static  long            pending = 0;
+static  spoolStats_t    stats;
+static  pthread_mutex_t spoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static  int             sequenceFD = -1;
+static  long long       nextSequence = 1;
+static  long long       reservedSequence = 0;                   // on disk - never hand out one at or past this without moving it
+static  long long       sequenceRetryAt = 0;                    // after a failed save, don't try again before this one
+static  int             sequenceFailing = FALSE;
+
+
+// -----------------------------------------------------------------------------
+static
+uint32_t    checksum (const unsigned char *data, const size_t length)
+{
+    //
+    //  FNV-1a. Only has to catch torn writes, not tampering
+    uint32_t    hash = 2166136261u;
+    size_t      i;
+
+    for (i = 0; i < length; i += 1) {
+        hash ^= data[ i ];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// -----------------------------------------------------------------------------
+static
+uint64_t    alignRecord (const uint64_t length)
+{
+    return (length + RECORD_ALIGN - 1) & ~((uint64_t) RECORD_ALIGN - 1);
+}
+
+// -----------------------------------------------------------------------------
+static
+recordHeader_t  *recordAt (const segment_t *seg, const uint64_t offset)
+{
+    //
+    //  NULL unless there's a whole, intact record at offset
+    const segmentHeader_t   *header = seg->header;
+
+    if (offset + sizeof( recordHeader_t ) > header->writeOffset)
+        return NULL;
+
+    recordHeader_t  *record = (recordHeader_t *) (seg->base + offset);
+    if (record->length < sizeof( recordHeader_t ) || offset + record->length > header->writeOffset)
+        return NULL;
+    if (sizeof( recordHeader_t ) + record->topicLength + record->payloadLength != record->length)
+        return NULL;
+    if (record->topicLength >= SPOOL_MAX_TOPIC || record->payloadLength > SPOOL_MAX_PAYLOAD)
+        return NULL;
+
+    const unsigned char *body = (const unsigned char *) &record->spooledUS;
+    if (checksum( body, record->length - offsetof( recordHeader_t, spooledUS ) ) != record->checksum)
+        return NULL;
+
+    return record;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    resetSegment (segment_t *seg, const uint64_t generation)
+{
+    segmentHeader_t *header = seg->header;
+
+    memset( header, '\0', sizeof( segmentHeader_t ) );
+    header->magic = SPOOL_MAGIC;
+    header->version = SPOOL_VERSION;
+    header->segmentBytes = segmentBytes;
+    header->generation = generation;
+    header->writeOffset = sizeof( segmentHeader_t );
+    header->readOffset = sizeof( segmentHeader_t );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    recoverSegment (segment_t *seg)
+{
+    //
+    //  Walk the records. Anything that doesn't check out - and everything after
+    //  it - is dropped. If replay had stopped somewhere that isn't a record
+    //  boundary, start the segment over; duplicates are better than holes
+    segmentHeader_t *header = seg->header;
+    uint64_t        offset = sizeof( segmentHeader_t );
+    uint32_t        records = 0;
+    uint32_t        replayed = 0;
+    int             readOffsetFound = (header->readOffset == offset);
+
+    if (header->writeOffset < offset || header->writeOffset > (uint64_t) segmentBytes)
+        header->writeOffset = offset;
+
+    while (offset < header->writeOffset) {
+        recordHeader_t  *record = recordAt( seg, offset );
+        if (record == NULL)
+            break;
+
+        records += 1;
+        offset += alignRecord( record->length );
+        if (offset > header->writeOffset)
+            offset = header->writeOffset;
+        if (offset <= header->readOffset)
+            replayed += 1;
+        if (offset == header->readOffset)
+            readOffsetFound = TRUE;
+    }
+
+    if (records < header->records)
+        stats.corrupt += (header->records - records);
+    header->writeOffset = offset;
+    header->records = records;
+
+    if (!readOffsetFound || header->readOffset > offset) {
+        header->readOffset = sizeof( segmentHeader_t );
+        replayed = 0;
+    }
+    header->replayed = replayed;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     openSegment (const char *directory, const int index)
+{
+    segment_t   *seg = &segments[ index ];
+    char        path[ 512 ];
+    struct stat info;
+
+    snprintf( path, sizeof path, "%s/segment.%d", directory, index );
+    if ((seg->fd = open( path, O_RDWR | O_CREAT, 0644 )) < 0) {
+        Logger_LogError( "Spool: unable to open %s: %s\n", path, strerror( errno ) );
+        return FALSE;
+    }
+
+    if (fstat( seg->fd, &info ) != 0 || (info.st_size != segmentBytes && ftruncate( seg->fd, segmentBytes ) != 0)) {
+        Logger_LogError( "Spool: unable to size %s to %lld bytes: %s\n", path, segmentBytes, strerror( errno ) );
+        return FALSE;
+    }
+
+    seg->base = mmap( NULL, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0 );
+    if (seg->base == MAP_FAILED) {
+        seg->base = NULL;
+        Logger_LogError( "Spool: unable to map %s: %s\n", path, strerror( errno ) );
+        return FALSE;
+    }
+    seg->header = (segmentHeader_t *) seg->base;
+
+    //
+    //  A new file, or one from a different budget - start it over
+    segmentHeader_t *header = seg->header;
+    if (header->magic != SPOOL_MAGIC || header->version != SPOOL_VERSION || header->segmentBytes != (uint64_t) segmentBytes) {
+        if (header->magic == SPOOL_MAGIC && header->records > header->replayed)
+            Logger_LogWarning( "Spool: %s was written with a different budget - discarding %u records\n",
+                               path, header->records - header->replayed );
+        resetSegment( seg, 0 );
+    } else if (header->generation != 0) {
+        recoverSegment( seg );
+    }
+
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     openSequence (const char *directory)
+{
+    char            path[ 512 ];
+    sequenceFile_t  file;
+
+    snprintf( path, sizeof path, "%s/sequence", directory );
+    if ((sequenceFD = open( path, O_RDWR | O_CREAT, 0644 )) < 0) {
+        Logger_LogError( "Spool: unable to open %s: %s\n", path, strerror( errno ) );
+        return FALSE;
+    }
+
+    if (pread( sequenceFD, &file, sizeof file, 0 ) == sizeof file && file.magic == SEQUENCE_MAGIC && file.next > 0)
+        nextSequence = file.next;
+    reservedSequence = nextSequence;
+    sequenceRetryAt = 0;
+    sequenceFailing = FALSE;
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    reserveSequences (void)
+{
+    //
+    //  Write down where the next run has to start before we use any of the
+    //  numbers below it. If the disk won't take it, say so once and try again
+    //  a block later rather than on every message. Hold spoolLock
+    sequenceFile_t  file;
+
+    memset( &file, '\0', sizeof file );
+    file.magic = SEQUENCE_MAGIC;
+    file.next = nextSequence + SEQUENCE_BLOCK;
+
+    if (pwrite( sequenceFD, &file, sizeof file, 0 ) != sizeof file || fdatasync( sequenceFD ) != 0) {
+        if (!sequenceFailing)
+            Logger_LogError( "Spool: unable to save the sequence number: %s - retrying every %d messages\n",
+                             strerror( errno ), SEQUENCE_BLOCK );
+        sequenceFailing = TRUE;
+        sequenceRetryAt = nextSequence + SEQUENCE_BLOCK;
+        return;
+    }
+    if (sequenceFailing)
+        Logger_LogWarning( "Spool: saving the sequence number again\n" );
+    sequenceFailing = FALSE;
+    reservedSequence = file.next;
+}
+
+// -----------------------------------------------------------------------------
+int     Spool_Open (const char *directory, const int megabytes)
+{
+    int         i;
+    uint64_t    newest = 0;
+    uint64_t    oldestPending = 0;
+
+    if (megabytes < 1 || megabytes > SPOOL_MAX_MEGABYTES) {
+        Logger_LogError( "Spool: budget of %d MB is out of range (1 - %d)\n", megabytes, SPOOL_MAX_MEGABYTES );
+        return FALSE;
+    }
+
+    segmentBytes = ((long long) megabytes * 1024 * 1024) / SPOOL_SEGMENTS;
+    if (segmentBytes < MIN_SEGMENT_BYTES)
+        segmentBytes = MIN_SEGMENT_BYTES;
+    segmentBytes &= ~((long long) RECORD_ALIGN - 1);
+
+    if (mkdir( directory, 0755 ) != 0 && errno != EEXIST) {
+        Logger_LogError( "Spool: unable to create %s: %s\n", directory, strerror( errno ) );
+        return FALSE;
+    }
+
+    pthread_mutex_lock( &spoolLock );
+    memset( &stats, '\0', sizeof stats );
+    for (i = 0; i < SPOOL_SEGMENTS; i += 1) {
+        if (!openSegment( directory, i )) {
+            pthread_mutex_unlock( &spoolLock );
+            Spool_Close();
+            return FALSE;
+        }
+    }
+    if (!openSequence( directory )) {
+        pthread_mutex_unlock( &spoolLock );
+        Spool_Close();
+        return FALSE;
+    }
+
+    //
+    //  Put the ring back together - we append to the newest segment, and replay
+    //  from the oldest one that still has something in it
+    pending = 0;
+    writer = 0;
+    for (i = 0; i < SPOOL_SEGMENTS; i += 1) {
+        segmentHeader_t *header = segments[ i ].header;
+        if (header->generation > newest) {
+            newest = header->generation;
+            writer = i;
+        }
+        if (header->records > header->replayed) {
+            pending += (header->records - header->replayed);
+            if (oldestPending == 0 || header->generation < oldestPending) {
+                oldestPending = header->generation;
+                reader = i;
+            }
+        }
+    }
+    if (newest == 0) {
+        newest = 1;
+        resetSegment( &segments[ writer ], newest );
+    }
+    if (oldestPending == 0)
+        reader = writer;
+    nextGeneration = newest + 1;
+
+    stats.bytesBudget = segmentBytes * SPOOL_SEGMENTS;
+    isOpen = TRUE;
+    pthread_mutex_unlock( &spoolLock );
+
+    Logger_LogInfo( "Spool: %s, %d segments of %lld KB, %ld records waiting to be replayed, sequence numbers from %lld\n",
+                    directory, SPOOL_SEGMENTS, segmentBytes / 1024, pending, nextSequence );
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+void    Spool_Close (void)
+{
+    int i;
+
+    pthread_mutex_lock( &spoolLock );
+    isOpen = FALSE;
+    for (i = 0; i < SPOOL_SEGMENTS; i += 1) {
+        segment_t   *seg = &segments[ i ];
+        if (seg->base != NULL) {
+            msync( seg->base, segmentBytes, MS_SYNC );
+            munmap( seg->base, segmentBytes );
+        }
+        if (seg->fd > 0)
+            close( seg->fd );
+        memset( seg, '\0', sizeof( segment_t ) );
+    }
+    if (sequenceFD >= 0)
+        close( sequenceFD );
+    sequenceFD = -1;
+    pthread_mutex_unlock( &spoolLock );
+}
+
+// -----------------------------------------------------------------------------
+int     Spool_IsOpen (void)
+{
+    return __atomic_load_n( &isOpen, __ATOMIC_RELAXED );
+}
+
+// -----------------------------------------------------------------------------
+long long   Spool_NextSequence (void)
+{
+    //
+    //  Without a spool directory they just start over at 1 each run
+    pthread_mutex_lock( &spoolLock );
+    long long   sequence = nextSequence;
+    nextSequence += 1;
+    if (sequenceFD >= 0 && sequence >= reservedSequence && sequence >= sequenceRetryAt)
+        reserveSequences();
+    pthread_mutex_unlock( &spoolLock );
+
+    return sequence;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    nextSegment (void)
+{
+    //
+    //  The writer's segment is full. If the next one round still has records to
+    //  replay they're the oldest we have - they go. Hold spoolLock
+    int             next = (writer + 1) % SPOOL_SEGMENTS;
+    segment_t       *seg = &segments[ next ];
+    segmentHeader_t *header = seg->header;
+
+    msync( segments[ writer ].base, segmentBytes, MS_ASYNC );
+
+    if (header->records > header->replayed) {
+        long    lost = header->records - header->replayed;
+        stats.evicted += lost;
+        pending -= lost;
+        Logger_LogWarning( "Spool full - %ld oldest records evicted without being replayed\n", lost );
+        if (reader == next)
+            reader = (next + 1) % SPOOL_SEGMENTS;
+    }
+
+    resetSegment( seg, nextGeneration );
+    nextGeneration += 1;
+    writer = next;
+}
+
+// -----------------------------------------------------------------------------
+int     Spool_Append (const int topicClass, const char *topic, const char *payload, const int length)
+{
+    //
+    //  FALSE if the spool isn't open or the message could never fit
+    int         topicLength = strlen( topic );
+    uint64_t    recordLength = sizeof( recordHeader_t ) + topicLength + length;
+    uint64_t    need = alignRecord( recordLength );
+
+    if (topicLength >= SPOOL_MAX_TOPIC || length < 0 || length > SPOOL_MAX_PAYLOAD)
+        return FALSE;
+
+    pthread_mutex_lock( &spoolLock );
+    if (!isOpen || need > (uint64_t) segmentBytes - sizeof( segmentHeader_t )) {
+        pthread_mutex_unlock( &spoolLock );
+        return FALSE;
+    }
+
+    segmentHeader_t *header = segments[ writer ].header;
+    if (header->writeOffset + need > (uint64_t) segmentBytes) {
+        nextSegment();
+        header = segments[ writer ].header;
+    }
+
+    unsigned char   *at = segments[ writer ].base + header->writeOffset;
+    recordHeader_t  *record = (recordHeader_t *) at;
+
+    record->spooledUS = Timestamp_EpochUS();
+    record->topicClass = topicClass;
+    record->topicLength = topicLength;
+    record->payloadLength = length;
+    memcpy( at + sizeof( recordHeader_t ), topic, topicLength );
+    memcpy( at + sizeof( recordHeader_t ) + topicLength, payload, length );
+    record->length = recordLength;
+    record->checksum = checksum( (const unsigned char *) &record->spooledUS, recordLength - offsetof( recordHeader_t, spooledUS ) );
+
+    //
+    //  Only now does the record count - the header is what recovery trusts
+    header->writeOffset += need;
+    header->records += 1;
+    pending += 1;
+    stats.appended += 1;
+    pthread_mutex_unlock( &spoolLock );
+
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+long    Spool_Pending (void)
+{
+    pthread_mutex_lock( &spoolLock );
+    long    count = pending;
+    pthread_mutex_unlock( &spoolLock );
+
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+int     Spool_Peek (spoolEntry_t *entry)
+{
+    //
+    //  Copy out the oldest record that hasn't been replayed. FALSE if there isn't one
+    pthread_mutex_lock( &spoolLock );
+    while (isOpen) {
+        segmentHeader_t *header = segments[ reader ].header;
+
+        if (header->replayed >= header->records) {
+            if (reader == writer)
+                break;
+            reader = (reader + 1) % SPOOL_SEGMENTS;
+            continue;
+        }
+
+        recordHeader_t  *record = recordAt( &segments[ reader ], header->readOffset );
+        if (record == NULL) {
+            //
+            //  Went bad on disk since we opened it - give up on the rest of the segment
+            long    lost = header->records - header->replayed;
+            stats.corrupt += lost;
+            pending -= lost;
+            header->replayed = header->records;
+            header->readOffset = header->writeOffset;
+            continue;
+        }
+
+        const char  *body = (const char *) record + sizeof( recordHeader_t );
+        entry->generation = header->generation;
+        entry->offset = header->readOffset;
+        entry->spooledUS = record->spooledUS;
+        entry->topicClass = record->topicClass;
+        memcpy( entry->topic, body, record->topicLength );
+        entry->topic[ record->topicLength ] = '\0';
+        memcpy( entry->payload, body + record->topicLength, record->payloadLength );
+        entry->length = record->payloadLength;
+
+        pthread_mutex_unlock( &spoolLock );
+        return TRUE;
+    }
+    pthread_mutex_unlock( &spoolLock );
+
+    return FALSE;
+}
+
+// -----------------------------------------------------------------------------
+void    Spool_Commit (const spoolEntry_t *entry)
+{
+    //
+    //  The record from Spool_Peek() has gone - move past it. Unless it was
+    //  evicted in the meantime, in which case we already have
+    pthread_mutex_lock( &spoolLock );
+    segmentHeader_t *header = segments[ reader ].header;
+    if (isOpen && header->generation == entry->generation && header->readOffset == (uint64_t) entry->offset) {
+        recordHeader_t  *record = (recordHeader_t *) (segments[ reader ].base + header->readOffset);
+        header->readOffset += alignRecord( record->length );
+        header->replayed += 1;
+        pending -= 1;
+        stats.replayed += 1;
+    }
+    pthread_mutex_unlock( &spoolLock );
+}
+
+// -----------------------------------------------------------------------------
+void    Spool_GetStats (spoolStats_t *statsOut, const int reset)
+{
+    int i;
+
+    pthread_mutex_lock( &spoolLock );
+    *statsOut = stats;
+    statsOut->open = isOpen;
+    statsOut->pending = pending;
+    statsOut->bytesUsed = 0;
+    for (i = 0; isOpen && i < SPOOL_SEGMENTS; i += 1)
+        statsOut->bytesUsed += segments[ i ].header->writeOffset - segments[ i ].header->readOffset;
+    if (reset) {
+        long long   budget = stats.bytesBudget;
+        memset( &stats, '\0', sizeof stats );
+        stats.bytesBudget = budget;
+    }
+    pthread_mutex_unlock( &spoolLock );
+}
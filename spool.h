@@ -0,0 +1,64 @@
+/*
+ * File:   spool.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jsonWriter.h"
+
+
+#define SPOOL_SEGMENTS              8               // the budget is split into this many files, oldest goes first
+#define SPOOL_DEFAULT_MEGABYTES     64
+#define SPOOL_MAX_MEGABYTES         512             // every segment stays mapped - mind a 32 bit address space
+#define SPOOL_MAX_TOPIC             256
+#define SPOOL_MAX_PAYLOAD           JSON_BUFFER_SIZE
+#define SEQUENCE_BLOCK              1024            // sequence numbers reserved on disk at a time
+
+//
+//  One record, copied out of the spool for replay
+typedef struct  spoolEntry {
+    unsigned long long  generation;                 // where it came from - for Spool_Commit()
+    long long   offset;
+    long long   spooledUS;                          // wall clock, when it went in
+    int         topicClass;
+    char        topic[ SPOOL_MAX_TOPIC ];
+    char        payload[ SPOOL_MAX_PAYLOAD ];
+    int         length;
+} spoolEntry_t;
+
+typedef struct  spoolStats {
+    int         open;
+    long        pending;                            // spooled, not yet replayed
+    long        appended;
+    long        replayed;
+    long        evicted;                            // pushed out by newer records, never replayed
+    long        corrupt;                            // failed their checksum after a crash
+    long long   bytesUsed;
+    long long   bytesBudget;
+} spoolStats_t;
+
+
+extern  int         Spool_Open( const char *directory, const int megabytes );
+extern  void        Spool_Close( void );
+extern  int         Spool_IsOpen( void );
+extern  long long   Spool_NextSequence( void );
+extern  int         Spool_Append( const int topicClass, const char *topic, const char *payload, const int length );
+extern  long        Spool_Pending( void );
+extern  int         Spool_Peek( spoolEntry_t *entry );
+extern  void        Spool_Commit( const spoolEntry_t *entry );
+extern  void        Spool_GetStats( spoolStats_t *stats, const int reset );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPOOL_H */
@@ -0,0 +1,30 @@
+/*
+ * File:   check.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+//
+//  Just enough for the standalone tests - every failed CHECK is reported with
+//  where it was, and CHECK_RESULT() is the exit status
+static  int     checksRun = 0;
+static  int     checksFailed = 0;
+
+#define CHECK(condition)        do {                                                \
+            checksRun += 1;                                                         \
+            if (!(condition)) {                                                     \
+                checksFailed += 1;                                                  \
+                fprintf( stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition ); \
+            }                                                                       \
+        } while (0)
+
+#define CHECK_RESULT(name)      ( printf( "%s: %d checks, %d failed\n", (name), checksRun, checksFailed ), \
+                                  (checksFailed == 0) ? 0 : 1 )
+
+#endif /* CHECK_H */
@@ -0,0 +1,246 @@
+/*
+ * File:    commandParserFuzz.c
+ * author:  patrick conroy
+ *
+ * The COMMAND and QUERY payloads come off the network, so both parsers get
+ * every file in the corpus and then thousands of mutations of each one -
+ * bytes flipped, inserted, deleted, duplicated, the payload cut short.
+ *
+ * Every input goes into a malloc'd buffer of exactly its length with no NUL
+ * after it, so under -fsanitize=address a read past payload + length is caught.
+ * Beyond not crashing, whatever comes back has to make sense: a count in range
+ * and NUL terminated strings, or -1 / FALSE with a reason.
+ *
+ * The seed files are named for what they should do - "cmd-ok-*" must parse as a
+ * command, "cmd-bad-*" must be rejected, "query-ok-*" / "query-bad-*" the same
+ * for CommandParser_ParseQuery().
+ *
+ * Built with -DLIBFUZZER this is a libFuzzer target instead ("make fuzz"), and
+ * the corpus directory is its seed corpus.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+
+#include "commandParser.h"
+#include "check.h"
+
+
+#define MUTATIONS_PER_SEED      20000
+#define FUZZ_MAX_INPUT          8192
+
+static  uint32_t    rngState = 2463534242u;
+
+
+// -----------------------------------------------------------------------------
+static
+int     terminated (const char *text, const int size)
+{
+    return (memchr( text, '\0', size ) != NULL);
+}
+
+// -----------------------------------------------------------------------------
+static
+void    parseBoth (const char *data, const int length, int *commandOK, int *queryOK)
+{
+    //
+    //  Exactly 'length' bytes on the heap - nothing after them to lean on
+    char            *payload = malloc( (length > 0) ? length : 1 );
+    mqttCommand_t   commands[ COMMAND_BATCH_MAX ];
+    historyQuery_t  query;
+    char            error[ 128 ];
+    int             i;
+
+    memcpy( payload, data, length );
+
+    error[ 0 ] = '\0';
+    int numCommands = CommandParser_Parse( payload, length, commands, COMMAND_BATCH_MAX, error, sizeof error );
+    CHECK( numCommands == -1 || (numCommands >= 1 && numCommands <= COMMAND_BATCH_MAX) );
+    if (numCommands < 0) {
+        CHECK( terminated( error, sizeof error ) && error[ 0 ] != '\0' );
+    } else {
+        for (i = 0; i < numCommands; i += 1) {
+            CHECK( terminated( commands[ i ].command, sizeof commands[ i ].command ) && commands[ i ].command[ 0 ] != '\0' );
+            CHECK( terminated( commands[ i ].cParam, sizeof commands[ i ].cParam ) );
+            CHECK( terminated( commands[ i ].correlationID, sizeof commands[ i ].correlationID ) );
+            CHECK( commands[ i ].batchSize == numCommands && commands[ i ].batchIndex == i );
+        }
+    }
+
+    error[ 0 ] = '\0';
+    int answered = CommandParser_ParseQuery( payload, length, &query, error, sizeof error );
+    if (!answered) {
+        CHECK( terminated( error, sizeof error ) && error[ 0 ] != '\0' );
+    } else {
+        CHECK( terminated( query.correlationID, sizeof query.correlationID ) );
+        CHECK( query.numColumns >= 0 && query.numColumns <= HISTORY_COLUMNS );
+        CHECK( query.maxPoints >= 1 && query.maxPoints <= HISTORY_QUERY_MAX_POINTS );
+    }
+
+    free( payload );
+    if (commandOK != NULL)
+        *commandOK = (numCommands > 0);
+    if (queryOK != NULL)
+        *queryOK = answered;
+}
+
+#ifdef LIBFUZZER
+
+// -----------------------------------------------------------------------------
+int     LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+    if (size <= FUZZ_MAX_INPUT)
+        parseBoth( (const char *) data, (int) size, NULL, NULL );
+    if (checksFailed > 0)
+        abort();
+    return 0;
+}
+
+#else
+
+// -----------------------------------------------------------------------------
+static
+uint32_t    nextRandom (void)
+{
+    //
+    //  xorshift32 - the same mutations every run
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     mutate (char *buffer, int length)
+{
+    //
+    //  One to four edits, biased toward the characters JSON cares about
+    static  const char  interesting[] = "{}[]\":,\\.-+eE0123456789ntrufals \t\n\xc3\xff";
+    int     edits = 1 + (nextRandom() % 4);
+
+    while (edits-- > 0) {
+        int position = (length > 0) ? (int) (nextRandom() % length) : 0;
+
+        switch (nextRandom() % 6) {
+            case 0:                                 //  overwrite a byte
+                if (length > 0)
+                    buffer[ position ] = interesting[ nextRandom() % (sizeof interesting - 1) ];
+                break;
+            case 1:                                 //  flip a bit
+                if (length > 0)
+                    buffer[ position ] ^= (char) (1 << (nextRandom() % 8));
+                break;
+            case 2:                                 //  insert a byte
+                if (length < FUZZ_MAX_INPUT) {
+                    memmove( &buffer[ position + 1 ], &buffer[ position ], length - position );
+                    buffer[ position ] = interesting[ nextRandom() % (sizeof interesting - 1) ];
+                    length += 1;
+                }
+                break;
+            case 3: {                               //  delete a run
+                int count = 1 + (nextRandom() % 8);
+                if (position + count > length)
+                    count = length - position;
+                memmove( &buffer[ position ], &buffer[ position + count ], length - position - count );
+                length -= count;
+                break;
+            }
+            case 4: {                               //  duplicate a run
+                int count = 1 + (nextRandom() % 16);
+                if (position + count > length)
+                    count = length - position;
+                if (length + count <= FUZZ_MAX_INPUT) {
+                    memmove( &buffer[ position + count ], &buffer[ position ], length - position );
+                    length += count;
+                }
+                break;
+            }
+            case 5:                                 //  cut it short
+                length = position;
+                break;
+        }
+    }
+    return length;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    checkVerdict (const char *name, const char *prefix, const int parsed)
+{
+    //
+    //  "<prefix>ok-..." has to parse, "<prefix>bad-..." has to be rejected
+    int length = strlen( prefix );
+
+    if (strncmp( name, prefix, length ) != 0)
+        return;
+    checksRun += 1;
+    if (parsed != (strncmp( &name[ length ], "ok-", 3 ) == 0)) {
+        checksFailed += 1;
+        fprintf( stderr, "%s should have been %s\n", name, parsed ? "rejected" : "accepted" );
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+int     readFile (const char *path, char *buffer, const int size)
+{
+    FILE    *fp = fopen( path, "rb" );
+    if (fp == NULL)
+        return -1;
+    int length = (int) fread( buffer, 1, size, fp );
+    fclose( fp );
+    return length;
+}
+
+// -----------------------------------------------------------------------------
+int main (int argc, char *argv[])
+{
+    const char      *directory = (argc > 1) ? argv[ 1 ] : "corpus/commandParser";
+    static  char    seed[ FUZZ_MAX_INPUT ];
+    static  char    mutant[ FUZZ_MAX_INPUT ];
+    char            path[ 1024 ];
+    struct dirent   *entry;
+    int             numSeeds = 0;
+    long            numMutants = 0;
+    int             i;
+
+    DIR *dir = opendir( directory );
+    if (dir == NULL) {
+        fprintf( stderr, "Unable to open the corpus [%s]\n", directory );
+        return 2;
+    }
+
+    while ((entry = readdir( dir )) != NULL) {
+        if (entry->d_name[ 0 ] == '.')
+            continue;
+        snprintf( path, sizeof path, "%s/%s", directory, entry->d_name );
+        int length = readFile( path, seed, sizeof seed );
+        if (length < 0)
+            continue;
+        numSeeds += 1;
+
+        //
+        //  The seed itself has to do what its name says
+        int commandOK, queryOK;
+        parseBoth( seed, length, &commandOK, &queryOK );
+        checkVerdict( entry->d_name, "cmd-", commandOK );
+        checkVerdict( entry->d_name, "query-", queryOK );
+
+        for (i = 0; i < MUTATIONS_PER_SEED; i += 1) {
+            memcpy( mutant, seed, length );
+            parseBoth( mutant, mutate( mutant, length ), NULL, NULL );
+            numMutants += 1;
+        }
+    }
+    closedir( dir );
+
+    printf( "%d seeds, %ld mutations\n", numSeeds, numMutants );
+    return CHECK_RESULT( "commandParserFuzz" );
+}
+
+#endif
@@ -0,0 +1,398 @@
+/*
+ * File:    historyTest.c
+ * author:  patrick conroy
+ *
+ * The on-device history (-H) in a scratch directory. Whatever goes in has to
+ * come back out bit for bit - the timestamps thru the delta of deltas, every
+ * column thru the XOR encoding - both from the open block and after a close
+ * and reopen. Summaries have to agree with the raw data, paging has to hand
+ * back every point exactly once, a block that fails its checksum is skipped,
+ * and once the file is full the oldest blocks go.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "logger.h"
+#include "history.h"
+#include "check.h"
+
+
+#define HISTORY_TEST_MEGABYTES  2                   // 32 blocks
+#define SMOOTH_POINTS           5000
+#define NOISY_POINTS            60000               // well past what 32 blocks hold
+#define START_MS                1791500000000LL
+#define DAY_MS                  86400000LL
+
+static  char                    directory[ 64 ];
+static  int                     allColumns[ HISTORY_COLUMNS ];
+static  long long               times[ NOISY_POINTS ];
+static  float                   values[ (long) NOISY_POINTS * HISTORY_COLUMNS ];
+static  uint32_t                rngState = 2463534242u;
+
+
+// -----------------------------------------------------------------------------
+static
+uint32_t    nextRandom (void)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    fill (const float *sample, RealTimeData_t *rtData, StatisticalParameters_t *stats)
+{
+    //
+    //  In the order of the field table in history.c
+    rtData->pvArrayVoltage = sample[ 0 ];
+    rtData->pvArrayCurrent = sample[ 1 ];
+    rtData->loadVoltage = sample[ 2 ];
+    rtData->loadCurrent = sample[ 3 ];
+    rtData->batteryTemp = sample[ 4 ];
+    rtData->caseTemp = sample[ 5 ];
+    rtData->remoteBatteryTemperature = sample[ 6 ];
+    rtData->batterySOC = (int) sample[ 7 ];
+    stats->maximumInputVoltageToday = sample[ 8 ];
+    stats->minimumInputVoltageToday = sample[ 9 ];
+    stats->maximumBatteryVoltageToday = sample[ 10 ];
+    stats->minimumBatteryVoltageToday = sample[ 11 ];
+    stats->consumedEnergyToday = sample[ 12 ];
+    stats->consumedEnergyMonth = sample[ 13 ];
+    stats->consumedEnergyYear = sample[ 14 ];
+    stats->totalConsumedEnergy = sample[ 15 ];
+    stats->generatedEnergyToday = sample[ 16 ];
+    stats->generatedEnergyMonth = sample[ 17 ];
+    stats->generatedEnergyYear = sample[ 18 ];
+    stats->totalGeneratedEnergy = sample[ 19 ];
+    stats->batteryVoltage = sample[ 20 ];
+    stats->batteryCurrent = sample[ 21 ];
+}
+
+// -----------------------------------------------------------------------------
+static
+float   smoothValue (const int i, const int column)
+{
+    //
+    //  What a controller mostly reports - slow drift, a few columns that move
+    if (column == 7)
+        return (float) (50 + i % 3);
+    return (float) (12.0 + column * 0.5 + ((i / 7) % 5) * 0.01 + ((column == 1) ? (i % 11) * 0.13 : 0.0));
+}
+
+// -----------------------------------------------------------------------------
+static
+void    appendAll (history_t *history, const int count)
+{
+    RealTimeData_t          rtData;
+    StatisticalParameters_t stats;
+    int                     i;
+
+    memset( &rtData, '\0', sizeof rtData );
+    memset( &stats, '\0', sizeof stats );
+    for (i = 0; i < count; i += 1) {
+        fill( &values[ (long) i * HISTORY_COLUMNS ], &rtData, &stats );
+        History_Append( history, times[ i ], &rtData, &stats );
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+int     readBack (history_t *history, const int first, const int count)
+{
+    //
+    //  Everything in the history has to be exactly points first .. first + count - 1
+    long long   *readTimes = malloc( sizeof( long long ) * count );
+    float       *readValues = malloc( sizeof( float ) * count * HISTORY_COLUMNS );
+    long long   nextMS = -1;
+    int         mismatches = 0;
+    int         i;
+    int         column;
+
+    int numRead = History_Read( history, 0, START_MS * 2, allColumns, HISTORY_COLUMNS, count, readTimes, readValues, &nextMS );
+    CHECK( numRead == count );
+    CHECK( nextMS == 0 );
+
+    for (i = 0; i < numRead && i < count; i += 1) {
+        if (readTimes[ i ] != times[ first + i ])
+            mismatches += 1;
+        for (column = 0; column < HISTORY_COLUMNS; column += 1)
+            if (readValues[ (long) column * count + i ] != values[ (long) (first + i) * HISTORY_COLUMNS + column ])
+                mismatches += 1;
+    }
+
+    free( readTimes );
+    free( readValues );
+    return (numRead == count && mismatches == 0);
+}
+
+// -----------------------------------------------------------------------------
+static
+void    makeSmooth (void)
+{
+    int     i;
+    int     column;
+
+    //
+    //  A second apart, a few ms of jitter, and a day missing in the middle
+    for (i = 0; i < SMOOTH_POINTS; i += 1) {
+        times[ i ] = START_MS + i * 1000LL + ((i % 10 == 0) ? 3 : 0) + ((i >= SMOOTH_POINTS / 2) ? DAY_MS : 0);
+        for (column = 0; column < HISTORY_COLUMNS; column += 1)
+            values[ (long) i * HISTORY_COLUMNS + column ] = smoothValue( i, column );
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+void    makeNoisy (void)
+{
+    int     i;
+    int     column;
+
+    //
+    //  Every bit of every value changing, and irregular gaps - worst case for the
+    //  encoding, and it fills blocks quickly
+    times[ 0 ] = START_MS;
+    for (i = 0; i < NOISY_POINTS; i += 1) {
+        if (i > 0)
+            times[ i ] = times[ i - 1 ] + 1 + (nextRandom() % 5000);
+        for (column = 0; column < HISTORY_COLUMNS; column += 1)
+            values[ (long) i * HISTORY_COLUMNS + column ] = (column == 7) ? (float) (nextRandom() % 101)
+                                                                          : (float) (nextRandom() % 1000000) / 1000.0f - 500.0f;
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+void    checkSummary (history_t *history, const int first, const int last)
+{
+    historySummary_t    summary;
+    int                 column;
+    int                 i;
+
+    CHECK( History_Summarize( history, times[ first ], times[ last ], &summary ) );
+    CHECK( summary.points == last - first + 1 );
+    CHECK( summary.firstMS == times[ first ] );
+    CHECK( summary.lastMS == times[ last ] );
+
+    for (column = 0; column < HISTORY_COLUMNS; column += 1) {
+        float   minimum = values[ (long) first * HISTORY_COLUMNS + column ];
+        float   maximum = minimum;
+        double  sum = 0.0;
+
+        for (i = first; i <= last; i += 1) {
+            float   value = values[ (long) i * HISTORY_COLUMNS + column ];
+            if (value < minimum)
+                minimum = value;
+            if (value > maximum)
+                maximum = value;
+            sum += value;
+        }
+        CHECK( summary.minimum[ column ] == minimum );
+        CHECK( summary.maximum[ column ] == maximum );
+        CHECK( summary.sum[ column ] > sum - 0.001 && summary.sum[ column ] < sum + 0.001 );
+    }
+}
+
+// -----------------------------------------------------------------------------
+static
+void    checkPaging (history_t *history, const int count)
+{
+    //
+    //  A page at a time, two columns - every point once, in order
+    long long   pageTimes[ 700 ];
+    float       pageValues[ 700 * 2 ];
+    int         columns[ 2 ] = { 1, 7 };
+    long long   fromMS = 0;
+    long long   nextMS;
+    int         total = 0;
+    int         inOrder = TRUE;
+
+    do {
+        int numRead = History_Read( history, fromMS, START_MS * 2, columns, 2, 700, pageTimes, pageValues, &nextMS );
+        int i;
+        CHECK( numRead >= 0 && numRead <= 700 );
+        for (i = 0; i < numRead && total + i < count; i += 1)
+            if (pageTimes[ i ] != times[ total + i ] || pageValues[ i ] != values[ (long) (total + i) * HISTORY_COLUMNS + 1 ])
+                inOrder = FALSE;
+        total += numRead;
+        fromMS = nextMS;
+    } while (nextMS != 0 && total <= count);
+
+    CHECK( total == count );
+    CHECK( inOrder );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    corruptFirstBlock (void)
+{
+    //
+    //  Somewhere in the middle of slot 0 - its checksum won't match any more
+    char    path[ 512 ];
+    FILE    *fp;
+
+    snprintf( path, sizeof path, "%s/1.history", directory );
+    fp = fopen( path, "r+b" );
+    CHECK( fp != NULL );
+    if (fp == NULL)
+        return;
+    fseek( fp, 4000, SEEK_SET );
+    int byte = fgetc( fp );
+    fseek( fp, 4000, SEEK_SET );
+    fputc( byte ^ 0x55, fp );
+    fclose( fp );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    removeDirectory (void)
+{
+    struct dirent   *file;
+    DIR             *dir = opendir( directory );
+    char            path[ 512 ];
+
+    while ((file = readdir( dir )) != NULL) {
+        if (file->d_name[ 0 ] == '.')
+            continue;
+        snprintf( path, sizeof path, "%s/%s", directory, file->d_name );
+        unlink( path );
+    }
+    closedir( dir );
+    rmdir( directory );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testSmooth (void)
+{
+    history_t   *history;
+
+    makeSmooth();
+    history = History_Open( directory, "1", HISTORY_TEST_MEGABYTES );
+    CHECK( history != NULL );
+    if (history == NULL)
+        return;
+
+    appendAll( history, SMOOTH_POINTS );
+    CHECK( history->appended == SMOOTH_POINTS );
+    CHECK( readBack( history, 0, SMOOTH_POINTS ) );
+    checkSummary( history, 100, 4000 );
+    checkPaging( history, SMOOTH_POINTS );
+
+    //
+    //  The open block is written out on close - all of it comes back
+    History_Close( history );
+    history = History_Open( directory, "1", HISTORY_TEST_MEGABYTES );
+    CHECK( history != NULL );
+    if (history == NULL)
+        return;
+    CHECK( readBack( history, 0, SMOOTH_POINTS ) );
+    checkSummary( history, 0, SMOOTH_POINTS - 1 );
+    History_Close( history );
+
+    //
+    //  It was all in one block - now it's gone, and counted
+    corruptFirstBlock();
+    history = History_Open( directory, "1", HISTORY_TEST_MEGABYTES );
+    CHECK( history != NULL );
+    if (history == NULL)
+        return;
+
+    long long   oneTime;
+    float       oneValue;
+    long long   nextMS;
+    int         column = 0;
+    CHECK( History_Read( history, 0, START_MS * 2, &column, 1, 1, &oneTime, &oneValue, &nextMS ) == 0 );
+    CHECK( history->corrupt == 1 );
+    History_Close( history );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testNoisyAndWrap (void)
+{
+    historySummary_t    summary;
+    history_t           *history;
+    int                 kept;
+
+    //
+    //  A fresh file
+    char    path[ 512 ];
+    snprintf( path, sizeof path, "%s/1.history", directory );
+    unlink( path );
+
+    makeNoisy();
+    history = History_Open( directory, "1", HISTORY_TEST_MEGABYTES );
+    CHECK( history != NULL );
+    if (history == NULL)
+        return;
+
+    appendAll( history, NOISY_POINTS );
+    CHECK( history->sealed > 32 );
+
+    //
+    //  The oldest blocks were overwritten - what's left is the most recent points,
+    //  with nothing missing from the end
+    CHECK( History_Summarize( history, 0, START_MS * 2, &summary ) );
+    kept = (int) summary.points;
+    CHECK( kept > 0 && kept < NOISY_POINTS );
+    CHECK( summary.lastMS == times[ NOISY_POINTS - 1 ] );
+    CHECK( summary.firstMS == times[ NOISY_POINTS - kept ] );
+    if (kept > 0 && kept < NOISY_POINTS) {
+        CHECK( readBack( history, NOISY_POINTS - kept, kept ) );
+        checkSummary( history, NOISY_POINTS - kept, NOISY_POINTS - 1 );
+    }
+
+    History_Close( history );
+    history = History_Open( directory, "1", HISTORY_TEST_MEGABYTES );
+    CHECK( history != NULL );
+    if (history == NULL)
+        return;
+    CHECK( History_Summarize( history, 0, START_MS * 2, &summary ) );
+    CHECK( summary.points == kept );
+    if (kept > 0 && kept < NOISY_POINTS)
+        CHECK( readBack( history, NOISY_POINTS - kept, kept ) );
+    History_Close( history );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testColumnNames (void)
+{
+    int     column;
+
+    for (column = 0; column < HISTORY_COLUMNS; column += 1)
+        CHECK( History_FindColumn( History_ColumnName( column ) ) == column );
+    CHECK( History_FindColumn( "batterySOC" ) == 7 );
+    CHECK( History_FindColumn( "noSuchField" ) < 0 );
+}
+
+// -----------------------------------------------------------------------------
+int main (int argc, char *argv[])
+{
+    int     column;
+
+    for (column = 0; column < HISTORY_COLUMNS; column += 1)
+        allColumns[ column ] = column;
+
+    snprintf( directory, sizeof directory, "/tmp/historyTest.XXXXXX" );
+    if (mkdtemp( directory ) == NULL) {
+        perror( "mkdtemp" );
+        return 1;
+    }
+
+    testColumnNames();
+    testSmooth();
+    testNoisyAndWrap();
+
+    removeDirectory();
+    return CHECK_RESULT( "historyTest" );
+}
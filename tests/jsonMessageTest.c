@@ -0,0 +1,294 @@
+/*
+ * File:    jsonMessageTest.c
+ * author:  patrick conroy
+ *
+ * DATA messages with delta publishing (-k). The first full message is a
+ * keyframe with everything in it; after that only the fields that changed go
+ * out - judged on the field as written, so a change below its precision isn't
+ * one, and within its deadband isn't either. Nothing counts as sent until
+ * JSONMessage_CommitDelta(). Every keyframeCycles full messages, or when one
+ * is asked for, everything goes out again. Partial messages never do.
+ *
+ * And the retained state messages - settings, rated data and identity aren't
+ * in DATA, and the same values always make the same bytes, so a hash of the
+ * message says whether it has to go out again.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "jsonMessage.h"
+#include "check.h"
+
+
+#define KEYFRAME_CYCLES         4
+
+static  RealTimeData_t          rtData;
+static  RealTimeStatus_t        rtStatus;
+static  Settings_t              settings;
+static  RatedData_t             ratedData;
+static  StatisticalParameters_t stats;
+static  char                    buffer[ 8192 ];
+static  jsonWriter_t            writer;
+static  deltaState_t            delta;
+static  long long               sequence = 0;
+
+
+// -----------------------------------------------------------------------------
+static
+const char  *build (const int sections, deltaState_t *state)
+{
+    sequence += 1;
+    return createJSONMessage( &writer, FALSE, "LS/1/DATA", sections, sequence, state, &rtData, &rtStatus, &settings, &stats );
+}
+
+// -----------------------------------------------------------------------------
+static
+const char  *publish (const int sections)
+{
+    //
+    //  Built and handed to MQTT
+    const char  *message = build( sections, &delta );
+    JSONMessage_CommitDelta( &delta );
+    return message;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     has (const char *message, const char *text)
+{
+    return (message != NULL && strstr( message, text ) != NULL);
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testWithoutDelta (void)
+{
+    //
+    //  No delta state - every field, every time, and no "keyframe" flag
+    const char  *message = build( DATA_BLOCKS_MASK, NULL );
+
+    CHECK( has( message, "\"pvArrayVoltage\":" ) );
+    CHECK( has( message, "\"temperatures\":{" ) );
+    CHECK( has( message, "\"statistics\":{" ) );
+    CHECK( !has( message, "\"keyframe\"" ) );
+    CHECK( !has( message, "\"partial\"" ) );
+
+    message = build( BLOCK_MASK( BLOCK_REALTIME_DATA ), NULL );
+    CHECK( has( message, "\"partial\":true" ) );
+    CHECK( has( message, "\"pvArrayVoltage\":" ) );
+    CHECK( !has( message, "\"statistics\"" ) );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testDeltas (void)
+{
+    const char  *message;
+
+    //
+    //  No keyframes getting in the way - testKeyframes() does those
+    JSONMessage_InitializeDelta( &delta, 1000 );
+
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"keyframe\":true" ) );
+    CHECK( has( message, "\"pvArrayVoltage\":13," ) );
+    CHECK( has( message, "\"statistics\":{" ) );
+
+    //
+    //  Nothing changed - no fields, and no empty sections
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"keyframe\":false" ) );
+    CHECK( has( message, "\"sequence\":" ) );
+    CHECK( !has( message, "\"pvArrayVoltage\"" ) );
+    CHECK( !has( message, "\"temperatures\"" ) );
+    CHECK( !has( message, "\"statistics\"" ) );
+
+    //
+    //  One field in a section - the section opens for it alone
+    rtData.caseTemp = 31.0f;
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"temperatures\":{\"case\":31}" ) );
+    CHECK( !has( message, "\"loadCurrent\"" ) );
+
+    //
+    //  loadCurrent goes out at 2 digits - 1.231 and 1.234 are both "1.23"
+    rtData.loadCurrent = 1.234f;
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( !has( message, "\"loadCurrent\"" ) );
+    rtData.loadCurrent = 1.246f;
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"loadCurrent\":1.25" ) );
+
+    //
+    //  pvArrayVoltage has a 0.5 deadband - measured from what was last sent
+    rtData.pvArrayVoltage = 13.3f;
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( !has( message, "\"pvArrayVoltage\"" ) );
+    rtData.pvArrayVoltage = 13.6f;
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"pvArrayVoltage\":13.6" ) );
+    rtData.pvArrayVoltage = 13.9f;
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( !has( message, "\"pvArrayVoltage\"" ) );
+
+    //
+    //  A keyframe sends it whatever the deadband says
+    JSONMessage_RequestKeyframe( &delta );
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"pvArrayVoltage\":13.9" ) );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testCommit (void)
+{
+    const char  *message;
+
+    JSONMessage_InitializeDelta( &delta, 1000 );
+    publish( DATA_BLOCKS_MASK );
+
+    //
+    //  Built but never handed over - the change is still owed
+    rtData.batterySOC = 77;
+    message = build( DATA_BLOCKS_MASK, &delta );
+    CHECK( has( message, "\"batterySOC\":77" ) );
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"batterySOC\":77" ) );
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( !has( message, "\"batterySOC\"" ) );
+
+    //
+    //  A keyframe that wasn't committed is still due
+    JSONMessage_RequestKeyframe( &delta );
+    message = build( DATA_BLOCKS_MASK, &delta );
+    CHECK( has( message, "\"keyframe\":true" ) );
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"keyframe\":true" ) );
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"keyframe\":false" ) );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testKeyframes (void)
+{
+    const char  *message;
+    int         i;
+
+    JSONMessage_InitializeDelta( &delta, KEYFRAME_CYCLES );
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"keyframe\":true" ) );
+
+    //
+    //  Partial messages carry what changed, but never count toward - or are - a keyframe
+    for (i = 0; i < 2 * KEYFRAME_CYCLES; i += 1) {
+        rtData.loadVoltage = 12.0f + i;
+        message = publish( BLOCK_MASK( BLOCK_REALTIME_DATA ) );
+        CHECK( has( message, "\"partial\":true" ) );
+        CHECK( has( message, "\"keyframe\":false" ) );
+        CHECK( has( message, "\"loadVoltage\":" ) );
+    }
+
+    for (i = 1; i < KEYFRAME_CYCLES; i += 1)
+        CHECK( has( publish( DATA_BLOCKS_MASK ), "\"keyframe\":false" ) );
+    message = publish( DATA_BLOCKS_MASK );
+    CHECK( has( message, "\"keyframe\":true" ) );
+    CHECK( has( message, "\"pvArrayVoltage\":" ) );
+    CHECK( has( message, "\"statistics\":{" ) );
+
+    //
+    //  The KEYFRAME command - the next full message, not a partial one
+    CHECK( has( publish( DATA_BLOCKS_MASK ), "\"keyframe\":false" ) );
+    JSONMessage_RequestKeyframe( &delta );
+    CHECK( has( publish( BLOCK_MASK( BLOCK_STATISTICS ) ), "\"keyframe\":false" ) );
+    CHECK( has( publish( DATA_BLOCKS_MASK ), "\"keyframe\":true" ) );
+    CHECK( has( publish( DATA_BLOCKS_MASK ), "\"keyframe\":false" ) );
+
+    CHECK( delta.keyframes == 3 );
+    CHECK( delta.messages == 2 * KEYFRAME_CYCLES + KEYFRAME_CYCLES + 5 );
+    CHECK( delta.fieldsSent < delta.fieldsConsidered );
+
+    //
+    //  0 cycles - every full message is everything
+    JSONMessage_InitializeDelta( &delta, 0 );
+    for (i = 0; i < 3; i += 1)
+        CHECK( has( publish( DATA_BLOCKS_MASK ), "\"pvArrayVoltage\":" ) );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testStateMessages (void)
+{
+    char        first[ 8192 ];
+    const char  *message;
+    uint32_t    hash;
+
+    //
+    //  DATA is version 3.0 and has no settings or rated data
+    message = build( DATA_BLOCKS_MASK, NULL );
+    CHECK( has( message, "\"version\":\"3.0\"" ) );
+    CHECK( !has( message, "\"settings\"" ) );
+    CHECK( !has( message, "\"ratedData\"" ) );
+    CHECK( !has( message, "\"batteryType\"" ) );
+
+    strcpy( settings.batteryType, "Sealed" );
+    settings.batteryCapacity = 200;
+    settings.boostVoltage = 14.4f;
+    message = JSONMessage_CreateSettings( &writer, "LS/1/SETTINGS", &settings );
+    CHECK( has( message, "\"topic\":\"LS/1/SETTINGS\"" ) );
+    CHECK( has( message, "\"version\":\"3.0\"" ) );
+    CHECK( has( message, "\"settings\":{\"batteryType\":\"Sealed\",\"batteryCapacity\":200" ) );
+    CHECK( has( message, "\"boostVoltage\":14.4" ) );
+    CHECK( !has( message, "\"dateTime\"" ) );
+    CHECK( !has( message, "\"sequence\"" ) );
+
+    //
+    //  Built again from the same values - byte for byte the same
+    strncpy( first, message, sizeof first - 1 );
+    first[ sizeof first - 1 ] = '\0';
+    hash = JSONMessage_Hash( first );
+    message = JSONMessage_CreateSettings( &writer, "LS/1/SETTINGS", &settings );
+    CHECK( strcmp( message, first ) == 0 );
+    CHECK( JSONMessage_Hash( message ) == hash );
+
+    //
+    //  A change shows up in the hash
+    settings.boostVoltage = 14.5f;
+    message = JSONMessage_CreateSettings( &writer, "LS/1/SETTINGS", &settings );
+    CHECK( JSONMessage_Hash( message ) != hash );
+
+    ratedData.pvArrayRatedVoltage = 150.0f;
+    message = JSONMessage_CreateRatedData( &writer, "LS/1/RATED", &ratedData );
+    CHECK( has( message, "\"version\":\"3.0\"" ) );
+    CHECK( has( message, "\"ratedData\":{\"pvArrayRatedVoltage\":150" ) );
+
+    message = JSONMessage_CreateIdentity( &writer, "LS/1/IDENTITY", "1", 2, "/dev/ttyUSB0" );
+    CHECK( has( message, "\"version\":\"3.0\"" ) );
+    CHECK( has( message, "\"identity\":{\"controllerID\":\"1\",\"slaveID\":2,\"serialPort\":\"/dev/ttyUSB0\"}" ) );
+}
+
+// -----------------------------------------------------------------------------
+int main (int argc, char *argv[])
+{
+    //
+    //  Has to be in before the first message is built
+    CHECK( JSONMessage_SetDeadbands( "pvArrayVoltage=0.5" ) );
+    CHECK( !JSONMessage_SetDeadbands( "pvArrayVoltage" ) );
+
+    JSON_WriterInitialize( &writer, buffer, sizeof buffer, FALSE );
+    rtData.pvArrayVoltage = 13.0f;
+    rtData.loadCurrent = 1.231f;
+    rtData.batterySOC = 80;
+
+    testWithoutDelta();
+    testDeltas();
+    testCommit();
+    testKeyframes();
+    testStateMessages();
+
+    return CHECK_RESULT( "jsonMessageTest" );
+}
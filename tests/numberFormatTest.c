@@ -0,0 +1,181 @@
+/*
+ * File:    numberFormatTest.c
+ * author:  patrick conroy
+ *
+ * Format_Fixed() and Format_Integer() - the cases that went wrong with the old
+ * FP2xP macros and "%1.15g" (negative values rounded toward zero, energy
+ * totals overflowing an int, binary tails), the edges (NaN, Infinity, too
+ * big, precision out of range), and then a few hundred thousand random values
+ * against snprintf.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "logger.h"
+#include "numberFormat.h"
+#include "check.h"
+
+
+#define RANDOM_VALUES           200000
+
+static  uint32_t    rngState = 2463534242u;
+
+
+// -----------------------------------------------------------------------------
+static
+uint32_t    nextRandom (void)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     fixedIs (const double value, const int precision, const char *expected)
+{
+    char    out[ FORMAT_MAX_LENGTH ];
+    int     length = Format_Fixed( out, value, precision );
+
+    if (length != (int) strlen( expected ) || strcmp( out, expected ) != 0) {
+        fprintf( stderr, "Format_Fixed( %.17g, %d ) gave [%s], expected [%s]\n", value, precision, out, expected );
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// -----------------------------------------------------------------------------
+static
+int     integerIs (const long long value, const char *expected)
+{
+    char    out[ FORMAT_MAX_LENGTH ];
+    int     length = Format_Integer( out, value );
+
+    return (length == (int) strlen( expected ) && strcmp( out, expected ) == 0);
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testFixed (void)
+{
+    char    out[ FORMAT_MAX_LENGTH ];
+
+    //
+    //  Trailing zeros go
+    CHECK( fixedIs( 12.30, 2, "12.3" ) );
+    CHECK( fixedIs( 4.00, 2, "4" ) );
+    CHECK( fixedIs( 0.0, 2, "0" ) );
+    CHECK( fixedIs( 100.0, 0, "100" ) );
+
+    //
+    //  Leading zeros in the fraction stay
+    CHECK( fixedIs( 0.05, 2, "0.05" ) );
+    CHECK( fixedIs( 3.007, 3, "3.007" ) );
+    CHECK( fixedIs( -0.05, 2, "-0.05" ) );
+
+    //
+    //  Half away from zero, the same both sides
+    CHECK( fixedIs( 3.25, 1, "3.3" ) );
+    CHECK( fixedIs( -3.25, 1, "-3.3" ) );
+    CHECK( fixedIs( 2.5, 0, "3" ) );
+    CHECK( fixedIs( -2.5, 0, "-3" ) );
+    CHECK( fixedIs( 12.345678, 2, "12.35" ) );
+    CHECK( fixedIs( 9.996, 2, "10" ) );
+    CHECK( fixedIs( -9.996, 2, "-10" ) );
+
+    //
+    //  No "-0"
+    CHECK( fixedIs( -0.004, 2, "0" ) );
+    CHECK( fixedIs( -0.0, 1, "0" ) );
+
+    //
+    //  No binary tails
+    CHECK( fixedIs( 0.1 + 0.2, 2, "0.3" ) );
+    CHECK( fixedIs( 12.3f, 2, "12.3" ) );
+
+    //
+    //  Bigger than an int - a lifetime energy total
+    CHECK( fixedIs( 123456789012.5, 0, "123456789013" ) );
+    CHECK( fixedIs( 3000000000.25, 2, "3000000000.25" ) );
+
+    //
+    //  Precision is clamped to 0 .. FORMAT_MAX_PRECISION
+    CHECK( fixedIs( 1.6, -1, "2" ) );
+    CHECK( fixedIs( 0.123456789, 12, "0.123456789" ) );
+
+    //
+    //  Can't be written this way - the caller falls back
+    CHECK( Format_Fixed( out, NAN, 2 ) == -1 );
+    CHECK( Format_Fixed( out, INFINITY, 2 ) == -1 );
+    CHECK( Format_Fixed( out, -INFINITY, 2 ) == -1 );
+    CHECK( Format_Fixed( out, 1.0e19, 0 ) == -1 );
+    CHECK( Format_Fixed( out, 1.0e12, 9 ) == -1 );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testInteger (void)
+{
+    CHECK( integerIs( 0, "0" ) );
+    CHECK( integerIs( 7, "7" ) );
+    CHECK( integerIs( -42, "-42" ) );
+    CHECK( integerIs( 9223372036854775807LL, "9223372036854775807" ) );
+    CHECK( integerIs( -9223372036854775807LL - 1, "-9223372036854775808" ) );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testAgainstSnprintf (void)
+{
+    //
+    //  snprintf rounds the exact binary value, we round the scaled one - they only
+    //  disagree right at a tie, so those are skipped
+    char    out[ FORMAT_MAX_LENGTH ];
+    char    expected[ 64 ];
+    int     mismatches = 0;
+    int     i;
+
+    for (i = 0; i < RANDOM_VALUES; i += 1) {
+        int     precision = nextRandom() % 4;
+        double  value = ((double) nextRandom() / 4294967296.0 - 0.5) * 2.0e6;
+        double  scaled = fabs( value ) * pow( 10.0, precision );
+
+        if (fabs( scaled - floor( scaled ) - 0.5 ) < 1.0e-6)
+            continue;
+
+        snprintf( expected, sizeof expected, "%.*f", precision, value );
+        if (strchr( expected, '.' ) != NULL) {
+            char    *end = expected + strlen( expected ) - 1;
+            while (*end == '0')
+                *end-- = '\0';
+            if (*end == '.')
+                *end = '\0';
+        }
+        if (strcmp( expected, "-0" ) == 0)
+            strcpy( expected, "0" );
+
+        Format_Fixed( out, value, precision );
+        if (strcmp( out, expected ) != 0) {
+            if (mismatches < 5)
+                fprintf( stderr, "%.17g at %d: [%s] vs snprintf [%s]\n", value, precision, out, expected );
+            mismatches += 1;
+        }
+    }
+    CHECK( mismatches == 0 );
+}
+
+// -----------------------------------------------------------------------------
+int main (int argc, char *argv[])
+{
+    testFixed();
+    testInteger();
+    testAgainstSnprintf();
+
+    return CHECK_RESULT( "numberFormatTest" );
+}
@@ -0,0 +1,254 @@
+/*
+ * File:    spoolTest.c
+ * author:  patrick conroy
+ *
+ * The DATA spool (-S) in a scratch directory: records come back out oldest
+ * first and intact, what's been replayed stays replayed across a close and
+ * reopen, sequence numbers never go backwards from one run to the next, a
+ * full spool evicts its oldest records rather than refusing new ones, and a
+ * record that fails its checksum after a crash is dropped along with the rest
+ * of its segment.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "logger.h"
+#include "spool.h"
+#include "check.h"
+
+
+#define SPOOL_TEST_MEGABYTES    1                   // 8 segments of 128 KB
+#define RECORD_PAYLOAD          3000
+#define TOPIC                   "LS/1/DATA"
+
+static  spoolEntry_t    entry;
+static  char            directory[ 64 ];
+
+
+// -----------------------------------------------------------------------------
+static
+void    appendNumbered (const char *prefix, const int number, const int length)
+{
+    char    payload[ RECORD_PAYLOAD ];
+
+    memset( payload, 'x', sizeof payload );
+    snprintf( payload, sizeof payload, "%s%d", prefix, number );
+    CHECK( Spool_Append( 0, TOPIC, payload, length ) );
+}
+
+// -----------------------------------------------------------------------------
+static
+int     numberOf (const spoolEntry_t *spooled, const char *prefix)
+{
+    if (strncmp( spooled->payload, prefix, strlen( prefix ) ) != 0)
+        return -1;
+    return atoi( &spooled->payload[ strlen( prefix ) ] );
+}
+
+// -----------------------------------------------------------------------------
+static
+int     corruptRecord (const char *text)
+{
+    //
+    //  Find text in one of the segment files and change its first byte - the
+    //  record's checksum won't match any more. TRUE if it was found
+    struct dirent   *file;
+    DIR             *dir = opendir( directory );
+    int             found = FALSE;
+
+    while (!found && (file = readdir( dir )) != NULL) {
+        char    path[ 512 ];
+        FILE    *fp;
+        long    size;
+
+        if (strncmp( file->d_name, "segment", 7 ) != 0)
+            continue;
+        snprintf( path, sizeof path, "%s/%s", directory, file->d_name );
+        if ((fp = fopen( path, "r+b" )) == NULL)
+            continue;
+
+        fseek( fp, 0, SEEK_END );
+        size = ftell( fp );
+        char    *contents = malloc( size );
+        rewind( fp );
+        if (fread( contents, 1, size, fp ) == (size_t) size) {
+            long    at;
+            long    textLength = strlen( text );
+            for (at = 0; !found && at + textLength <= size; at += 1) {
+                if (memcmp( &contents[ at ], text, textLength ) == 0) {
+                    fseek( fp, at, SEEK_SET );
+                    fputc( 'Z', fp );
+                    found = TRUE;
+                }
+            }
+        }
+        free( contents );
+        fclose( fp );
+    }
+    closedir( dir );
+    return found;
+}
+
+// -----------------------------------------------------------------------------
+static
+void    removeDirectory (void)
+{
+    struct dirent   *file;
+    DIR             *dir = opendir( directory );
+    char            path[ 512 ];
+
+    while ((file = readdir( dir )) != NULL) {
+        if (file->d_name[ 0 ] == '.')
+            continue;
+        snprintf( path, sizeof path, "%s/%s", directory, file->d_name );
+        unlink( path );
+    }
+    closedir( dir );
+    rmdir( directory );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testOrderAndContents (void)
+{
+    int     i;
+
+    CHECK( Spool_Open( directory, SPOOL_TEST_MEGABYTES ) );
+    CHECK( Spool_IsOpen() );
+    CHECK( Spool_NextSequence() == 1 );
+    CHECK( Spool_NextSequence() == 2 );
+
+    for (i = 0; i < 100; i += 1)
+        appendNumbered( "msg", i, RECORD_PAYLOAD );
+    CHECK( Spool_Pending() == 100 );
+
+    CHECK( Spool_Peek( &entry ) );
+    CHECK( numberOf( &entry, "msg" ) == 0 );
+    CHECK( strcmp( entry.topic, TOPIC ) == 0 );
+    CHECK( entry.topicClass == 0 );
+    CHECK( entry.length == RECORD_PAYLOAD );
+
+    //
+    //  Peek doesn't move on - Commit does
+    CHECK( Spool_Peek( &entry ) && numberOf( &entry, "msg" ) == 0 );
+    for (i = 0; i < 10; i += 1) {
+        CHECK( Spool_Peek( &entry ) && numberOf( &entry, "msg" ) == i );
+        Spool_Commit( &entry );
+    }
+    CHECK( Spool_Pending() == 90 );
+    Spool_Close();
+    CHECK( !Spool_IsOpen() );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testReopen (void)
+{
+    //
+    //  Picks up where testOrderAndContents() left off
+    CHECK( Spool_Open( directory, SPOOL_TEST_MEGABYTES ) );
+    CHECK( Spool_Pending() == 90 );
+    CHECK( Spool_Peek( &entry ) && numberOf( &entry, "msg" ) == 10 );
+
+    //
+    //  Two were handed out last time - whatever comes next has to be past them
+    CHECK( Spool_NextSequence() > 2 );
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testEviction (void)
+{
+    spoolStats_t    stats;
+    spoolEntry_t    stale = entry;                  // msg10, about to be evicted
+    int             i;
+    int             previous = -1;
+    int             inOrder = TRUE;
+    long            replayed = 0;
+
+    //
+    //  Far more than the 1 MB budget holds
+    for (i = 100; i < 400; i += 1)
+        appendNumbered( "msg", i, RECORD_PAYLOAD );
+
+    Spool_GetStats( &stats, FALSE );
+    CHECK( stats.evicted > 0 );
+    CHECK( stats.pending == 390 - stats.evicted );
+    CHECK( stats.bytesUsed <= stats.bytesBudget );
+
+    //
+    //  Committing a record that's already gone changes nothing
+    Spool_Commit( &stale );
+    CHECK( Spool_Pending() == stats.pending );
+
+    CHECK( Spool_Peek( &entry ) );
+    CHECK( numberOf( &entry, "msg" ) == 10 + stats.evicted );
+
+    while (Spool_Peek( &entry )) {
+        int number = numberOf( &entry, "msg" );
+        if (number <= previous)
+            inOrder = FALSE;
+        previous = number;
+        Spool_Commit( &entry );
+        replayed += 1;
+    }
+    CHECK( inOrder );
+    CHECK( previous == 399 );
+    CHECK( replayed == stats.pending );
+    CHECK( Spool_Pending() == 0 );
+    Spool_Close();
+}
+
+// -----------------------------------------------------------------------------
+static
+void    testCorruptRecord (void)
+{
+    spoolStats_t    stats;
+    int             i;
+
+    CHECK( Spool_Open( directory, SPOOL_TEST_MEGABYTES ) );
+    CHECK( Spool_Pending() == 0 );
+    for (i = 0; i < 5; i += 1)
+        appendNumbered( "post", i, 100 );
+    Spool_Close();
+
+    CHECK( corruptRecord( "post2" ) );
+
+    CHECK( Spool_Open( directory, SPOOL_TEST_MEGABYTES ) );
+    Spool_GetStats( &stats, FALSE );
+    CHECK( stats.corrupt == 3 );                    // post2 and the two behind it
+    CHECK( Spool_Pending() == 2 );
+
+    int     seen[ 5 ] = { 0 };
+    while (Spool_Peek( &entry )) {
+        int number = numberOf( &entry, "post" );
+        if (number >= 0 && number < 5)
+            seen[ number ] += 1;
+        Spool_Commit( &entry );
+    }
+    CHECK( seen[ 0 ] == 1 && seen[ 1 ] == 1 && seen[ 2 ] == 0 && seen[ 3 ] == 0 && seen[ 4 ] == 0 );
+    Spool_Close();
+}
+
+// -----------------------------------------------------------------------------
+int main (int argc, char *argv[])
+{
+    snprintf( directory, sizeof directory, "/tmp/spoolTest.XXXXXX" );
+    if (mkdtemp( directory ) == NULL) {
+        perror( "mkdtemp" );
+        return 1;
+    }
+
+    testOrderAndContents();
+    testReopen();
+    testEviction();
+    testCorruptRecord();
+
+    removeDirectory();
+    return CHECK_RESULT( "spoolTest" );
+}
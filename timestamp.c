@@ -0,0 +1,123 @@
+/*
+ * File:    timestamp.c
+ * author:  patrick conroy
+ *
+ * Current date/time strings for the log file and the MQTT payloads.
+ *
+ * The logger gets called from the main thread, the mosquitto thread, the
+ * command thread and every port poller, so the old getCurrentDateTime()
+ * copies - each with one shared static buffer - could hand out a string that
+ * another thread was in the middle of rewriting.
+ *
+ * Every thread now has its own cache and its own output buffers. The expensive
+ * part (localtime_r + strftime, which also works out the timezone offset) only
+ * happens when the second rolls over; otherwise we just patch the milliseconds
+ * into the copy we already have. The pointer returned is good until the same
+ * thread calls Timestamp_Now() again with the same format.
+ *
+ * date:    October 16, 2026
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "timestamp.h"
+
+
+typedef struct  timestampCache {
+    time_t  second;                                     // -1 until the first call
+    int     length[ NUM_TIMESTAMP_FORMATS ];            // strftime()'d length, before any milliseconds
+    char    buffer[ NUM_TIMESTAMP_FORMATS ][ TIMESTAMP_MAX_LENGTH ];
+} timestampCache_t;
+
+static  __thread    timestampCache_t    cache = { .second = -1 };
+static  long long   startupUS = 0;                      // Timestamp_MarkStartup(), monotonic
+
+
+// -----------------------------------------------------------------------------
+static
+void    refreshCache (const time_t second)
+{
+    struct  tm  tmBuffer;
+    int         i;
+
+    cache.second = second;
+
+    if (localtime_r( &second, &tmBuffer ) == NULL) {
+        for (i = 0; i < NUM_TIMESTAMP_FORMATS; i += 1) {
+            cache.buffer[ i ][ 0 ] = '\0';
+            cache.length[ i ] = 0;
+        }
+        return;
+    }
+
+    cache.length[ TIMESTAMP_ISO8601 ] = strftime( cache.buffer[ TIMESTAMP_ISO8601 ], TIMESTAMP_MAX_LENGTH,
+                                                  "%FT%T%z", &tmBuffer );
+    cache.length[ TIMESTAMP_LOG ] = strftime( cache.buffer[ TIMESTAMP_LOG ], TIMESTAMP_MAX_LENGTH,
+                                              "%F %T", &tmBuffer );
+}
+
+// -----------------------------------------------------------------------------
+const char  *Timestamp_Now (const timestampFormat_t format)
+{
+    struct  timespec    ts;
+
+    if (format < 0 || format >= NUM_TIMESTAMP_FORMATS)
+        return "";
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    if (ts.tv_sec != cache.second)
+        refreshCache( ts.tv_sec );
+
+    char    *buffer = cache.buffer[ format ];
+    int     len = cache.length[ format ];
+
+    //
+    //  The log format carries milliseconds - patch them in after the seconds
+    if (format == TIMESTAMP_LOG && len > 0) {
+        int milliSeconds = (int) (ts.tv_nsec / 1000000L);
+        buffer[ len ] = '.';
+        buffer[ len + 1 ] = (milliSeconds / 100) + '0';
+        buffer[ len + 2 ] = ((milliSeconds % 100) / 10) + '0';
+        buffer[ len + 3 ] = (milliSeconds % 10) + '0';
+        buffer[ len + 4 ] = '\0';
+    }
+
+    return buffer;
+}
+
+// -----------------------------------------------------------------------------
+long long   Timestamp_EpochUS (void)
+{
+    //
+    //  Wall clock microseconds - for timestamps that leave this process
+    struct  timespec    ts;
+
+    clock_gettime( CLOCK_REALTIME, &ts );
+    return ((long long) ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000L);
+}
+
+// -----------------------------------------------------------------------------
+long long   Timestamp_MonotonicUS (void)
+{
+    //
+    //  For measuring intervals - doesn't jump when NTP finally sets the clock
+    struct  timespec    ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ((long long) ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000L);
+}
+
+// -----------------------------------------------------------------------------
+void    Timestamp_MarkStartup (void)
+{
+    //
+    //  main() calls this first thing, before there are any other threads
+    startupUS = Timestamp_MonotonicUS();
+}
+
+// -----------------------------------------------------------------------------
+double  Timestamp_SinceStartupMS (void)
+{
+    return (Timestamp_MonotonicUS() - startupUS) / 1000.0;
+}
@@ -0,0 +1,37 @@
+/*
+ * File:   timestamp.h
+ * Author: pconroy
+ *
+ * Created on October 16, 2026
+ */
+
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+typedef enum {
+    TIMESTAMP_ISO8601 = 0,              // "2026-10-16T14:37:48-0400"     - MQTT payloads
+    TIMESTAMP_LOG,                      // "2026-10-16 14:37:48.123"      - log file lines
+    NUM_TIMESTAMP_FORMATS
+} timestampFormat_t;
+
+#define TIMESTAMP_MAX_LENGTH    40
+
+
+extern  const char  *Timestamp_Now( const timestampFormat_t format );
+extern  long long   Timestamp_EpochUS( void );
+extern  long long   Timestamp_MonotonicUS( void );
+extern  void        Timestamp_MarkStartup( void );
+extern  double      Timestamp_SinceStartupMS( void );
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TIMESTAMP_H */
+